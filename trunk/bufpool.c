@@ -0,0 +1,104 @@
+/*
+ * bufpool.c  --  relay buffers borrowed while data is in flight
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * vim: set sw=4 ts=4
+ */
+
+/*
+ * A relaying process needs a buffer for a direction only while
+ * data passes that way, yet most tunnels are idle most of the time.
+ * Buffers of buffer_size bytes are therefore borrowed from a small
+ * pool as data is read, and returned once it has been delivered.
+ * A busy flow reuses a returned buffer at the cost of exchanging a
+ * pointer. After BUFFER_IDLE microseconds without any return, the
+ * pool is emptied. Every buffer being a mapping of its own, its
+ * pages then go back to the system at once, rather than lingering
+ * in the heap as they might with malloc().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#define _INCLUDE_EXTERNALS	1
+#include "gunnel.h"
+
+#ifndef MAP_ANONYMOUS
+#  define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+/* Returned buffers kept for reuse. */
+#define BUFFER_POOL		4
+
+/* Usec without returns, before the pool is emptied. */
+#ifndef BUFFER_IDLE
+#  define BUFFER_IDLE	1000000
+#endif
+
+static void *pool[BUFFER_POOL];
+static int pooled = 0;
+static long long returned_at;
+
+/**
+ * buffer_get  --  borrow a relay buffer of buffer_size bytes
+ */
+
+void *buffer_get(void) {
+	void *buf;
+
+	if (pooled > 0)
+		return pool[--pooled];
+
+	buf = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	return (buf == MAP_FAILED) ? NULL : buf;
+} /* buffer_get(void) */
+
+/**
+ * buffer_put  --  return a buffer at monotonic time now
+ */
+
+void buffer_put(void *buf, long long now) {
+	if (buf == NULL)
+		return;
+
+	if (pooled == BUFFER_POOL) {
+		munmap(buf, buffer_size);
+		return;
+	}
+
+	pool[pooled++] = buf;
+	returned_at = now;
+} /* buffer_put(void *, long long) */
+
+/**
+ * buffer_trim  --  empty the pool, once it has been idle
+ *
+ * Returns the microseconds until the pool is due for emptying,
+ * or -1 when it is empty.
+ */
+
+long long buffer_trim(long long now) {
+	if (pooled == 0)
+		return -1;
+
+	if (now - returned_at < BUFFER_IDLE)
+		return returned_at + BUFFER_IDLE - now;
+
+	while (pooled > 0)
+		munmap(pool[--pooled], buffer_size);
+
+	return -1;
+} /* buffer_trim(long long) */
@@ -0,0 +1,284 @@
+/*
+ * cipherbench.c  --  throughput of AEAD ciphers on this processor
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * vim: set sw=4 ts=4
+ */
+
+/*
+ * Each AEAD cipher known to GnuTLS is timed while it encrypts and
+ * decrypts records of maximal TLS size. AES is fast only with
+ * hardware support, whereas ChaCha20-Poly1305 is fast everywhere,
+ * so their order in a fixed priority suits some hosts only.
+ *
+ * The cipher priority "auto" is derived from these measurements,
+ * once per process: the fastest cipher first, and CBC modes last,
+ * as in "NORMAL". A server also takes precedence over the order
+ * preferred by its clients.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#include <getopt.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+
+#define _INCLUDE_EXTERNALS	1
+#include "gunnel.h"
+#include "plugins.h"
+
+/* Length of one encrypted record. */
+#define CIPHERBENCH_RECORD	16384
+
+/* Measuring time per cipher and direction, for "auto". */
+#ifndef CIPHERBENCH_AUTO_USEC
+#  define CIPHERBENCH_AUTO_USEC	20000
+#endif
+
+#define CIPHERBENCH_MAX		8
+
+#define CIPHER_PRIORITY_LENGTH	256
+
+static const gnutls_cipher_algorithm_t candidates[] = {
+	GNUTLS_CIPHER_AES_128_GCM,
+	GNUTLS_CIPHER_AES_256_GCM,
+	GNUTLS_CIPHER_CHACHA20_POLY1305,
+	GNUTLS_CIPHER_AES_128_CCM,
+	GNUTLS_CIPHER_AES_256_CCM,
+};
+
+static const char cipherbench_options_string[] = "ht:";
+
+static long long bench_clock(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+} /* bench_clock(void) */
+
+/* Relayed data passes both ways, so both speeds count. */
+static double combined(const struct cipher_speed *cs) {
+	if ( (cs->encrypt <= 0) || (cs->decrypt <= 0) )
+		return 0.0;
+
+	return 2.0 / (1.0 / cs->encrypt + 1.0 / cs->decrypt);
+} /* combined(const struct cipher_speed *) */
+
+/*
+ * Time a single cipher in both directions. Returns -1
+ * when GnuTLS is unable to provide it.
+ */
+
+static int measure(struct cipher_speed *cs, long usec) {
+	int rc = -1;
+	unsigned char keybuf[32], nonce[12];
+	unsigned char *plain, *sealed, *opened;
+	size_t tag, len;
+	long long start, now, bytes;
+	gnutls_datum_t key;
+	gnutls_aead_cipher_hd_t hd;
+
+	key.data = keybuf;
+	key.size = gnutls_cipher_get_key_size(cs->algorithm);
+	tag = gnutls_cipher_get_tag_size(cs->algorithm);
+
+	if ( (key.size == 0) || (key.size > sizeof(keybuf)) )
+		return -1;
+
+	gnutls_rnd(GNUTLS_RND_NONCE, keybuf, key.size);
+	memset(nonce, '\0', sizeof(nonce));
+
+	plain = malloc(CIPHERBENCH_RECORD);
+	sealed = malloc(CIPHERBENCH_RECORD + tag);
+	opened = malloc(CIPHERBENCH_RECORD + tag);
+
+	if ( (plain == NULL) || (sealed == NULL) || (opened == NULL)
+			|| (gnutls_aead_cipher_init(&hd, cs->algorithm, &key) < 0) )
+		goto out;
+
+	memset(plain, 'g', CIPHERBENCH_RECORD);
+
+	start = bench_clock();
+	bytes = 0;
+	do {
+		len = CIPHERBENCH_RECORD + tag;
+		if ( gnutls_aead_cipher_encrypt(hd, nonce, sizeof(nonce), NULL, 0,
+					tag, plain, CIPHERBENCH_RECORD, sealed, &len) < 0 )
+			goto deinit;
+		bytes += CIPHERBENCH_RECORD;
+		now = bench_clock();
+	} while (now - start < usec);
+
+	cs->encrypt = (double) bytes / (now - start);
+
+	start = bench_clock();
+	bytes = 0;
+	do {
+		len = CIPHERBENCH_RECORD + tag;
+		if ( gnutls_aead_cipher_decrypt(hd, nonce, sizeof(nonce), NULL, 0,
+					tag, sealed, CIPHERBENCH_RECORD + tag, opened, &len) < 0 )
+			goto deinit;
+		bytes += CIPHERBENCH_RECORD;
+		now = bench_clock();
+	} while (now - start < usec);
+
+	cs->decrypt = (double) bytes / (now - start);
+	rc = 0;
+
+deinit:
+	gnutls_aead_cipher_deinit(hd);
+out:
+	free(plain);
+	free(sealed);
+	free(opened);
+
+	return rc;
+} /* measure(struct cipher_speed *, long) */
+
+/**
+ * cipher_speeds  --  measure the available AEAD ciphers
+ *
+ * Every cipher is timed for usec microseconds per direction.
+ * The results are sorted, fastest first. Returns their number.
+ */
+
+int cipher_speeds(struct cipher_speed *speeds, int max, long usec) {
+	int j, k, num = 0;
+	struct cipher_speed cs;
+
+	gnutls_global_init();
+
+	for (j = 0; j < (int) (sizeof(candidates) / sizeof(candidates[0])); ++j) {
+		if (num >= max)
+			break;
+
+		memset(&cs, '\0', sizeof(cs));
+		cs.algorithm = candidates[j];
+
+		if ( measure(&cs, usec) )
+			continue;
+
+		/* Insertion keeps the list sorted. */
+		for (k = num; (k > 0) && (combined(&speeds[k - 1]) < combined(&cs)); --k)
+			speeds[k] = speeds[k - 1];
+		speeds[k] = cs;
+		++num;
+	}
+
+	gnutls_global_deinit();
+
+	return num;
+} /* cipher_speeds(struct cipher_speed *, int, long) */
+
+/* Write a priority string listing ciphers in the given order. */
+static void compose_priority(char *priority, size_t size,
+							const struct cipher_speed *speeds, int num,
+							int server) {
+	int j;
+	size_t len;
+
+	snprintf(priority, size, "NORMAL:-CIPHER-ALL");
+
+	for (j = 0; j < num; ++j) {
+		len = strlen(priority);
+		snprintf(priority + len, size - len, ":+%s",
+				gnutls_cipher_get_name(speeds[j].algorithm));
+	}
+
+	len = strlen(priority);
+	snprintf(priority + len, size - len, ":+AES-256-CBC:+AES-128-CBC%s",
+			server ? ":%SERVER_PRECEDENCE" : "");
+} /* compose_priority(char *, size_t, const struct cipher_speed *, int, int) */
+
+/**
+ * cipher_priority_auto  --  priority string ordered by speed
+ *
+ * Measures at the first call only, thus before forking.
+ */
+
+const char *cipher_priority_auto(int server) {
+	static int num = -1;
+	static struct cipher_speed speeds[CIPHERBENCH_MAX];
+	static char priority[2][CIPHER_PRIORITY_LENGTH];
+
+	server = !!server;
+
+	if (num < 0) {
+		num = cipher_speeds(speeds, CIPHERBENCH_MAX, CIPHERBENCH_AUTO_USEC);
+		compose_priority(priority[0], sizeof(priority[0]), speeds, num, 0);
+		compose_priority(priority[1], sizeof(priority[1]), speeds, num, 1);
+	}
+
+	return num ? priority[server] : "NORMAL";
+} /* cipher_priority_auto(int) */
+
+static void cipherbench_usage(char *progname) {
+	printf("Usage: %s " BENCH_TIME_STR "\n\n"
+			"Measures the AEAD ciphers of GnuTLS, each for msec"
+			" milliseconds\nin either direction, and displays"
+			" the resulting \"auto\" priority.\n\n", progname);
+
+	exit(EXIT_FAILURE);
+} /* cipherbench_usage(char *) */
+
+/**
+ * run_cipherbench  --  display throughput of AEAD ciphers
+ */
+
+int run_cipherbench(int argc, char *argv[]) {
+	int j, opt, num, show_usage = 0;
+	long msec = 200;
+	char priority[CIPHER_PRIORITY_LENGTH];
+	struct cipher_speed speeds[CIPHERBENCH_MAX];
+
+	while ( (opt = getopt(argc, argv, cipherbench_options_string)) != -1 ) {
+		switch (opt) {
+			case 'h':	show_usage = 1;
+						break;
+			case BENCH_TIME:
+						msec = atol(optarg);
+						break;
+			case '?':
+			default:
+						fprintf(stderr, "\n");
+						show_usage = 1;
+						break;
+		}
+	}
+
+	if (show_usage || (msec <= 0))
+		/* Never returns. */
+		cipherbench_usage(argv[0]);
+
+	num = cipher_speeds(speeds, CIPHERBENCH_MAX, msec * 1000);
+
+	if (num == 0) {
+		fprintf(stderr, "No AEAD cipher is available.\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("%-20s %14s %14s\n", "Cipher", "Encrypt MB/s", "Decrypt MB/s");
+
+	for (j = 0; j < num; ++j)
+		printf("%-20s %14.1f %14.1f\n",
+				gnutls_cipher_get_name(speeds[j].algorithm),
+				speeds[j].encrypt, speeds[j].decrypt);
+
+	compose_priority(priority, sizeof(priority), speeds, num, 0);
+	printf("\nPriority \"auto\" of a client:\n    %s\n", priority);
+
+	return EXIT_SUCCESS;
+} /* run_cipherbench(int, char *[]) */
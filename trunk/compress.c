@@ -0,0 +1,307 @@
+/*
+ * compress.c  --  deflate streams between gunnel peers
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * vim: set sw=4 ts=4
+ */
+
+/*
+ * Two gunnel instances may compress the data inside their TLS
+ * session, once both have offered the protocol "gunnel-deflate"
+ * in the handshake. Each direction is a single deflate stream,
+ * flushed to a byte boundary with every write, so that the peer
+ * can inflate all that was relayed without further waiting.
+ *
+ * A stream which has saved less than a tenth after its first
+ * ZIP_PROBE bytes falls back to level zero, i.e. stored blocks.
+ * This needs no signalling, and costs little beyond a copy.
+ *
+ * Every stream adds its amounts to counters shared by all forked
+ * connections, which are written to the statistics file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <sys/types.h>
+
+#if USE_ZLIB
+#  include <zlib.h>
+#endif
+
+#define _INCLUDE_EXTERNALS	1
+#include "gunnel.h"
+
+#if USE_ZLIB
+
+/* Input judged before an incompressible stream is stored. */
+#define ZIP_PROBE		(256 * 1024)
+
+/* Compressed input kept while it is being inflated. */
+#define ZIP_INPUT		16384
+
+struct zip {
+	z_stream out, in;
+	int stored;				/* Incompressible, sent at level zero. */
+	unsigned long long raw_out, zip_out, zip_in, raw_in;
+	unsigned char *buf;		/* Output of deflate. */
+	size_t size;
+	int more;				/* Inflate may hold further output. */
+	unsigned char input[ZIP_INPUT];
+};
+
+/* Totals of every connection, shared after forking. */
+struct zip_counters {
+	unsigned long long streams, stored;
+	unsigned long long raw_out, zip_out, zip_in, raw_in;
+};
+
+static struct zip_counters *counters = NULL;
+
+/**
+ * compress_init  --  prepare the shared counters
+ *
+ * Must be called before any connection is forked.
+ */
+
+int compress_init(void) {
+	void *area;
+
+	if (counters)
+		return 0;
+
+	if ( (area = map_shared(sizeof(*counters))) == NULL )
+		return -1;
+
+	counters = area;
+
+	return 0;
+} /* compress_init(void) */
+
+/**
+ * zip_new  --  both streams of a connection
+ */
+
+struct zip *zip_new(int level) {
+	struct zip *zip;
+
+	if ( (zip = calloc(1, sizeof(*zip))) == NULL )
+		return NULL;
+
+	if ( deflateInit(&zip->out, level) != Z_OK ) {
+		free(zip);
+		return NULL;
+	}
+
+	if ( inflateInit(&zip->in) != Z_OK ) {
+		deflateEnd(&zip->out);
+		free(zip);
+		return NULL;
+	}
+
+	return zip;
+} /* zip_new(int) */
+
+/**
+ * zip_free  --  release the streams, counting their amounts
+ */
+
+void zip_free(struct zip *zip) {
+	if (zip == NULL)
+		return;
+
+	/* A stream handed to another process has carried nothing. */
+	if ( counters && (zip->raw_out || zip->zip_in) ) {
+		__atomic_add_fetch(&counters->streams, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&counters->stored, zip->stored, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&counters->raw_out, zip->raw_out, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&counters->zip_out, zip->zip_out, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&counters->zip_in, zip->zip_in, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&counters->raw_in, zip->raw_in, __ATOMIC_RELAXED);
+	}
+
+	deflateEnd(&zip->out);
+	inflateEnd(&zip->in);
+	free(zip->buf);
+	free(zip);
+} /* zip_free(struct zip *) */
+
+/**
+ * zip_deflate  --  compress and flush a buffer
+ *
+ * Sets *out to the result, valid until the next call.
+ * Returns its length, or -1 at failure.
+ */
+
+ssize_t zip_deflate(struct zip *zip, const void *buf, size_t len,
+					const void **out) {
+	size_t need;
+	unsigned char *more;
+
+	/* Room for all output, with a sync marker, and a change of level. */
+	need = deflateBound(&zip->out, len) + 64;
+	if (need > zip->size) {
+		if ( (more = realloc(zip->buf, need)) == NULL )
+			return -1;
+		zip->buf = more;
+		zip->size = need;
+	}
+
+	zip->out.next_out = zip->buf;
+	zip->out.avail_out = zip->size;
+
+	/* Little saved so far is not worth the effort. */
+	if ( !zip->stored && (zip->raw_out >= ZIP_PROBE)
+			&& (zip->zip_out * 10 > zip->raw_out * 9) ) {
+		if ( deflateParams(&zip->out, 0, Z_DEFAULT_STRATEGY) != Z_OK )
+			return -1;
+		zip->stored = 1;
+	}
+
+	zip->out.next_in = (unsigned char *) buf;
+	zip->out.avail_in = len;
+
+	if ( (deflate(&zip->out, Z_SYNC_FLUSH) != Z_OK)
+			|| (zip->out.avail_in > 0) )
+		return -1;
+
+	need = zip->size - zip->out.avail_out;
+	zip->raw_out += len;
+	zip->zip_out += need;
+	*out = zip->buf;
+
+	return need;
+} /* zip_deflate(struct zip *, const void *, size_t, const void **) */
+
+/**
+ * zip_input  --  room for compressed input
+ *
+ * Valid only once zip_inflate() has returned naught.
+ */
+
+void *zip_input(struct zip *zip, size_t *len) {
+	*len = sizeof(zip->input);
+
+	return zip->input;
+} /* zip_input(struct zip *, size_t *) */
+
+/**
+ * zip_supply  --  len bytes have been placed by zip_input()
+ */
+
+void zip_supply(struct zip *zip, size_t len) {
+	zip->in.next_in = zip->input;
+	zip->in.avail_in = len;
+	zip->zip_in += len;
+} /* zip_supply(struct zip *, size_t) */
+
+/**
+ * zip_inflate  --  decompress into a buffer
+ *
+ * Returns the amount produced, naught when more input is
+ * needed, or -1 for a corrupt stream.
+ */
+
+ssize_t zip_inflate(struct zip *zip, void *buf, size_t len) {
+	int rc;
+	size_t n;
+
+	if ( (zip->in.avail_in == 0) && !zip->more )
+		return 0;
+
+	zip->in.next_out = buf;
+	zip->in.avail_out = len;
+
+	rc = inflate(&zip->in, Z_SYNC_FLUSH);
+	if ( (rc != Z_OK) && (rc != Z_BUF_ERROR) )
+		return -1;
+
+	n = len - zip->in.avail_out;
+	zip->more = (zip->in.avail_out == 0);
+	zip->raw_in += n;
+
+	return n;
+} /* zip_inflate(struct zip *, void *, size_t) */
+
+/**
+ * zip_pending  --  can output be had without further input?
+ */
+
+int zip_pending(const struct zip *zip) {
+	return (zip->in.avail_in > 0) || zip->more;
+} /* zip_pending(const struct zip *) */
+
+/**
+ * compress_report  --  write the counters of all streams
+ */
+
+void compress_report(FILE *file) {
+	struct zip_counters c;
+
+	if (counters == NULL)
+		return;
+
+	memcpy(&c, counters, sizeof(c));
+
+	fprintf(file, "compress_streams %llu\n"
+				"compress_stored %llu\n"
+				"compress_sent_raw %llu\n"
+				"compress_sent %llu\n"
+				"compress_sent_ratio %.3f\n"
+				"compress_received %llu\n"
+				"compress_received_raw %llu\n"
+				"compress_received_ratio %.3f\n",
+			c.streams, c.stored,
+			c.raw_out, c.zip_out,
+			c.zip_out ? (double) c.raw_out / c.zip_out : 0.0,
+			c.zip_in, c.raw_in,
+			c.zip_in ? (double) c.raw_in / c.zip_in : 0.0);
+} /* compress_report(FILE *) */
+
+#else /* !USE_ZLIB */
+
+int compress_init(void) {
+	return -1;
+} /* compress_init(void) */
+
+struct zip *zip_new(int level) {
+	return NULL;
+} /* zip_new(int) */
+
+void zip_free(struct zip *zip) {
+} /* zip_free(struct zip *) */
+
+ssize_t zip_deflate(struct zip *zip, const void *buf, size_t len,
+					const void **out) {
+	return -1;
+} /* zip_deflate(struct zip *, const void *, size_t, const void **) */
+
+void *zip_input(struct zip *zip, size_t *len) {
+	*len = 0;
+	return NULL;
+} /* zip_input(struct zip *, size_t *) */
+
+void zip_supply(struct zip *zip, size_t len) {
+} /* zip_supply(struct zip *, size_t) */
+
+ssize_t zip_inflate(struct zip *zip, void *buf, size_t len) {
+	return -1;
+} /* zip_inflate(struct zip *, void *, size_t) */
+
+int zip_pending(const struct zip *zip) {
+	return 0;
+} /* zip_pending(const struct zip *) */
+
+void compress_report(FILE *file) {
+} /* compress_report(FILE *) */
+
+#endif /* USE_ZLIB */
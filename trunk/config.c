@@ -0,0 +1,435 @@
+/*
+ * config.c  --  many tunnels served by a single daemon
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * vim: set sw=4 ts=4
+ */
+
+/*
+ * A configuration file declares tunnels of any subsystem, each
+ * in a section of its own:
+ *
+ *     # Comment lines begin with '#' or ';'.
+ *     [web]
+ *     service = tls-to-plain
+ *     local = 443
+ *     remote = localhost,80
+ *     certificate = /etc/gunnel/web-rsa.pem, /etc/gunnel/web-ec.pem
+ *
+ * Like -c and -k, the keys "certificate" and "key" may be repeated,
+ * or may list several files separated by commas.
+ * Further keys are "key", "ca", "ciphers", "tuning", "rate",
+ * "tunnel_rate", "verify", "early_data", "mux", "routes", "compress",
+ * "stripes", and "reverse", which default to the switches -k, -a, -C,
+ * -T, -b, -B, -V, -e, -m, -R, -Z, -P, and -Y of the command line,
+ * just as "certificate" defaults to -c. All tunnels
+ * share one accepting process, one handshake pool, and credentials
+ * loaded once for every distinct set of files.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <getopt.h>
+
+#define _INCLUDE_EXTERNALS	1
+#include "gunnel.h"
+#include "plugins.h"
+
+#define CONFIG_LINE_LENGTH	1024
+
+static const char config_options_string[] = "hf:g:u:c:k:a:C:oNH:E:w:F:T:b:B:S:V:e:m:z:n:R:Z:P:Y:Q:";
+
+/* Subsystems available to configuration files. */
+static const struct service *services[] = {
+#if USE_PLAIN_TO_TLS
+	&plain_to_tls_service,
+#endif
+#if USE_TLS_TO_PLAIN
+	&tls_to_plain_service,
+#endif
+#if USE_TLS_TO_TLS
+	&tls_to_tls_service,
+#endif
+#if USE_PLAIN_TO_PLAIN
+	&plain_to_plain_service,
+#endif
+	NULL
+};
+
+static struct tunnel tunnels[MAX_TUNNELS];
+
+static void config_usage(char *progname) {
+	int j;
+
+	printf("Usage: %s " CONFIG_FILE_STR
+						TUNNEL_USR_STR
+						TUNNEL_GRP_STR
+						ONE_SHOT_STR
+						FOREGROUND_STR
+						HANDOVER_SOCK_STR
+						IO_BACKEND_STR
+			"\n\t\t    "
+						HANDSHAKE_WORKERS_STR
+						FLUSH_WINDOW_STR
+						CERT_FILE_STR
+						CA_FILE_STR
+						KEY_FILE_STR
+			"\n\t\t    "
+						CIPHER_POLICY_STR
+						SOCKET_TUNING_STR
+						RATE_LIMIT_STR
+						TUNNEL_RATE_STR
+			"\n\t\t    "
+						VERIFY_PEER_STR
+						EARLY_DATA_STR
+						MUX_LINKS_STR
+						ROUTE_FILE_STR
+						COMPRESSION_STR
+						STRIPES_STR
+						REVERSE_LINKS_STR
+						BUFFER_SIZE_STR
+						MAX_CHILDREN_STR
+						BUSY_POLL_STR
+						STATISTICS_FILE_STR
+			"\n\n", progname);
+
+	printf("Services in configuration files:\n");
+	for (j = 0; services[j]; ++j)
+		printf("\t%s\n", services[j]->name);
+
+	exit(EXIT_FAILURE);
+} /* config_usage(char *) */
+
+/* Remove surrounding white space, in place. */
+static char *trim(char *str) {
+	char *end;
+
+	while ( isspace((unsigned char) *str) )
+		++str;
+
+	end = str + strlen(str);
+	while ( (end > str) && isspace((unsigned char) end[-1]) )
+		--end;
+	*end = '\0';
+
+	return str;
+} /* trim(char *) */
+
+static const struct service *lookup_service(const char *name) {
+	int j;
+
+	for (j = 0; services[j]; ++j)
+		if ( strcmp(services[j]->name, name) == 0 )
+			return services[j];
+
+	return NULL;
+} /* lookup_service(const char *) */
+
+/* Begin a tunnel with the defaults of the command line. */
+static struct tunnel *new_tunnel(const char *name) {
+	struct tunnel *tun;
+	static int count = 0;
+
+	if (count >= MAX_TUNNELS)
+		return NULL;
+
+	tun = &tunnels[count++];
+	memset(tun, '\0', sizeof(*tun));
+
+	tun->name = strdup(name);
+	tun->certificate = certificate;
+	tun->keyfile = keyfile;
+	tun->cafile = cafile;
+	tun->ciphers = ciphers;
+	tun->tuning_profiles = tuning_profiles;
+	tun->rate_limits = rate_limits;
+	tun->tunnel_rate_limits = tunnel_rate_limits;
+	tun->verify_mode = verify_mode;
+	tun->early_data = early_data;
+	tun->mux_links = mux_links;
+	tun->route_file = route_file;
+	tun->compress_level = compress_level;
+	tun->stripe_links = stripe_links;
+	tun->reverse_links = reverse_links;
+
+	return tun;
+} /* new_tunnel(const char *) */
+
+/* Assign a single key of the present tunnel. */
+static int set_key(struct tunnel *tun, const char *key, const char *value) {
+	const struct service *svc;
+	char *copy;
+
+	if ( strcmp(key, "service") == 0 ) {
+		if ( (svc = lookup_service(value)) == NULL )
+			return -1;
+		tun->svc = *svc;
+		return 0;
+	}
+
+	if ( (copy = strdup(value)) == NULL )
+		return -1;
+
+	if ( strcmp(key, "local") == 0 )
+		tun->local_port = copy;
+	else if ( strcmp(key, "remote") == 0 )
+		tun->remote_port = copy;
+	else if ( strcmp(key, "certificate") == 0 ) {
+		/* Repeated keys add certificates, as does -c. */
+		tun->certificate = (tun->certificate == certificate)
+							? copy : append_list(tun->certificate, copy);
+		/* A key given by -k belongs to the certificate of -c. */
+		if (tun->keyfile == keyfile)
+			tun->keyfile = NULL;
+	}
+	else if ( strcmp(key, "key") == 0 )
+		tun->keyfile = (tun->keyfile == keyfile)
+						? copy : append_list(tun->keyfile, copy);
+	else if ( strcmp(key, "ca") == 0 )
+		tun->cafile = copy;
+	else if ( strcmp(key, "ciphers") == 0 )
+		tun->ciphers = copy;
+	else if ( strcmp(key, "tuning") == 0 )
+		tun->tuning_profiles = copy;
+	else if ( strcmp(key, "rate") == 0 )
+		tun->rate_limits = copy;
+	else if ( strcmp(key, "tunnel_rate") == 0 )
+		tun->tunnel_rate_limits = copy;
+	else if ( strcmp(key, "verify") == 0 )
+		tun->verify_mode = copy;
+	else if ( strcmp(key, "early_data") == 0 )
+		tun->early_data = copy;
+	else if ( strcmp(key, "mux") == 0 )
+		tun->mux_links = copy;
+	else if ( strcmp(key, "routes") == 0 )
+		tun->route_file = copy;
+	else if ( strcmp(key, "compress") == 0 )
+		tun->compress_level = copy;
+	else if ( strcmp(key, "stripes") == 0 )
+		tun->stripe_links = copy;
+	else if ( strcmp(key, "reverse") == 0 )
+		tun->reverse_links = copy;
+	else {
+		free(copy);
+		return -1;
+	}
+
+	return 0;
+} /* set_key(struct tunnel *, const char *, const char *) */
+
+/*
+ * Read the tunnels declared in a file. Returns their number,
+ * or -1 after reporting the first error.
+ */
+
+static int read_config(const char *path) {
+	int count = 0, lineno = 0;
+	char line[CONFIG_LINE_LENGTH], *str, *value;
+	FILE *file;
+	struct tunnel *tun = NULL;
+
+	if ( (file = fopen(path, "r")) == NULL ) {
+		perror(path);
+		return -1;
+	}
+
+	while ( fgets(line, sizeof(line), file) ) {
+		++lineno;
+		str = trim(line);
+
+		if ( (*str == '\0') || (*str == '#') || (*str == ';') )
+			continue;
+
+		if (*str == '[') {
+			if ( (value = strchr(str, ']')) == NULL ) {
+				fprintf(stderr, "%s:%d: Unterminated section name.\n",
+						path, lineno);
+				goto failure;
+			}
+
+			*value = '\0';
+			if ( (tun = new_tunnel(trim(str + 1))) == NULL ) {
+				fprintf(stderr, "%s:%d: More than %d tunnels.\n",
+						path, lineno, MAX_TUNNELS);
+				goto failure;
+			}
+			++count;
+			continue;
+		}
+
+		if ( (value = strchr(str, '=')) == NULL ) {
+			fprintf(stderr, "%s:%d: Expected \"key = value\".\n",
+					path, lineno);
+			goto failure;
+		}
+
+		*value++ = '\0';
+
+		if (tun == NULL) {
+			fprintf(stderr, "%s:%d: Key outside of any tunnel.\n",
+					path, lineno);
+			goto failure;
+		}
+
+		if ( set_key(tun, trim(str), trim(value)) ) {
+			fprintf(stderr, "%s:%d: Invalid setting \"%s\".\n",
+					path, lineno, trim(str));
+			goto failure;
+		}
+	}
+
+	fclose(file);
+
+	if (count == 0)
+		fprintf(stderr, "%s: No tunnels are declared.\n", path);
+
+	return count ? count : -1;
+
+failure:
+	fclose(file);
+	return -1;
+} /* read_config(const char *) */
+
+/**
+ * run_config  --  serve the tunnels of a configuration file
+ */
+
+int run_config(int argc, char *argv[]) {
+	int j, opt, count, show_usage = 0;
+	char *path = NULL;
+
+	while ( (opt = getopt(argc, argv, config_options_string)) != -1 ) {
+		switch (opt) {
+			case 'h':	show_usage = 1;
+						break;
+			case CONFIG_FILE:
+						path = optarg;
+						break;
+			case CERT_FILE:
+						certificate = append_list(certificate, optarg);
+						break;
+			case CA_FILE:
+						cafile = optarg;
+						break;
+			case KEY_FILE:
+						keyfile = append_list(keyfile, optarg);
+						break;
+			case CIPHER_POLICY:
+						ciphers = optarg;
+						break;
+			case TUNNEL_USR:
+						user_name = optarg;
+						break;
+			case TUNNEL_GRP:
+						group_name = optarg;
+						break;
+			case ONE_SHOT:
+						again = 0;
+						break;
+			case FOREGROUND:
+						foreground = 1;
+						break;
+			case HANDOVER_SOCK:
+						handover_path = optarg;
+						break;
+			case IO_BACKEND:
+						io_backend = optarg;
+						break;
+			case HANDSHAKE_WORKERS:
+						handshake_workers = atoi(optarg);
+						break;
+			case FLUSH_WINDOW:
+						flush_window = atol(optarg);
+						break;
+			case SOCKET_TUNING:
+						tuning_profiles = optarg;
+						break;
+			case RATE_LIMIT:
+						rate_limits = optarg;
+						break;
+			case TUNNEL_RATE:
+						tunnel_rate_limits = optarg;
+						break;
+			case VERIFY_PEER:
+						verify_mode = optarg;
+						break;
+			case STATISTICS_FILE:
+						statistics_path = optarg;
+						break;
+			case EARLY_DATA:
+						early_data = optarg;
+						break;
+			case MUX_LINKS:
+						mux_links = optarg;
+						break;
+			case ROUTE_FILE:
+						route_file = optarg;
+						break;
+			case COMPRESSION:
+						compress_level = optarg;
+						break;
+			case STRIPES:
+						stripe_links = optarg;
+						break;
+			case REVERSE_LINKS:
+						reverse_links = optarg;
+						break;
+			case BUSY_POLL:
+						busy_poll = optarg;
+						break;
+			case BUFFER_SIZE:
+						buffer_size = atol(optarg);
+						break;
+			case MAX_CHILDREN:
+						max_children = atoi(optarg);
+						break;
+			case '?':
+			default:
+						fprintf(stderr, "\n");
+						show_usage = 1;
+						break;
+		}
+	}
+
+	if (show_usage || (path == NULL))
+		/* Never returns. */
+		config_usage(argv[0]);
+
+	if ( (count = read_config(path)) < 0 )
+		return EXIT_FAILURE;
+
+	for (j = 0; j < count; ++j) {
+		if ( tunnels[j].svc.name == NULL ) {
+			fprintf(stderr, "Tunnel %s: Missing service.\n", tunnels[j].name);
+			tls_context_release_all();
+			return EXIT_FAILURE;
+		}
+
+		if ( (tunnels[j].local_port == NULL)
+				|| (tunnels[j].remote_port == NULL) ) {
+			fprintf(stderr, "Tunnel %s: Missing port descriptions.\n",
+					tunnels[j].name);
+			tls_context_release_all();
+			return EXIT_FAILURE;
+		}
+
+		if ( prepare_tunnel(&tunnels[j]) ) {
+			fprintf(stderr, "Tunnel %s is not usable.\n", tunnels[j].name);
+			tls_context_release_all();
+			return EXIT_FAILURE;
+		}
+	}
+
+	return serve_tunnels(tunnels, count);
+} /* run_config(int, char *[]) */
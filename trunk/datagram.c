@@ -0,0 +1,830 @@
+/*
+ * datagram.c  --  UDP traffic protected by DTLS
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * vim: set sw=4 ts=4
+ */
+
+/*
+ * Datagrams wrapped in a TLS stream would suffer head-of-line
+ * blocking, so the datagram services use DTLS instead. A single
+ * process serves every peer, each with a DTLS session of its own:
+ *
+ *   plain-udp-to-dtls  receives datagrams at the local port, and
+ *                      carries the traffic of each sending peer
+ *                      over a session from a socket of its own.
+ *
+ *   dtls-to-plain-udp  shares the local port among all sessions,
+ *                      and relays each peer through a UDP socket
+ *                      of its own. A new peer is first answered
+ *                      by a stateless cookie, so that forged
+ *                      source addresses never allocate a session.
+ *
+ * The shared local socket is read by recvmmsg() and written by
+ * sendmmsg(), up to DGRAM_BATCH datagrams per system call, as is
+ * the remote socket of every plain peer. Peers are found by their
+ * address in a hash table, and are forgotten after DGRAM_IDLE
+ * seconds of silence in both directions.
+ */
+
+/* For recvmmsg() and sendmmsg(). */
+#define _GNU_SOURCE	1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <getopt.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netdb.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/dtls.h>
+
+#define _INCLUDE_EXTERNALS	1
+#include "gunnel.h"
+
+/* Datagrams per recvmmsg() or sendmmsg(). */
+#ifndef DGRAM_BATCH
+#  define DGRAM_BATCH	32
+#endif
+
+/* Largest datagram, and DTLS record; any longer one is dropped. */
+#define DGRAM_SIZE		(16384 + 256)
+
+/* Path MTU assumed for handshake messages: Ethernet, less IPv4 and UDP. */
+#ifndef DGRAM_MTU
+#  define DGRAM_MTU		1472
+#endif
+
+#ifndef DGRAM_MAX_PEERS
+#  define DGRAM_MAX_PEERS	512
+#endif
+
+#define DGRAM_BUCKETS	1024
+
+/* Seconds of silence before a peer is forgotten. */
+#ifndef DGRAM_IDLE
+#  define DGRAM_IDLE	120
+#endif
+
+/* Datagrams held while a client session is negotiated. */
+#define DGRAM_BACKLOG	8
+
+/* DTLS 1.2 record type of handshake messages. */
+#define RECORD_HANDSHAKE	22
+
+static const char datagram_options_string[] = "hl:r:g:u:Nc:k:a:C:V:";
+
+/* Message passing */
+static char message[MESSAGE_LENGTH] = "";
+
+struct dgram_peer {
+	struct sockaddr_storage addr;	/* At the local port. */
+	socklen_t addrlen;
+	int fd;						/* Towards the remote port. */
+	gnutls_session_t session;
+	int established;
+	long long retransmit;		/* Deadline during handshake, msec. */
+	time_t last_seen;
+	const unsigned char *in;	/* Datagram offered to a server session. */
+	size_t in_len;
+	int held;					/* Count of datagrams in backlog[]. */
+	size_t held_len[DGRAM_BACKLOG];
+	unsigned char *backlog;
+	struct dgram_peer *next;	/* In the same bucket. */
+};
+
+/* Outgoing datagrams, written by a single sendmmsg(). */
+struct dgram_batch {
+	int count;
+	struct mmsghdr msg[DGRAM_BATCH];
+	struct iovec iov[DGRAM_BATCH];
+	struct sockaddr_storage addr[DGRAM_BATCH];
+	unsigned char buf[DGRAM_BATCH][DGRAM_SIZE];
+};
+
+static int server;
+static int sd = -1;		/* The local port. */
+static const struct tls_context *tls;
+static struct sockaddr_storage remote;
+static socklen_t remote_len;
+static gnutls_datum_t cookie_key;
+
+static struct dgram_peer *buckets[DGRAM_BUCKETS];
+static int peers = 0;
+
+static struct dgram_batch out;	/* To the local port. */
+static struct dgram_batch in;	/* Read from any socket. */
+
+static long long now_msec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+} /* now_msec(void) */
+
+static unsigned int addr_hash(const struct sockaddr_storage *addr,
+								socklen_t len) {
+	unsigned int hash = 2166136261u;
+	const unsigned char *p = (const unsigned char *) addr;
+
+	while (len-- > 0)
+		hash = (hash ^ *p++) * 16777619u;
+
+	return hash % DGRAM_BUCKETS;
+} /* addr_hash(const struct sockaddr_storage *, socklen_t) */
+
+static struct dgram_peer *peer_find(const struct sockaddr_storage *addr,
+									socklen_t len) {
+	struct dgram_peer *p;
+
+	for (p = buckets[addr_hash(addr, len)]; p; p = p->next)
+		if ( (p->addrlen == len) && (memcmp(&p->addr, addr, len) == 0) )
+			return p;
+
+	return NULL;
+} /* peer_find(const struct sockaddr_storage *, socklen_t) */
+
+/* Send all datagrams of the batch to the local port. */
+static void batch_flush(void) {
+	int n, done = 0;
+
+	while (done < out.count) {
+		n = sendmmsg(sd, out.msg + done, out.count - done, 0);
+
+		if ( (n < 0) && (errno == EINTR) )
+			continue;
+
+		/* Datagrams may be lost, as always. */
+		if (n <= 0)
+			break;
+
+		done += n;
+	}
+
+	out.count = 0;
+} /* batch_flush(void) */
+
+static void batch_add(const struct sockaddr_storage *addr, socklen_t len,
+						const void *data, size_t size) {
+	int j;
+
+	if (size > DGRAM_SIZE)
+		return;
+
+	if (out.count == DGRAM_BATCH)
+		batch_flush();
+
+	j = out.count++;
+	memcpy(out.buf[j], data, size);
+	memcpy(&out.addr[j], addr, len);
+
+	out.iov[j].iov_base = out.buf[j];
+	out.iov[j].iov_len = size;
+	memset(&out.msg[j], '\0', sizeof(out.msg[j]));
+	out.msg[j].msg_hdr.msg_name = &out.addr[j];
+	out.msg[j].msg_hdr.msg_namelen = len;
+	out.msg[j].msg_hdr.msg_iov = &out.iov[j];
+	out.msg[j].msg_hdr.msg_iovlen = 1;
+} /* batch_add(const struct sockaddr_storage *, socklen_t,
+	 const void *, size_t) */
+
+/* Read what a socket offers, returning the number of datagrams. */
+static int batch_read(int fd) {
+	int j, n;
+
+	for (j = 0; j < DGRAM_BATCH; ++j) {
+		in.iov[j].iov_base = in.buf[j];
+		in.iov[j].iov_len = DGRAM_SIZE;
+		memset(&in.msg[j], '\0', sizeof(in.msg[j]));
+		in.msg[j].msg_hdr.msg_name = &in.addr[j];
+		in.msg[j].msg_hdr.msg_namelen = sizeof(in.addr[j]);
+		in.msg[j].msg_hdr.msg_iov = &in.iov[j];
+		in.msg[j].msg_hdr.msg_iovlen = 1;
+	}
+
+	do
+		n = recvmmsg(fd, in.msg, DGRAM_BATCH, MSG_DONTWAIT, NULL);
+	while ( (n < 0) && (errno == EINTR) );
+
+	return (n < 0) ? 0 : n;
+} /* batch_read(int) */
+
+/* Records of a server session leave through the shared port. */
+static ssize_t server_push(gnutls_transport_ptr_t ptr,
+							const void *data, size_t len) {
+	struct dgram_peer *p = ptr;
+
+	batch_add(&p->addr, p->addrlen, data, len);
+
+	return len;
+} /* server_push(gnutls_transport_ptr_t, const void *, size_t) */
+
+/* A server session reads the datagram it was offered, if any. */
+static ssize_t server_pull(gnutls_transport_ptr_t ptr, void *data, size_t len) {
+	struct dgram_peer *p = ptr;
+
+	if (p->in == NULL) {
+		gnutls_transport_set_errno(p->session, EAGAIN);
+		return -1;
+	}
+
+	if (len > p->in_len)
+		len = p->in_len;
+
+	memcpy(data, p->in, len);
+	p->in = NULL;
+
+	return len;
+} /* server_pull(gnutls_transport_ptr_t, void *, size_t) */
+
+static int server_pull_timeout(gnutls_transport_ptr_t ptr, unsigned int ms) {
+	struct dgram_peer *p = ptr;
+
+	return p->in ? 1 : 0;
+} /* server_pull_timeout(gnutls_transport_ptr_t, unsigned int) */
+
+/* A client session owns a connected socket. */
+static ssize_t client_push(gnutls_transport_ptr_t ptr,
+							const void *data, size_t len) {
+	struct dgram_peer *p = ptr;
+
+	return send(p->fd, data, len, 0);
+} /* client_push(gnutls_transport_ptr_t, const void *, size_t) */
+
+static ssize_t client_pull(gnutls_transport_ptr_t ptr, void *data, size_t len) {
+	ssize_t n;
+	struct dgram_peer *p = ptr;
+
+	n = recv(p->fd, data, len, MSG_DONTWAIT);
+	if (n < 0)
+		gnutls_transport_set_errno(p->session, errno);
+
+	return n;
+} /* client_pull(gnutls_transport_ptr_t, void *, size_t) */
+
+static int client_pull_timeout(gnutls_transport_ptr_t ptr, unsigned int ms) {
+	char byte;
+	struct dgram_peer *p = ptr;
+
+	return recv(p->fd, &byte, sizeof(byte), MSG_DONTWAIT | MSG_PEEK) >= 0;
+} /* client_pull_timeout(gnutls_transport_ptr_t, unsigned int) */
+
+static void peer_drop(struct dgram_peer *p) {
+	struct dgram_peer **pp;
+
+	for (pp = &buckets[addr_hash(&p->addr, p->addrlen)]; *pp; pp = &(*pp)->next)
+		if (*pp == p) {
+			*pp = p->next;
+			break;
+		}
+
+	if (p->session) {
+		if (p->established)
+			gnutls_bye(p->session, GNUTLS_SHUT_WR);
+		gnutls_deinit(p->session);
+	}
+
+	close(p->fd);
+	free(p->backlog);
+	free(p);
+	--peers;
+} /* peer_drop(struct dgram_peer *) */
+
+/* A new peer, with a socket towards the remote port. */
+static struct dgram_peer *peer_new(const struct sockaddr_storage *addr,
+									socklen_t len) {
+	unsigned int hash;
+	struct dgram_peer *p;
+
+	if (peers >= DGRAM_MAX_PEERS)
+		return NULL;
+
+	if ( (p = calloc(1, sizeof(*p))) == NULL )
+		return NULL;
+
+	memcpy(&p->addr, addr, len);
+	p->addrlen = len;
+	p->last_seen = time(NULL);
+
+	p->fd = socket(remote.ss_family, SOCK_DGRAM, 0);
+
+	if ( (p->fd < 0) || (p->fd >= FD_SETSIZE)
+			|| connect(p->fd, (struct sockaddr *) &remote, remote_len) ) {
+		if (p->fd >= 0)
+			close(p->fd);
+		free(p);
+		return NULL;
+	}
+
+	hash = addr_hash(addr, len);
+	p->next = buckets[hash];
+	buckets[hash] = p;
+	++peers;
+
+	if ( init_dtls_session(&p->session, tls, message, sizeof(message)) ) {
+		p->session = NULL;
+		peer_drop(p);
+		return NULL;
+	}
+
+	gnutls_dtls_set_mtu(p->session, DGRAM_MTU);
+	gnutls_transport_set_ptr(p->session, p);
+
+	if (server) {
+		gnutls_transport_set_push_function(p->session, server_push);
+		gnutls_transport_set_pull_function(p->session, server_pull);
+		gnutls_transport_set_pull_timeout_function(p->session,
+												server_pull_timeout);
+	} else {
+		gnutls_transport_set_push_function(p->session, client_push);
+		gnutls_transport_set_pull_function(p->session, client_pull);
+		gnutls_transport_set_pull_timeout_function(p->session,
+												client_pull_timeout);
+	}
+
+	return p;
+} /* peer_new(const struct sockaddr_storage *, socklen_t) */
+
+/* Deliver decrypted data towards the plain side. */
+static void deliver_plain(struct dgram_peer *p, const void *data, size_t len) {
+	if (server)
+		send(p->fd, data, len, 0);
+	else
+		batch_add(&p->addr, p->addrlen, data, len);
+} /* deliver_plain(struct dgram_peer *, const void *, size_t) */
+
+/* Encrypt a plain datagram. Returns -1 when the peer was dropped. */
+static int deliver_dtls(struct dgram_peer *p, const void *data, size_t len) {
+	ssize_t n;
+
+	n = gnutls_record_send(p->session, data, len);
+
+	/* A datagram too long for the MTU is lost. */
+	if ( (n < 0) && gnutls_error_is_fatal(n) ) {
+		peer_drop(p);
+		return -1;
+	}
+
+	return 0;
+} /* deliver_dtls(struct dgram_peer *, const void *, size_t) */
+
+/* Continue a handshake. Returns -1 when the peer was dropped. */
+static int peer_handshake(struct dgram_peer *p) {
+	int j, rc;
+
+	rc = gnutls_handshake(p->session);
+
+	if ( (rc == GNUTLS_E_AGAIN) || (rc == GNUTLS_E_INTERRUPTED) ) {
+		p->retransmit = now_msec() + gnutls_dtls_get_timeout(p->session);
+		return 0;
+	}
+
+	if (rc < 0) {
+		if ( gnutls_error_is_fatal(rc) ) {
+			peer_drop(p);
+			return -1;
+		}
+		return 0;
+	}
+
+	p->established = 1;
+
+	/* Like plain datagrams, records exceeding the path MTU
+	 * are left for IP to fragment, rather than being lost. */
+	gnutls_dtls_set_mtu(p->session, DGRAM_SIZE);
+
+	/* Datagrams that arrived meanwhile. */
+	for (j = 0; j < p->held; ++j)
+		if ( deliver_dtls(p, p->backlog + j * DGRAM_SIZE, p->held_len[j]) )
+			return -1;
+
+	free(p->backlog);
+	p->backlog = NULL;
+	p->held = 0;
+
+	return 0;
+} /* peer_handshake(struct dgram_peer *) */
+
+/* Read from a session. Returns -1 when the peer was dropped. */
+static int dtls_read(struct dgram_peer *p) {
+	ssize_t n;
+	unsigned char buf[DGRAM_SIZE];
+
+	if (! p->established) {
+		if ( peer_handshake(p) )
+			return -1;
+		if (! p->established)
+			return 0;
+	}
+
+	while (1) {
+		n = gnutls_record_recv(p->session, buf, sizeof(buf));
+
+		if (n > 0) {
+			p->last_seen = time(NULL);
+			deliver_plain(p, buf, n);
+			continue;
+		}
+
+		if ( (n == GNUTLS_E_AGAIN) || (n == GNUTLS_E_INTERRUPTED) )
+			return 0;
+
+		/* Closure by the peer, or a broken session. */
+		if ( (n == 0) || gnutls_error_is_fatal(n) ) {
+			peer_drop(p);
+			return -1;
+		}
+
+		/* Records failing authentication are discarded. */
+		return 0;
+	}
+} /* dtls_read(struct dgram_peer *) */
+
+/* A datagram from a plain peer at the local port. */
+static void plain_arrived(const struct sockaddr_storage *addr, socklen_t len,
+							const unsigned char *data, size_t size) {
+	struct dgram_peer *p;
+
+	if ( (p = peer_find(addr, len)) == NULL ) {
+		if ( (p = peer_new(addr, len)) == NULL )
+			return;
+
+		if ( (p->backlog = malloc(DGRAM_BACKLOG * DGRAM_SIZE)) == NULL ) {
+			peer_drop(p);
+			return;
+		}
+
+		if ( peer_handshake(p) )
+			return;
+	}
+
+	p->last_seen = time(NULL);
+
+	if (p->established) {
+		deliver_dtls(p, data, size);
+		return;
+	}
+
+	/* Held until the session is ready, lost beyond that. */
+	if (p->held < DGRAM_BACKLOG) {
+		memcpy(p->backlog + p->held * DGRAM_SIZE, data, size);
+		p->held_len[p->held++] = size;
+	}
+} /* plain_arrived(const struct sockaddr_storage *, socklen_t,
+	 const unsigned char *, size_t) */
+
+/* Answer a new client with a cookie, keeping no state. */
+static ssize_t cookie_push(gnutls_transport_ptr_t ptr,
+							const void *data, size_t len) {
+	const struct dgram_peer *dest = ptr;
+
+	batch_add(&dest->addr, dest->addrlen, data, len);
+
+	return len;
+} /* cookie_push(gnutls_transport_ptr_t, const void *, size_t) */
+
+/* A datagram from a DTLS peer at the local port. */
+static void dtls_arrived(const struct sockaddr_storage *addr, socklen_t len,
+							const unsigned char *data, size_t size) {
+	struct dgram_peer *p, dest;
+	gnutls_dtls_prestate_st prestate;
+
+	if ( (p = peer_find(addr, len)) == NULL ) {
+		/* Only a ClientHello may introduce a peer. */
+		if ( (size == 0) || (data[0] != RECORD_HANDSHAKE) )
+			return;
+
+		memset(&prestate, '\0', sizeof(prestate));
+
+		if ( gnutls_dtls_cookie_verify(&cookie_key, (void *) addr, len,
+										(void *) data, size, &prestate) < 0 ) {
+			memcpy(&dest.addr, addr, len);
+			dest.addrlen = len;
+			gnutls_dtls_cookie_send(&cookie_key, (void *) addr, len,
+									&prestate, &dest, cookie_push);
+			return;
+		}
+
+		if ( (p = peer_new(addr, len)) == NULL )
+			return;
+
+		gnutls_dtls_prestate_set(p->session, &prestate);
+	}
+
+	p->last_seen = time(NULL);
+	p->in = data;
+	p->in_len = size;
+
+	if ( dtls_read(p) == 0 )
+		p->in = NULL;
+} /* dtls_arrived(const struct sockaddr_storage *, socklen_t,
+	 const unsigned char *, size_t) */
+
+/* Datagrams at the local port. */
+static void local_read(void) {
+	int j, n;
+
+	n = batch_read(sd);
+
+	for (j = 0; j < n; ++j) {
+		if (in.msg[j].msg_hdr.msg_flags & MSG_TRUNC)
+			continue;
+
+		if (server)
+			dtls_arrived(&in.addr[j], in.msg[j].msg_hdr.msg_namelen,
+						in.buf[j], in.msg[j].msg_len);
+		else
+			plain_arrived(&in.addr[j], in.msg[j].msg_hdr.msg_namelen,
+						in.buf[j], in.msg[j].msg_len);
+	}
+} /* local_read(void) */
+
+/* Traffic at the remote socket of a peer. */
+static void remote_read(struct dgram_peer *p) {
+	int j, n;
+
+	if (! server) {
+		dtls_read(p);
+		return;
+	}
+
+	n = batch_read(p->fd);
+	if (n > 0)
+		p->last_seen = time(NULL);
+
+	for (j = 0; j < n; ++j) {
+		if ( !p->established || (in.msg[j].msg_hdr.msg_flags & MSG_TRUNC) )
+			continue;
+
+		if ( deliver_dtls(p, in.buf[j], in.msg[j].msg_len) )
+			return;
+	}
+} /* remote_read(struct dgram_peer *) */
+
+#define watch(fd, set) \
+	do { FD_SET((fd), (set)); maxfd = ((fd) > maxfd) ? (fd) : maxfd; } while (0)
+
+static void datagram_loop(void) {
+	int j, maxfd;
+	long long now, wait;
+	fd_set rset;
+	struct timeval tv, *timeout;
+	struct dgram_peer *p, *next;
+
+	while (again) {
+		/* Established peers keep their credentials. */
+		if (reload_due) {
+			reload_due = 0;
+			tls_context_reload_all(message, sizeof(message));
+			fprintf(stderr, "%s", message);
+		}
+
+		FD_ZERO(&rset);
+		maxfd = -1;
+		watch(sd, &rset);
+
+		/* Idle peers are checked every second. */
+		wait = 1000;
+		now = now_msec();
+
+		for (j = 0; j < DGRAM_BUCKETS; ++j)
+			for (p = buckets[j]; p; p = p->next) {
+				watch(p->fd, &rset);
+				if ( !p->established && (p->retransmit - now < wait) )
+					wait = p->retransmit - now;
+			}
+
+		if (wait < 0)
+			wait = 0;
+		tv.tv_sec = wait / 1000;
+		tv.tv_usec = (wait % 1000) * 1000;
+		timeout = peers ? &tv : NULL;
+
+		if ( select(maxfd + 1, &rset, NULL, NULL, timeout) < 0 ) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if ( FD_ISSET(sd, &rset) )
+			local_read();
+
+		now = now_msec();
+
+		for (j = 0; j < DGRAM_BUCKETS; ++j)
+			for (p = buckets[j]; p; p = next) {
+				next = p->next;
+
+				if ( FD_ISSET(p->fd, &rset) )
+					remote_read(p);
+				else if ( !p->established && (p->retransmit <= now) )
+					peer_handshake(p);
+				else if (time(NULL) - p->last_seen > DGRAM_IDLE)
+					peer_drop(p);
+			}
+
+		batch_flush();
+	}
+
+	for (j = 0; j < DGRAM_BUCKETS; ++j)
+		while (buckets[j])
+			peer_drop(buckets[j]);
+
+	batch_flush();
+} /* datagram_loop(void) */
+
+/* Resolve the remote port once, for every peer. */
+static int resolve_remote(char *rhost, char *rport) {
+	struct addrinfo hints, *aiptr;
+
+	memset(&hints, '\0', sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+#if defined(AI_ADDRCONFIG)
+	hints.ai_flags = AI_ADDRCONFIG;
+#endif
+
+	if ( getaddrinfo(rhost, rport, &hints, &aiptr) )
+		return -1;
+
+	memcpy(&remote, aiptr->ai_addr, aiptr->ai_addrlen);
+	remote_len = aiptr->ai_addrlen;
+	freeaddrinfo(aiptr);
+
+	return 0;
+} /* resolve_remote(char *, char *) */
+
+static void datagram_usage(const struct service *svc, char *progname) {
+	printf("Usage: %s " LOCAL_PORT_STR
+						REMOTE_PORT_STR
+						TUNNEL_USR_STR
+						TUNNEL_GRP_STR
+						FOREGROUND_STR
+			"\n\t\t    "
+						CERT_FILE_STR
+						CA_FILE_STR
+						KEY_FILE_STR
+						CIPHER_POLICY_STR
+						VERIFY_PEER_STR
+			"\n\n"
+			"Relays UDP datagrams %s DTLS, with a session per peer.\n\n",
+			progname,
+			(svc->local_kind == TRANSPORT_DTLS_SERVER)
+				? "protected by" : "to be protected by");
+
+	exit(EXIT_FAILURE);
+} /* datagram_usage(const struct service *, char *) */
+
+/**
+ * run_datagram_service  --  main control for datagram subsystems
+ */
+
+int run_datagram_service(const struct service *svc, int argc, char *argv[]) {
+	int opt, rc, show_usage = 0, verify = VERIFY_NONE;
+	char *lhost, *lport, *rhost, *rport;
+
+	while ( (opt = getopt(argc, argv, datagram_options_string)) != -1 ) {
+		switch (opt) {
+			case 'h':	show_usage = 1;
+						break;
+			case LOCAL_PORT:
+						local_port_string = optarg;
+						break;
+			case REMOTE_PORT:
+						remote_port_string = optarg;
+						break;
+			case CERT_FILE:
+						certificate = append_list(certificate, optarg);
+						break;
+			case CA_FILE:
+						cafile = optarg;
+						break;
+			case KEY_FILE:
+						keyfile = append_list(keyfile, optarg);
+						break;
+			case CIPHER_POLICY:
+						ciphers = optarg;
+						break;
+			case TUNNEL_USR:
+						user_name = optarg;
+						break;
+			case TUNNEL_GRP:
+						group_name = optarg;
+						break;
+			case FOREGROUND:
+						foreground = 1;
+						break;
+			case VERIFY_PEER:
+						verify_mode = optarg;
+						break;
+			case '?':
+			default:
+						fprintf(stderr, "\n");
+						show_usage = 1;
+						break;
+		}
+	}
+
+	if (show_usage)
+		/* Never returns. */
+		datagram_usage(svc, argv[0]);
+
+	if ( ! keyfile )
+		keyfile = certificate;
+
+	server = (svc->local_kind == TRANSPORT_DTLS_SERVER);
+
+	if ( local_port_string == NULL
+			|| remote_port_string == NULL ) {
+		fprintf(stderr, "Missing port descriptions.\n");
+		return EXIT_FAILURE;
+	}
+
+	if ( (rc = decompose_port(local_port_string, &lhost, &lport)) ) {
+		fprintf(stderr, "Local port: ");
+		gunnel_error_message(stderr, rc);
+		return EXIT_FAILURE;
+	}
+
+	if ( (rc = decompose_port(remote_port_string, &rhost, &rport)) ) {
+		fprintf(stderr, "Remote port: ");
+		gunnel_error_message(stderr, rc);
+		return EXIT_FAILURE;
+	}
+
+	if ( is_unix_socket_path(lhost, lport)
+			|| is_unix_socket_path(rhost, rport) ) {
+		fprintf(stderr, "Datagram services need UDP ports.\n");
+		return EXIT_FAILURE;
+	}
+
+	if ( resolve_remote(rhost, rport) ) {
+		fprintf(stderr, "Unable to resolve the remote port.\n");
+		return EXIT_FAILURE;
+	}
+
+	if ( (rc = test_usr_grp(user_name, group_name)) ) {
+		gunnel_error_message(stderr, rc);
+		return EXIT_FAILURE;
+	}
+
+	if ( (verify_mode == NULL) || (strcmp(verify_mode, "none") == 0) )
+		verify = VERIFY_NONE;
+	else if ( strcmp(verify_mode, "optional") == 0 )
+		verify = VERIFY_OPTIONAL;
+	else if ( strcmp(verify_mode, "require") == 0 )
+		verify = VERIFY_REQUIRE;
+	else {
+		fprintf(stderr, "Unknown verification mode: %s\n", verify_mode);
+		return EXIT_FAILURE;
+	}
+
+	tls = tls_context_load(certificate, keyfile, cafile, ciphers, server,
+							verify, 0, message, sizeof(message));
+	if (tls == NULL) {
+		fprintf(stderr, "%s\nInit DTLS failed!\n", message);
+		return EXIT_FAILURE;
+	}
+
+	fprintf(stderr, "%s", message);
+
+	if ( server && (gnutls_key_generate(&cookie_key,
+										GNUTLS_COOKIE_KEY_SIZE) < 0) ) {
+		fprintf(stderr, "No key for cookies.\n");
+		tls_context_release_all();
+		return EXIT_FAILURE;
+	}
+
+	if ( (sd = get_datagram_socket(lhost, lport)) < 0 ) {
+		tls_context_release_all();
+		return EXIT_FAILURE;
+	}
+
+	if ( (rc = underpriv_daemon_mode()) != GUNNEL_SUCCESS ) {
+		tls_context_release_all();
+		return EXIT_FAILURE;
+	}
+
+	atexit(tls_context_release_all);
+
+	datagram_loop();
+
+	return EXIT_SUCCESS;
+} /* run_datagram_service(const struct service *, int, char *[]) */
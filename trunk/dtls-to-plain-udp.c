@@ -0,0 +1,32 @@
+/*
+ * dtls-to-plain-udp.c  --  receive DTLS, forward plain datagrams
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * vim: set sw=4 ts=4
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define _INCLUDE_EXTERNALS	1
+#include "gunnel.h"
+
+const struct service dtls_to_plain_udp_service = {
+	"dtls-to-plain-udp",
+	TRANSPORT_DTLS_SERVER,
+	TRANSPORT_UDP
+};
+
+/*
+ * Main control for this subsystem.
+ */
+int dtls_to_plain_udp(int argc, char *argv[]) {
+	return run_datagram_service(&dtls_to_plain_udp_service, argc, argv);
+} /* dtls_to_plain_udp(int, char *[]) */
@@ -39,6 +39,65 @@ char *ciphers		= "NORMAL";
 char *local_port_string = NULL;
 char *remote_port_string = NULL;
 
+/* Control socket for restarts. */
+char *handover_path = NULL;
+
+/* Stay attached to the invoking process, as a supervisor wants. */
+int foreground = 0;
+
+/* Size of handshake pool, naught for none. */
+int handshake_workers = 0;
+
+/* Event backend: "auto", "select", or "uring". */
+char *io_backend = "auto";
+
+/* Time to await more data for a TLS record, in microseconds. */
+long flush_window = 0;
+
+/* Size of the relay buffers borrowed by connections. */
+long buffer_size = 16384;
+
+/* Most children serving clients at any time. */
+int max_children = 4096;
+
+/* Tuning profiles of local and remote sockets. */
+char *tuning_profiles = NULL;
+
+/* Bandwidth limits per connection, and per tunnel. */
+char *rate_limits = NULL;
+char *tunnel_rate_limits = NULL;
+
+/* Verification of peer certificates. */
+char *verify_mode = "none";
+
+/* TLS 1.3 early data, disabled unless a size is given. */
+char *early_data = NULL;
+
+/* Links carrying the streams of many clients, if any. */
+char *mux_links = NULL;
+
+/* Upstreams by server name and protocol, read from a file. */
+char *route_file = NULL;
+
+/* Deflate level offered to gunnel peers, none unless given. */
+char *compress_level = NULL;
+
+/* Links carrying each client, with its window, if striped. */
+char *stripe_links = NULL;
+
+/* Idle links dialled from behind a NAT, if reversed. */
+char *reverse_links = NULL;
+
+/* Spin budget and processor of busy polling relays, if any. */
+char *busy_poll = NULL;
+
+/* Statistics are written to this file at SIGUSR2. */
+char *statistics_path = NULL;
+int statistics_due = 0;
+
+/* Certificates and keys are loaded anew at SIGHUP. */
+int reload_due = 0;
+
 /* Looping control. */
 int again = 1;
 
@@ -53,14 +112,29 @@ static struct {
 #if USE_TLS_TO_PLAIN
 	{ "tls-to-plain", tls_to_plain },
 #endif
+#if USE_TLS_TO_TLS
+	{ "tls-to-tls", tls_to_tls },
+#endif
 #if USE_PLAIN_TO_PLAIN
 	{ "plain-to-plain", plain_to_plain },
 #endif
+#if USE_PLAIN_UDP_TO_DTLS
+	{ "plain-udp-to-dtls", plain_udp_to_dtls },
+#endif
+#if USE_DTLS_TO_PLAIN_UDP
+	{ "dtls-to-plain-udp", dtls_to_plain_udp },
+#endif
 #if USE_TLS_SNOOP
 	{ "tls-snoop", tls_snooper },
 #endif
 #if USE_PLAIN_SNOOP
 	{ "plain-snoop", plain_snooper },
+#endif
+#if USE_CONFIG
+	{ "config", run_config },
+#endif
+#if USE_CIPHERBENCH
+	{ "cipherbench", run_cipherbench },
 #endif
 	{ NULL, NULL }
 };	/* plugins[] */
@@ -13,6 +13,7 @@
 
 #include <errno.h>
 #include <locale.h>
+#include <sys/types.h>
 
 #include <gnutls/gnutls.h>
 
@@ -36,19 +37,67 @@
 #define REMOTE_PORT		'r'
 #define REMOTE_PORT_STR	"[-r port] "
 #define CERT_FILE		'c'
-#define CERT_FILE_STR	"[-c certfile] "
+#define CERT_FILE_STR	"[-c certfile]... "
 #define CA_FILE			'a'
 #define CA_FILE_STR		"[-a cafile] "
 #define KEY_FILE		'k'
-#define KEY_FILE_STR	"[-k keyfile] "
+#define KEY_FILE_STR	"[-k keyfile]... "
 #define CIPHER_POLICY	'C'
-#define CIPHER_POLICY_STR	"[-C ciphers] "
+#define CIPHER_POLICY_STR	"[-C ciphers|auto] "
 #define TUNNEL_USR		'u'
 #define TUNNEL_USR_STR	"[-u uid] "
 #define TUNNEL_GRP		'g'
 #define TUNNEL_GRP_STR	"[-g gid] "
 #define ONE_SHOT		'o'
 #define ONE_SHOT_STR	"[-o] "
+#define FOREGROUND		'N'
+#define FOREGROUND_STR	"[-N] "
+#define HANDOVER_SOCK	'H'
+#define HANDOVER_SOCK_STR	"[-H ctlsocket] "
+#define HANDSHAKE_WORKERS	'w'
+#define HANDSHAKE_WORKERS_STR	"[-w workers] "
+#define IO_BACKEND		'E'
+#define IO_BACKEND_STR	"[-E auto|select|uring] "
+#define FLUSH_WINDOW	'F'
+#define FLUSH_WINDOW_STR	"[-F usec] "
+#define SOCKET_TUNING	'T'
+#define SOCKET_TUNING_STR	"[-T profile[,profile]] "
+#define RATE_LIMIT		'b'
+#define RATE_LIMIT_STR	"[-b up[,down]] "
+#define TUNNEL_RATE		'B'
+#define TUNNEL_RATE_STR	"[-B up[,down]] "
+#define VERIFY_PEER		'V'
+#define VERIFY_PEER_STR	"[-V none|optional|require] "
+#define STATISTICS_FILE	'S'
+#define STATISTICS_FILE_STR	"[-S statsfile] "
+#define CONFIG_FILE		'f'
+#define CONFIG_FILE_STR	"[-f configfile] "
+#define BENCH_TIME		't'
+#define EARLY_DATA		'e'
+#define EARLY_DATA_STR	"[-e maxbytes] "
+#define BENCH_TIME_STR	"[-t msec] "
+#define MUX_LINKS		'm'
+#define MUX_LINKS_STR	"[-m links] "
+#define BUFFER_SIZE		'z'
+#define BUFFER_SIZE_STR	"[-z bytes] "
+#define MAX_CHILDREN	'n'
+#define MAX_CHILDREN_STR	"[-n children] "
+#define ROUTE_FILE		'R'
+#define ROUTE_FILE_STR	"[-R routefile] "
+#define COMPRESSION		'Z'
+#define COMPRESSION_STR	"[-Z level] "
+#define STRIPES			'P'
+#define STRIPES_STR		"[-P links[,window]] "
+#define REVERSE_LINKS	'Y'
+#define REVERSE_LINKS_STR	"[-Y idle] "
+#define BUSY_POLL		'Q'
+#define BUSY_POLL_STR	"[-Q usec[,cpu]] "
+
+/* Most descriptors passed in a single message. */
+#define MAX_PASSED_FDS	64
+
+/* Most tunnels served by one daemon, each having a listener. */
+#define MAX_TUNNELS		MAX_PASSED_FDS
 
 /* Enumeration of identified errors. */
 enum {
@@ -61,9 +110,198 @@ enum {
 	GUNNEL_INVALID_PORT,
 	GUNNEL_ALLOCATION_FAILURE,
 	GUNNEL_FAILED_REMOTE_CONN,
-	GUNNEL_FAILED_REMOTELY
+	GUNNEL_FAILED_REMOTELY,
+	GUNNEL_FAILED_HANDSHAKE,
+	GUNNEL_FAILED_SESSION,
+	GUNNEL_FAILED_HANDOVER
+};
+
+/* Kinds of transport on either side of a tunnel. */
+enum transport_kind {
+	TRANSPORT_PLAIN = 0,
+	TRANSPORT_UNIX,
+	TRANSPORT_TLS_SERVER,
+	TRANSPORT_TLS_CLIENT,
+	TRANSPORT_KTLS,		/* Records handled by the kernel. */
+	/* Datagram services only. */
+	TRANSPORT_UDP,
+	TRANSPORT_DTLS_SERVER,
+	TRANSPORT_DTLS_CLIENT
+};
+
+struct transport;
+
+/* Operations implemented by every transport. */
+struct transport_ops {
+	int (*handshake)(struct transport *tp);
+	ssize_t (*read)(struct transport *tp, void *buf, size_t len);
+	ssize_t (*write)(struct transport *tp, const void *buf, size_t len);
+	void (*shutdown)(struct transport *tp);
+	/* Amount of already decoded data awaiting a read. */
+	size_t (*pending)(struct transport *tp);
+};
+
+/* One endpoint of a tunnel. */
+struct transport {
+	int fd;
+	int kind;
+	int established;
+	gnutls_session_t session;
+	const struct transport_ops *ops;
+	/* Sizing of outgoing TLS records. */
+	size_t record_size;		/* Present target size. */
+	size_t corked;			/* Held back for coalescing. */
+	size_t burst;			/* Sent since last idle period. */
+	long long last_sent;	/* Monotonic time, microseconds. */
+	long long flush_at;		/* Deadline for corked data. */
+	/* TLS 1.3 early data. */
+	struct transport *peer;	/* Other side of the tunnel, if known. */
+	unsigned char *early;	/* Received, not yet passed to the peer. */
+	size_t early_len;
+	/* Compression agreed with a gunnel peer. */
+	int compress;			/* Level offered, or naught. */
+	struct zip *zip;
+};
+
+/* Socket options making up a tuning profile, naught for default. */
+struct tuning {
+	const char *name;
+	int nodelay;
+	int sndbuf, rcvbuf;
+	int notsent_lowat;
+	int defer_accept;	/* Seconds, for listeners. */
+	int fastopen;		/* Queue length, for listeners. */
+	int keepidle, keepintvl, keepcnt;
+};
+
+/* A token bucket counting bytes. */
+struct bucket {
+	long long rate;		/* Bytes per second, naught for no limit. */
+	long long depth;	/* Largest burst. */
+	long long tokens;	/* Negative while in debt. */
+	long long stamp;	/* Time of last refill, microseconds. */
+};
+
+/* Aggregate limits of a tunnel, private to shaping.c. */
+struct tunnel_shaping;
+
+/* Bandwidth limits of one connection, indexed by direction:
+ * naught from the local side, one from the remote side. */
+struct shaper {
+	struct bucket own[2];
+	struct tunnel_shaping *tunnel;
+};
+
+/* Description of a subsystem built from two transports. */
+struct service {
+	const char *name;
+	int local_kind;		/* Accepting side. */
+	int remote_kind;	/* Connecting side. */
+	const struct tuning *local_tuning;
+	const struct tuning *remote_tuning;
+};
+
+/* Credentials and cipher priority, private to tls.c. */
+struct tls_context;
+
+/* Session ticket shared by forked clients, private to resume.c. */
+struct ticket_slot;
+
+/* Upstreams chosen by server name and protocol, private to routing.c. */
+struct route_table;
+
+/* Deflate streams of a connection, private to compress.c. */
+struct zip;
+
+/* Application protocol of compressing gunnel peers. */
+#define COMPRESS_PROTOCOL	"gunnel-deflate"
+
+/* One tunnel served by the daemon, with settings of its own. */
+struct tunnel {
+	const char *name;
+	struct service svc;		/* Kinds adjusted to the actual ports. */
+	char *local_port;		/* Generalised ports. */
+	char *remote_port;
+	char *certificate;
+	char *keyfile;
+	char *cafile;
+	char *ciphers;
+	char *tuning_profiles;
+	char *rate_limits;		/* Per connection. */
+	char *tunnel_rate_limits;	/* Aggregate. */
+	char *verify_mode;
+	char *early_data;		/* Largest amount, or naught. */
+	char *mux_links;		/* Links carrying multiplexed streams. */
+	char *route_file;		/* Routes by server name, if any. */
+	char *compress_level;	/* Offered to gunnel peers, if any. */
+	char *stripe_links;		/* Links carrying each client, and window. */
+	char *reverse_links;	/* Idle links dialled by the inner side. */
+	/* Resolved by prepare_tunnel(). */
+	char *lhost, *lport;
+	char *rhost, *rport;
+	struct tuning local_tuning, remote_tuning;
+	const struct tls_context *tls;
+	long long rate[2];
+	struct tunnel_shaping *shaping;
+	int mux;				/* Number of links, or naught. */
+	const struct route_table *routes;
+	int compress;			/* Level of deflate, or naught. */
+	int stripes;			/* Links of a striped client, or naught. */
+	long stripe_window;		/* Bytes beyond those delivered. */
+	int reverse;			/* Idle links of a reverse tunnel, or naught. */
+	int reverse_sd;			/* Accepting links at the outer side. */
+};
+
+/* A listening socket known by its generalised port. */
+struct listener {
+	const char *name;
+	int sd;
+};
+
+/* Verification of the peer's certificate chain. */
+enum verify_mode {
+	VERIFY_NONE = 0,
+	VERIFY_OPTIONAL,	/* A presented chain must be valid. */
+	VERIFY_REQUIRE		/* The peer must present a valid chain. */
+};
+
+/* Length of the SHA-256 digest identifying a chain. */
+#define VERIFY_DIGEST_LENGTH	32
+
+/* Largest session ticket kept for resumption, with its state. */
+#define TICKET_SIZE		4096
+
+/* Most early data sent, or accepted, by a TLS 1.3 session. */
+#define MAX_EARLY_DATA	16384
+
+/* Seconds granted a peer to complete a TLS handshake. */
+#define HANDSHAKE_TIMEOUT	10
+
+/* Most TLS connections carrying the streams of one tunnel. */
+#define MAX_MUX_LINKS	8
+
+/* Most TLS connections carrying a single striped client. */
+#define MAX_STRIPES		16
+
+/* Reordering allowed to a striped client, in bytes. */
+#define STRIPE_WINDOW		(4 * 1024 * 1024)
+#define MIN_STRIPE_WINDOW	(64 * 1024)
+#define MAX_STRIPE_WINDOW	(64 * 1024 * 1024)
+
+/* Most idle links kept by a reverse tunnel. */
+#define MAX_REVERSE_LINKS	32
+
+/* Measured throughput of an AEAD cipher, in MB/s. */
+struct cipher_speed {
+	gnutls_cipher_algorithm_t algorithm;
+	double encrypt;
+	double decrypt;
 };
 
+#define is_tls_transport(kind) \
+	( ((kind) == TRANSPORT_TLS_SERVER) || ((kind) == TRANSPORT_TLS_CLIENT) \
+	  || ((kind) == TRANSPORT_KTLS) )
+
 #if _INCLUDE_EXTERNALS
 
 extern char *local_port_string;
@@ -74,28 +312,267 @@ extern char *keyfile;
 extern char *ciphers;    
 extern char *user_name;
 extern char *group_name;
+extern char *handover_path;
+extern int foreground;
+extern int handshake_workers;
+extern char *io_backend;
+extern long flush_window;
+extern long buffer_size;
+extern int max_children;
+extern char *tuning_profiles;
+extern char *rate_limits;
+extern char *tunnel_rate_limits;
+extern char *verify_mode;
+extern char *early_data;
+extern char *mux_links;
+extern char *route_file;
+extern char *compress_level;
+extern char *stripe_links;
+extern char *reverse_links;
+extern char *busy_poll;
+extern char *statistics_path;
+extern int statistics_due;
+extern int reload_due;
 extern int again;
 
 #endif /* _INCLUDE_EXTERNALS */
 
 /* From tls.c */
-int init_tls_server(char *msg, int maxlen);
+struct tls_context *tls_context_load(const char *certificate,
+							const char *keyfile, const char *cafile,
+							const char *ciphers, int server, int verify,
+							size_t early, char *msg, int maxlen);
+
+int tls_context_reload_all(char *message, int len);
+
+void tls_context_release_all(void);
+
+size_t tls_early_data_room(gnutls_session_t session);
+
+int tls_session_credentials(gnutls_session_t session,
+							const struct tls_context *ctx);
+
+int init_tls_client_session(gnutls_session_t *sess,
+							const struct tls_context *ctx,
+							char *msg, int maxlen);
+
+int init_tls_server_session(gnutls_session_t *sess,
+							const struct tls_context *ctx,
+							char *msg, int maxlen);
+
+int init_dtls_session(gnutls_session_t *sess,
+						const struct tls_context *ctx,
+						char *msg, int maxlen);
+
+/* From cipherbench.c */
+int cipher_speeds(struct cipher_speed *speeds, int max, long usec);
+
+const char *cipher_priority_auto(int server);
+
+/* From resume.c */
+struct ticket_slot *ticket_slot_new(void);
+
+void ticket_slot_store(struct ticket_slot *slot, const void *data, size_t len);
+
+size_t ticket_slot_fetch(struct ticket_slot *slot, void *buf, size_t size);
+
+int replay_init(void);
+
+int replay_seen(const unsigned char *digest, time_t expires);
+
+/* From transport.c */
+int transport_init(struct transport *tp, int fd, int kind,
+					const struct tls_context *tls, char *msg, int maxlen);
+
+int transport_handshake(struct transport *tp);
+
+ssize_t transport_write(struct transport *tp, const void *buf, size_t len);
+
+ssize_t transport_send(struct transport *tp, const void *buf, size_t len);
+
+void transport_compress(struct transport *tp, int level);
+
+void transport_close(struct transport *tp);
+
+void transport_release(struct transport *tp);
+
+int transport_enable_ktls(struct transport *tp);
+
+void relay_traffic(struct transport *local, struct transport *remote,
+					struct shaper *sh);
+
+/* From bufpool.c */
+void *buffer_get(void);
+
+void buffer_put(void *buf, long long now);
+
+long long buffer_trim(long long now);
+
+/* From handover.c */
+int handover_offer(char *path);
+
+int handover_send(int cd, struct listener *list, int count);
 
-void deinit_tls_server(void);
+int handover_receive(char *path, struct listener *list, int count);
 
-int init_tls_client(char *msg, int maxlen);
+int activation_receive(struct listener *list, int count);
 
-void deinit_tls_client(void);
+/* From uring.c */
+int uring_usable(void);
 
-int init_tls_client_session(gnutls_session_t *sess, char *msg, int maxlen);
+int uring_relay(struct transport *local, struct transport *remote);
 
-int init_tls_server_session(gnutls_session_t *sess, char *msg, int maxlen);
+int uring_accept_start(const int *sds, int nsd, const int *pollfds, int num);
+
+int uring_accept_wait(int *ready);
+
+int uring_accept_active(void);
+
+int uring_accept_stop(int *which);
+
+void uring_accept_forget(void);
+
+/* From stripe.c */
+void stripe_serve(const struct tunnel *tun, struct transport *tp);
+
+/* From compress.c */
+int compress_init(void);
+
+struct zip *zip_new(int level);
+
+void zip_free(struct zip *zip);
+
+ssize_t zip_deflate(struct zip *zip, const void *buf, size_t len,
+					const void **out);
+
+void *zip_input(struct zip *zip, size_t *len);
+
+void zip_supply(struct zip *zip, size_t len);
+
+ssize_t zip_inflate(struct zip *zip, void *buf, size_t len);
+
+int zip_pending(const struct zip *zip);
+
+void compress_report(FILE *file);
+
+/* From routing.c */
+struct route_table *route_load(const char *path, const struct tunnel *tun,
+								int verify, size_t early);
+
+int route_count(const struct route_table *rt);
+
+void route_prepare(const struct tunnel *tun, struct transport *local);
+
+int route_connect(const struct tunnel *tun, struct transport *local);
+
+/* From supervisor.c */
+int supervisor_init(void);
+
+int supervisor_admit(void);
+
+void supervisor_release(void);
+
+void supervisor_watch(pid_t pid, int td, const struct tunnel *tun);
+
+pid_t supervisor_fork(void);
+
+void supervisor_reap(void);
+
+void supervisor_report(FILE *file);
+
+void supervisor_forget(void);
+
+/* From tuning.c */
+const struct tuning *tuning_lookup(const char *name);
+
+void tuning_socket(int sd, const struct tuning *tune);
+
+void tuning_connect(int sd, const struct tuning *tune);
+
+void tuning_listener(int sd, const struct tuning *tune);
+
+void tuning_report(const char *side, int sd, const struct tuning *tune);
+
+int tuning_busy_poll(const char *spec);
+
+long tuning_spin_start(int sd, int rd);
+
+/* From shared.c */
+void *map_shared(size_t size);
+
+void spin_lock(char *lock);
+
+void spin_unlock(char *lock);
+
+/* From shaping.c */
+int shaping_parse(const char *spec, long long rate[2]);
+
+struct tunnel_shaping *shaping_share(const long long rate[2]);
+
+void shaper_init(struct shaper *sh, const long long rate[2],
+				struct tunnel_shaping *ts);
+
+void shaper_release(struct shaper *sh);
+
+int shaper_limited(const struct shaper *sh);
+
+size_t shaper_allow(struct shaper *sh, int dir, size_t len,
+					long long now, long long *wait);
+
+void shaper_consume(struct shaper *sh, int dir, size_t len);
+
+/* From verify.c */
+int verify_cache_init(void);
+
+int verify_cache_lookup(const unsigned char *digest, unsigned int generation);
+
+void verify_cache_store(const unsigned char *digest, unsigned int generation,
+						time_t expires);
+
+void verify_cache_report(FILE *file);
+
+/* From workers.c */
+int handshake_pool_start(const struct tunnel *tunnels, int count,
+						int workers, const int *unneeded, int num);
+
+int handshake_pool_dispatch(int qd, int index, int td);
+
+int handshake_pool_collect(int qd, int *index, int *td, int *rd);
+
+void handshake_pool_relay(const struct tunnel *tun, int td, int rd);
+
+/* From datagram.c */
+int run_datagram_service(const struct service *svc, int argc, char *argv[]);
+
+/* From mux.c */
+int mux_start(const struct tunnel *tun, const int *unneeded, int num);
+
+int mux_dispatch(int md, int td);
+
+void mux_serve(const struct tunnel *tun, struct transport *tp);
+
+/* From reverse.c */
+int reverse_start(const struct tunnel *tun, int ls,
+				const int *unneeded, int num);
+
+int reverse_dispatch(int rq, int td);
+
+void reverse_dial(const struct tunnel *tun);
+
+/* From service.c */
+int run_service(const struct service *svc, int argc, char *argv[]);
+
+int prepare_tunnel(struct tunnel *tun);
+
+int serve_tunnels(struct tunnel *tunnels, int count);
 
 /* From utils.c */
 void gunnel_error_message(FILE *file, int num);
 
 int test_usr_grp(char *usr, char *grp);
 
+char *append_list(char *list, const char *item);
+
 int decompose_port(const char *gport, char **host, char **port);
 
 void signal_responder(int sig);
@@ -107,4 +584,15 @@ int underpriv_daemon_mode(void);
 
 int get_listening_socket(char *lhost, char *lport);
 
+int get_connected_socket(char *rhost, char *rport,
+							const struct tuning *tune);
+
+int get_datagram_socket(char *lhost, char *lport);
+
+int is_unix_socket_path(const char *host, const char *port);
+
+int send_fds(int sd, const void *buf, size_t len, const int *fds, int num);
+
+ssize_t recv_fds(int sd, void *buf, size_t len, int *fds, int *num);
+
 #endif /* _GUNNEL_H */
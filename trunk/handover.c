@@ -0,0 +1,316 @@
+/*
+ * handover.c  --  pass listening sockets to a successor
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * vim: set sw=4 ts=4
+ */
+
+/*
+ * A running daemon keeps a unix control socket. A newly started
+ * daemon, given the same control socket, connects to it and is
+ * sent every listening socket together with its generalised port.
+ * Once the successor has acknowledged, the predecessor stops
+ * accepting and lets its tunnels drain. The listening sockets
+ * are never closed in between, so no client is refused.
+ *
+ * A service manager like systemd may instead hold the listening
+ * sockets, and pass them at every start. Restarts then never close
+ * them, and a tunnel need not run before its first client arrives.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define _INCLUDE_EXTERNALS	1
+#include "gunnel.h"
+
+#define HANDOVER_MAGIC	0x476e6e6c	/* "Gnnl" */
+#define HANDOVER_ACK	'A'
+
+/* First descriptor passed by a service manager. */
+#define ACTIVATION_FD	3
+
+/* Leading part of each handover message. */
+struct handover_header {
+	unsigned int magic;
+	unsigned int count;
+	unsigned int namelen;
+};
+
+/* Send a full buffer, or fail. */
+static int send_all(int sd, const void *buf, size_t len) {
+	ssize_t n;
+	size_t done = 0;
+
+	while (done < len) {
+		n = send(sd, (const char *) buf + done, len - done, 0);
+		if ( (n < 0) && (errno == EINTR) )
+			continue;
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+
+	return 0;
+} /* send_all(int, const void *, size_t) */
+
+/* Receive a full buffer, or fail. */
+static int recv_all(int sd, void *buf, size_t len) {
+	ssize_t n;
+	size_t done = 0;
+
+	while (done < len) {
+		n = recv(sd, (char *) buf + done, len - done, 0);
+		if ( (n < 0) && (errno == EINTR) )
+			continue;
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+
+	return 0;
+} /* recv_all(int, void *, size_t) */
+
+/**
+ * handover_offer  --  open the control socket of a running daemon
+ */
+
+int handover_offer(char *path) {
+	return get_listening_socket(path, NULL);
+} /* handover_offer(char *) */
+
+/**
+ * handover_send  --  serve one successor at the control socket
+ *
+ * Returns GUNNEL_SUCCESS when the successor has taken over
+ * all listeners, whereupon the caller should stop accepting.
+ */
+
+int handover_send(int cd, struct listener *list, int count) {
+	int j, sd;
+	int fds[MAX_PASSED_FDS];
+	size_t namelen = 0, pos = 0;
+	char ack, *names;
+	struct handover_header header;
+
+	if ( (count <= 0) || (count > MAX_PASSED_FDS) )
+		return GUNNEL_FAILED_HANDOVER;
+
+	if ( (sd = accept(cd, NULL, NULL)) < 0 )
+		return GUNNEL_FAILED_HANDOVER;
+
+	for (j = 0; j < count; ++j)
+		namelen += strlen(list[j].name) + 1;
+
+	if ( (names = malloc(namelen)) == NULL ) {
+		close(sd);
+		return GUNNEL_ALLOCATION_FAILURE;
+	}
+
+	for (j = 0; j < count; ++j) {
+		strcpy(names + pos, list[j].name);
+		pos += strlen(list[j].name) + 1;
+		fds[j] = list[j].sd;
+	}
+
+	header.magic = HANDOVER_MAGIC;
+	header.count = count;
+	header.namelen = namelen;
+
+	/* The descriptors travel along with the header. */
+	if ( send_fds(sd, &header, sizeof(header), fds, count)
+			|| send_all(sd, names, namelen)
+			|| recv_all(sd, &ack, 1)
+			|| (ack != HANDOVER_ACK) ) {
+		/* Successor failed, so keep serving. */
+		free(names);
+		close(sd);
+		return GUNNEL_FAILED_HANDOVER;
+	}
+
+	free(names);
+	close(sd);
+
+	return GUNNEL_SUCCESS;
+} /* handover_send(int, struct listener *, int) */
+
+/**
+ * handover_receive  --  adopt the listeners of a predecessor
+ *
+ * Every entry in list[] whose name matches a received socket
+ * gets it as list[].sd, all others are left with -1.
+ * Returns the number of adopted sockets, or -1 when there is
+ * no predecessor at the control socket.
+ */
+
+int handover_receive(char *path, struct listener *list, int count) {
+	int j, k, sd, num = MAX_PASSED_FDS, adopted = 0;
+	int fds[MAX_PASSED_FDS];
+	char *names, *name;
+	char ack = HANDOVER_ACK;
+	struct handover_header header;
+
+	for (j = 0; j < count; ++j)
+		list[j].sd = -1;
+
+	if ( (sd = get_connected_socket(path, NULL, NULL)) < 0 )
+		return -1;
+
+	if ( (recv_fds(sd, &header, sizeof(header), fds, &num)
+				!= sizeof(header))
+			|| (header.magic != HANDOVER_MAGIC) ) {
+		for (k = 0; k < num; ++k)
+			close(fds[k]);
+		close(sd);
+		return -1;
+	}
+
+	if ( (num != (int) header.count)
+			|| ((names = malloc(header.namelen + 1)) == NULL) ) {
+		for (k = 0; k < num; ++k)
+			close(fds[k]);
+		close(sd);
+		return -1;
+	}
+
+	if ( recv_all(sd, names, header.namelen) ) {
+		for (k = 0; k < num; ++k)
+			close(fds[k]);
+		free(names);
+		close(sd);
+		return -1;
+	}
+	names[header.namelen] = '\0';
+
+	/* Pair received sockets with the desired listeners. */
+	for (k = 0, name = names; k < num; ++k, name += strlen(name) + 1) {
+		for (j = 0; j < count; ++j) {
+			if ( (list[j].sd < 0) && (strcmp(list[j].name, name) == 0) )
+				break;
+		}
+
+		if (j < count) {
+			list[j].sd = fds[k];
+			++adopted;
+		} else
+			/* Not used by the new configuration. */
+			close(fds[k]);
+	}
+
+	free(names);
+
+	/* The predecessor may now stop accepting. */
+	send_all(sd, &ack, 1);
+	close(sd);
+
+	return adopted;
+} /* handover_receive(char *, struct listener *, int) */
+
+/* Is sd a listening stream socket? */
+static int is_stream_listener(int sd) {
+	int type, listening;
+	socklen_t len;
+
+	len = sizeof(type);
+	if ( getsockopt(sd, SOL_SOCKET, SO_TYPE, &type, &len)
+			|| (type != SOCK_STREAM) )
+		return 0;
+
+	len = sizeof(listening);
+	if ( getsockopt(sd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) )
+		return 0;
+
+	return listening;
+} /* is_stream_listener(int) */
+
+/**
+ * activation_receive  --  adopt the listeners of a service manager
+ *
+ * Sockets are passed as by systemd, numbered by LISTEN_FDS for
+ * the process LISTEN_PID. Each is given to the entry in list[]
+ * named alike in LISTEN_FDNAMES or, unless every name is known,
+ * to the first entry still lacking a socket. Unused sockets are
+ * closed. Returns the number of adopted sockets.
+ */
+
+int activation_receive(struct listener *list, int count) {
+	int j, k, sd, num, named, adopted = 0;
+	char *str, *end, *names = NULL, *name[MAX_PASSED_FDS];
+
+	str = getenv("LISTEN_PID");
+	if ( (str == NULL) || (strtol(str, &end, 10) != getpid())
+			|| (*end != '\0') )
+		return 0;
+
+	str = getenv("LISTEN_FDS");
+	num = str ? strtol(str, &end, 10) : 0;
+	if ( (str == NULL) || (*end != '\0') || (num < 1) )
+		return 0;
+
+	if (num > MAX_PASSED_FDS) {
+		fprintf(stderr, "Only %d passed sockets are adopted.\n",
+				MAX_PASSED_FDS);
+		num = MAX_PASSED_FDS;
+	}
+
+	/* Names are separated by colons. */
+	str = getenv("LISTEN_FDNAMES");
+	named = str && ((names = strdup(str)) != NULL);
+
+	for (k = 0, str = names; named && (k < num); ++k) {
+		if (str == NULL) {
+			named = 0;
+			break;
+		}
+
+		name[k] = str;
+		if ( (str = strchr(str, ':')) )
+			*str++ = '\0';
+
+		for (j = 0; j < count; ++j)
+			if ( (list[j].sd < 0) && (strcmp(list[j].name, name[k]) == 0) )
+				break;
+
+		named = (j < count);
+	}
+
+	/* Children, such as a successor, are not to adopt them again. */
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+
+	for (k = 0; k < num; ++k) {
+		sd = ACTIVATION_FD + k;
+		fcntl(sd, F_SETFD, FD_CLOEXEC);
+
+		for (j = 0; j < count; ++j)
+			if ( (list[j].sd < 0)
+					&& (!named || (strcmp(list[j].name, name[k]) == 0)) )
+				break;
+
+		if ( (j < count) && is_stream_listener(sd) ) {
+			list[j].sd = sd;
+			++adopted;
+		} else {
+			fprintf(stderr, "Passed socket %d is not used.\n", sd);
+			close(sd);
+		}
+	}
+
+	free(names);
+
+	return adopted;
+} /* activation_receive(struct listener *, int) */
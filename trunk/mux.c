@@ -0,0 +1,764 @@
+/*
+ * mux.c  --  many client streams carried by few TLS connections
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * vim: set sw=4 ts=4
+ */
+
+/*
+ * Every client of a plain-to-tls tunnel ordinarily costs a TCP
+ * connection and a TLS handshake of its own. With "-m links",
+ * a single process instead carries all clients of the tunnel as
+ * streams over at most that many long-lived TLS connections,
+ * here called links. A tls-to-plain tunnel with "-m" separates
+ * the streams again, connecting a remote socket for each.
+ *
+ * Each frame on a link begins with a header of eight bytes:
+ * type, flags (presently naught), payload length, and stream
+ * identifier, in network byte order. A stream is announced by
+ * MUX_OPEN, carries MUX_DATA, is half closed by MUX_CLOSE, and
+ * aborted by MUX_RESET. A sender may have at most MUX_WINDOW
+ * bytes outstanding per stream, renewed by MUX_CREDIT as the
+ * receiver delivers them, so a slow client never stalls the
+ * other streams sharing its link.
+ *
+ * Links are non-blocking once established. Connecting a link,
+ * or a remote socket for a new stream, does block the process
+ * briefly, as with the handshake of a plain-to-tls worker.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+
+#define _INCLUDE_EXTERNALS	1
+#include "gunnel.h"
+
+#define MUX_HEADER		8
+#define MUX_PAYLOAD		16384
+
+/* Credit of a new stream, in either direction. */
+#define MUX_WINDOW		(256 * 1024)
+
+/* Plain sockets are not read while a link has this much queued. */
+#define MUX_LINK_QUEUE	(4 * MUX_PAYLOAD)
+
+#ifndef MUX_MAX_STREAMS
+#  define MUX_MAX_STREAMS	256
+#endif
+
+/* Frame types. */
+enum {
+	MUX_OPEN = 1,
+	MUX_DATA,
+	MUX_CREDIT,		/* Four bytes of further credit. */
+	MUX_CLOSE,
+	MUX_RESET
+};
+
+/* Tag accompanying each client passed to the process. */
+#define MUX_NEW_CLIENT	'n'
+
+/* Message passing */
+static char message[MESSAGE_LENGTH] = "";
+
+/* Bytes awaiting a socket. */
+struct mux_queue {
+	unsigned char *buf;
+	size_t start, end, size;
+};
+
+#define queue_length(q)	((q)->end - (q)->start)
+
+struct mux_link {
+	struct transport tp;	/* Down while tp.fd is negative. */
+	int streams;
+	uint32_t next_id;
+	size_t offered;			/* Held by GnuTLS, to be offered again. */
+	struct mux_queue out;
+	size_t in_len;
+	unsigned char in[MUX_HEADER + MUX_PAYLOAD];
+};
+
+struct mux_stream {
+	int fd;					/* Free slot while negative. */
+	uint32_t id;
+	struct mux_link *link;
+	long credit;			/* May yet be sent to the peer. */
+	size_t delivered;		/* Since credit was last returned. */
+	int read_closed;		/* MUX_CLOSE has been sent. */
+	int write_closed;		/* MUX_CLOSE has been received. */
+	struct mux_queue out;	/* Received from the peer. */
+};
+
+static struct mux_link links[MAX_MUX_LINKS];
+static int nlinks = 0;
+
+static struct mux_stream streams[MUX_MAX_STREAMS];
+
+static void put32(unsigned char *p, uint32_t val) {
+	p[0] = val >> 24;
+	p[1] = val >> 16;
+	p[2] = val >> 8;
+	p[3] = val;
+} /* put32(unsigned char *, uint32_t) */
+
+static uint32_t get32(const unsigned char *p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+			| ((uint32_t) p[2] << 8) | p[3];
+} /* get32(const unsigned char *) */
+
+static void put_header(unsigned char *p, int type, uint32_t id, size_t len) {
+	p[0] = type;
+	p[1] = 0;
+	p[2] = len >> 8;
+	p[3] = len;
+	put32(p + 4, id);
+} /* put_header(unsigned char *, int, uint32_t, size_t) */
+
+/* Make room for len more bytes, returning where they go. */
+static unsigned char *queue_reserve(struct mux_queue *q, size_t len) {
+	size_t size;
+	unsigned char *buf;
+
+	if (q->start == q->end)
+		q->start = q->end = 0;
+
+	if ( (q->end + len > q->size) && (q->start > 0) ) {
+		memmove(q->buf, q->buf + q->start, q->end - q->start);
+		q->end -= q->start;
+		q->start = 0;
+	}
+
+	if (q->end + len > q->size) {
+		size = q->size ? q->size : MUX_HEADER + MUX_PAYLOAD;
+		while (size < q->end + len)
+			size *= 2;
+
+		if ( (buf = realloc(q->buf, size)) == NULL )
+			return NULL;
+
+		q->buf = buf;
+		q->size = size;
+	}
+
+	return q->buf + q->end;
+} /* queue_reserve(struct mux_queue *, size_t) */
+
+static void queue_free(struct mux_queue *q) {
+	free(q->buf);
+	memset(q, '\0', sizeof(*q));
+} /* queue_free(struct mux_queue *) */
+
+/* Queue a frame for a link. */
+static int link_frame(struct mux_link *l, int type, uint32_t id,
+					const void *data, size_t len) {
+	unsigned char *p;
+
+	if ( (p = queue_reserve(&l->out, MUX_HEADER + len)) == NULL )
+		return -1;
+
+	put_header(p, type, id, len);
+	if (len)
+		memcpy(p + MUX_HEADER, data, len);
+	l->out.end += MUX_HEADER + len;
+
+	return 0;
+} /* link_frame(struct mux_link *, int, uint32_t, const void *, size_t) */
+
+static struct mux_stream *stream_new(int fd, struct mux_link *l,
+									uint32_t id) {
+	int j;
+	struct mux_stream *s;
+
+	if (fd >= FD_SETSIZE)
+		return NULL;
+
+	for (j = 0; j < MUX_MAX_STREAMS; ++j) {
+		s = &streams[j];
+		if (s->fd >= 0)
+			continue;
+
+		memset(s, '\0', sizeof(*s));
+		s->fd = fd;
+		s->id = id;
+		s->link = l;
+		s->credit = MUX_WINDOW;
+		++l->streams;
+
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+		return s;
+	}
+
+	return NULL;
+} /* stream_new(int, struct mux_link *, uint32_t) */
+
+static struct mux_stream *stream_find(const struct mux_link *l, uint32_t id) {
+	int j;
+
+	for (j = 0; j < MUX_MAX_STREAMS; ++j)
+		if ( (streams[j].fd >= 0) && (streams[j].link == l)
+				&& (streams[j].id == id) )
+			return &streams[j];
+
+	return NULL;
+} /* stream_find(const struct mux_link *, uint32_t) */
+
+/* Release a stream, aborting it when reset is set. */
+static void stream_drop(struct mux_stream *s, int reset) {
+	if (reset) {
+		link_frame(s->link, MUX_RESET, s->id, NULL, 0);
+		shutdown(s->fd, SHUT_RDWR);
+	}
+
+	close(s->fd);
+	s->fd = -1;
+	queue_free(&s->out);
+	--s->link->streams;
+} /* stream_drop(struct mux_stream *, int) */
+
+/* A stream closed in both directions is complete. */
+static void stream_check(struct mux_stream *s) {
+	if ( s->read_closed && s->write_closed && (queue_length(&s->out) == 0) )
+		stream_drop(s, 0);
+} /* stream_check(struct mux_stream *) */
+
+/* Frame what the plain socket offers, within the credit. */
+static void stream_read(struct mux_stream *s) {
+	ssize_t n;
+	size_t len;
+	unsigned char *p;
+
+	len = (s->credit < MUX_PAYLOAD) ? s->credit : MUX_PAYLOAD;
+
+	if ( (p = queue_reserve(&s->link->out, MUX_HEADER + len)) == NULL ) {
+		stream_drop(s, 1);
+		return;
+	}
+
+	do
+		n = recv(s->fd, p + MUX_HEADER, len, 0);
+	while ( (n < 0) && (errno == EINTR) );
+
+	if ( (n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)) )
+		return;
+
+	if (n < 0) {
+		stream_drop(s, 1);
+		return;
+	}
+
+	if (n == 0) {
+		s->read_closed = 1;
+		link_frame(s->link, MUX_CLOSE, s->id, NULL, 0);
+		stream_check(s);
+		return;
+	}
+
+	put_header(p, MUX_DATA, s->id, n);
+	s->link->out.end += MUX_HEADER + n;
+	s->credit -= n;
+} /* stream_read(struct mux_stream *) */
+
+/* Deliver received data to the plain socket, returning credit. */
+static void stream_flush(struct mux_stream *s) {
+	ssize_t n;
+	unsigned char credit[4];
+
+	while ( queue_length(&s->out) ) {
+		n = send(s->fd, s->out.buf + s->out.start, queue_length(&s->out),
+				MSG_NOSIGNAL);
+
+		if ( (n < 0) && (errno == EINTR) )
+			continue;
+
+		if ( (n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)) )
+			break;
+
+		if (n <= 0) {
+			stream_drop(s, 1);
+			return;
+		}
+
+		s->out.start += n;
+		s->delivered += n;
+	}
+
+	if (s->delivered >= MUX_WINDOW / 2) {
+		put32(credit, s->delivered);
+		link_frame(s->link, MUX_CREDIT, s->id, credit, sizeof(credit));
+		s->delivered = 0;
+	}
+
+	if ( s->write_closed && (queue_length(&s->out) == 0) ) {
+		shutdown(s->fd, SHUT_WR);
+		stream_check(s);
+	}
+} /* stream_flush(struct mux_stream *) */
+
+/* Connect the remote side of a stream announced by the peer. */
+static void stream_open_remote(const struct tunnel *tun, struct mux_link *l,
+								uint32_t id) {
+	int rd;
+
+	rd = get_connected_socket(tun->rhost, tun->rport, tun->svc.remote_tuning);
+
+	if ( (rd >= 0) && stream_new(rd, l, id) )
+		return;
+
+	if (rd >= 0)
+		close(rd);
+
+	link_frame(l, MUX_RESET, id, NULL, 0);
+} /* stream_open_remote(const struct tunnel *, struct mux_link *,
+	 uint32_t) */
+
+/* Act on a single frame. Returns -1 at a violation of protocol. */
+static int handle_frame(const struct tunnel *tun, struct mux_link *l,
+						int server, const unsigned char *hdr, size_t len) {
+	uint32_t id = get32(hdr + 4);
+	const unsigned char *data = hdr + MUX_HEADER;
+	unsigned char *p;
+	struct mux_stream *s;
+
+	s = stream_find(l, id);
+
+	switch (hdr[0]) {
+		case MUX_OPEN:
+			if ( !server || s )
+				return -1;
+			stream_open_remote(tun, l, id);
+			break;
+		case MUX_DATA:
+			/* Data may be in flight when a stream is reset. */
+			if ( (s == NULL) || s->write_closed )
+				break;
+
+			if ( (queue_length(&s->out) + len > MUX_WINDOW)
+					|| ((p = queue_reserve(&s->out, len)) == NULL) ) {
+				stream_drop(s, 1);
+				break;
+			}
+
+			memcpy(p, data, len);
+			s->out.end += len;
+			stream_flush(s);
+			break;
+		case MUX_CREDIT:
+			if ( s && (len == 4) )
+				s->credit += get32(data);
+			break;
+		case MUX_CLOSE:
+			if (s) {
+				s->write_closed = 1;
+				stream_flush(s);
+			}
+			break;
+		case MUX_RESET:
+			if (s)
+				stream_drop(s, 0);
+			break;
+		default:
+			return -1;
+	}
+
+	return 0;
+} /* handle_frame(const struct tunnel *, struct mux_link *, int,
+	 const unsigned char *, size_t) */
+
+/* Act on every complete frame received. */
+static int link_parse(const struct tunnel *tun, struct mux_link *l,
+					int server) {
+	size_t len, used = 0;
+	unsigned char *hdr;
+
+	while (l->in_len - used >= MUX_HEADER) {
+		hdr = l->in + used;
+		len = (hdr[2] << 8) | hdr[3];
+
+		if (len > MUX_PAYLOAD)
+			return -1;
+
+		if (l->in_len - used < MUX_HEADER + len)
+			break;
+
+		if ( handle_frame(tun, l, server, hdr, len) )
+			return -1;
+
+		used += MUX_HEADER + len;
+	}
+
+	memmove(l->in, l->in + used, l->in_len - used);
+	l->in_len -= used;
+
+	return 0;
+} /* link_parse(const struct tunnel *, struct mux_link *, int) */
+
+static int link_read(const struct tunnel *tun, struct mux_link *l,
+					int server) {
+	ssize_t n;
+
+	errno = 0;
+	n = l->tp.ops->read(&l->tp, l->in + l->in_len,
+						sizeof(l->in) - l->in_len);
+
+	if ( (n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)) )
+		return 0;
+
+	if (n <= 0)
+		return -1;
+
+	l->in_len += n;
+
+	return link_parse(tun, l, server);
+} /* link_read(const struct tunnel *, struct mux_link *, int) */
+
+/* Send queued frames, as far as the link accepts them. */
+static int link_flush(struct mux_link *l) {
+	ssize_t n;
+	size_t len;
+
+	while ( queue_length(&l->out) ) {
+		len = queue_length(&l->out);
+		if (len > MUX_PAYLOAD)
+			len = MUX_PAYLOAD;
+		if (l->offered)
+			len = l->offered;
+
+		errno = 0;
+		n = transport_send(&l->tp, l->out.buf + l->out.start, len);
+
+		if ( (n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ) {
+			l->offered = len;
+			return 0;
+		}
+
+		if (n <= 0)
+			return -1;
+
+		l->offered = 0;
+		l->out.start += n;
+	}
+
+	return 0;
+} /* link_flush(struct mux_link *) */
+
+/* Close a link, with every stream it carries. */
+static void link_down(struct mux_link *l) {
+	int j;
+
+	for (j = 0; j < MUX_MAX_STREAMS; ++j)
+		if ( (streams[j].fd >= 0) && (streams[j].link == l) )
+			stream_drop(&streams[j], 0);
+
+	fcntl(l->tp.fd, F_SETFL, fcntl(l->tp.fd, F_GETFL) & ~O_NONBLOCK);
+	transport_close(&l->tp);
+
+	queue_free(&l->out);
+	l->in_len = 0;
+	l->offered = 0;
+	l->streams = 0;
+} /* link_down(struct mux_link *) */
+
+/* Connect and negotiate a link. */
+static int link_up(const struct tunnel *tun, struct mux_link *l) {
+	int fd;
+
+	if ( (fd = get_connected_socket(tun->rhost, tun->rport,
+									tun->svc.remote_tuning)) < 0 )
+		return -1;
+
+	if ( (fd >= FD_SETSIZE)
+			|| transport_init(&l->tp, fd, tun->svc.remote_kind, tun->tls,
+								message, sizeof(message)) ) {
+		close(fd);
+		l->tp.fd = -1;
+		return -1;
+	}
+
+	if ( transport_handshake(&l->tp) != GUNNEL_SUCCESS ) {
+		transport_close(&l->tp);
+		return -1;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	l->next_id = 1;
+
+	return 0;
+} /* link_up(const struct tunnel *, struct mux_link *) */
+
+/*
+ * The link carrying fewest streams. An idle link is reused,
+ * but otherwise a link yet to be established counts as empty,
+ * so that clients spread over all links.
+ */
+static struct mux_link *choose_link(const struct tunnel *tun) {
+	int j, load, least = 0;
+	struct mux_link *l = NULL;
+
+	for (j = 0; j < nlinks; ++j) {
+		load = (links[j].tp.fd < 0) ? 0 : links[j].streams;
+
+		if ( (l == NULL) || (load < least) ) {
+			l = &links[j];
+			least = load;
+		}
+	}
+
+	if ( l && (l->tp.fd < 0) && link_up(tun, l) )
+		return NULL;
+
+	return l;
+} /* choose_link(const struct tunnel *) */
+
+/* Receive a client from the accepting process, or notice its leave. */
+static int take_client(const struct tunnel *tun, int ctl) {
+	int td, num = 1;
+	ssize_t n;
+	char tag;
+	struct mux_link *l;
+	struct mux_stream *s;
+
+	if ( (n = recv_fds(ctl, &tag, sizeof(tag), &td, &num)) < 0 ) {
+		if (errno == EINTR)
+			return ctl;
+	}
+
+	if (n <= 0) {
+		close(ctl);
+		return -1;
+	}
+
+	if (num != 1)
+		return ctl;
+
+	if ( (tag != MUX_NEW_CLIENT) || ((l = choose_link(tun)) == NULL)
+			|| ((s = stream_new(td, l, l->next_id)) == NULL) ) {
+		shutdown(td, SHUT_RDWR);
+		close(td);
+		return ctl;
+	}
+
+	++l->next_id;
+	link_frame(l, MUX_OPEN, s->id, NULL, 0);
+
+	return ctl;
+} /* take_client(const struct tunnel *, int) */
+
+#define watch(fd, set) \
+	do { FD_SET((fd), (set)); maxfd = ((fd) > maxfd) ? (fd) : maxfd; } while (0)
+
+/*
+ * Relay every stream, until none is left and none may come:
+ * for a client when ctl is closed, for a server with its link.
+ */
+static void mux_loop(const struct tunnel *tun, int server, int ctl) {
+	int j, maxfd, active;
+	fd_set rset, wset;
+	struct timeval tv, *timeout;
+	struct mux_link *l;
+	struct mux_stream *s;
+
+	while (1) {
+		FD_ZERO(&rset);
+		FD_ZERO(&wset);
+		maxfd = -1;
+		timeout = NULL;
+		active = 0;
+
+		if (ctl >= 0)
+			watch(ctl, &rset);
+
+		for (j = 0; j < nlinks; ++j) {
+			l = &links[j];
+			if (l->tp.fd < 0)
+				continue;
+
+			active |= server;
+			watch(l->tp.fd, &rset);
+			if ( queue_length(&l->out) )
+				watch(l->tp.fd, &wset);
+
+			/* Decrypted data is not seen by select(). */
+			if ( l->tp.ops->pending(&l->tp) ) {
+				tv.tv_sec = tv.tv_usec = 0;
+				timeout = &tv;
+			}
+		}
+
+		for (j = 0; j < MUX_MAX_STREAMS; ++j) {
+			s = &streams[j];
+			if (s->fd < 0)
+				continue;
+
+			active = 1;
+			if ( !s->read_closed && (s->credit > 0)
+					&& (queue_length(&s->link->out) < MUX_LINK_QUEUE) )
+				watch(s->fd, &rset);
+			if ( queue_length(&s->out) )
+				watch(s->fd, &wset);
+		}
+
+		if ( !active && (ctl < 0) )
+			break;
+
+		if ( select(maxfd + 1, &rset, &wset, NULL, timeout) < 0 ) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if ( (ctl >= 0) && FD_ISSET(ctl, &rset) )
+			ctl = take_client(tun, ctl);
+
+		for (j = 0; j < nlinks; ++j) {
+			l = &links[j];
+			if (l->tp.fd < 0)
+				continue;
+
+			if ( (FD_ISSET(l->tp.fd, &rset) || l->tp.ops->pending(&l->tp))
+					&& link_read(tun, l, server) )
+				link_down(l);
+		}
+
+		for (j = 0; j < MUX_MAX_STREAMS; ++j) {
+			s = &streams[j];
+
+			if ( (s->fd >= 0) && FD_ISSET(s->fd, &wset) )
+				stream_flush(s);
+
+			if ( (s->fd >= 0) && FD_ISSET(s->fd, &rset) )
+				stream_read(s);
+		}
+
+		/* Frames of many streams leave in common records. */
+		for (j = 0; j < nlinks; ++j) {
+			l = &links[j];
+			if ( (l->tp.fd >= 0) && queue_length(&l->out) && link_flush(l) )
+				link_down(l);
+		}
+	}
+
+	if (ctl >= 0)
+		close(ctl);
+
+	for (j = 0; j < nlinks; ++j)
+		if (links[j].tp.fd >= 0)
+			link_down(&links[j]);
+} /* mux_loop(const struct tunnel *, int, int) */
+
+static void mux_init(int count) {
+	int j;
+
+	nlinks = count;
+
+	for (j = 0; j < MAX_MUX_LINKS; ++j) {
+		memset(&links[j], '\0', sizeof(links[j]));
+		links[j].tp.fd = -1;
+	}
+
+	for (j = 0; j < MUX_MAX_STREAMS; ++j)
+		streams[j].fd = -1;
+} /* mux_init(int) */
+
+/**
+ * mux_start  --  fork the process carrying a tunnel's clients
+ *
+ * The descriptors in unneeded[] are closed by the process.
+ * Returns the descriptor for mux_dispatch(), or -1 at failure.
+ */
+
+int mux_start(const struct tunnel *tun, const int *unneeded, int num) {
+	int qv[2];
+
+	if ( socketpair(AF_UNIX, SOCK_SEQPACKET, 0, qv) < 0 )
+		return -1;
+
+	switch (supervisor_fork()) {
+		case -1:
+			close(qv[0]);
+			close(qv[1]);
+			return -1;
+		case 0:
+			close(qv[0]);
+			while (num > 0)
+				if (unneeded[--num] >= 0)
+					close(unneeded[num]);
+			mux_init(tun->mux);
+			mux_loop(tun, 0, qv[1]);
+			exit(GUNNEL_SUCCESS);
+		default:
+			break;
+	}
+
+	close(qv[1]);
+
+	return qv[0];
+} /* mux_start(const struct tunnel *, const int *, int) */
+
+/**
+ * mux_dispatch  --  pass a new client to be carried as a stream
+ *
+ * The caller keeps its copy of td.
+ */
+
+int mux_dispatch(int md, int td) {
+	char tag = MUX_NEW_CLIENT;
+
+	if (md < 0)
+		return -1;
+
+	return send_fds(md, &tag, sizeof(tag), &td, 1);
+} /* mux_dispatch(int, int) */
+
+/**
+ * mux_serve  --  separate the streams arriving over a link
+ *
+ * The established transport is taken over, and is closed
+ * once the peer leaves.
+ */
+
+void mux_serve(const struct tunnel *tun, struct transport *tp) {
+	struct mux_link *l = &links[0];
+
+	mux_init(1);
+
+	l->tp = *tp;
+	tp->fd = -1;
+	tp->early = NULL;
+	tp->early_len = 0;
+
+	/* Early data holds the first frames. */
+	if (l->tp.early_len) {
+		memcpy(l->in, l->tp.early, l->tp.early_len);
+		l->in_len = l->tp.early_len;
+		free(l->tp.early);
+		l->tp.early = NULL;
+		l->tp.early_len = 0;
+
+		if ( link_parse(tun, l, 1) ) {
+			link_down(l);
+			return;
+		}
+	}
+
+	fcntl(l->tp.fd, F_SETFL, fcntl(l->tp.fd, F_GETFL) | O_NONBLOCK);
+
+	mux_loop(tun, 1, -1);
+} /* mux_serve(const struct tunnel *, struct transport *) */
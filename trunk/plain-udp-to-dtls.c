@@ -0,0 +1,32 @@
+/*
+ * plain-udp-to-dtls.c  --  receive plain datagrams, forward DTLS
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * vim: set sw=4 ts=4
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define _INCLUDE_EXTERNALS	1
+#include "gunnel.h"
+
+const struct service plain_udp_to_dtls_service = {
+	"plain-udp-to-dtls",
+	TRANSPORT_UDP,
+	TRANSPORT_DTLS_CLIENT
+};
+
+/*
+ * Main control for this subsystem.
+ */
+int plain_udp_to_dtls(int argc, char *argv[]) {
+	return run_datagram_service(&plain_udp_to_dtls_service, argc, argv);
+} /* plain_udp_to_dtls(int, char *[]) */
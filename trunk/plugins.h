@@ -19,8 +19,19 @@
 
 extern int plain_to_tls(int argc, char *argv[]);
 extern int tls_to_plain(int argc, char *argv[]);
+extern int tls_to_tls(int argc, char *argv[]);
 extern int plain_to_plain(int argc, char *argv[]);
+extern int plain_udp_to_dtls(int argc, char *argv[]);
+extern int dtls_to_plain_udp(int argc, char *argv[]);
 extern int tls_snooper(int argc, char *argv[]);
 extern int plain_snooper(int argc, char *argv[]);
+extern int run_config(int argc, char *argv[]);
+extern int run_cipherbench(int argc, char *argv[]);
+
+/* Descriptions of the subsystems, for use in configuration files. */
+extern const struct service plain_to_tls_service;
+extern const struct service tls_to_plain_service;
+extern const struct service tls_to_tls_service;
+extern const struct service plain_to_plain_service;
 
 #endif /* _PLUGINS_H */
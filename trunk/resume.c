@@ -0,0 +1,171 @@
+/*
+ * resume.c  --  session tickets and replay protection of early data
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * vim: set sw=4 ts=4
+ */
+
+/*
+ * A TLS client resumes its session with the ticket most recently
+ * issued by the server, which also permits early data. Every
+ * connection being served by a forked process, a context keeps
+ * its ticket in a slot of shared memory, updated by whichever
+ * process received a new one.
+ *
+ * A server accepting early data must refuse a ClientHello seen
+ * before, lest a recorded request is replayed. The hashes of
+ * recent ClientHello messages are kept in a shared table, until
+ * they fall outside the replay window of GnuTLS. A full set of
+ * the table refuses early data, which is then resent after the
+ * handshake, rather than evicting an entry still in force.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/types.h>
+
+#define _INCLUDE_EXTERNALS	1
+#include "gunnel.h"
+
+#ifndef REPLAY_SETS
+#  define REPLAY_SETS	512
+#endif
+
+#define REPLAY_WAYS		8
+
+struct ticket_slot {
+	char lock;
+	size_t len;		/* Naught while no ticket is known. */
+	unsigned char data[TICKET_SIZE];
+};
+
+/* A ClientHello seen recently. */
+struct replay_entry {
+	unsigned char digest[VERIFY_DIGEST_LENGTH];
+	time_t expires;		/* Naught for an unused entry. */
+};
+
+struct replay_table {
+	char lock;
+	struct replay_entry entry[REPLAY_SETS][REPLAY_WAYS];
+};
+
+static struct replay_table *replay = NULL;
+
+/**
+ * ticket_slot_new  --  shared storage of one session ticket
+ *
+ * Must be called before any connection is forked.
+ */
+
+struct ticket_slot *ticket_slot_new(void) {
+	return map_shared(sizeof(struct ticket_slot));
+} /* ticket_slot_new(void) */
+
+/**
+ * ticket_slot_store  --  replace the ticket of a slot
+ *
+ * A ticket too large for the slot is ignored.
+ */
+
+void ticket_slot_store(struct ticket_slot *slot, const void *data, size_t len) {
+	if ( (slot == NULL) || (len > sizeof(slot->data)) )
+		return;
+
+	spin_lock(&slot->lock);
+	memcpy(slot->data, data, len);
+	slot->len = len;
+	spin_unlock(&slot->lock);
+} /* ticket_slot_store(struct ticket_slot *, const void *, size_t) */
+
+/**
+ * ticket_slot_fetch  --  copy the present ticket
+ *
+ * Returns its length, or naught when there is none.
+ */
+
+size_t ticket_slot_fetch(struct ticket_slot *slot, void *buf, size_t size) {
+	size_t len = 0;
+
+	if (slot == NULL)
+		return 0;
+
+	spin_lock(&slot->lock);
+	if (slot->len <= size) {
+		len = slot->len;
+		memcpy(buf, slot->data, len);
+	}
+	spin_unlock(&slot->lock);
+
+	return len;
+} /* ticket_slot_fetch(struct ticket_slot *, void *, size_t) */
+
+/**
+ * replay_init  --  map the table of recent ClientHello messages
+ *
+ * Must be called before any connection is forked.
+ */
+
+int replay_init(void) {
+	if (replay)
+		return 0;
+
+	if ( (replay = map_shared(sizeof(*replay))) == NULL )
+		return -1;
+
+	return 0;
+} /* replay_init(void) */
+
+/**
+ * replay_seen  --  check and record a ClientHello
+ *
+ * Returns 1 when the digest is known, or when there is no
+ * room to remember it, otherwise records it and returns 0.
+ */
+
+int replay_seen(const unsigned char *digest, time_t expires) {
+	int j, free_way = -1, seen = 0;
+	time_t now = time(NULL);
+	struct replay_entry *set;
+
+	if (replay == NULL)
+		return 1;
+
+	spin_lock(&replay->lock);
+
+	set = replay->entry[ (digest[0] | (digest[1] << 8)) % REPLAY_SETS ];
+
+	for (j = 0; j < REPLAY_WAYS; ++j) {
+		if (set[j].expires <= now) {
+			if (free_way < 0)
+				free_way = j;
+			continue;
+		}
+
+		if ( memcmp(set[j].digest, digest, VERIFY_DIGEST_LENGTH) == 0 ) {
+			seen = 1;
+			break;
+		}
+	}
+
+	if ( !seen && (free_way >= 0) ) {
+		memcpy(set[free_way].digest, digest, VERIFY_DIGEST_LENGTH);
+		set[free_way].expires = expires;
+	} else
+		seen = 1;
+
+	spin_unlock(&replay->lock);
+
+	return seen;
+} /* replay_seen(const unsigned char *, time_t) */
@@ -0,0 +1,503 @@
+/*
+ * reverse.c  --  tunnels dialled from behind a NAT
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * vim: set sw=4 ts=4
+ */
+
+/*
+ * A plain service behind NAT cannot be reached by a connecting
+ * gunnel. With "-Y idle", the inner tls-to-plain instead dials
+ * the port given by "-l", where an outer plain-to-tls accepts
+ * links at its "-r" port. The roles of TLS are kept, the inner
+ * side being the server, so certificates are those of an ordinary
+ * pair of tunnels.
+ *
+ * The inner side keeps that many links connected and negotiated,
+ * yet idle. The outer side holds as many links, each in a process
+ * of its own, and passes each new client to an idle link. The link
+ * sends REVERSE_GO, whereupon the inner side connects the plain
+ * service, and dials another link to keep its pool full. A client
+ * thus waits neither for a connection nor for a handshake on the
+ * inner leg, unless every link is in use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+
+#define _INCLUDE_EXTERNALS	1
+#include "gunnel.h"
+
+/* Tags on the control socket of an outer link. */
+#define REVERSE_READY	'r'
+#define REVERSE_CLIENT	'c'
+
+/* Sent over a link as it is put to use. */
+#define REVERSE_GO		'G'
+
+/* Clients awaiting a link at the outer side. */
+#define REVERSE_BACKLOG	64
+
+/* Usec before dialling again, once a link has failed. */
+#define REVERSE_RETRY	1000000
+
+/* Message passing */
+static char message[MESSAGE_LENGTH] = "";
+
+/* Monotonic clock in microseconds. */
+static long long now_usec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+} /* now_usec(void) */
+
+/* Idle links must survive, and be known dead, behind NAT. */
+static void keep_alive(int fd) {
+	int on = 1;
+
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+} /* keep_alive(int) */
+
+/* Relay a client over a link just put to use. */
+static void relay_link(const struct tunnel *tun, struct transport *link,
+						int fd) {
+	struct transport plain;
+	struct shaper shaper;
+
+	if ( transport_init(&plain, fd, TRANSPORT_PLAIN, tun->tls,
+						message, sizeof(message)) ) {
+		close(fd);
+		return;
+	}
+
+	shaper_init(&shaper, tun->rate, tun->shaping);
+	if ( is_tls_transport(tun->svc.local_kind) )
+		relay_traffic(link, &plain, &shaper);
+	else
+		relay_traffic(&plain, link, &shaper);
+	shaper_release(&shaper);
+
+	transport_close(&plain);
+} /* relay_link(const struct tunnel *, struct transport *, int) */
+
+/*
+ * Is an idle link still sound? Records may arrive, like tickets
+ * for resumption, but no data before the link is put to use.
+ */
+static int link_sound(struct transport *link) {
+	int flags;
+	ssize_t n;
+	char byte;
+
+	flags = fcntl(link->fd, F_GETFL);
+	fcntl(link->fd, F_SETFL, flags | O_NONBLOCK);
+
+	errno = 0;
+	n = link->ops->read(link, &byte, 1);
+
+	fcntl(link->fd, F_SETFL, flags);
+
+	return (n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+} /* link_sound(struct transport *) */
+
+/* An outer link, negotiated and awaiting its client. */
+static void outer_link(const struct tunnel *tun, int fd, int ctl) {
+	int td, num;
+	char tag;
+	fd_set rset;
+	struct transport link;
+
+	keep_alive(fd);
+
+	if ( transport_init(&link, fd, tun->svc.remote_kind, tun->tls,
+						message, sizeof(message)) ) {
+		close(fd);
+		return;
+	}
+
+	transport_compress(&link, tun->compress);
+
+	tag = REVERSE_READY;
+	if ( (transport_handshake(&link) != GUNNEL_SUCCESS)
+			|| (send(ctl, &tag, sizeof(tag), 0) != sizeof(tag)) ) {
+		transport_close(&link);
+		return;
+	}
+
+	while (1) {
+		FD_ZERO(&rset);
+		FD_SET(fd, &rset);
+		FD_SET(ctl, &rset);
+
+		if ( select(((fd > ctl) ? fd : ctl) + 1, &rset, NULL, NULL, NULL) < 0 ) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if ( FD_ISSET(fd, &rset) && !link_sound(&link) )
+			break;
+
+		if (! FD_ISSET(ctl, &rset) )
+			continue;
+
+		num = 1;
+		if ( recv_fds(ctl, &tag, sizeof(tag), &td, &num) <= 0 )
+			break;
+
+		if ( (num != 1) || (tag != REVERSE_CLIENT) )
+			continue;
+
+		close(ctl);
+
+		tag = REVERSE_GO;
+		if ( transport_write(&link, &tag, sizeof(tag)) == sizeof(tag) )
+			relay_link(tun, &link, td);
+		else {
+			shutdown(td, SHUT_RDWR);
+			close(td);
+		}
+
+		break;
+	}
+
+	transport_close(&link);
+} /* outer_link(const struct tunnel *, int, int) */
+
+/* Links held by the outer side, negotiating or idle. */
+struct pooled_link {
+	int ctl;				/* Free slot while negative. */
+	int ready;
+};
+
+/* Hand waiting clients to idle links. */
+static void match_clients(struct pooled_link *pool, int max,
+						int *waiting, int *nwaiting) {
+	int j;
+	char tag = REVERSE_CLIENT;
+
+	for (j = 0; (j < max) && (*nwaiting > 0); ++j) {
+		if ( (pool[j].ctl < 0) || !pool[j].ready )
+			continue;
+
+		/* A link which has just left keeps the client waiting. */
+		if ( send_fds(pool[j].ctl, &tag, sizeof(tag), waiting, 1) == 0 ) {
+			close(waiting[0]);
+			memmove(waiting, waiting + 1, --*nwaiting * sizeof(int));
+		}
+
+		close(pool[j].ctl);
+		pool[j].ctl = -1;
+	}
+} /* match_clients(struct pooled_link *, int, int *, int *) */
+
+/* Accept links at ls, and clients from qd, until the latter closes. */
+static void outer_keep(const struct tunnel *tun, int ls, int qd) {
+	int j, fd, num, held, maxfd, nwaiting = 0;
+	int cv[2], waiting[REVERSE_BACKLOG];
+	char tag;
+	fd_set rset;
+	struct pooled_link pool[MAX_REVERSE_LINKS];
+
+	for (j = 0; j < tun->reverse; ++j)
+		pool[j].ctl = -1;
+
+	while (qd >= 0) {
+		FD_ZERO(&rset);
+		FD_SET(qd, &rset);
+		maxfd = qd;
+
+		for (j = 0, held = 0; j < tun->reverse; ++j) {
+			if (pool[j].ctl < 0)
+				continue;
+			++held;
+			FD_SET(pool[j].ctl, &rset);
+			maxfd = (pool[j].ctl > maxfd) ? pool[j].ctl : maxfd;
+		}
+
+		/* Links beyond the given number are left waiting. */
+		if (held < tun->reverse) {
+			FD_SET(ls, &rset);
+			maxfd = (ls > maxfd) ? ls : maxfd;
+		}
+
+		if ( select(maxfd + 1, &rset, NULL, NULL, NULL) < 0 ) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if ( (held < tun->reverse) && FD_ISSET(ls, &rset)
+				&& ((fd = accept(ls, NULL, NULL)) >= 0) ) {
+			for (j = 0; pool[j].ctl >= 0; ++j)
+				;
+
+			if ( socketpair(AF_UNIX, SOCK_SEQPACKET, 0, cv) < 0 ) {
+				close(fd);
+				continue;
+			}
+
+			switch (fork()) {
+				case -1:
+					close(cv[0]);
+					close(cv[1]);
+					break;
+				case 0:
+					close(cv[0]);
+					close(ls);
+					close(qd);
+					while (nwaiting > 0)
+						close(waiting[--nwaiting]);
+					for (j = 0; j < tun->reverse; ++j)
+						if (pool[j].ctl >= 0)
+							close(pool[j].ctl);
+					outer_link(tun, fd, cv[1]);
+					exit(GUNNEL_SUCCESS);
+				default:
+					close(cv[1]);
+					pool[j].ctl = cv[0];
+					pool[j].ready = 0;
+					break;
+			}
+
+			close(fd);
+		}
+
+		for (j = 0; j < tun->reverse; ++j) {
+			if ( (pool[j].ctl < 0) || !FD_ISSET(pool[j].ctl, &rset) )
+				continue;
+
+			if ( (recv(pool[j].ctl, &tag, sizeof(tag), 0) == sizeof(tag))
+					&& (tag == REVERSE_READY) ) {
+				pool[j].ready = 1;
+				continue;
+			}
+
+			/* The link has failed, or was closed by the inner side. */
+			close(pool[j].ctl);
+			pool[j].ctl = -1;
+		}
+
+		if ( FD_ISSET(qd, &rset) ) {
+			num = 1;
+			if ( recv_fds(qd, &tag, sizeof(tag), &fd, &num) <= 0 ) {
+				if (errno != EINTR) {
+					close(qd);
+					qd = -1;
+				}
+			} else if ( (num == 1) && (nwaiting < REVERSE_BACKLOG) )
+				waiting[nwaiting++] = fd;
+			else if (num == 1) {
+				shutdown(fd, SHUT_RDWR);
+				close(fd);
+			}
+		}
+
+		match_clients(pool, tun->reverse, waiting, &nwaiting);
+	}
+
+	/* Clients in use are relayed by their own processes. */
+	while (nwaiting > 0) {
+		shutdown(waiting[--nwaiting], SHUT_RDWR);
+		close(waiting[nwaiting]);
+	}
+
+	for (j = 0; j < tun->reverse; ++j)
+		if (pool[j].ctl >= 0)
+			close(pool[j].ctl);
+
+	close(ls);
+} /* outer_keep(const struct tunnel *, int, int) */
+
+/**
+ * reverse_start  --  fork the process holding a tunnel's links
+ *
+ * Links are accepted at ls, which is closed by the caller.
+ * The descriptors in unneeded[] are closed by the process.
+ * Returns the descriptor for reverse_dispatch(), or -1 at failure.
+ */
+
+int reverse_start(const struct tunnel *tun, int ls,
+				const int *unneeded, int num) {
+	int qv[2];
+
+	if ( socketpair(AF_UNIX, SOCK_SEQPACKET, 0, qv) < 0 )
+		return -1;
+
+	switch (supervisor_fork()) {
+		case -1:
+			close(qv[0]);
+			close(qv[1]);
+			return -1;
+		case 0:
+			close(qv[0]);
+			while (num > 0)
+				if (unneeded[--num] >= 0)
+					close(unneeded[num]);
+			outer_keep(tun, ls, qv[1]);
+			exit(GUNNEL_SUCCESS);
+		default:
+			break;
+	}
+
+	close(qv[1]);
+
+	return qv[0];
+} /* reverse_start(const struct tunnel *, int, const int *, int) */
+
+/**
+ * reverse_dispatch  --  pass a new client to an idle link
+ *
+ * The caller keeps its copy of td.
+ */
+
+int reverse_dispatch(int rq, int td) {
+	char tag = REVERSE_CLIENT;
+
+	if (rq < 0)
+		return -1;
+
+	return send_fds(rq, &tag, sizeof(tag), &td, 1);
+} /* reverse_dispatch(int, int) */
+
+/* An inner link: dial, negotiate, and await its use. */
+static void inner_link(const struct tunnel *tun, int report) {
+	int fd, rd;
+	char byte;
+	struct transport link;
+
+	if ( (fd = get_connected_socket(tun->lhost, tun->lport,
+									tun->svc.local_tuning)) < 0 )
+		return;
+
+	keep_alive(fd);
+
+	if ( transport_init(&link, fd, tun->svc.local_kind, tun->tls,
+						message, sizeof(message)) ) {
+		close(fd);
+		return;
+	}
+
+	transport_compress(&link, tun->compress);
+
+	if ( (transport_handshake(&link) != GUNNEL_SUCCESS)
+			|| (link.ops->read(&link, &byte, sizeof(byte)) != sizeof(byte))
+			|| (byte != REVERSE_GO) ) {
+		transport_close(&link);
+		return;
+	}
+
+	/* Another link may be dialled in its stead. */
+	write(report, &byte, sizeof(byte));
+	close(report);
+
+	if ( (rd = get_connected_socket(tun->rhost, tun->rport,
+									tun->svc.remote_tuning)) >= 0 )
+		relay_link(tun, &link, rd);
+
+	transport_close(&link);
+} /* inner_link(const struct tunnel *, int) */
+
+/**
+ * reverse_dial  --  keep idle links to the outer side of a tunnel
+ *
+ * Replaces the accepting loop of an inner tunnel. Returns once
+ * asked to stop, and once the links in use have finished.
+ */
+
+void reverse_dial(const struct tunnel *tun) {
+	int j, n, maxfd, idle = 0;
+	int pv[2], reports[MAX_REVERSE_LINKS];
+	char byte;
+	long long now, retry_at = 0;
+	fd_set rset;
+	struct timeval tv, *timeout;
+
+	while (again) {
+		/* Links dialled from now on use fresh credentials. */
+		if (reload_due) {
+			reload_due = 0;
+			tls_context_reload_all(message, sizeof(message));
+			fprintf(stderr, "%s", message);
+		}
+
+		now = now_usec();
+
+		/* Dial as many as are missing, unless recently failed. */
+		while ( (idle < tun->reverse) && (now >= retry_at)
+				&& (pipe(pv) == 0) ) {
+			switch (fork()) {
+				case -1:
+					close(pv[0]);
+					close(pv[1]);
+					retry_at = now + REVERSE_RETRY;
+					continue;
+				case 0:
+					close(pv[0]);
+					for (j = 0; j < idle; ++j)
+						close(reports[j]);
+					inner_link(tun, pv[1]);
+					exit(GUNNEL_SUCCESS);
+				default:
+					close(pv[1]);
+					reports[idle++] = pv[0];
+					break;
+			}
+		}
+
+		FD_ZERO(&rset);
+		maxfd = -1;
+		for (j = 0; j < idle; ++j) {
+			FD_SET(reports[j], &rset);
+			maxfd = (reports[j] > maxfd) ? reports[j] : maxfd;
+		}
+
+		timeout = NULL;
+		if ( (idle < tun->reverse) && (retry_at > now) ) {
+			tv.tv_sec = (retry_at - now) / 1000000;
+			tv.tv_usec = (retry_at - now) % 1000000;
+			timeout = &tv;
+		}
+
+		if ( select(maxfd + 1, &rset, NULL, NULL, timeout) < 0 )
+			continue;
+
+		for (j = 0; j < idle; ++j) {
+			if (! FD_ISSET(reports[j], &rset) )
+				continue;
+
+			/* A link ending unused failed, or was refused. */
+			if ( (n = read(reports[j], &byte, sizeof(byte))) <= 0 )
+				retry_at = now_usec() + REVERSE_RETRY;
+
+			close(reports[j]);
+			reports[j--] = reports[--idle];
+		}
+	}
+
+	for (j = 0; j < idle; ++j)
+		close(reports[j]);
+
+	/* Links in use are left to finish. */
+	while ( (wait(NULL) > 0) || (errno == EINTR) )
+		;
+} /* reverse_dial(const struct tunnel *) */
@@ -0,0 +1,446 @@
+/*
+ * routing.c  --  choose an upstream by server name and protocol
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * vim: set sw=4 ts=4
+ */
+
+/*
+ * A TLS server may route each client by the server name and the
+ * application protocols offered in its ClientHello. The routes are
+ * read from a file, one route on every line:
+ *
+ *     # name           protocol   upstream          certificate  key
+ *     www.example.com  -          localhost,8080
+ *     *.example.com    h2         10.0.0.2,8443     wild.pem     wild.key
+ *     *                acme-tls/1 localhost,9999
+ *
+ * A name "*.suffix" matches a single label in front of the suffix,
+ * and "*", alternatively "-", matches every name, even a missing
+ * one. A protocol "-" matches any protocol. A route carrying a
+ * certificate is served with it, in place of that of the tunnel.
+ * Clients matching no route go to the remote port of the tunnel.
+ *
+ * The names are kept in an open addressing hash table, built once
+ * as the file is read. A lookup probes for the full name, for its
+ * wildcard, and for "*", so its cost does not grow with the number
+ * of names. Routes for the same name, but different protocols, are
+ * chained from a single slot, with a protocol of "-" as fallback.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <gnutls/gnutls.h>
+
+#define _INCLUDE_EXTERNALS	1
+#include "gunnel.h"
+
+#define ROUTE_LINE_LENGTH	1024
+#define ROUTE_NAME_LENGTH	256
+
+/* Distinct protocols announced by a routing server. */
+#define MAX_ROUTE_PROTOCOLS	16
+
+struct route {
+	char *name;			/* In lower case. */
+	char *protocol;		/* Or NULL, for any. */
+	char *rhost, *rport;
+	const struct tls_context *tls;	/* Own certificate, or NULL. */
+	int next;			/* Same name, other protocol, or -1. */
+};
+
+struct route_table {
+	struct route *route;
+	int count;
+	int *slot;			/* First route of a name, or -1. */
+	unsigned int mask;
+	gnutls_datum_t protocol[MAX_ROUTE_PROTOCOLS];
+	int protocols;
+};
+
+static char message[MESSAGE_LENGTH] = "";
+
+/* Tunnel whose handshake is in progress. A process
+ * handshakes a single session at a time. */
+static const struct tunnel *hello_tunnel = NULL;
+
+/* FNV-1a. */
+static unsigned int name_hash(const char *name, size_t len) {
+	unsigned int hash = 2166136261U;
+
+	while (len--) {
+		hash ^= (unsigned char) *name++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+} /* name_hash(const char *, size_t) */
+
+/* Slot of a name, or of the free slot where it belongs. */
+static int name_slot(const struct route_table *rt, const char *name,
+					size_t len) {
+	unsigned int j;
+	const char *other;
+
+	for (j = name_hash(name, len) & rt->mask; rt->slot[j] >= 0;
+			j = (j + 1) & rt->mask) {
+		other = rt->route[rt->slot[j]].name;
+		if ( (strncmp(other, name, len) == 0) && (other[len] == '\0') )
+			break;
+	}
+
+	return j;
+} /* name_slot(const struct route_table *, const char *, size_t) */
+
+/* Best route among those of a single name. */
+static const struct route *pick_route(const struct route_table *rt,
+							const char *name, size_t len,
+							const char *protocol) {
+	int j;
+	const struct route *any = NULL;
+
+	for (j = rt->slot[name_slot(rt, name, len)]; j >= 0;
+			j = rt->route[j].next) {
+		if (rt->route[j].protocol == NULL)
+			any = &rt->route[j];
+		else if ( protocol && (strcmp(rt->route[j].protocol, protocol) == 0) )
+			return &rt->route[j];
+	}
+
+	return any;
+} /* pick_route(const struct route_table *, const char *, size_t,
+	 const char *) */
+
+/* Route of a name and a protocol, either possibly missing. */
+static const struct route *lookup_route(const struct route_table *rt,
+							const char *name, const char *protocol) {
+	size_t len;
+	char key[ROUTE_NAME_LENGTH + 1], *dot;
+	const struct route *route;
+
+	key[0] = '*';
+	for (len = 0; name && name[len] && (len < ROUTE_NAME_LENGTH - 1); ++len)
+		key[len + 1] = tolower((unsigned char) name[len]);
+
+	/* Fully qualified names end in a dot. */
+	if ( len && (key[len] == '.') )
+		--len;
+	key[len + 1] = '\0';
+
+	if ( len && (route = pick_route(rt, key + 1, len, protocol)) )
+		return route;
+
+	/* Replace the first label by the wildcard. */
+	if ( len && (dot = strchr(key + 1, '.')) ) {
+		dot[-1] = '*';
+		if ( (route = pick_route(rt, dot - 1, strlen(dot - 1), protocol)) )
+			return route;
+	}
+
+	return pick_route(rt, "*", 1, protocol);
+} /* lookup_route(const struct route_table *, const char *, const char *) */
+
+/* Route selected by the ClientHello of a server session. */
+static const struct route *choose_route(const struct route_table *rt,
+										gnutls_session_t session) {
+	unsigned int type;
+	size_t size;
+	char name[ROUTE_NAME_LENGTH], protocol[ROUTE_NAME_LENGTH];
+	gnutls_datum_t alpn;
+
+	size = sizeof(name);
+	if ( (gnutls_server_name_get(session, name, &size, &type, 0) < 0)
+			|| (type != GNUTLS_NAME_DNS) )
+		name[0] = '\0';
+
+	protocol[0] = '\0';
+	if ( (gnutls_alpn_get_selected_protocol(session, &alpn) == 0)
+			&& (alpn.size < sizeof(protocol)) ) {
+		memcpy(protocol, alpn.data, alpn.size);
+		protocol[alpn.size] = '\0';
+	}
+
+	return lookup_route(rt, name, protocol[0] ? protocol : NULL);
+} /* choose_route(const struct route_table *, gnutls_session_t) */
+
+/* Serve the certificate of the route, once the ClientHello is known. */
+static int route_hello(gnutls_session_t session) {
+	const struct route *route;
+
+	if (hello_tunnel == NULL)
+		return 0;
+
+	route = choose_route(hello_tunnel->routes, session);
+	if ( route && route->tls )
+		tls_session_credentials(session, route->tls);
+
+	return 0;
+} /* route_hello(gnutls_session_t) */
+
+/* Announce a protocol, unless it already is. */
+static int add_protocol(struct route_table *rt, char *protocol) {
+	int j;
+
+	for (j = 0; j < rt->protocols; ++j)
+		if ( strcmp((char *) rt->protocol[j].data, protocol) == 0 )
+			return 0;
+
+	if (rt->protocols == MAX_ROUTE_PROTOCOLS)
+		return -1;
+
+	rt->protocol[rt->protocols].data = (unsigned char *) protocol;
+	rt->protocol[rt->protocols].size = strlen(protocol);
+	++rt->protocols;
+
+	return 0;
+} /* add_protocol(struct route_table *, char *) */
+
+/* Enter every route into the hash table. */
+static int index_routes(struct route_table *rt) {
+	int j, k, size = 16;
+	unsigned int s;
+	struct route *route;
+
+	while (size < 2 * rt->count)
+		size *= 2;
+
+	if ( (rt->slot = malloc(size * sizeof(*rt->slot))) == NULL )
+		return -1;
+
+	memset(rt->slot, 0xff, size * sizeof(*rt->slot));
+	rt->mask = size - 1;
+
+	for (j = 0; j < rt->count; ++j) {
+		route = &rt->route[j];
+		route->next = -1;
+		s = name_slot(rt, route->name, strlen(route->name));
+
+		if (rt->slot[s] < 0) {
+			rt->slot[s] = j;
+			continue;
+		}
+
+		/* Keep the order of the file within a name. */
+		for (k = rt->slot[s]; ; k = rt->route[k].next) {
+			if ( (route->protocol == NULL) ? (rt->route[k].protocol == NULL)
+					: (rt->route[k].protocol
+						&& !strcmp(rt->route[k].protocol, route->protocol)) )
+				return j + 1;	/* Duplicate, one beyond its index. */
+
+			if (rt->route[k].next < 0)
+				break;
+		}
+		rt->route[k].next = j;
+	}
+
+	return 0;
+} /* index_routes(struct route_table *) */
+
+/* Parse a single line into a new route. */
+static int parse_route(struct route_table *rt, char *line,
+						const struct tunnel *tun, int verify, size_t early,
+						char *msg, int len) {
+	int n;
+	char *field[6], *str, *save = NULL;
+	struct route *route;
+
+	for (n = 0, str = strtok_r(line, " \t\r\n", &save); str && (n < 6);
+			str = strtok_r(NULL, " \t\r\n", &save))
+		field[n++] = str;
+
+	if ( (n < 3) || (n > 5) ) {
+		snprintf(msg, len, "Expected \"name protocol upstream"
+								" [certificate [key]]\".");
+		return -1;
+	}
+
+	route = &rt->route[rt->count];
+	memset(route, '\0', sizeof(*route));
+
+	if ( (strcmp(field[0], "-") == 0) || (strcmp(field[0], "*") == 0) )
+		field[0] = "*";
+	else if ( strchr(field[0] + 1, '*')
+			|| ((field[0][0] == '*') && (field[0][1] != '.')) ) {
+		snprintf(msg, len, "Wildcards must read \"*.suffix\".");
+		return -1;
+	}
+
+	if ( strlen(field[0]) >= ROUTE_NAME_LENGTH - 1 ) {
+		snprintf(msg, len, "Too long a name.");
+		return -1;
+	}
+
+	if ( (route->name = strdup(field[0])) == NULL )
+		return -1;
+	for (str = route->name; *str; ++str)
+		*str = tolower((unsigned char) *str);
+
+	n -= 3;
+	if ( strcmp(field[1], "-") ) {
+		if ( ((route->protocol = strdup(field[1])) == NULL)
+				|| add_protocol(rt, route->protocol) ) {
+			snprintf(msg, len, "At most %d distinct protocols.",
+					MAX_ROUTE_PROTOCOLS);
+			return -1;
+		}
+	}
+
+	if ( decompose_port(field[2], &route->rhost, &route->rport) ) {
+		snprintf(msg, len, "Invalid upstream \"%s\".", field[2]);
+		return -1;
+	}
+
+	if (n > 0) {
+		route->tls = tls_context_load(field[3], (n > 1) ? field[4] : field[3],
+									tun->cafile, tun->ciphers, 1, verify,
+									early, msg, len);
+		if (route->tls == NULL)
+			return -1;
+	}
+
+	++rt->count;
+
+	return 0;
+} /* parse_route(struct route_table *, char *, const struct tunnel *,
+	 int, size_t, char *, int) */
+
+/**
+ * route_load  --  read the routes of a tunnel
+ *
+ * Certificates of the routes share the CA-chain, the ciphers,
+ * and the verification of the tunnel. Returns NULL after
+ * reporting the first error.
+ */
+
+struct route_table *route_load(const char *path, const struct tunnel *tun,
+								int verify, size_t early) {
+	int lineno = 0, room = 64, dup;
+	char line[ROUTE_LINE_LENGTH], *str;
+	FILE *file;
+	struct route *more;
+	struct route_table *rt;
+
+	if ( (file = fopen(path, "r")) == NULL ) {
+		perror(path);
+		return NULL;
+	}
+
+	if ( ((rt = calloc(1, sizeof(*rt))) == NULL)
+			|| ((rt->route = malloc(room * sizeof(*rt->route))) == NULL) ) {
+		fprintf(stderr, "%s: Out of memory.\n", path);
+		goto failure;
+	}
+
+	while ( fgets(line, sizeof(line), file) ) {
+		++lineno;
+
+		for (str = line; isspace((unsigned char) *str); ++str)
+			;
+		if ( (*str == '\0') || (*str == '#') || (*str == ';') )
+			continue;
+
+		if (rt->count == room) {
+			room *= 2;
+			if ( (more = realloc(rt->route, room * sizeof(*more))) == NULL ) {
+				fprintf(stderr, "%s: Out of memory.\n", path);
+				goto failure;
+			}
+			rt->route = more;
+		}
+
+		message[0] = '\0';
+		if ( parse_route(rt, str, tun, verify, early,
+							message, sizeof(message)) ) {
+			fprintf(stderr, "%s:%d: %s\n", path, lineno, message);
+			goto failure;
+		}
+	}
+
+	fclose(file);
+
+	/* Compressing peers match the routes for any protocol. */
+	if ( tun->compress && add_protocol(rt, (char *) COMPRESS_PROTOCOL) ) {
+		fprintf(stderr, "%s: At most %d distinct protocols.\n",
+				path, MAX_ROUTE_PROTOCOLS);
+		return NULL;
+	}
+
+	if ( (dup = index_routes(rt)) < 0 ) {
+		fprintf(stderr, "%s: Out of memory.\n", path);
+		return NULL;
+	}
+
+	if (dup) {
+		fprintf(stderr, "%s: Route \"%s %s\" is given twice.\n",
+				path, rt->route[dup - 1].name,
+				rt->route[dup - 1].protocol ? rt->route[dup - 1].protocol
+											: "-");
+		return NULL;
+	}
+
+	return rt;
+
+failure:
+	fclose(file);
+	return NULL;
+} /* route_load(const char *, const struct tunnel *, int, size_t) */
+
+/**
+ * route_count  --  number of routes in a table
+ */
+
+int route_count(const struct route_table *rt) {
+	return rt ? rt->count : 0;
+} /* route_count(const struct route_table *) */
+
+/**
+ * route_prepare  --  let a server session be routed
+ *
+ * Must precede the handshake. The protocols of every route
+ * are offered to the client.
+ */
+
+void route_prepare(const struct tunnel *tun, struct transport *local) {
+	if ( (tun->routes == NULL) || (local->kind != TRANSPORT_TLS_SERVER) )
+		return;
+
+	hello_tunnel = tun;
+
+	if (tun->routes->protocols)
+		gnutls_alpn_set_protocols(local->session, tun->routes->protocol,
+									tun->routes->protocols, 0);
+
+	gnutls_handshake_set_post_client_hello_function(local->session,
+													route_hello);
+} /* route_prepare(const struct tunnel *, struct transport *) */
+
+/**
+ * route_connect  --  connect to the upstream of an established client
+ *
+ * Returns the connected socket, or -1.
+ */
+
+int route_connect(const struct tunnel *tun, struct transport *local) {
+	const struct route *route = NULL;
+
+	if ( tun->routes && (local->kind == TRANSPORT_TLS_SERVER) )
+		route = choose_route(tun->routes, local->session);
+
+	if (route)
+		return get_connected_socket(route->rhost, route->rport,
+									tun->svc.remote_tuning);
+
+	return get_connected_socket(tun->rhost, tun->rport,
+								tun->svc.remote_tuning);
+} /* route_connect(const struct tunnel *, struct transport *) */
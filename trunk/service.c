@@ -0,0 +1,1343 @@
+/*
+ * service.c  --  common frame for all tunnel subsystems
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * vim: set sw=4 ts=4
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <getopt.h>
+
+#define _INCLUDE_EXTERNALS	1
+#include "gunnel.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+#include <fcntl.h>
+
+static const char plain_options_string[] = "hl:r:g:u:oNH:E:T:b:B:S:z:n:Q:";
+static const char tls_options_string[] =
+						"hl:r:g:u:c:k:a:C:oNH:E:w:F:T:b:B:S:V:e:m:z:n:R:Z:P:Y:Q:";
+
+/* Message passing */
+static char message[MESSAGE_LENGTH] = "";
+
+/* Semaphores for flow control. */
+static int show_usage = 0;
+
+/* Queues of the processes carrying multiplexed, or reversed, clients. */
+static int tunnel_queues[MAX_TUNNELS];
+
+/* Listeners for links of reverse tunnels, kept for restarts. */
+static int link_listeners[MAX_TUNNELS];
+
+/* Looping for incoming clients. */
+static int accept_loop(const struct tunnel *tunnels, struct listener *lst,
+						int count, int cd);
+
+/* Return "none" if argument is null. */
+static inline const char *cover_empty_string(const char *str) {
+	return str ? str : "none";
+} /* cover_empty_string(const char *) */
+
+/* Does the service make use of TLS at all? */
+static inline int uses_tls(const struct service *svc) {
+	return is_tls_transport(svc->local_kind)
+			|| is_tls_transport(svc->remote_kind);
+} /* uses_tls(const struct service *) */
+
+/* Does the service make use of server side TLS? */
+static inline int uses_tls_server(const struct service *svc) {
+	return (svc->local_kind == TRANSPORT_TLS_SERVER)
+			|| (svc->remote_kind == TRANSPORT_TLS_SERVER);
+} /* uses_tls_server(const struct service *) */
+
+/* Display usage and instantiated settings. */
+static void show_info(const struct service *svc, char *progname) {
+	printf("Usage: %s " LOCAL_PORT_STR
+						REMOTE_PORT_STR
+						TUNNEL_USR_STR
+						TUNNEL_GRP_STR
+						ONE_SHOT_STR
+						FOREGROUND_STR
+						HANDOVER_SOCK_STR
+						IO_BACKEND_STR
+						SOCKET_TUNING_STR
+			"\n\t\t    "
+						RATE_LIMIT_STR
+						TUNNEL_RATE_STR
+						STATISTICS_FILE_STR
+						BUFFER_SIZE_STR
+						MAX_CHILDREN_STR
+						BUSY_POLL_STR,
+				progname);
+
+	if ( uses_tls(svc) )
+		printf("\n\t\t    "
+				CERT_FILE_STR
+				CA_FILE_STR
+				KEY_FILE_STR
+				CIPHER_POLICY_STR
+				HANDSHAKE_WORKERS_STR
+				FLUSH_WINDOW_STR
+				"\n\t\t    "
+				VERIFY_PEER_STR
+				EARLY_DATA_STR
+				MUX_LINKS_STR
+				ROUTE_FILE_STR
+				COMPRESSION_STR
+				STRIPES_STR
+				REVERSE_LINKS_STR);
+
+	printf("\n\n");
+
+	printf("Active settings:\n"
+			"\tProcess owner:   %s\n"
+			"\tProcess group:   %s\n"
+			"\tLocal port:      %s\n"
+			"\tRemote port:     %s\n"
+			"\tOne shot server: %s\n"
+			"\tForeground:      %s\n"
+			"\tControl socket:  %s\n"
+			"\tEvent backend:   %s\n"
+			"\tSocket tuning:   %s\n"
+			"\tConnection rate: %s\n"
+			"\tTunnel rate:     %s\n"
+			"\tStatistics:      %s\n"
+			"\tRelay buffers:   %ld bytes\n"
+			"\tChild limit:     %d\n"
+			"\tBusy polling:    %s\n",
+			cover_empty_string(user_name),
+			cover_empty_string(group_name),
+			cover_empty_string(local_port_string),
+			cover_empty_string(remote_port_string),
+			again ? "false" : "true",
+			foreground ? "true" : "false",
+			cover_empty_string(handover_path),
+			io_backend,
+			cover_empty_string(tuning_profiles),
+			cover_empty_string(rate_limits),
+			cover_empty_string(tunnel_rate_limits),
+			cover_empty_string(statistics_path),
+			buffer_size,
+			max_children,
+			cover_empty_string(busy_poll)
+			);
+
+	if ( uses_tls(svc) )
+		printf("\tCertificate:     %s\n"
+				"\tKey file:        %s\n"
+				"\tCA-chain:        %s\n"
+				"\tCipher policy:   %s\n"
+				"\tHandshake pool:  %d\n"
+				"\tFlush window:    %ld usec\n"
+				"\tVerify peer:     %s\n"
+				"\tEarly data:      %s\n"
+				"\tMultiplexing:    %s\n"
+				"\tRouting:         %s\n"
+				"\tCompression:     %s\n"
+				"\tStriping:        %s\n"
+				"\tReverse links:   %s\n",
+				cover_empty_string(certificate),
+				cover_empty_string(keyfile),
+				cover_empty_string(cafile),
+				ciphers,
+				handshake_workers,
+				flush_window,
+				verify_mode,
+				cover_empty_string(early_data),
+				cover_empty_string(mux_links),
+				cover_empty_string(route_file),
+				cover_empty_string(compress_level),
+				cover_empty_string(stripe_links),
+				cover_empty_string(reverse_links)
+				);
+
+	exit(EXIT_FAILURE);
+} /* show_info(const struct service *, char *) */
+
+/*
+ * Resolve the profiles of "-T local[,remote]" for a tunnel.
+ * A deferred accept, like a connect awaiting the first write,
+ * is useful only when the client speaks first, as with TLS.
+ */
+static int choose_tuning(struct tunnel *tun) {
+	char *comma;
+	const struct tuning *lt, *rt;
+
+	if (tun->tuning_profiles == NULL)
+		return 0;
+
+	if ( (comma = strchr(tun->tuning_profiles, ',')) )
+		*comma = '\0';
+
+	lt = tuning_lookup(tun->tuning_profiles);
+	rt = comma ? tuning_lookup(comma + 1) : lt;
+
+	if (comma)
+		*comma = ',';
+
+	if ( (lt == NULL) || (rt == NULL) )
+		return -1;
+
+	tun->local_tuning = *lt;
+	tun->remote_tuning = *rt;
+
+	if (! is_tls_transport(tun->svc.local_kind) )
+		tun->local_tuning.defer_accept = 0;
+
+	if (tun->svc.remote_kind != TRANSPORT_TLS_CLIENT)
+		tun->remote_tuning.fastopen = 0;
+
+	/* Unix sockets are left alone. */
+	if (tun->svc.local_kind != TRANSPORT_UNIX)
+		tun->svc.local_tuning = &tun->local_tuning;
+
+	if (tun->svc.remote_kind != TRANSPORT_UNIX)
+		tun->svc.remote_tuning = &tun->remote_tuning;
+
+	return 0;
+} /* choose_tuning(struct tunnel *) */
+
+/*
+ * Early data is of use only for latency. The short records
+ * ending a handshake must then not wait for acknowledgement.
+ */
+static void tune_for_early_data(struct tunnel *tun) {
+	if ( is_tls_transport(tun->svc.local_kind) ) {
+		tun->local_tuning.nodelay = 1;
+		tun->svc.local_tuning = &tun->local_tuning;
+	}
+
+	if ( is_tls_transport(tun->svc.remote_kind) ) {
+		tun->remote_tuning.nodelay = 1;
+		tun->svc.remote_tuning = &tun->remote_tuning;
+	}
+} /* tune_for_early_data(struct tunnel *) */
+
+/*
+ * Streams are multiplexed by plain-to-tls, over the given number
+ * of links, and separated by tls-to-plain, for any such number.
+ * Every stream passes the single process of its tunnel, which
+ * has no means of limiting their rates.
+ */
+static int choose_mux(struct tunnel *tun) {
+	long links;
+	char *end;
+
+	links = strtol(tun->mux_links, &end, 10);
+	if ( (*end != '\0') || (links < 1) || (links > MAX_MUX_LINKS) ) {
+		fprintf(stderr, "Multiplexing takes 1 to %d links.\n", MAX_MUX_LINKS);
+		return -1;
+	}
+
+	if ( !((tun->svc.remote_kind == TRANSPORT_TLS_CLIENT)
+				&& !is_tls_transport(tun->svc.local_kind))
+			&& !((tun->svc.local_kind == TRANSPORT_TLS_SERVER)
+				&& !is_tls_transport(tun->svc.remote_kind)) ) {
+		fprintf(stderr, "Only plain-to-tls and tls-to-plain multiplex.\n");
+		return -1;
+	}
+
+	if ( tun->rate[0] || tun->rate[1] || tun->shaping ) {
+		fprintf(stderr, "Rate limits do not apply to multiplexed streams.\n");
+		return -1;
+	}
+
+	tun->mux = links;
+
+	return 0;
+} /* choose_mux(struct tunnel *) */
+
+/*
+ * Each client is striped by plain-to-tls over the given number
+ * of links, and gathered by tls-to-plain from at most as many.
+ * The window bounds the data held out of order, as chosen by
+ * the client, and as allowed by the server.
+ */
+static int choose_stripes(struct tunnel *tun, long early) {
+	long links, window = STRIPE_WINDOW;
+	char *end;
+
+	links = strtol(tun->stripe_links, &end, 10);
+	if (*end == ',')
+		window = strtol(end + 1, &end, 10);
+
+	if ( (*end != '\0') || (links < 1) || (links > MAX_STRIPES) ) {
+		fprintf(stderr, "Striping takes 1 to %d links.\n", MAX_STRIPES);
+		return -1;
+	}
+
+	if ( (window < MIN_STRIPE_WINDOW) || (window > MAX_STRIPE_WINDOW) ) {
+		fprintf(stderr, "Stripe window must be %d to %d bytes.\n",
+				MIN_STRIPE_WINDOW, MAX_STRIPE_WINDOW);
+		return -1;
+	}
+
+	if ( !((tun->svc.remote_kind == TRANSPORT_TLS_CLIENT)
+				&& !is_tls_transport(tun->svc.local_kind))
+			&& !((tun->svc.local_kind == TRANSPORT_TLS_SERVER)
+				&& !is_tls_transport(tun->svc.remote_kind)) ) {
+		fprintf(stderr, "Only plain-to-tls and tls-to-plain stripe.\n");
+		return -1;
+	}
+
+	if ( tun->mux || tun->route_file || tun->compress || early ) {
+		fprintf(stderr, "Striping excludes multiplexing, routing, "
+						"compression, and early data.\n");
+		return -1;
+	}
+
+	if ( tun->rate[0] || tun->rate[1] || tun->shaping ) {
+		fprintf(stderr, "Rate limits do not apply to striped clients.\n");
+		return -1;
+	}
+
+	tun->stripes = links;
+	tun->stripe_window = window;
+
+	return 0;
+} /* choose_stripes(struct tunnel *, long) */
+
+/*
+ * A reverse tunnel is dialled by tls-to-plain, from behind a NAT,
+ * at the remote port of plain-to-tls. Either side keeps the given
+ * number of idle links, waiting for clients.
+ */
+static int choose_reverse(struct tunnel *tun, long early) {
+	long links;
+	char *end;
+
+	links = strtol(tun->reverse_links, &end, 10);
+	if ( (*end != '\0') || (links < 1) || (links > MAX_REVERSE_LINKS) ) {
+		fprintf(stderr, "Reverse tunnels keep 1 to %d idle links.\n",
+				MAX_REVERSE_LINKS);
+		return -1;
+	}
+
+	if ( !((tun->svc.remote_kind == TRANSPORT_TLS_CLIENT)
+				&& !is_tls_transport(tun->svc.local_kind))
+			&& !((tun->svc.local_kind == TRANSPORT_TLS_SERVER)
+				&& !is_tls_transport(tun->svc.remote_kind)) ) {
+		fprintf(stderr, "Only plain-to-tls and tls-to-plain reverse.\n");
+		return -1;
+	}
+
+	if ( tun->mux || tun->stripes || tun->route_file || early ) {
+		fprintf(stderr, "Reverse tunnels exclude multiplexing, striping, "
+						"routing, and early data.\n");
+		return -1;
+	}
+
+	tun->reverse = links;
+
+	return 0;
+} /* choose_reverse(struct tunnel *, long) */
+
+/* Is the tunnel dialled by this side, listening at no port? */
+static inline int dials_reverse(const struct tunnel *tun) {
+	return tun->reverse && is_tls_transport(tun->svc.local_kind);
+} /* dials_reverse(const struct tunnel *) */
+
+/**
+ * run_service  --  main control for any subsystem
+ */
+
+int run_service(const struct service *svc, int argc, char *argv[]) {
+	int opt;
+	static struct tunnel tunnel;
+
+	while ( (opt = getopt(argc, argv, uses_tls(svc)
+									? tls_options_string
+									: plain_options_string)) != -1 ) {
+		switch (opt) {
+			case 'h':	show_usage = 1;
+						break;
+			case LOCAL_PORT:
+						local_port_string = optarg;
+						break;
+			case REMOTE_PORT:
+						remote_port_string = optarg;
+						break;
+			case CERT_FILE:
+						certificate = append_list(certificate, optarg);
+						break;
+			case CA_FILE:
+						cafile = optarg;
+						break;
+			case KEY_FILE:
+						keyfile = append_list(keyfile, optarg);
+						break;
+			case CIPHER_POLICY:
+						ciphers = optarg;
+						break;
+			case TUNNEL_USR:
+						user_name = optarg;
+						break;
+			case TUNNEL_GRP:
+						group_name = optarg;
+						break;
+			case ONE_SHOT:
+						again = 0;
+						break;
+			case FOREGROUND:
+						foreground = 1;
+						break;
+			case HANDOVER_SOCK:
+						handover_path = optarg;
+						break;
+			case IO_BACKEND:
+						io_backend = optarg;
+						break;
+			case HANDSHAKE_WORKERS:
+						handshake_workers = atoi(optarg);
+						break;
+			case FLUSH_WINDOW:
+						flush_window = atol(optarg);
+						break;
+			case SOCKET_TUNING:
+						tuning_profiles = optarg;
+						break;
+			case RATE_LIMIT:
+						rate_limits = optarg;
+						break;
+			case TUNNEL_RATE:
+						tunnel_rate_limits = optarg;
+						break;
+			case VERIFY_PEER:
+						verify_mode = optarg;
+						break;
+			case STATISTICS_FILE:
+						statistics_path = optarg;
+						break;
+			case EARLY_DATA:
+						early_data = optarg;
+						break;
+			case MUX_LINKS:
+						mux_links = optarg;
+						break;
+			case ROUTE_FILE:
+						route_file = optarg;
+						break;
+			case COMPRESSION:
+						compress_level = optarg;
+						break;
+			case STRIPES:
+						stripe_links = optarg;
+						break;
+			case REVERSE_LINKS:
+						reverse_links = optarg;
+						break;
+			case BUSY_POLL:
+						busy_poll = optarg;
+						break;
+			case BUFFER_SIZE:
+						buffer_size = atol(optarg);
+						break;
+			case MAX_CHILDREN:
+						max_children = atoi(optarg);
+						break;
+			case '?':
+			default:
+						fprintf(stderr, "\n");
+						show_usage = 1;
+						break;
+		}
+	}
+
+	/* Prepare any settings. */
+
+	/* Implicit key should be bundled with the certificate. */
+	if ( ! keyfile )
+		keyfile = certificate;
+
+	if (show_usage)
+		/* Never returns. */
+		show_info(svc, argv[0]);
+
+	if ( local_port_string == NULL
+			|| remote_port_string == NULL ) {
+		fprintf(stderr, "Missing port descriptions.\n");
+		return EXIT_FAILURE;
+	}
+
+	/* The command line describes a single tunnel. */
+	tunnel.name = svc->name;
+	tunnel.svc = *svc;
+	tunnel.local_port = local_port_string;
+	tunnel.remote_port = remote_port_string;
+	tunnel.certificate = certificate;
+	tunnel.keyfile = keyfile;
+	tunnel.cafile = cafile;
+	tunnel.ciphers = ciphers;
+	tunnel.tuning_profiles = tuning_profiles;
+	tunnel.rate_limits = rate_limits;
+	tunnel.tunnel_rate_limits = tunnel_rate_limits;
+	tunnel.verify_mode = verify_mode;
+	tunnel.early_data = early_data;
+	tunnel.mux_links = mux_links;
+	tunnel.route_file = route_file;
+	tunnel.compress_level = compress_level;
+	tunnel.stripe_links = stripe_links;
+	tunnel.reverse_links = reverse_links;
+
+	if ( prepare_tunnel(&tunnel) )
+		return EXIT_FAILURE;
+
+	return serve_tunnels(&tunnel, 1);
+} /* run_service(const struct service *, int, char *[]) */
+
+/**
+ * prepare_tunnel  --  resolve the ports and settings of a tunnel
+ *
+ * TLS credentials are loaded, unless an earlier tunnel
+ * already did so for the same files. Aggregate rate limits
+ * are prepared for sharing with every forked connection.
+ */
+
+int prepare_tunnel(struct tunnel *tun) {
+	int rc, verify = VERIFY_NONE;
+	long early = 0;
+	long long total[2];
+	char *end;
+
+	if ( ! tun->keyfile )
+		tun->keyfile = tun->certificate;
+
+	if ( (rc = decompose_port(tun->local_port, &tun->lhost, &tun->lport)) ) {
+		fprintf(stderr, "Local port: ");
+		gunnel_error_message(stderr, rc);
+		return EXIT_FAILURE;
+	}
+
+	if ( (rc = decompose_port(tun->remote_port, &tun->rhost, &tun->rport)) ) {
+		fprintf(stderr, "Remote port: ");
+		gunnel_error_message(stderr, rc);
+		return EXIT_FAILURE;
+	}
+
+	/* Plain traffic over unix sockets is its own transport. */
+	if ( (tun->svc.local_kind == TRANSPORT_PLAIN)
+			&& is_unix_socket_path(tun->lhost, tun->lport) )
+		tun->svc.local_kind = TRANSPORT_UNIX;
+
+	if ( (tun->svc.remote_kind == TRANSPORT_PLAIN)
+			&& is_unix_socket_path(tun->rhost, tun->rport) )
+		tun->svc.remote_kind = TRANSPORT_UNIX;
+
+	if ( choose_tuning(tun) ) {
+		fprintf(stderr, "Unknown tuning profile: %s\n", tun->tuning_profiles);
+		return EXIT_FAILURE;
+	}
+
+	if ( shaping_parse(tun->rate_limits, tun->rate) ) {
+		fprintf(stderr, "Invalid rate limit: %s\n", tun->rate_limits);
+		return EXIT_FAILURE;
+	}
+
+	if ( shaping_parse(tun->tunnel_rate_limits, total) ) {
+		fprintf(stderr, "Invalid rate limit: %s\n", tun->tunnel_rate_limits);
+		return EXIT_FAILURE;
+	}
+
+	if ( (total[0] || total[1])
+			&& ((tun->shaping = shaping_share(total)) == NULL) ) {
+		fprintf(stderr, "No shared memory for rate limits.\n");
+		return EXIT_FAILURE;
+	}
+
+	if ( (tun->verify_mode == NULL) || (strcmp(tun->verify_mode, "none") == 0) )
+		verify = VERIFY_NONE;
+	else if ( strcmp(tun->verify_mode, "optional") == 0 )
+		verify = VERIFY_OPTIONAL;
+	else if ( strcmp(tun->verify_mode, "require") == 0 )
+		verify = VERIFY_REQUIRE;
+	else {
+		fprintf(stderr, "Unknown verification mode: %s\n", tun->verify_mode);
+		return EXIT_FAILURE;
+	}
+
+	/* Early data may be replayed, so it is never implied. */
+	if (tun->early_data) {
+		early = strtol(tun->early_data, &end, 10);
+		if ( (*end != '\0') || (early < 0) || (early > MAX_EARLY_DATA) ) {
+			fprintf(stderr, "Early data must be 0 to %d bytes.\n",
+					MAX_EARLY_DATA);
+			return EXIT_FAILURE;
+		}
+
+		if (early > 0)
+			tune_for_early_data(tun);
+	}
+
+	if ( tun->mux_links && choose_mux(tun) )
+		return EXIT_FAILURE;
+
+	/* Compression is agreed upon per connection. */
+	if (tun->compress_level) {
+		tun->compress = strtol(tun->compress_level, &end, 10);
+		if ( (*end != '\0') || (tun->compress < 0) || (tun->compress > 9) ) {
+			fprintf(stderr, "Compression level must be 0 to 9.\n");
+			return EXIT_FAILURE;
+		}
+
+		if ( tun->compress && (tun->mux_links || !uses_tls(&tun->svc)) ) {
+			fprintf(stderr, "Compression needs TLS without multiplexing.\n");
+			return EXIT_FAILURE;
+		}
+
+		if ( tun->compress && compress_init() ) {
+			fprintf(stderr, "Compression is not available.\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if ( tun->stripe_links && choose_stripes(tun, early) )
+		return EXIT_FAILURE;
+
+	if ( tun->reverse_links && choose_reverse(tun, early) )
+		return EXIT_FAILURE;
+
+	/* Initiate Libgnutls with certificate, key, etcetera. */
+	if ( uses_tls(&tun->svc) ) {
+		tun->tls = tls_context_load(tun->certificate, tun->keyfile,
+									tun->cafile, tun->ciphers,
+									uses_tls_server(&tun->svc), verify,
+									early, message, sizeof(message));
+		if (tun->tls == NULL) {
+			fprintf(stderr, "%s\nInit TLS failed!\n", message);
+			return EXIT_FAILURE;
+		}
+
+		fprintf(stderr, "%s", message);
+	}
+
+	/* Routes choose among upstreams by the ClientHello. */
+	if (tun->route_file) {
+		if ( (tun->svc.local_kind != TRANSPORT_TLS_SERVER) || tun->mux_links ) {
+			fprintf(stderr, "Routing needs a TLS server without multiplexing.\n");
+			return EXIT_FAILURE;
+		}
+
+		tun->routes = route_load(tun->route_file, tun, verify, early);
+		if (tun->routes == NULL)
+			return EXIT_FAILURE;
+
+		fprintf(stderr, "Routing by %d route%s of \"%s\".\n",
+				route_count(tun->routes),
+				(route_count(tun->routes) == 1) ? "" : "s", tun->route_file);
+	}
+
+	return EXIT_SUCCESS;
+} /* prepare_tunnel(struct tunnel *) */
+
+/**
+ * serve_tunnels  --  listen for every tunnel and become a daemon
+ *
+ * The tunnels must have been resolved by prepare_tunnel().
+ * Returns only at failure.
+ */
+
+int serve_tunnels(struct tunnel *tunnels, int count) {
+	int j, k, rc, cd = -1, adopted = 0;
+	struct listener listeners[MAX_TUNNELS];
+
+	if ( (count < 1) || (count > MAX_TUNNELS) ) {
+		fprintf(stderr, "A daemon serves 1 to %d tunnels.\n", MAX_TUNNELS);
+		goto failure;
+	}
+
+	/* Check feasibility of GID-UID changes. */
+	if ( (rc = test_usr_grp(user_name, group_name)) ) {
+		gunnel_error_message(stderr, rc);
+		goto failure;
+	}
+
+	if ( (handshake_workers < 0) || (handshake_workers > 64) ) {
+		fprintf(stderr, "Handshake pool must have 0 to 64 workers.\n");
+		goto failure;
+	}
+
+	if ( (flush_window < 0) || (flush_window > 1000000) ) {
+		fprintf(stderr, "Flush window must be 0 to 1000000 usec.\n");
+		goto failure;
+	}
+
+	if ( (buffer_size < 2048) || (buffer_size > 65536) ) {
+		fprintf(stderr, "Relay buffers must be 2048 to 65536 bytes.\n");
+		goto failure;
+	}
+
+	if ( (max_children < 1) || (max_children > 65536) ) {
+		fprintf(stderr, "Child limit must be 1 to 65536.\n");
+		goto failure;
+	}
+
+	if ( busy_poll && tuning_busy_poll(busy_poll) ) {
+		fprintf(stderr, "Busy polling takes 1 to 1000000 usec, "
+						"and an available processor.\n");
+		goto failure;
+	}
+
+	if ( strcmp(io_backend, "auto") && strcmp(io_backend, "select")
+			&& strcmp(io_backend, "uring") ) {
+		fprintf(stderr, "Unknown event backend: %s\n", io_backend);
+		goto failure;
+	}
+
+	if ( (strcmp(io_backend, "uring") == 0) && !uring_usable() ) {
+		fprintf(stderr, "The io_uring backend is not available.\n");
+		goto failure;
+	}
+
+	if ( handover_path && (handover_path[0] != '/') ) {
+		fprintf(stderr, "Control socket must be an absolute path.\n");
+		goto failure;
+	}
+
+	if ( statistics_path && (statistics_path[0] != '/') ) {
+		fprintf(stderr, "Statistics file must be an absolute path.\n");
+		goto failure;
+	}
+
+	for (j = 0; j < count; ++j) {
+		if ( dials_reverse(&tunnels[j]) && ((count > 1) || handover_path) ) {
+			fprintf(stderr, "Tunnel %s dials out, and must run alone, "
+							"without a control socket.\n", tunnels[j].name);
+			goto failure;
+		}
+
+		for (k = 0; k < j; ++k)
+			if ( strcmp(tunnels[k].local_port, tunnels[j].local_port) == 0 ) {
+				fprintf(stderr, "Tunnels %s and %s share the local port %s.\n",
+						tunnels[k].name, tunnels[j].name,
+						tunnels[j].local_port);
+				goto failure;
+			}
+
+		listeners[j].name = tunnels[j].local_port;
+		listeners[j].sd = -1;
+	}
+
+	/* Links are dialled as soon as privileges are resigned. */
+	if ( dials_reverse(&tunnels[0]) ) {
+		if ( (rc = underpriv_daemon_mode()) != GUNNEL_SUCCESS )
+			goto failure;
+
+		atexit(tls_context_release_all);
+		reverse_dial(&tunnels[0]);
+
+		return EXIT_SUCCESS;
+	}
+
+	/* A running predecessor passes on its listening sockets. */
+	if ( handover_path
+			&& ((adopted = handover_receive(handover_path,
+											listeners, count)) > 0) )
+		fprintf(stderr, "%d listening socket%s taken over from %s.\n",
+				adopted, (adopted == 1) ? "" : "s", handover_path);
+
+	/* A service manager may pass them as well. */
+	if ( (adopted = activation_receive(listeners, count)) > 0 )
+		fprintf(stderr, "%d listening socket%s passed by the service "
+						"manager.\n", adopted, (adopted == 1) ? "" : "s");
+
+	for (j = 0; j < count; ++j) {
+		if ( (listeners[j].sd < 0)
+				&& ((listeners[j].sd = get_listening_socket(tunnels[j].lhost,
+												tunnels[j].lport)) < 0) ) {
+			while (j > 0) {
+				close(listeners[--j].sd);
+				if (tunnels[j].reverse_sd >= 0)
+					close(tunnels[j].reverse_sd);
+			}
+			goto failure;
+		}
+
+		tuning_listener(listeners[j].sd, tunnels[j].svc.local_tuning);
+
+		/* Links of a reverse tunnel arrive at its remote port. */
+		tunnels[j].reverse_sd = -1;
+		if ( tunnels[j].reverse
+				&& ((tunnels[j].reverse_sd = get_listening_socket(
+									tunnels[j].rhost, tunnels[j].rport)) < 0) ) {
+			close(listeners[j].sd);
+			while (j > 0) {
+				close(listeners[--j].sd);
+				if (tunnels[j].reverse_sd >= 0)
+					close(tunnels[j].reverse_sd);
+			}
+			goto failure;
+		}
+
+		if (tunnels[j].tuning_profiles) {
+			if (count > 1)
+				fprintf(stderr, "Tunnel %s:\n", tunnels[j].name);
+			tuning_report("Local", listeners[j].sd,
+							tunnels[j].svc.local_tuning);
+			tuning_report("Remote", -1, tunnels[j].svc.remote_tuning);
+		}
+
+		free(tunnels[j].lhost);
+		free(tunnels[j].lport);
+		tunnels[j].lhost = tunnels[j].lport = NULL;
+	}
+
+	/* Be prepared to hand over in turn. */
+	if ( handover_path && ((cd = handover_offer(handover_path)) < 0) ) {
+		for (j = 0; j < count; ++j) {
+			close(listeners[j].sd);
+			if (tunnels[j].reverse_sd >= 0)
+				close(tunnels[j].reverse_sd);
+		}
+		goto failure;
+	}
+
+	/* Resign as much privilege as possible. */
+	if ( (rc = underpriv_daemon_mode()) != GUNNEL_SUCCESS )
+		goto failure;
+
+	atexit(tls_context_release_all);
+
+	/* Put the listeners to work. */
+	accept_loop(tunnels, listeners, count, cd);
+
+	return EXIT_SUCCESS;
+
+failure:
+	tls_context_release_all();
+	return EXIT_FAILURE;
+} /* serve_tunnels(struct tunnel *, int) */
+
+/* Relay a client whose upstream is known after its handshake. */
+static void serve_routed_client(const struct tunnel *tun, int td) {
+	int rd;
+	struct transport local, remote;
+	struct shaper shaper;
+
+	if ( transport_init(&local, td, tun->svc.local_kind, tun->tls,
+						message, sizeof(message)) ) {
+		shutdown(td, SHUT_RDWR);
+		close(td);
+		return;
+	}
+
+	transport_compress(&local, tun->compress);
+	route_prepare(tun, &local);
+
+	if ( (transport_handshake(&local) != GUNNEL_SUCCESS)
+			|| ((rd = route_connect(tun, &local)) < 0) ) {
+		transport_close(&local);
+		return;
+	}
+
+	if ( transport_init(&remote, rd, tun->svc.remote_kind, tun->tls,
+						message, sizeof(message)) ) {
+		transport_close(&local);
+		shutdown(rd, SHUT_RDWR);
+		close(rd);
+		return;
+	}
+
+	transport_compress(&remote, tun->compress);
+
+	if ( transport_handshake(&remote) == GUNNEL_SUCCESS ) {
+		shaper_init(&shaper, tun->rate, tun->shaping);
+		relay_traffic(&local, &remote, &shaper);
+		shaper_release(&shaper);
+	}
+
+	transport_close(&remote);
+	transport_close(&local);
+} /* serve_routed_client(const struct tunnel *, int) */
+
+/**
+ * serve_client  --  connect upstream and relay a single client
+ */
+
+static void serve_client(const struct tunnel *tun, int td) {
+	int rd;
+	struct transport local, remote;
+	struct shaper shaper;
+
+	if (tun->routes) {
+		serve_routed_client(tun, td);
+		return;
+	}
+
+	/* Multiplexed and striped streams each connect on their own. */
+	if ( tun->mux || tun->stripes ) {
+		if ( transport_init(&local, td, tun->svc.local_kind, tun->tls,
+							message, sizeof(message)) ) {
+			shutdown(td, SHUT_RDWR);
+			close(td);
+			return;
+		}
+
+		if ( transport_handshake(&local) == GUNNEL_SUCCESS ) {
+			if (tun->mux)
+				mux_serve(tun, &local);
+			else
+				stripe_serve(tun, &local);
+		}
+
+		transport_close(&local);
+		return;
+	}
+
+	if ( (rd = get_connected_socket(tun->rhost, tun->rport,
+									tun->svc.remote_tuning)) < 0 ) {
+		/* Failure when locating the remote host. */
+		shutdown(td, SHUT_RDWR);
+		close(td);
+		return;
+	}
+
+	if ( transport_init(&local, td, tun->svc.local_kind, tun->tls,
+						message, sizeof(message)) ) {
+		shutdown(rd, SHUT_RDWR);
+		close(rd);
+		shutdown(td, SHUT_RDWR);
+		close(td);
+		return;
+	}
+
+	transport_compress(&local, tun->compress);
+
+	if ( transport_init(&remote, rd, tun->svc.remote_kind, tun->tls,
+						message, sizeof(message)) ) {
+		transport_close(&local);
+		shutdown(rd, SHUT_RDWR);
+		close(rd);
+		return;
+	}
+
+	transport_compress(&remote, tun->compress);
+
+	/* Early data passes directly between the sides. */
+	local.peer = &remote;
+	remote.peer = &local;
+
+	if ( (transport_handshake(&local) == GUNNEL_SUCCESS)
+			&& (transport_handshake(&remote) == GUNNEL_SUCCESS) ) {
+		shaper_init(&shaper, tun->rate, tun->shaping);
+		relay_traffic(&local, &remote, &shaper);
+		shaper_release(&shaper);
+	}
+
+	transport_close(&remote);
+	transport_close(&local);
+} /* serve_client(const struct tunnel *, int) */
+
+/* Write the counters of the daemon, as requested by SIGUSR2. */
+static void write_statistics(void) {
+	FILE *file;
+
+	statistics_due = 0;
+
+	if (statistics_path == NULL)
+		return;
+
+	if ( (file = fopen(statistics_path, "w")) == NULL )
+		return;
+
+	verify_cache_report(file);
+	compress_report(file);
+	supervisor_report(file);
+	fclose(file);
+} /* write_statistics(void) */
+
+/* Events noticed by the accepting process. */
+#define EVENT_CLIENT	0x01
+#define EVENT_CONTROL	0x02
+#define EVENT_POOL		0x04
+#define EVENT_CHILD		0x08
+
+/*
+ * Wait for clients at any listener, or input at cd, qd and sd.
+ * A client is returned in *td, accepted at listener *index.
+ * Returns a mask of events, or -1 when interrupted.
+ */
+
+static int wait_for_events(int ring, const struct listener *lst, int count,
+							int cd, int qd, int sd, int *td, int *index) {
+	int j, maxfd, ready, events = 0;
+	static int next = 0;
+	socklen_t socklen;
+	fd_set fdset;
+	struct sockaddr_storage addr;
+
+	*td = -1;
+
+	if (ring) {
+		if ( (*td = uring_accept_wait(&ready)) >= 0 ) {
+			*index = ready;
+			return EVENT_CLIENT;
+		}
+
+		if (ready == 0)
+			return EVENT_CONTROL;
+		if (ready == 1)
+			return EVENT_POOL;
+		if (ready == 2)
+			return EVENT_CHILD;
+
+		return -1;
+	}
+
+	maxfd = (qd > cd) ? qd : cd;
+	maxfd = (sd > maxfd) ? sd : maxfd;
+
+	FD_ZERO(&fdset);
+	for (j = 0; j < count; ++j) {
+		FD_SET(lst[j].sd, &fdset);
+		maxfd = (lst[j].sd > maxfd) ? lst[j].sd : maxfd;
+	}
+	if (cd >= 0)
+		FD_SET(cd, &fdset);
+	if (qd >= 0)
+		FD_SET(qd, &fdset);
+	if (sd >= 0)
+		FD_SET(sd, &fdset);
+
+	if ( select(maxfd + 1, &fdset, NULL, NULL, NULL) < 0 )
+		return -1;
+
+	if ( (cd >= 0) && FD_ISSET(cd, &fdset) )
+		events |= EVENT_CONTROL;
+
+	if ( (qd >= 0) && FD_ISSET(qd, &fdset) )
+		events |= EVENT_POOL;
+
+	if ( (sd >= 0) && FD_ISSET(sd, &fdset) )
+		events |= EVENT_CHILD;
+
+	/* Take turns, lest a busy tunnel starve the others. */
+	for (j = 0; j < count; ++j) {
+		*index = (next + j) % count;
+
+		if (! FD_ISSET(lst[*index].sd, &fdset) )
+			continue;
+
+		socklen = sizeof(addr);
+		*td = accept(lst[*index].sd, (struct sockaddr *) &addr, &socklen);
+		if (*td >= 0) {
+			events |= EVENT_CLIENT;
+			next = *index + 1;
+			break;
+		}
+	}
+
+	return events;
+} /* wait_for_events(int, const struct listener *, int, int, int, int,
+	 int *, int *) */
+
+/* Close what a working offspring does not need. */
+static void leave_acceptor(const struct listener *lst, int count,
+							int cd, int qd) {
+	while (count > 0) {
+		close(lst[--count].sd);
+		if (tunnel_queues[count] >= 0)
+			close(tunnel_queues[count]);
+		if (link_listeners[count] >= 0)
+			close(link_listeners[count]);
+	}
+	if (cd >= 0)
+		close(cd);
+	if (qd >= 0)
+		close(qd);
+	uring_accept_forget();
+	supervisor_forget();
+} /* leave_acceptor(const struct listener *, int, int, int) */
+
+/* Pass a new client to the handshake pool, or fork its worker. */
+static void spawn_client(const struct tunnel *tunnels, int index, int td,
+						const struct listener *lst, int count,
+						int cd, int qd) {
+	pid_t pid;
+	const struct tunnel *tun = &tunnels[index];
+
+#if !defined(__linux__)
+	/* Some systems let the accepted socket inherit
+	 * the non-blocking mode of the listener. */
+	fcntl(td, F_SETFL, fcntl(td, F_GETFL) & ~O_NONBLOCK);
+#endif
+
+	tuning_socket(td, tun->svc.local_tuning);
+
+	/* A multiplexing client never speaks without its process. */
+	if ( tun->mux && !is_tls_transport(tun->svc.local_kind) ) {
+		if ( mux_dispatch(tunnel_queues[index], td) )
+			shutdown(td, SHUT_RDWR);
+		close(td);
+		return;
+	}
+
+	/* Nor does a reversed client, before a link is free. */
+	if (tun->reverse) {
+		if ( reverse_dispatch(tunnel_queues[index], td) )
+			shutdown(td, SHUT_RDWR);
+		close(td);
+		return;
+	}
+
+	if ( (qd >= 0) && uses_tls(&tun->svc)
+			&& (handshake_pool_dispatch(qd, index, td) == 0) ) {
+		close(td);
+		return;
+	}
+
+	/* Beyond the limit, the client is turned away. */
+	if (! supervisor_admit() ) {
+		shutdown(td, SHUT_RDWR);
+		close(td);
+		return;
+	}
+
+	/* The remote connection is built by the
+	 * working daemon, so that a slow remote
+	 * host never delays the next client. */
+
+	switch (pid = fork()) {
+		case -1:
+			/* Failure to fork. Close everything down. */
+			shutdown(td, SHUT_RDWR);
+			close(td);
+			leave_acceptor(lst, count, cd, qd);
+			exit(GUNNEL_FORKING);
+		case 0:
+			/* Working offspring. */
+			/* The listening sockets are no longer needed. */
+			leave_acceptor(lst, count, cd, qd);
+			/* Move somewhere relatively safe. */
+			serve_client(tun, td);
+			exit(GUNNEL_SUCCESS);
+		default:
+			/* This parent reports success. */
+			supervisor_watch(pid, td, tun);
+			close(td);
+			break;
+	}
+} /* spawn_client(const struct tunnel *, int, int,
+	 const struct listener *, int, int, int) */
+
+/*
+ * Fork the helpers of the tunnels: the handshake workers, whose
+ * queue is returned, and the processes carrying multiplexed or
+ * reversed tunnels, whose queues are kept in tunnel_queues[].
+ */
+static int start_helpers(const struct tunnel *tunnels,
+						const struct listener *lst, int count, int cd) {
+	int j, qd = -1, pool = 0;
+	int sds[3 * MAX_TUNNELS + 2];
+
+	/* Each helper closes what the acceptor holds. */
+	for (j = 0; j < count; ++j) {
+		sds[j] = lst[j].sd;
+		sds[count + j] = link_listeners[j];
+
+		pool |= uses_tls(&tunnels[j].svc) && !tunnels[j].reverse;
+	}
+	sds[2 * count] = cd;
+
+	/* Handshakes can be separated from relaying. */
+	if ( (handshake_workers > 0) && pool )
+		qd = handshake_pool_start(tunnels, count, handshake_workers,
+									sds, 2 * count + 1);
+
+	/* Multiplexing clients of a tunnel share one process,
+	 * as do the links of a reverse tunnel. */
+	sds[2 * count + 1] = qd;
+	for (j = 0; j < count; ++j) {
+		tunnel_queues[j] = -1;
+		if ( tunnels[j].mux && !is_tls_transport(tunnels[j].svc.local_kind) )
+			tunnel_queues[j] = mux_start(&tunnels[j], sds, 2 * count + 2 + j);
+		else if (tunnels[j].reverse) {
+			sds[count + j] = -1;	/* Its own listener. */
+			tunnel_queues[j] = reverse_start(&tunnels[j], link_listeners[j],
+											sds, 2 * count + 2 + j);
+			sds[count + j] = link_listeners[j];
+		}
+		sds[2 * count + 2 + j] = tunnel_queues[j];
+	}
+
+	return qd;
+} /* start_helpers(const struct tunnel *, const struct listener *,
+	 int, int) */
+
+/* Fork a relay worker for a session returned by the handshake pool.
+ * Returns -1 when no session was waiting. */
+static int relay_established(const struct tunnel *tunnels,
+							const struct listener *lst, int count,
+							int cd, int qd) {
+	int index, td, rd;
+	pid_t pid = -1;
+
+	if ( handshake_pool_collect(qd, &index, &td, &rd) )
+		return -1;
+
+	if ( (index < count) && supervisor_admit() && ((pid = fork()) < 0) )
+		supervisor_release();
+
+	switch (pid) {
+		case -1:
+			break;
+		case 0:
+			leave_acceptor(lst, count, cd, qd);
+			handshake_pool_relay(&tunnels[index], td, rd);
+			exit(GUNNEL_SUCCESS);
+		default:
+			supervisor_watch(pid, td, &tunnels[index]);
+			break;
+	}
+
+	close(td);
+	if (rd >= 0)
+		close(rd);
+
+	return 0;
+} /* relay_established(const struct tunnel *, const struct listener *,
+	 int, int, int) */
+
+/*
+ * Close the queues of all helpers, which leave once idle,
+ * to be reaped by the supervisor. Clients still queued for a
+ * handshake are served by the retiring workers, which relay
+ * them on their own, as the pool no longer takes sessions back.
+ * Those already returned are relayed from here.
+ */
+static void stop_helpers(const struct tunnel *tunnels,
+						const struct listener *lst, int count,
+						int cd, int qd) {
+	int j;
+
+	for (j = 0; j < count; ++j)
+		if (tunnel_queues[j] >= 0) {
+			close(tunnel_queues[j]);	/* Streams drain. */
+			tunnel_queues[j] = -1;
+		}
+
+	if (qd >= 0) {
+		shutdown(qd, SHUT_RD);	/* Sessions stay with the workers. */
+		while ( relay_established(tunnels, lst, count, cd, qd) == 0 )
+			;
+		close(qd);	/* Handshake workers leave. */
+	}
+} /* stop_helpers(const struct tunnel *, const struct listener *,
+	 int, int, int) */
+
+static int accept_loop(const struct tunnel *tunnels, struct listener *lst,
+						int count, int cd) {
+	int j, td = -1, qd, sd, events, ring = 0, index = 0;
+	int kd, kindex;		/* Drained while td may be pending. */
+	int sds[MAX_TUNNELS], watched[3];
+
+	for (j = 0; j < count; ++j) {
+		/* A successor may accept from the same socket. */
+		fcntl(lst[j].sd, F_SETFL, fcntl(lst[j].sd, F_GETFL) | O_NONBLOCK);
+		sds[j] = lst[j].sd;
+
+		link_listeners[j] = tunnels[j].reverse ? tunnels[j].reverse_sd : -1;
+	}
+
+	/* Children serving clients, and helpers, are watched from here on. */
+	sd = supervisor_init();
+
+	qd = start_helpers(tunnels, lst, count, cd);
+
+	/* Prefer io_uring for accepting, if available. */
+	watched[0] = cd;
+	watched[1] = qd;
+	watched[2] = sd;
+	ring = (uring_accept_start(sds, count, watched, 3) == 0);
+
+	do {
+		events = wait_for_events(ring, lst, count, cd, qd, sd, &td, &index);
+		ring = ring && uring_accept_active();
+
+		if (statistics_due)
+			write_statistics();
+
+		/* Helpers are restarted to pick up fresh credentials,
+		 * whereas running tunnels keep theirs. */
+		if (reload_due) {
+			reload_due = 0;
+			if ( tls_context_reload_all(message, sizeof(message)) > 0 ) {
+				/* A client at hand is served by the old helpers,
+				 * lest the new ones inherit its socket. */
+				if ( (events > 0) && (events & EVENT_CLIENT) ) {
+					spawn_client(tunnels, index, td, lst, count, cd, qd);
+					events &= ~EVENT_CLIENT;
+				}
+
+				while ( (kd = uring_accept_stop(&kindex)) >= 0 )
+					spawn_client(tunnels, kindex, kd, lst, count, cd, qd);
+
+				stop_helpers(tunnels, lst, count, cd, qd);
+				qd = start_helpers(tunnels, lst, count, cd);
+
+				watched[1] = qd;
+				ring = ring && (uring_accept_start(sds, count, watched, 3) == 0);
+			}
+			fprintf(stderr, "%s", message);
+		}
+
+		if (events < 0) {
+			if (! again)
+				break;
+			continue;
+		}
+
+		/* Ended children make room for new clients. */
+		if (events & EVENT_CHILD)
+			supervisor_reap();
+
+		if (events & EVENT_CLIENT)
+			spawn_client(tunnels, index, td, lst, count, cd, qd);
+
+		/* Established sessions get a relay worker. */
+		if (events & EVENT_POOL)
+			relay_established(tunnels, lst, count, cd, qd);
+
+		if ( (events & EVENT_CONTROL)
+				&& (handover_send(cd, lst, count) == GUNNEL_SUCCESS) ) {
+			/* The successor is now accepting. Stop as
+			 * would SIGUSR1, but leave the sockets open. */
+			again = 0;
+			break;
+		}
+	} while (again);
+
+	/* Clients already accepted by the kernel are served. */
+	while ( (td = uring_accept_stop(&index)) >= 0 )
+		spawn_client(tunnels, index, td, lst, count, cd, qd);
+
+	/* Accept no more, yet let existing tunnels drain. */
+	stop_helpers(tunnels, lst, count, cd, qd);
+	for (j = 0; j < count; ++j) {
+		close(lst[j].sd);
+		if (link_listeners[j] >= 0)
+			close(link_listeners[j]);
+	}
+	if (cd >= 0)
+		close(cd);
+
+	while ( (wait(NULL) > 0) || (errno == EINTR) )
+		;
+
+	exit(GUNNEL_SUCCESS);
+} /* accept_loop(const struct tunnel *, struct listener *, int, int) */
@@ -0,0 +1,322 @@
+/*
+ * shaping.c  --  token buckets limiting the relayed bandwidth
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * vim: set sw=4 ts=4
+ */
+
+/*
+ * Every connection has a bucket of its own in each direction.
+ * A tunnel may add an aggregate bucket per direction, kept in
+ * memory shared by all processes forked after its creation.
+ * Data is read from a source only as far as the tokens reach,
+ * so the sender is slowed by TCP itself. A connection takes
+ * at most its equal share of the aggregate tokens at a time,
+ * whence no single connection starves the others. An empty
+ * bucket yields a delay for select(), never a busy loop.
+ *
+ * A relay ended by a signal leaves by way of exit(), rather than
+ * by returning, so the connection held by the process is released
+ * at exit as well. Otherwise the count of active connections would
+ * shrink the share of every later connection.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/types.h>
+
+#define _INCLUDE_EXTERNALS	1
+#include "gunnel.h"
+
+/* Smallest amount worth a read, unless the bucket is shallower. */
+#define SHAPING_QUANTUM		1460
+
+/* Depth of a bucket in time at its rate, in microseconds. */
+#define SHAPING_BURST		50000
+
+/* Aggregate limits of a tunnel, shared by its connections. */
+struct tunnel_shaping {
+	char lock;
+	int active[2];		/* Connections drawing from each bucket. */
+	struct bucket bucket[2];
+};
+
+/* The connection of this process in the aggregate buckets. */
+static struct shaper *held = NULL;
+
+/* Monotonic clock in microseconds. */
+static long long shaping_clock(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+} /* shaping_clock(void) */
+
+static void bucket_init(struct bucket *b, long long rate, long long now) {
+	b->rate = rate;
+	b->depth = rate * SHAPING_BURST / 1000000;
+	if (b->depth < 4 * SHAPING_QUANTUM)
+		b->depth = 4 * SHAPING_QUANTUM;
+	b->tokens = b->depth;
+	b->stamp = now;
+} /* bucket_init(struct bucket *, long long, long long) */
+
+/* Add the tokens earned since the last refill. */
+static void bucket_refill(struct bucket *b, long long now) {
+	long long earned;
+
+	earned = (now - b->stamp) * b->rate / 1000000;
+
+	/* Fractions are kept by leaving the stamp alone. */
+	if (earned <= 0)
+		return;
+
+	b->tokens += earned;
+	b->stamp = now;
+
+	if (b->tokens > b->depth)
+		b->tokens = b->depth;
+} /* bucket_refill(struct bucket *, long long) */
+
+/* Time until a bucket holds 'need' tokens. */
+static long long bucket_delay(const struct bucket *b, long long need) {
+	return (need - b->tokens) * 1000000 / b->rate + 1;
+} /* bucket_delay(const struct bucket *, long long) */
+
+/**
+ * shaping_parse  --  read rates given as "up[,down]"
+ *
+ * Rates are bytes per second, with an optional suffix k, M,
+ * or G. Naught means no limit. A single rate applies to both
+ * directions. Returns -1 for a malformed specification.
+ */
+
+int shaping_parse(const char *spec, long long rate[2]) {
+	int j;
+	char *end;
+	double value;
+
+	rate[0] = rate[1] = 0;
+
+	if (spec == NULL)
+		return 0;
+
+	for (j = 0; j < 2; ++j) {
+		value = strtod(spec, &end);
+		if ( (end == spec) || (value < 0) )
+			return -1;
+
+		switch (*end) {
+			case 'k':	value *= 1e3;
+						++end;
+						break;
+			case 'M':	value *= 1e6;
+						++end;
+						break;
+			case 'G':	value *= 1e9;
+						++end;
+						break;
+		}
+
+		rate[j] = (long long) value;
+
+		if (*end == '\0') {
+			if (j == 0)
+				rate[1] = rate[0];
+			return 0;
+		}
+
+		if ( (*end != ',') || (j == 1) )
+			return -1;
+
+		spec = end + 1;
+	}
+
+	return 0;
+} /* shaping_parse(const char *, long long [2]) */
+
+/**
+ * shaping_share  --  aggregate buckets for a tunnel
+ *
+ * Must be called before any connection is forked. Returns
+ * NULL when neither direction is limited, or at failure.
+ */
+
+struct tunnel_shaping *shaping_share(const long long rate[2]) {
+	int j;
+	long long now;
+	struct tunnel_shaping *ts;
+
+	if ( (rate[0] == 0) && (rate[1] == 0) )
+		return NULL;
+
+	if ( (ts = map_shared(sizeof(*ts))) == NULL )
+		return NULL;
+
+	now = shaping_clock();
+
+	for (j = 0; j < 2; ++j)
+		if (rate[j])
+			bucket_init(&ts->bucket[j], rate[j], now);
+
+	return ts;
+} /* shaping_share(const long long [2]) */
+
+/* Release a connection still held at exit. */
+static void shaper_exit(void) {
+	if (held)
+		shaper_release(held);
+} /* shaper_exit(void) */
+
+/**
+ * shaper_init  --  limits for a single connection
+ *
+ * The connection joins the aggregate buckets in ts, if any.
+ */
+
+void shaper_init(struct shaper *sh, const long long rate[2],
+				struct tunnel_shaping *ts) {
+	int j;
+	long long now = shaping_clock();
+	static int registered = 0;
+
+	memset(sh, '\0', sizeof(*sh));
+	sh->tunnel = ts;
+
+	if (ts) {
+		if (! registered )
+			registered = (atexit(shaper_exit) == 0);
+		held = sh;
+	}
+
+	for (j = 0; j < 2; ++j) {
+		if (rate[j])
+			bucket_init(&sh->own[j], rate[j], now);
+
+		if ( ts && ts->bucket[j].rate )
+			__atomic_add_fetch(&ts->active[j], 1, __ATOMIC_RELAXED);
+	}
+} /* shaper_init(struct shaper *, const long long [2],
+	 struct tunnel_shaping *) */
+
+/**
+ * shaper_release  --  leave the aggregate buckets
+ */
+
+void shaper_release(struct shaper *sh) {
+	int j;
+	struct tunnel_shaping *ts = sh->tunnel;
+
+	if (ts == NULL)
+		return;
+
+	/* Forgotten first, lest a signal release it twice. */
+	sh->tunnel = NULL;
+	if (held == sh)
+		held = NULL;
+
+	for (j = 0; j < 2; ++j)
+		if (ts->bucket[j].rate)
+			__atomic_sub_fetch(&ts->active[j], 1, __ATOMIC_RELAXED);
+} /* shaper_release(struct shaper *) */
+
+/**
+ * shaper_limited  --  does any bucket apply?
+ */
+
+int shaper_limited(const struct shaper *sh) {
+	if (sh == NULL)
+		return 0;
+
+	return sh->own[0].rate || sh->own[1].rate || sh->tunnel;
+} /* shaper_limited(const struct shaper *) */
+
+/**
+ * shaper_allow  --  bytes which may be read in a direction
+ *
+ * Returns at most len. When naught is returned, *wait is
+ * the delay in microseconds before asking again.
+ */
+
+size_t shaper_allow(struct shaper *sh, int dir, size_t len,
+					long long now, long long *wait) {
+	int active;
+	long long room = len, need, share;
+	struct bucket *b;
+
+	*wait = 0;
+
+	if (sh == NULL)
+		return len;
+
+	b = &sh->own[dir];
+	if (b->rate) {
+		bucket_refill(b, now);
+		need = (b->depth < SHAPING_QUANTUM) ? b->depth : SHAPING_QUANTUM;
+
+		if (b->tokens < need)
+			*wait = bucket_delay(b, need);
+		else if (b->tokens < room)
+			room = b->tokens;
+	}
+
+	if ( sh->tunnel && sh->tunnel->bucket[dir].rate ) {
+		spin_lock(&sh->tunnel->lock);
+
+		b = &sh->tunnel->bucket[dir];
+		bucket_refill(b, now);
+
+		active = sh->tunnel->active[dir];
+		if (active < 1)
+			active = 1;
+
+		/* Enough for every active connection to have a quantum. */
+		need = (long long) active * SHAPING_QUANTUM;
+		if (need > b->depth)
+			need = b->depth;
+
+		if (b->tokens < need) {
+			need = bucket_delay(b, need);
+			if (need > *wait)
+				*wait = need;
+		} else {
+			share = b->tokens / active;
+			if (share < room)
+				room = share;
+		}
+
+		spin_unlock(&sh->tunnel->lock);
+	}
+
+	return *wait ? 0 : room;
+} /* shaper_allow(struct shaper *, int, size_t, long long, long long *) */
+
+/**
+ * shaper_consume  --  account for bytes read in a direction
+ */
+
+void shaper_consume(struct shaper *sh, int dir, size_t len) {
+	if (sh == NULL)
+		return;
+
+	if (sh->own[dir].rate)
+		sh->own[dir].tokens -= len;
+
+	if ( sh->tunnel && sh->tunnel->bucket[dir].rate ) {
+		spin_lock(&sh->tunnel->lock);
+		sh->tunnel->bucket[dir].tokens -= len;
+		spin_unlock(&sh->tunnel->lock);
+	}
+} /* shaper_consume(struct shaper *, int, size_t) */
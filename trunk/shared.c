@@ -0,0 +1,73 @@
+/*
+ * shared.c  --  memory shared by every forked connection
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * vim: set sw=4 ts=4
+ */
+
+/*
+ * Counters, caches, and buckets common to all connections of a
+ * tunnel live in anonymous shared mappings, made before any
+ * connection is forked. The critical sections guarding them are
+ * a few instructions long, so a lock of a single byte, yielding
+ * the processor while taken, serves better than a semaphore.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sched.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#define _INCLUDE_EXTERNALS	1
+#include "gunnel.h"
+
+#ifndef MAP_ANONYMOUS
+#  define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+/**
+ * map_shared  --  zeroed memory shared with forked children
+ *
+ * Returns NULL at failure.
+ */
+
+void *map_shared(size_t size) {
+	void *area;
+
+	area = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (area == MAP_FAILED)
+		return NULL;
+
+	memset(area, '\0', size);
+
+	return area;
+} /* map_shared(size_t) */
+
+/**
+ * spin_lock  --  take the lock held in a shared byte
+ */
+
+void spin_lock(char *lock) {
+	while ( __atomic_test_and_set(lock, __ATOMIC_ACQUIRE) )
+		sched_yield();
+} /* spin_lock(char *) */
+
+/**
+ * spin_unlock  --  release the lock held in a shared byte
+ */
+
+void spin_unlock(char *lock) {
+	__atomic_clear(lock, __ATOMIC_RELEASE);
+} /* spin_unlock(char *) */
@@ -0,0 +1,911 @@
+/*
+ * stripe.c  --  one client stream spread over parallel TLS connections
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * vim: set sw=4 ts=4
+ */
+
+/*
+ * A single TCP connection is limited by its congestion window,
+ * and a loss stalls all that follows it. With "-P links[,window]",
+ * plain-to-tls instead carries every client over that many TLS
+ * connections, here called links, to a tls-to-plain having "-P"
+ * as well. The stream is cut into chunks numbered in sequence,
+ * each sent on the link with least queued, and the far end puts
+ * them back in order before delivery.
+ *
+ * Each link first sends a join message: the magic "GSTR", an
+ * identifier of sixteen random bytes, the index of the link,
+ * the number of links, two reserved bytes, and the window, in
+ * network byte order. Every link being accepted by a process of
+ * its own, the process of link naught binds an abstract socket
+ * named by the identifier, connects the remote side, and becomes
+ * the leader. Any other link is relayed by its process to that
+ * socket, unchanged, so the leader sees all links alike.
+ *
+ * The frames on a link resemble those of mux.c: type, flags,
+ * payload length, and sequence number, eight bytes in all. Data
+ * and the final STRIPE_CLOSE each take a sequence number, and
+ * STRIPE_CREDIT returns the sequence and the byte count delivered,
+ * both cumulative. A sender keeps within the window, in bytes, as
+ * well as within STRIPE_SLOTS chunks, beyond what was credited,
+ * which bounds the reorder buffer of the receiver. The window is
+ * chosen by the client, and is refused by a server allowing less.
+ *
+ * Nothing being sent twice, a stream fails along with any of its
+ * links, and STRIPE_RESET then aborts it at the far end as well.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <gnutls/crypto.h>
+
+#define _INCLUDE_EXTERNALS	1
+#include "gunnel.h"
+
+#define STRIPE_HEADER	8
+#define STRIPE_PAYLOAD	16384
+
+/* Chunks held out of order, a power of two. */
+#define STRIPE_SLOTS	1024
+
+/* The plain socket is not read while every link has this much queued. */
+#define STRIPE_LINK_QUEUE	(2 * (STRIPE_HEADER + STRIPE_PAYLOAD))
+
+#define STRIPE_JOIN		28
+#define STRIPE_ID		16
+#define STRIPE_MAGIC	"GSTR"
+
+/* Usec granted a follower to find its leader. */
+#define STRIPE_JOIN_WAIT	2000000
+#define STRIPE_JOIN_STEP	10000
+
+/* Frame types. */
+enum {
+	STRIPE_DATA = 1,
+	STRIPE_CLOSE,
+	STRIPE_CREDIT,	/* Eight bytes: sequence and byte count delivered. */
+	STRIPE_RESET
+};
+
+/* Message passing */
+static char message[MESSAGE_LENGTH] = "";
+
+/* Bytes awaiting a socket. */
+struct stripe_queue {
+	unsigned char *buf;
+	size_t start, end, size;
+};
+
+#define queue_length(q)	((q)->end - (q)->start)
+
+struct stripe_link {
+	struct transport tp;	/* Down while tp.fd is negative. */
+	size_t offered;			/* Held by GnuTLS, to be offered again. */
+	struct stripe_queue out;
+	size_t in_len;
+	unsigned char in[STRIPE_HEADER + STRIPE_PAYLOAD];
+};
+
+/* A chunk received, possibly out of order. */
+struct stripe_slot {
+	unsigned char *data;	/* Empty slot while NULL, unless closing. */
+	size_t len;
+	int close;
+};
+
+static struct stripe_link links[MAX_STRIPES];
+static int nlinks = 0;
+
+static struct stripe_slot slots[STRIPE_SLOTS];
+
+/* The whole stream, in both directions. */
+static struct {
+	int fd;					/* Plain socket. */
+	int listener;			/* Awaiting followers, unless negative. */
+	int awaited;			/* Followers yet to join. */
+	uint32_t window;
+	/* Sending. */
+	uint32_t next_seq, acked_seq;
+	uint32_t sent_bytes, acked_bytes;
+	int read_closed;		/* STRIPE_CLOSE is sent. */
+	/* Receiving. */
+	uint32_t deliver_seq, credited_seq;
+	uint32_t delivered_bytes, credited_bytes;
+	size_t held, written;
+	int write_closed;		/* STRIPE_CLOSE is delivered. */
+	int failed;
+} st;
+
+static void put32(unsigned char *p, uint32_t val) {
+	p[0] = val >> 24;
+	p[1] = val >> 16;
+	p[2] = val >> 8;
+	p[3] = val;
+} /* put32(unsigned char *, uint32_t) */
+
+static uint32_t get32(const unsigned char *p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+			| ((uint32_t) p[2] << 8) | p[3];
+} /* get32(const unsigned char *) */
+
+static void put_header(unsigned char *p, int type, uint32_t seq, size_t len) {
+	p[0] = type;
+	p[1] = 0;
+	p[2] = len >> 8;
+	p[3] = len;
+	put32(p + 4, seq);
+} /* put_header(unsigned char *, int, uint32_t, size_t) */
+
+/* Make room for len more bytes, returning where they go. */
+static unsigned char *queue_reserve(struct stripe_queue *q, size_t len) {
+	size_t size;
+	unsigned char *buf;
+
+	if (q->start == q->end)
+		q->start = q->end = 0;
+
+	if ( (q->end + len > q->size) && (q->start > 0) ) {
+		memmove(q->buf, q->buf + q->start, q->end - q->start);
+		q->end -= q->start;
+		q->start = 0;
+	}
+
+	if (q->end + len > q->size) {
+		size = q->size ? q->size : STRIPE_HEADER + STRIPE_PAYLOAD;
+		while (size < q->end + len)
+			size *= 2;
+
+		if ( (buf = realloc(q->buf, size)) == NULL )
+			return NULL;
+
+		q->buf = buf;
+		q->size = size;
+	}
+
+	return q->buf + q->end;
+} /* queue_reserve(struct stripe_queue *, size_t) */
+
+static void queue_free(struct stripe_queue *q) {
+	free(q->buf);
+	memset(q, '\0', sizeof(*q));
+} /* queue_free(struct stripe_queue *) */
+
+/* The live link with least queued, or NULL. */
+static struct stripe_link *choose_link(void) {
+	int j;
+	struct stripe_link *l = NULL;
+
+	for (j = 0; j < nlinks; ++j) {
+		if (links[j].tp.fd < 0)
+			continue;
+
+		if ( (l == NULL) || (queue_length(&links[j].out) < queue_length(&l->out)) )
+			l = &links[j];
+	}
+
+	return l;
+} /* choose_link(void) */
+
+/* Queue a frame on the least busy link. */
+static int stripe_frame(int type, uint32_t seq, const void *data, size_t len) {
+	unsigned char *p;
+	struct stripe_link *l;
+
+	if ( ((l = choose_link()) == NULL)
+			|| ((p = queue_reserve(&l->out, STRIPE_HEADER + len)) == NULL) )
+		return -1;
+
+	put_header(p, type, seq, len);
+	if (len)
+		memcpy(p + STRIPE_HEADER, data, len);
+	l->out.end += STRIPE_HEADER + len;
+
+	return 0;
+} /* stripe_frame(int, uint32_t, const void *, size_t) */
+
+/* May another chunk be sent? */
+static int may_send(void) {
+	return (st.next_seq - st.acked_seq < STRIPE_SLOTS - 1)
+			&& (st.sent_bytes - st.acked_bytes + STRIPE_PAYLOAD <= st.window);
+} /* may_send(void) */
+
+/* Is everything sent acknowledged, and everything received delivered? */
+static int stripe_done(void) {
+	int j;
+
+	if ( !st.read_closed || !st.write_closed || (st.acked_seq != st.next_seq) )
+		return 0;
+
+	for (j = 0; j < nlinks; ++j)
+		if ( (links[j].tp.fd >= 0) && queue_length(&links[j].out) )
+			return 0;
+
+	return 1;
+} /* stripe_done(void) */
+
+/* Return credit once enough has been delivered. */
+static void stripe_credit(int now) {
+	unsigned char credit[8];
+
+	if ( !now && (st.deliver_seq - st.credited_seq < STRIPE_SLOTS / 4)
+			&& (st.delivered_bytes - st.credited_bytes < st.window / 4) )
+		return;
+
+	if ( (st.deliver_seq == st.credited_seq)
+			&& (st.delivered_bytes == st.credited_bytes) )
+		return;
+
+	put32(credit, st.deliver_seq);
+	put32(credit + 4, st.delivered_bytes);
+
+	if ( stripe_frame(STRIPE_CREDIT, 0, credit, sizeof(credit)) ) {
+		st.failed = 1;
+		return;
+	}
+
+	st.credited_seq = st.deliver_seq;
+	st.credited_bytes = st.delivered_bytes;
+} /* stripe_credit(int) */
+
+/* Frame what the plain socket offers. */
+static void stripe_read(void) {
+	ssize_t n;
+	unsigned char *p;
+	struct stripe_link *l;
+
+	if ( ((l = choose_link()) == NULL)
+			|| ((p = queue_reserve(&l->out, STRIPE_HEADER + STRIPE_PAYLOAD))
+				== NULL) ) {
+		st.failed = 1;
+		return;
+	}
+
+	do
+		n = recv(st.fd, p + STRIPE_HEADER, STRIPE_PAYLOAD, 0);
+	while ( (n < 0) && (errno == EINTR) );
+
+	if ( (n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)) )
+		return;
+
+	if (n < 0) {
+		st.failed = 1;
+		return;
+	}
+
+	if (n == 0) {
+		put_header(p, STRIPE_CLOSE, st.next_seq++, 0);
+		l->out.end += STRIPE_HEADER;
+		st.read_closed = 1;
+		return;
+	}
+
+	put_header(p, STRIPE_DATA, st.next_seq++, n);
+	l->out.end += STRIPE_HEADER + n;
+	st.sent_bytes += n;
+} /* stripe_read(void) */
+
+/* Deliver received chunks to the plain socket, in order. */
+static void stripe_flush(void) {
+	ssize_t n;
+	struct stripe_slot *s;
+
+	while (1) {
+		s = &slots[st.deliver_seq % STRIPE_SLOTS];
+
+		if (s->close) {
+			shutdown(st.fd, SHUT_WR);
+			s->close = 0;
+			st.write_closed = 1;
+			++st.deliver_seq;
+			stripe_credit(1);
+			return;
+		}
+
+		if (s->data == NULL)
+			break;
+
+		n = send(st.fd, s->data + st.written, s->len - st.written,
+				MSG_NOSIGNAL);
+
+		if ( (n < 0) && (errno == EINTR) )
+			continue;
+
+		if ( (n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)) )
+			break;
+
+		if (n <= 0) {
+			st.failed = 1;
+			return;
+		}
+
+		st.written += n;
+		if (st.written < s->len)
+			continue;
+
+		free(s->data);
+		s->data = NULL;
+		st.held -= s->len;
+		st.delivered_bytes += s->len;
+		st.written = 0;
+		++st.deliver_seq;
+	}
+
+	stripe_credit(0);
+} /* stripe_flush(void) */
+
+/* Act on a single frame. Returns -1 at a violation of protocol. */
+static int handle_frame(const unsigned char *hdr, size_t len) {
+	uint32_t seq = get32(hdr + 4);
+	const unsigned char *data = hdr + STRIPE_HEADER;
+	struct stripe_slot *s;
+
+	switch (hdr[0]) {
+		case STRIPE_DATA:
+		case STRIPE_CLOSE:
+			s = &slots[seq % STRIPE_SLOTS];
+
+			if ( (seq - st.deliver_seq >= STRIPE_SLOTS) || s->data || s->close )
+				return -1;
+
+			if (hdr[0] == STRIPE_CLOSE) {
+				s->close = 1;
+				break;
+			}
+
+			if ( (len == 0) || (st.held + len > st.window)
+					|| ((s->data = malloc(len)) == NULL) )
+				return -1;
+
+			memcpy(s->data, data, len);
+			s->len = len;
+			st.held += len;
+			break;
+		case STRIPE_CREDIT:
+			if (len != 8)
+				return -1;
+			st.acked_seq = get32(data);
+			st.acked_bytes = get32(data + 4);
+			break;
+		case STRIPE_RESET:
+		default:
+			return -1;
+	}
+
+	return 0;
+} /* handle_frame(const unsigned char *, size_t) */
+
+/* Act on every complete frame received. */
+static int link_parse(struct stripe_link *l) {
+	size_t len, used = 0;
+	unsigned char *hdr;
+
+	while (l->in_len - used >= STRIPE_HEADER) {
+		hdr = l->in + used;
+		len = (hdr[2] << 8) | hdr[3];
+
+		if (len > STRIPE_PAYLOAD)
+			return -1;
+
+		if (l->in_len - used < STRIPE_HEADER + len)
+			break;
+
+		if ( handle_frame(hdr, len) )
+			return -1;
+
+		used += STRIPE_HEADER + len;
+	}
+
+	memmove(l->in, l->in + used, l->in_len - used);
+	l->in_len -= used;
+
+	return 0;
+} /* link_parse(struct stripe_link *) */
+
+/* Returns -1 at failure, and 1 when the peer has left the link. */
+static int link_read(struct stripe_link *l) {
+	ssize_t n;
+
+	errno = 0;
+	n = l->tp.ops->read(&l->tp, l->in + l->in_len,
+						sizeof(l->in) - l->in_len);
+
+	if ( (n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)) )
+		return 0;
+
+	if (n == 0)
+		return 1;
+
+	if (n < 0)
+		return -1;
+
+	l->in_len += n;
+
+	return link_parse(l);
+} /* link_read(struct stripe_link *) */
+
+/* Send queued frames, as far as the link accepts them. */
+static int link_flush(struct stripe_link *l) {
+	ssize_t n;
+	size_t len;
+
+	while ( queue_length(&l->out) ) {
+		len = queue_length(&l->out);
+		if (len > STRIPE_PAYLOAD)
+			len = STRIPE_PAYLOAD;
+		if (l->offered)
+			len = l->offered;
+
+		errno = 0;
+		n = transport_send(&l->tp, l->out.buf + l->out.start, len);
+
+		if ( (n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ) {
+			l->offered = len;
+			return 0;
+		}
+
+		if (n <= 0)
+			return -1;
+
+		l->offered = 0;
+		l->out.start += n;
+	}
+
+	return 0;
+} /* link_flush(struct stripe_link *) */
+
+/*
+ * Credit is small, and must not wait for the acknowledgement
+ * of earlier chunks, as Nagle's algorithm would have it.
+ */
+static void link_prompt(int fd) {
+	int on = 1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+} /* link_prompt(int) */
+
+static void link_down(struct stripe_link *l) {
+	fcntl(l->tp.fd, F_SETFL, fcntl(l->tp.fd, F_GETFL) & ~O_NONBLOCK);
+	transport_close(&l->tp);
+
+	queue_free(&l->out);
+	l->in_len = 0;
+	l->offered = 0;
+} /* link_down(struct stripe_link *) */
+
+/*
+ * A link closed by the peer, which does so only once complete,
+ * since a failure is announced by STRIPE_RESET. Yet the stream
+ * is lost with the last link, unless it too is complete.
+ */
+static void link_lost(struct stripe_link *l) {
+	int j, live = 0;
+
+	link_down(l);
+
+	for (j = 0; j < nlinks; ++j)
+		live += (links[j].tp.fd >= 0);
+
+	if ( (live == 0) && !stripe_done() )
+		st.failed = 1;
+} /* link_lost(struct stripe_link *) */
+
+/* Take a descriptor as a further link. */
+static int link_add(int fd, int kind) {
+	struct stripe_link *l;
+
+	if ( (nlinks == MAX_STRIPES) || (fd >= FD_SETSIZE) )
+		return -1;
+
+	l = &links[nlinks];
+	memset(l, '\0', sizeof(*l));
+
+	if ( transport_init(&l->tp, fd, kind, NULL, message, sizeof(message)) ) {
+		l->tp.fd = -1;
+		return -1;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	++nlinks;
+
+	return 0;
+} /* link_add(int, int) */
+
+/* Receive a follower of the leader. */
+static void take_follower(void) {
+	int fd;
+
+	if ( (fd = accept(st.listener, NULL, NULL)) < 0 )
+		return;
+
+	if ( link_add(fd, TRANSPORT_PLAIN) )
+		close(fd);
+
+	if (--st.awaited <= 0) {
+		close(st.listener);
+		st.listener = -1;
+	}
+} /* take_follower(void) */
+
+#define watch(fd, set) \
+	do { FD_SET((fd), (set)); maxfd = ((fd) > maxfd) ? (fd) : maxfd; } while (0)
+
+/* Relay the stream, until it is complete or has failed. */
+static void stripe_loop(void) {
+	int j, rc, maxfd;
+	fd_set rset, wset;
+	struct timeval tv, *timeout;
+	struct stripe_link *l;
+
+	while ( !st.failed && !stripe_done() ) {
+		FD_ZERO(&rset);
+		FD_ZERO(&wset);
+		maxfd = -1;
+		timeout = NULL;
+
+		if (st.listener >= 0)
+			watch(st.listener, &rset);
+
+		if ( !st.read_closed && may_send() && (l = choose_link())
+				&& (queue_length(&l->out) < STRIPE_LINK_QUEUE) )
+			watch(st.fd, &rset);
+
+		if ( slots[st.deliver_seq % STRIPE_SLOTS].data )
+			watch(st.fd, &wset);
+
+		for (j = 0; j < nlinks; ++j) {
+			l = &links[j];
+			if (l->tp.fd < 0)
+				continue;
+
+			watch(l->tp.fd, &rset);
+			if ( queue_length(&l->out) )
+				watch(l->tp.fd, &wset);
+
+			/* Decrypted data is not seen by select(). */
+			if ( l->tp.ops->pending(&l->tp) ) {
+				tv.tv_sec = tv.tv_usec = 0;
+				timeout = &tv;
+			}
+		}
+
+		if ( select(maxfd + 1, &rset, &wset, NULL, timeout) < 0 ) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if ( (st.listener >= 0) && FD_ISSET(st.listener, &rset) )
+			take_follower();
+
+		for (j = 0; j < nlinks; ++j) {
+			l = &links[j];
+			if (l->tp.fd < 0)
+				continue;
+
+			if ( !FD_ISSET(l->tp.fd, &rset) && !l->tp.ops->pending(&l->tp) )
+				continue;
+
+			if ( (rc = link_read(l)) < 0 )
+				st.failed = 1;
+			else if (rc > 0)
+				link_lost(l);
+		}
+
+		if ( FD_ISSET(st.fd, &wset) || slots[st.deliver_seq % STRIPE_SLOTS].close )
+			stripe_flush();
+
+		if ( !st.failed && FD_ISSET(st.fd, &rset) )
+			stripe_read();
+
+		/* Chunks and credit leave in common records. */
+		for (j = 0; j < nlinks; ++j) {
+			l = &links[j];
+			if ( (l->tp.fd >= 0) && queue_length(&l->out) && link_flush(l) )
+				st.failed = 1;
+		}
+	}
+} /* stripe_loop(void) */
+
+static void stripe_init(int fd, uint32_t window) {
+	int j;
+
+	memset(&st, '\0', sizeof(st));
+	st.fd = fd;
+	st.listener = -1;
+	st.window = window;
+
+	nlinks = 0;
+	for (j = 0; j < MAX_STRIPES; ++j) {
+		memset(&links[j], '\0', sizeof(links[j]));
+		links[j].tp.fd = -1;
+	}
+
+	memset(slots, '\0', sizeof(slots));
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+} /* stripe_init(int, uint32_t) */
+
+/* Release the stream, aborting it at failure. */
+static void stripe_release(void) {
+	int j;
+	unsigned char hdr[STRIPE_HEADER];
+
+	for (j = 0; j < nlinks; ++j) {
+		if (links[j].tp.fd < 0)
+			continue;
+
+		if (st.failed) {
+			put_header(hdr, STRIPE_RESET, 0, 0);
+			queue_free(&links[j].out);
+			links[j].offered = 0;
+			transport_send(&links[j].tp, hdr, sizeof(hdr));
+		}
+
+		link_down(&links[j]);
+	}
+
+	for (j = 0; j < STRIPE_SLOTS; ++j)
+		free(slots[j].data);
+
+	if (st.listener >= 0)
+		close(st.listener);
+
+	if (st.failed)
+		shutdown(st.fd, SHUT_RDWR);
+	fcntl(st.fd, F_SETFL, fcntl(st.fd, F_GETFL) & ~O_NONBLOCK);
+} /* stripe_release(void) */
+
+/* Abstract socket named by the identifier of a stream. */
+static socklen_t stripe_address(struct sockaddr_un *sun,
+								const unsigned char *id) {
+	int j;
+	char *p;
+
+	memset(sun, '\0', sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+
+	p = sun->sun_path + 1;
+	p += sprintf(p, "gunnel-stripe-");
+	for (j = 0; j < STRIPE_ID; ++j)
+		p += sprintf(p, "%02x", id[j]);
+
+	return offsetof(struct sockaddr_un, sun_path) + (p - sun->sun_path);
+} /* stripe_address(struct sockaddr_un *, const unsigned char *) */
+
+/* Connect and negotiate a link, then announce the stream. */
+static int link_up(const struct tunnel *tun, const unsigned char *join) {
+	int fd;
+	struct stripe_link *l;
+
+	if ( (fd = get_connected_socket(tun->rhost, tun->rport,
+									tun->svc.remote_tuning)) < 0 )
+		return -1;
+
+	if ( (fd >= FD_SETSIZE) || (nlinks == MAX_STRIPES) ) {
+		close(fd);
+		return -1;
+	}
+
+	l = &links[nlinks];
+	memset(l, '\0', sizeof(*l));
+
+	if ( transport_init(&l->tp, fd, tun->svc.remote_kind, tun->tls,
+						message, sizeof(message)) ) {
+		close(fd);
+		l->tp.fd = -1;
+		return -1;
+	}
+
+	if ( (transport_handshake(&l->tp) != GUNNEL_SUCCESS)
+			|| (transport_write(&l->tp, join, STRIPE_JOIN) != STRIPE_JOIN) ) {
+		transport_close(&l->tp);
+		return -1;
+	}
+
+	link_prompt(fd);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	++nlinks;
+
+	return 0;
+} /* link_up(const struct tunnel *, const unsigned char *) */
+
+/* Spread a plain client over new links. */
+static void stripe_client(const struct tunnel *tun, struct transport *local) {
+	int j;
+	unsigned char join[STRIPE_JOIN];
+
+	stripe_init(local->fd, tun->stripe_window);
+
+	memset(join, '\0', sizeof(join));
+	memcpy(join, STRIPE_MAGIC, 4);
+	if ( gnutls_rnd(GNUTLS_RND_RANDOM, join + 4, STRIPE_ID) < 0 )
+		return;
+	join[21] = tun->stripes;
+	put32(join + 24, tun->stripe_window);
+
+	/* Link naught makes its process the leader. */
+	for (j = 0; j < tun->stripes; ++j) {
+		join[20] = j;
+		if ( link_up(tun, join) && (j == 0) )
+			return;
+	}
+
+	stripe_loop();
+	stripe_release();
+} /* stripe_client(const struct tunnel *, struct transport *) */
+
+/* Read the join message of a link, before anything else. */
+static int read_join(struct transport *tp, unsigned char *join) {
+	ssize_t n;
+	size_t len = 0;
+
+	/* Early data belongs to unstriped clients only. */
+	if (tp->early_len)
+		return -1;
+
+	while (len < STRIPE_JOIN) {
+		n = tp->ops->read(tp, join + len, STRIPE_JOIN - len);
+		if (n <= 0)
+			return -1;
+		len += n;
+	}
+
+	if ( memcmp(join, STRIPE_MAGIC, 4) || (join[21] == 0)
+			|| (join[20] >= join[21]) )
+		return -1;
+
+	return 0;
+} /* read_join(struct transport *, unsigned char *) */
+
+/* Abort the stream of a link not joined. */
+static void link_refuse(struct transport *tp) {
+	unsigned char hdr[STRIPE_HEADER];
+
+	put_header(hdr, STRIPE_RESET, 0, 0);
+	transport_write(tp, hdr, sizeof(hdr));
+} /* link_refuse(struct transport *) */
+
+/* Relay a link, other than the first, to its leader. */
+static void stripe_follow(struct transport *tp, const struct sockaddr_un *sun,
+						socklen_t len) {
+	int ud;
+	long waited = 0;
+	struct transport leader;
+
+	if ( (ud = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ) {
+		link_refuse(tp);
+		return;
+	}
+
+	/* The leader may yet be negotiating. */
+	while ( connect(ud, (const struct sockaddr *) sun, len) < 0 ) {
+		if ( ((errno != ECONNREFUSED) && (errno != ENOENT))
+				|| (waited >= STRIPE_JOIN_WAIT) ) {
+			close(ud);
+			link_refuse(tp);
+			return;
+		}
+
+		usleep(STRIPE_JOIN_STEP);
+		waited += STRIPE_JOIN_STEP;
+	}
+
+	transport_init(&leader, ud, TRANSPORT_UNIX, NULL, message, sizeof(message));
+	relay_traffic(tp, &leader, NULL);
+	transport_close(&leader);
+} /* stripe_follow(struct transport *, const struct sockaddr_un *,
+	 socklen_t) */
+
+/* Gather the links of a stream, and connect its remote side. */
+static void stripe_lead(const struct tunnel *tun, struct transport *tp,
+						int sd, int count, uint32_t window) {
+	int rd;
+
+	if ( (listen(sd, MAX_STRIPES) < 0)
+			|| ((rd = get_connected_socket(tun->rhost, tun->rport,
+										tun->svc.remote_tuning)) < 0) ) {
+		close(sd);
+		link_refuse(tp);
+		return;
+	}
+
+	stripe_init(rd, window);
+	st.listener = sd;
+	st.awaited = count - 1;
+
+	links[0].tp = *tp;
+	tp->fd = -1;
+	nlinks = 1;
+	fcntl(links[0].tp.fd, F_SETFL,
+			fcntl(links[0].tp.fd, F_GETFL) | O_NONBLOCK);
+
+	if (st.awaited == 0) {
+		close(sd);
+		st.listener = -1;
+	}
+
+	stripe_loop();
+	stripe_release();
+
+	close(rd);
+} /* stripe_lead(const struct tunnel *, struct transport *, int, int,
+	 uint32_t) */
+
+/* Join a link to its stream. */
+static void stripe_server(const struct tunnel *tun, struct transport *tp) {
+	int sd;
+	uint32_t window;
+	socklen_t len;
+	struct sockaddr_un sun;
+	unsigned char join[STRIPE_JOIN];
+
+	if ( read_join(tp, join) )
+		return;
+
+	link_prompt(tp->fd);
+
+	window = get32(join + 24);
+	if ( (join[21] > tun->stripes) || (window > tun->stripe_window)
+			|| (window < 2 * STRIPE_PAYLOAD) ) {
+		link_refuse(tp);
+		return;
+	}
+
+	len = stripe_address(&sun, join + 4);
+
+	if (join[20] > 0) {
+		stripe_follow(tp, &sun, len);
+		return;
+	}
+
+	if ( (sd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ) {
+		link_refuse(tp);
+		return;
+	}
+
+	/* A second link naught is refused. */
+	if ( bind(sd, (struct sockaddr *) &sun, len) == 0 ) {
+		stripe_lead(tun, tp, sd, join[21], window);
+		return;
+	}
+
+	close(sd);
+	link_refuse(tp);
+} /* stripe_server(const struct tunnel *, struct transport *) */
+
+/**
+ * stripe_serve  --  carry a client stream over striped links
+ *
+ * A plain transport is spread over new links, whereas a TLS
+ * transport is a link, to be joined with the others of its stream.
+ * The transport is closed by the caller.
+ */
+
+void stripe_serve(const struct tunnel *tun, struct transport *tp) {
+	if ( is_tls_transport(tp->kind) )
+		stripe_server(tun, tp);
+	else
+		stripe_client(tun, tp);
+} /* stripe_serve(const struct tunnel *, struct transport *) */
@@ -0,0 +1,517 @@
+/*
+ * supervisor.c  --  keep track of the children serving clients
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * vim: set sw=4 ts=4
+ */
+
+/*
+ * Every child forked by the accepting process for a client is
+ * watched through a process descriptor, collected in an epoll
+ * instance of its own. That descriptor is in turn watched by the
+ * accepting process, so an ending child is noticed in the same
+ * loop as new clients, and is reaped with its resource usage.
+ *
+ * The table of children has a slot for each admitted child, the
+ * free slots forming a list. Admission, as well as reaping, thus
+ * takes constant time, whatever the number of children. Relays
+ * forked by handshake workers are admitted as well, so the count
+ * of living children is kept in a census shared with them. The most
+ * recently ended children are remembered in a ring, to be reported
+ * along with the living ones.
+ *
+ * Helpers, such as the handshake workers, are forked here as well,
+ * and are watched in the same epoll instance until they end, be it
+ * in service or after having been retired at a reload.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <netdb.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+
+#if defined(__linux__)
+#  include <sys/epoll.h>
+#  include <sys/syscall.h>
+#  if defined(SYS_pidfd_open)
+#    define HAVE_PIDFD	1
+#  endif
+#endif
+
+#define _INCLUDE_EXTERNALS	1
+#include "gunnel.h"
+
+#if HAVE_PIDFD
+
+/* Ended children remembered for reporting. */
+#define ENDED_RING		32
+
+/* Process descriptors examined at each reaping. */
+#define REAP_BATCH		64
+
+/* Room for "[address]:port". */
+#define CLIENT_LENGTH	(NI_MAXHOST + NI_MAXSERV + 3)
+
+struct child {
+	pid_t pid;
+	int pidfd;
+	int next;				/* Next free slot, or -1. */
+	time_t started;
+	long long begun;		/* Monotonic usec. */
+	const struct tunnel *tun;
+	char client[CLIENT_LENGTH];
+};
+
+struct ended_child {
+	pid_t pid;
+	int status;
+	time_t started;
+	long long lasted;		/* Usec. */
+	const struct tunnel *tun;
+	struct rusage usage;
+	char client[CLIENT_LENGTH];
+};
+
+/* Shared with the handshake workers. */
+struct census {
+	char lock;
+	int living;
+	unsigned long refused;
+};
+
+static struct child *children = NULL;
+static struct census *census = NULL;
+static int free_slot = -1;
+static int epfd = -1;
+
+struct helper {
+	pid_t pid;				/* Zero for a free entry. */
+	int pidfd;
+};
+
+/* Marks the epoll data of a helper. */
+#define HELPER_MARK		0x80000000U
+
+static struct helper *helpers = NULL;
+static int helpers_size = 0;
+
+static struct ended_child ended[ENDED_RING];
+static unsigned long ended_count = 0;
+static struct timeval total_utime, total_stime;
+
+/* Monotonic clock in microseconds. */
+static long long now_usec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+} /* now_usec(void) */
+
+/* Describe the peer of td. */
+static void name_client(int td, char *name, size_t len) {
+	char host[NI_MAXHOST], serv[NI_MAXSERV];
+	socklen_t socklen;
+	struct sockaddr_storage addr;
+
+	addr.ss_family = AF_UNSPEC;
+	socklen = sizeof(addr);
+	if ( (getpeername(td, (struct sockaddr *) &addr, &socklen) < 0)
+			|| getnameinfo((struct sockaddr *) &addr, socklen,
+							host, sizeof(host), serv, sizeof(serv),
+							NI_NUMERICHOST | NI_NUMERICSERV) ) {
+		snprintf(name, len, "%s",
+				(addr.ss_family == AF_UNIX) ? "local" : "unknown");
+		return;
+	}
+
+	snprintf(name, len, (addr.ss_family == AF_INET6) ? "[%s]:%s" : "%s:%s",
+			host, serv);
+} /* name_client(int, char *, size_t) */
+
+/**
+ * supervisor_init  --  prepare a table for max_children children
+ *
+ * Children forked earlier are not watched, so helpers come later,
+ * through supervisor_fork(). Returns a descriptor
+ * which has input when a watched child has ended, or -1 if the
+ * system offers no process descriptors. The children are then
+ * reaped by signal_responder(), as before.
+ */
+
+int supervisor_init(void) {
+	int j, pidfd;
+
+	/* Is pidfd_open() implemented at all? */
+	if ( (pidfd = syscall(SYS_pidfd_open, getpid(), 0)) < 0 )
+		return -1;
+	close(pidfd);
+
+	if ( (census = map_shared(sizeof(*census))) == NULL )
+		return -1;
+
+	if ( (children = calloc(max_children, sizeof(*children))) == NULL ) {
+		munmap(census, sizeof(*census));
+		census = NULL;
+		return -1;
+	}
+
+	if ( (epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ) {
+		munmap(census, sizeof(*census));
+		census = NULL;
+		free(children);
+		children = NULL;
+		return -1;
+	}
+
+	for (j = 0; j < max_children; ++j)
+		children[j].next = j + 1;
+	children[max_children - 1].next = -1;
+	free_slot = 0;
+
+	/* Reaping belongs to the supervisor from now on. */
+	signal(SIGCHLD, SIG_DFL);
+
+	return epfd;
+} /* supervisor_init(void) */
+
+/**
+ * supervisor_admit  --  claim room for another child
+ *
+ * Also called by handshake workers. A refused client is counted,
+ * and should be closed by the caller. An admitted caller failing
+ * to fork calls supervisor_release().
+ */
+
+int supervisor_admit(void) {
+	int admitted;
+
+	if (census == NULL)
+		return 1;
+
+	spin_lock(&census->lock);
+	if ( (admitted = (census->living < max_children)) )
+		++census->living;
+	else
+		++census->refused;
+	spin_unlock(&census->lock);
+
+	return admitted;
+} /* supervisor_admit(void) */
+
+/**
+ * supervisor_release  --  give back the room of an ended child
+ */
+
+void supervisor_release(void) {
+	if (census == NULL)
+		return;
+
+	spin_lock(&census->lock);
+	if (census->living > 0)
+		--census->living;
+	spin_unlock(&census->lock);
+} /* supervisor_release(void) */
+
+/**
+ * supervisor_watch  --  watch the child pid, serving td of tun
+ *
+ * The caller must have been admitted. At failure, the child is
+ * left to the final reaping at exit, and its room is released.
+ */
+
+void supervisor_watch(pid_t pid, int td, const struct tunnel *tun) {
+	int slot;
+	struct child *ch;
+	struct epoll_event ev;
+
+	if (children == NULL)
+		return;
+
+	if ( (slot = free_slot) < 0 ) {
+		supervisor_release();
+		return;
+	}
+
+	ch = &children[slot];
+
+	if ( (ch->pidfd = syscall(SYS_pidfd_open, pid, 0)) < 0 ) {
+		supervisor_release();
+		return;
+	}
+
+	memset(&ev, '\0', sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = slot;
+
+	if ( epoll_ctl(epfd, EPOLL_CTL_ADD, ch->pidfd, &ev) < 0 ) {
+		close(ch->pidfd);
+		supervisor_release();
+		return;
+	}
+
+	free_slot = ch->next;
+
+	ch->pid = pid;
+	ch->started = time(NULL);
+	ch->begun = now_usec();
+	ch->tun = tun;
+	name_client(td, ch->client, sizeof(ch->client));
+} /* supervisor_watch(pid_t, int, const struct tunnel *) */
+
+/* Watch the helper pid, until it is reaped. */
+static void watch_helper(pid_t pid) {
+	int j;
+	struct helper *more;
+	struct epoll_event ev;
+
+	for (j = 0; j < helpers_size; ++j)
+		if (helpers[j].pid == 0)
+			break;
+
+	if (j == helpers_size) {
+		more = realloc(helpers, (helpers_size + 8) * sizeof(*helpers));
+		if (more == NULL)
+			return;		/* Left to the final reaping. */
+		helpers = more;
+		memset(&helpers[helpers_size], '\0', 8 * sizeof(*helpers));
+		helpers_size += 8;
+	}
+
+	if ( (helpers[j].pidfd = syscall(SYS_pidfd_open, pid, 0)) < 0 )
+		return;
+
+	memset(&ev, '\0', sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = HELPER_MARK | j;
+
+	if ( epoll_ctl(epfd, EPOLL_CTL_ADD, helpers[j].pidfd, &ev) < 0 ) {
+		close(helpers[j].pidfd);
+		return;
+	}
+
+	helpers[j].pid = pid;
+} /* watch_helper(pid_t) */
+
+/**
+ * supervisor_fork  --  fork a helper of the accepting process
+ *
+ * Returns as fork() does. The helper reaps its own children, and
+ * is itself reaped by supervisor_reap() whenever it ends.
+ */
+
+pid_t supervisor_fork(void) {
+	pid_t pid;
+
+	switch (pid = fork()) {
+		case -1:
+			break;
+		case 0:
+			supervisor_forget();
+			signal(SIGCHLD, signal_responder);
+			break;
+		default:
+			if (children != NULL)
+				watch_helper(pid);
+			break;
+	}
+
+	return pid;
+} /* supervisor_fork(void) */
+
+/**
+ * supervisor_reap  --  collect the children which have ended
+ *
+ * Ended helpers are reaped as well, but are not reported.
+ */
+
+void supervisor_reap(void) {
+	int j, n, status;
+	struct child *ch;
+	struct helper *hp;
+	struct ended_child *end;
+	struct rusage usage;
+	struct epoll_event ev[REAP_BATCH];
+
+	if (epfd < 0)
+		return;
+
+	while ( (n = epoll_wait(epfd, ev, REAP_BATCH, 0)) > 0 ) {
+		for (j = 0; j < n; ++j) {
+			if (ev[j].data.u32 & HELPER_MARK) {
+				hp = &helpers[ev[j].data.u32 & ~HELPER_MARK];
+				if ( waitpid(hp->pid, NULL, WNOHANG) == 0 )
+					continue;
+				close(hp->pidfd);
+				hp->pid = 0;
+				continue;
+			}
+
+			ch = &children[ev[j].data.u32];
+
+			memset(&usage, '\0', sizeof(usage));
+			status = 0;
+
+			if ( wait4(ch->pid, &status, WNOHANG, &usage) == 0 )
+				continue;	/* Not yet, strangely. */
+
+			end = &ended[ended_count++ % ENDED_RING];
+			end->pid = ch->pid;
+			end->status = status;
+			end->started = ch->started;
+			end->lasted = now_usec() - ch->begun;
+			end->tun = ch->tun;
+			end->usage = usage;
+			memcpy(end->client, ch->client, sizeof(end->client));
+
+			timeradd(&total_utime, &usage.ru_utime, &total_utime);
+			timeradd(&total_stime, &usage.ru_stime, &total_stime);
+
+			/* Closing removes it from the epoll instance. */
+			close(ch->pidfd);
+			ch->pidfd = -1;
+			ch->pid = 0;
+			ch->next = free_slot;
+			free_slot = ch - children;
+			supervisor_release();
+		}
+
+		if (n < REAP_BATCH)
+			break;
+	}
+} /* supervisor_reap(void) */
+
+/**
+ * supervisor_report  --  write the table of children
+ */
+
+void supervisor_report(FILE *file) {
+	int j;
+	unsigned long k;
+	long long now;
+	struct ended_child *end;
+
+	if (children == NULL)
+		return;
+
+	fprintf(file, "children_living %d\n"
+				"children_limit %d\n"
+				"children_refused %lu\n"
+				"children_ended %lu\n"
+				"children_user_time %ld.%06ld\n"
+				"children_system_time %ld.%06ld\n",
+			census->living, max_children, census->refused, ended_count,
+			(long) total_utime.tv_sec, (long) total_utime.tv_usec,
+			(long) total_stime.tv_sec, (long) total_stime.tv_usec);
+
+	/* pid tunnel client upstream started seconds */
+	now = now_usec();
+	for (j = 0; j < max_children; ++j) {
+		if (children[j].pid == 0)
+			continue;
+
+		fprintf(file, "child %ld %s %s %s %ld %.3f\n",
+				(long) children[j].pid, children[j].tun->name,
+				children[j].client, children[j].tun->remote_port,
+				(long) children[j].started,
+				(now - children[j].begun) / 1e6);
+	}
+
+	/* pid tunnel client upstream started seconds user system maxrss status */
+	k = (ended_count > ENDED_RING) ? ended_count - ENDED_RING : 0;
+	for ( ; k < ended_count; ++k) {
+		end = &ended[k % ENDED_RING];
+
+		fprintf(file, "ended %ld %s %s %s %ld %.3f %ld.%06ld %ld.%06ld %ld %d\n",
+				(long) end->pid, end->tun->name, end->client,
+				end->tun->remote_port, (long) end->started,
+				end->lasted / 1e6,
+				(long) end->usage.ru_utime.tv_sec,
+				(long) end->usage.ru_utime.tv_usec,
+				(long) end->usage.ru_stime.tv_sec,
+				(long) end->usage.ru_stime.tv_usec,
+				end->usage.ru_maxrss, end->status);
+	}
+} /* supervisor_report(FILE *) */
+
+/**
+ * supervisor_forget  --  release the table in a child
+ *
+ * The census is kept, for a handshake worker to use.
+ */
+
+void supervisor_forget(void) {
+	int j;
+
+	if (children == NULL)
+		return;
+
+	for (j = 0; j < max_children; ++j)
+		if (children[j].pid)
+			close(children[j].pidfd);
+
+	for (j = 0; j < helpers_size; ++j)
+		if (helpers[j].pid)
+			close(helpers[j].pidfd);
+	free(helpers);
+	helpers = NULL;
+	helpers_size = 0;
+
+	close(epfd);
+	epfd = -1;
+	free(children);
+	children = NULL;
+} /* supervisor_forget(void) */
+
+#else /* !HAVE_PIDFD */
+
+int supervisor_init(void) {
+	return -1;
+} /* supervisor_init(void) */
+
+int supervisor_admit(void) {
+	return 1;
+} /* supervisor_admit(void) */
+
+void supervisor_release(void) {
+} /* supervisor_release(void) */
+
+void supervisor_watch(pid_t pid, int td, const struct tunnel *tun) {
+} /* supervisor_watch(pid_t, int, const struct tunnel *) */
+
+pid_t supervisor_fork(void) {
+	pid_t pid;
+
+	if ( (pid = fork()) == 0 )
+		signal(SIGCHLD, signal_responder);
+
+	return pid;
+} /* supervisor_fork(void) */
+
+void supervisor_reap(void) {
+} /* supervisor_reap(void) */
+
+void supervisor_report(FILE *file) {
+} /* supervisor_report(FILE *) */
+
+void supervisor_forget(void) {
+} /* supervisor_forget(void) */
+
+#endif /* HAVE_PIDFD */
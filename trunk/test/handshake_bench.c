@@ -0,0 +1,267 @@
+/*
+ * test/handshake_bench.c  --  Server cost of TLS handshakes by key type.
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * Fresh RSA and ECDSA certificates are written to a temporary
+ * directory and loaded through tls_context_load(), once as RSA
+ * alone, and once as the list "rsa,ecdsa". A forked client then
+ * completes a series of handshakes with each context, while the
+ * server side measures its own processor time. The dual context
+ * must sign with ECDSA, although RSA was listed first, and must
+ * spend less processor time per handshake.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+
+#include "../gunnel.h"
+
+#define ROUNDS	100
+
+static char dir[] = "/tmp/gunnel-bench.XXXXXX";
+static char message[MESSAGE_LENGTH];
+
+/* Write a new key and a self-signed certificate. */
+static int make_credentials(const char *name, gnutls_pk_algorithm_t pk,
+							unsigned int bits) {
+	int rc = -1;
+	char path[256];
+	unsigned char buf[16384];
+	size_t len;
+	FILE *file;
+	gnutls_x509_privkey_t key;
+	gnutls_x509_crt_t crt;
+
+	gnutls_x509_privkey_init(&key);
+	gnutls_x509_crt_init(&crt);
+
+	if ( gnutls_x509_privkey_generate(key, pk, bits, 0) < 0 )
+		goto out;
+
+	gnutls_x509_crt_set_version(crt, 3);
+	gnutls_x509_crt_set_serial(crt, "\x01", 1);
+	gnutls_x509_crt_set_activation_time(crt, time(NULL) - 3600);
+	gnutls_x509_crt_set_expiration_time(crt, time(NULL) + 86400);
+	gnutls_x509_crt_set_dn_by_oid(crt, GNUTLS_OID_X520_COMMON_NAME, 0,
+									"localhost", strlen("localhost"));
+	gnutls_x509_crt_set_key(crt, key);
+	gnutls_x509_crt_set_key_usage(crt, GNUTLS_KEY_DIGITAL_SIGNATURE
+										| GNUTLS_KEY_KEY_ENCIPHERMENT);
+
+	if ( gnutls_x509_crt_sign2(crt, crt, key, GNUTLS_DIG_SHA256, 0) < 0 )
+		goto out;
+
+	snprintf(path, sizeof(path), "%s/%s.pem", dir, name);
+	len = sizeof(buf);
+	if ( (gnutls_x509_crt_export(crt, GNUTLS_X509_FMT_PEM, buf, &len) < 0)
+			|| ((file = fopen(path, "w")) == NULL) )
+		goto out;
+	fwrite(buf, 1, len, file);
+	fclose(file);
+
+	snprintf(path, sizeof(path), "%s/%s.key", dir, name);
+	len = sizeof(buf);
+	if ( (gnutls_x509_privkey_export(key, GNUTLS_X509_FMT_PEM, buf, &len) < 0)
+			|| ((file = fopen(path, "w")) == NULL) )
+		goto out;
+	fwrite(buf, 1, len, file);
+	fclose(file);
+
+	rc = 0;
+
+out:
+	gnutls_x509_crt_deinit(crt);
+	gnutls_x509_privkey_deinit(key);
+
+	return rc;
+} /* make_credentials(const char *, gnutls_pk_algorithm_t, unsigned int) */
+
+/* Connect and handshake, repeatedly, without verifying anything. */
+static void client(struct sockaddr_in *sin) {
+	int j, sd;
+	gnutls_session_t session;
+	gnutls_certificate_credentials_t cred;
+
+	gnutls_certificate_allocate_credentials(&cred);
+
+	for (j = 0; j < ROUNDS; ++j) {
+		if ( (sd = socket(AF_INET, SOCK_STREAM, 0)) < 0 )
+			exit(EXIT_FAILURE);
+
+		if ( connect(sd, (struct sockaddr *) sin, sizeof(*sin)) < 0 )
+			exit(EXIT_FAILURE);
+
+		gnutls_init(&session, GNUTLS_CLIENT);
+		gnutls_set_default_priority(session);
+		gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, cred);
+		gnutls_transport_set_int(session, sd);
+
+		if ( gnutls_handshake(session) == GNUTLS_E_SUCCESS )
+			gnutls_bye(session, GNUTLS_SHUT_WR);
+
+		gnutls_deinit(session);
+		close(sd);
+	}
+
+	gnutls_certificate_free_credentials(cred);
+} /* client(struct sockaddr_in *) */
+
+static double cpu_usec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+} /* cpu_usec(void) */
+
+/*
+ * Serve the handshakes of a client, returning processor time
+ * per handshake, and the signature algorithm last used.
+ */
+static double measure(const struct tls_context *ctx, const char **sign) {
+	int j, ls, td, done = 0;
+	double start, spent = 0.0;
+	socklen_t len;
+	struct sockaddr_in sin;
+	gnutls_session_t session;
+
+	*sign = "none";
+
+	if ( (ls = socket(AF_INET, SOCK_STREAM, 0)) < 0 )
+		return -1.0;
+
+	memset(&sin, '\0', sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	len = sizeof(sin);
+
+	if ( bind(ls, (struct sockaddr *) &sin, sizeof(sin)) || listen(ls, 8)
+			|| getsockname(ls, (struct sockaddr *) &sin, &len) )
+		return -1.0;
+
+	if (fork() == 0) {
+		close(ls);
+		client(&sin);
+		exit(EXIT_SUCCESS);
+	}
+
+	for (j = 0; j < ROUNDS; ++j) {
+		if ( (td = accept(ls, NULL, NULL)) < 0 )
+			break;
+
+		if ( init_tls_server_session(&session, ctx,
+									message, sizeof(message)) ) {
+			close(td);
+			break;
+		}
+
+		gnutls_transport_set_int(session, td);
+
+		start = cpu_usec();
+		if ( gnutls_handshake(session) == GNUTLS_E_SUCCESS ) {
+			spent += cpu_usec() - start;
+			*sign = gnutls_sign_get_name(gnutls_sign_algorithm_get(session));
+			++done;
+			gnutls_bye(session, GNUTLS_SHUT_WR);
+		}
+
+		gnutls_deinit(session);
+		close(td);
+	}
+
+	close(ls);
+	wait(NULL);
+
+	return (done == ROUNDS) ? spent / done : -1.0;
+} /* measure(const struct tls_context *, const char **) */
+
+int main(int argc, char *argv[]) {
+	double rsa, dual;
+	char certs[512], keys[512];
+	const char *rsa_sign, *dual_sign;
+	const struct tls_context *rsa_ctx, *dual_ctx;
+
+	if ( mkdtemp(dir) == NULL ) {
+		fprintf(stderr, "FAIL: No temporary directory.\n");
+		return EXIT_FAILURE;
+	}
+
+	gnutls_global_init();
+
+	if ( make_credentials("rsa", GNUTLS_PK_RSA, 2048)
+			|| make_credentials("ecdsa", GNUTLS_PK_ECDSA,
+				GNUTLS_CURVE_TO_BITS(GNUTLS_ECC_CURVE_SECP256R1)) ) {
+		fprintf(stderr, "FAIL: Could not generate credentials.\n");
+		return EXIT_FAILURE;
+	}
+
+	snprintf(certs, sizeof(certs), "%s/rsa.pem", dir);
+	snprintf(keys, sizeof(keys), "%s/rsa.key", dir);
+	rsa_ctx = tls_context_load(certs, keys, NULL, "NORMAL", 1, VERIFY_NONE, 0,
+								message, sizeof(message));
+
+	/* RSA is deliberately listed first. */
+	snprintf(certs, sizeof(certs), "%s/rsa.pem,%s/ecdsa.pem", dir, dir);
+	snprintf(keys, sizeof(keys), "%s/rsa.key,%s/ecdsa.key", dir, dir);
+	dual_ctx = tls_context_load(certs, keys, NULL, "NORMAL", 1, VERIFY_NONE, 0,
+								message, sizeof(message));
+
+	if ( (rsa_ctx == NULL) || (dual_ctx == NULL) ) {
+		fprintf(stderr, "FAIL: %s\n", message);
+		return EXIT_FAILURE;
+	}
+
+	fprintf(stderr, "Server handshakes, %d per context.\n", ROUNDS);
+
+	rsa = measure(rsa_ctx, &rsa_sign);
+	fprintf(stderr, "RSA alone:   %8.0f usec CPU per handshake, %s.\n",
+			rsa, rsa_sign);
+
+	dual = measure(dual_ctx, &dual_sign);
+	fprintf(stderr, "RSA + ECDSA: %8.0f usec CPU per handshake, %s.\n",
+			dual, dual_sign);
+
+	tls_context_release_all();
+
+	snprintf(certs, sizeof(certs), "rm -rf %s", dir);
+	system(certs);
+
+	if ( (rsa < 0) || (dual < 0) ) {
+		fprintf(stderr, "FAIL: Handshakes did not complete.\n");
+		return EXIT_FAILURE;
+	}
+
+	if ( strncmp(dual_sign, "ECDSA", 5) ) {
+		fprintf(stderr, "FAIL: The dual context did not prefer ECDSA.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (dual >= rsa) {
+		fprintf(stderr, "FAIL: No saving in processor time.\n");
+		return EXIT_FAILURE;
+	}
+
+	fprintf(stderr, "PASS: ECDSA handshakes cost %.0f%% less processor"
+					" time at the server.\n", 100.0 * (rsa - dual) / rsa);
+
+	return EXIT_SUCCESS;
+} /* main() */
@@ -0,0 +1,279 @@
+/*
+ * test/pingpong_bench.c  --  Relay latency of small messages.
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * An echo server is placed behind "gunnel plain-to-plain", run in
+ * the foreground, once by default and once busy polling with "-Q".
+ * A client sends small messages, one at a time, and times each
+ * round trip through the relay. The median and the 99th percentile
+ * of both modes are reported. Each mode must return every message
+ * intact, and busy polling must lower the 99th percentile. It pays
+ * off only with a processor to spare for the spinning relay, so a
+ * single processor merely earns a warning, and no verdict.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pwd.h>
+#include <grp.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define GUNNEL		"../gunnel"
+
+#define WARMUP		200
+#define ROUNDS		5000
+#define MESSAGE		64
+
+/* Spin budget of the busy polling relay, in usec. */
+#define SPIN		"200"
+
+/* Monotonic clock in microseconds. */
+static double now_usec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+} /* now_usec(void) */
+
+static void no_delay(int sd) {
+	int on = 1;
+
+	setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+} /* no_delay(int) */
+
+/* Listen at an unused loopback port, returned in *port. */
+static int listen_any(int *port) {
+	int sd, one = 1;
+	socklen_t len;
+	struct sockaddr_in sin;
+
+	if ( (sd = socket(AF_INET, SOCK_STREAM, 0)) < 0 )
+		return -1;
+
+	setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&sin, '\0', sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	len = sizeof(sin);
+
+	if ( bind(sd, (struct sockaddr *) &sin, sizeof(sin))
+			|| listen(sd, 8)
+			|| getsockname(sd, (struct sockaddr *) &sin, &len) ) {
+		close(sd);
+		return -1;
+	}
+
+	*port = ntohs(sin.sin_port);
+
+	return sd;
+} /* listen_any(int *) */
+
+/* Echo every connection, one at a time. */
+static void echo_server(int ls) {
+	int sd;
+	ssize_t n;
+	char buf[4096];
+
+	while ( (sd = accept(ls, NULL, NULL)) >= 0 ) {
+		no_delay(sd);
+		while ( (n = read(sd, buf, sizeof(buf))) > 0 )
+			if ( write(sd, buf, n) != n )
+				break;
+		close(sd);
+	}
+
+	exit(EXIT_SUCCESS);
+} /* echo_server(int) */
+
+/* Connect, retrying while the relay starts. */
+static int connect_relay(int port) {
+	int sd, tries;
+	struct sockaddr_in sin;
+
+	memset(&sin, '\0', sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(port);
+
+	for (tries = 0; tries < 200; ++tries) {
+		if ( (sd = socket(AF_INET, SOCK_STREAM, 0)) < 0 )
+			return -1;
+
+		if ( connect(sd, (struct sockaddr *) &sin, sizeof(sin)) == 0 ) {
+			no_delay(sd);
+			return sd;
+		}
+
+		close(sd);
+		usleep(10000);
+	}
+
+	return -1;
+} /* connect_relay(int) */
+
+static int compare(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+} /* compare(const void *, const void *) */
+
+/*
+ * Time ROUNDS round trips through a relay started with 'spin',
+ * or by default when it is NULL. Returns -1 at failure.
+ */
+static int measure(int echo_port, const char *spin,
+					double *median, double *p99) {
+	int j, sd, port, status;
+	size_t got;
+	ssize_t n;
+	pid_t pid;
+	char local[32], remote[32], msg[MESSAGE], buf[MESSAGE];
+	double start, rtt[ROUNDS];
+	struct passwd *pw;
+	struct group *gr;
+
+	/* Any free port will do, once released. */
+	if ( (sd = listen_any(&port)) < 0 )
+		return -1;
+	close(sd);
+
+	snprintf(local, sizeof(local), "127.0.0.1,%d", port);
+	snprintf(remote, sizeof(remote), "127.0.0.1,%d", echo_port);
+
+	/* The relay keeps our identity. */
+	pw = getpwuid(getuid());
+	gr = getgrgid(getgid());
+	if ( (pw == NULL) || (gr == NULL) )
+		return -1;
+
+	switch (pid = fork()) {
+		case -1:
+			return -1;
+		case 0:
+			if (spin)
+				execl(GUNNEL, "gunnel", "plain-to-plain", "-N", "-o",
+						"-l", local, "-r", remote, "-u", pw->pw_name,
+						"-g", gr->gr_name, "-Q", spin, (char *) NULL);
+			else
+				execl(GUNNEL, "gunnel", "plain-to-plain", "-N", "-o",
+						"-l", local, "-r", remote, "-u", pw->pw_name,
+						"-g", gr->gr_name, (char *) NULL);
+			_exit(EXIT_FAILURE);
+		default:
+			break;
+	}
+
+	if ( (sd = connect_relay(port)) < 0 ) {
+		kill(pid, SIGTERM);
+		waitpid(pid, &status, 0);
+		return -1;
+	}
+
+	for (j = 0; j < WARMUP + ROUNDS; ++j) {
+		memset(msg, 'a' + j % 26, sizeof(msg));
+		start = now_usec();
+
+		if ( write(sd, msg, sizeof(msg)) != sizeof(msg) )
+			break;
+
+		for (got = 0; got < sizeof(buf); got += n)
+			if ( (n = read(sd, buf + got, sizeof(buf) - got)) <= 0 )
+				break;
+
+		if ( (got < sizeof(buf)) || memcmp(msg, buf, sizeof(msg)) )
+			break;
+
+		if (j >= WARMUP)
+			rtt[j - WARMUP] = now_usec() - start;
+	}
+
+	close(sd);
+
+	/* A one shot relay leaves with its only client. */
+	waitpid(pid, &status, 0);
+
+	if (j < WARMUP + ROUNDS)
+		return -1;
+
+	qsort(rtt, ROUNDS, sizeof(rtt[0]), compare);
+	*median = rtt[ROUNDS / 2];
+	*p99 = rtt[ROUNDS * 99 / 100];
+
+	return 0;
+} /* measure(int, const char *, double *, double *) */
+
+int main(int argc, char *argv[]) {
+	int ls, echo_port, rc;
+	pid_t echo;
+	double median[2], p99[2];
+
+	printf("Round trips of %d byte messages through a relay.\n", MESSAGE);
+
+	if ( access(GUNNEL, X_OK) ) {
+		fprintf(stderr, "FAIL: No executable %s.\n", GUNNEL);
+		return EXIT_FAILURE;
+	}
+
+	if ( (ls = listen_any(&echo_port)) < 0 ) {
+		fprintf(stderr, "FAIL: No listening socket.\n");
+		return EXIT_FAILURE;
+	}
+
+	if ( (echo = fork()) == 0 )
+		echo_server(ls);
+	close(ls);
+
+	rc = measure(echo_port, NULL, &median[0], &p99[0])
+		|| measure(echo_port, SPIN, &median[1], &p99[1]);
+
+	kill(echo, SIGTERM);
+	waitpid(echo, NULL, 0);
+
+	if (rc) {
+		fprintf(stderr, "FAIL: Messages were not relayed intact.\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("Default:      median %.1f usec, p99 %.1f usec.\n",
+			median[0], p99[0]);
+	printf("Busy polling: median %.1f usec, p99 %.1f usec.\n",
+			median[1], p99[1]);
+
+	if (p99[1] < p99[0]) {
+		fprintf(stderr, "PASS: Ping-pong p99 of %.1f usec busy polling, "
+						"against %.1f usec by default.\n", p99[1], p99[0]);
+		return EXIT_SUCCESS;
+	}
+
+	if (sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+		fprintf(stderr, "WARNING: Busy polling did not lower the p99, "
+						"%.1f usec against %.1f usec,\n"
+						"WARNING: but a single processor leaves nothing "
+						"to spare for it.\n", p99[1], p99[0]);
+		return EXIT_SUCCESS;
+	}
+
+	fprintf(stderr, "FAIL: Busy polling did not lower the p99, "
+					"%.1f usec against %.1f usec.\n", p99[1], p99[0]);
+
+	return EXIT_FAILURE;
+} /* main(int, char *[]) */
@@ -19,6 +19,9 @@
 int again = 0;
 char *group_name = "nogroup";
 char *user_name = "nobody";
+int foreground = 0;
+int statistics_due = 0;
+int reload_due = 0;
 
 /* Precalculated test cases and their expected results. */
 struct {
@@ -0,0 +1,429 @@
+/*
+ * test/urgent_relay.c  --  Relaying of TCP urgent data, and its cost.
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * Two relay loops are compared over loopback TCP. The former
+ * speculatively calls recv(MSG_OOB) at every readable event,
+ * the latter waits for an exceptional condition and SIOCATMARK,
+ * as does relay_traffic(). Each loop moves the same stream with
+ * one urgent byte inserted halfway. The latter loop must spend
+ * fewer system calls per chunk.
+ *
+ * The same stream is then sent through "gunnel plain-to-plain",
+ * run in the foreground with the default event backend, whose
+ * relay must keep urgent data. There the urgent byte must reach
+ * the consumer at the mark where it was sent.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <pwd.h>
+#include <grp.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define GUNNEL		"../gunnel"
+
+#define CHUNKS		20000
+#define CHUNK		1024
+#define URGENT_AT	(CHUNKS / 2)	/* Chunks preceding the urgent byte. */
+#define URGENT_BYTE	'!'
+
+/* Findings of the consumer. */
+struct outcome {
+	long bytes;
+	long mark;		/* Ordinary bytes preceding the urgent byte. */
+	int urgent;
+};
+
+static long syscalls;
+
+static int send_all(int sd, const char *buf, size_t len) {
+	ssize_t n;
+
+	while (len > 0) {
+		if ( (n = send(sd, buf, len, 0)) <= 0 )
+			return -1;
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+} /* send_all(int, const char *, size_t) */
+
+/* A connected pair of loopback TCP sockets. */
+static int tcp_pair(int *a, int *b) {
+	int ls;
+	socklen_t len;
+	struct sockaddr_in sin;
+
+	if ( (ls = socket(AF_INET, SOCK_STREAM, 0)) < 0 )
+		return -1;
+
+	memset(&sin, '\0', sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	len = sizeof(sin);
+
+	if ( bind(ls, (struct sockaddr *) &sin, sizeof(sin))
+			|| listen(ls, 1)
+			|| getsockname(ls, (struct sockaddr *) &sin, &len)
+			|| ((*a = socket(AF_INET, SOCK_STREAM, 0)) < 0) ) {
+		close(ls);
+		return -1;
+	}
+
+	if ( connect(*a, (struct sockaddr *) &sin, sizeof(sin))
+			|| ((*b = accept(ls, NULL, NULL)) < 0) ) {
+		close(*a);
+		close(ls);
+		return -1;
+	}
+
+	close(ls);
+
+	return 0;
+} /* tcp_pair(int *, int *) */
+
+/* Listen at an unused loopback port, returned in *port. */
+static int listen_any(int *port) {
+	int sd, one = 1;
+	socklen_t len;
+	struct sockaddr_in sin;
+
+	if ( (sd = socket(AF_INET, SOCK_STREAM, 0)) < 0 )
+		return -1;
+
+	setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&sin, '\0', sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	len = sizeof(sin);
+
+	if ( bind(sd, (struct sockaddr *) &sin, sizeof(sin))
+			|| listen(sd, 8)
+			|| getsockname(sd, (struct sockaddr *) &sin, &len) ) {
+		close(sd);
+		return -1;
+	}
+
+	*port = ntohs(sin.sin_port);
+
+	return sd;
+} /* listen_any(int *) */
+
+/* Connect, retrying while the relay starts. */
+static int connect_relay(int port) {
+	int sd, tries;
+	struct sockaddr_in sin;
+
+	memset(&sin, '\0', sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(port);
+
+	for (tries = 0; tries < 200; ++tries) {
+		if ( (sd = socket(AF_INET, SOCK_STREAM, 0)) < 0 )
+			return -1;
+
+		if ( connect(sd, (struct sockaddr *) &sin, sizeof(sin)) == 0 )
+			return sd;
+
+		close(sd);
+		usleep(10000);
+	}
+
+	return -1;
+} /* connect_relay(int) */
+
+static void producer(int sd) {
+	int j;
+	char buf[CHUNK];
+
+	memset(buf, 'a', sizeof(buf));
+
+	for (j = 0; j < CHUNKS; ++j) {
+		if (j == URGENT_AT)
+			send(sd, "!", 1, MSG_OOB);
+		if ( send_all(sd, buf, sizeof(buf)) )
+			break;
+	}
+
+	close(sd);
+} /* producer(int) */
+
+static void consumer(int sd, int report) {
+	int mark;
+	ssize_t n;
+	char buf[CHUNK];
+	fd_set rset, eset;
+	struct outcome res = { 0, -1, -1 };
+
+	while (1) {
+		FD_ZERO(&rset);
+		FD_ZERO(&eset);
+		FD_SET(sd, &rset);
+		if (res.urgent < 0)
+			FD_SET(sd, &eset);
+
+		if ( select(sd + 1, &rset, NULL, &eset, NULL) < 0 )
+			break;
+
+		if ( FD_ISSET(sd, &eset)
+				&& (ioctl(sd, SIOCATMARK, &mark) == 0) && mark
+				&& (recv(sd, buf, 1, MSG_OOB) == 1) ) {
+			res.urgent = (unsigned char) buf[0];
+			res.mark = res.bytes;
+		}
+
+		if (! FD_ISSET(sd, &rset) )
+			continue;
+
+		if ( (n = recv(sd, buf, sizeof(buf), 0)) <= 0 )
+			break;
+
+		res.bytes += n;
+	}
+
+	write(report, &res, sizeof(res));
+	close(sd);
+} /* consumer(int, int) */
+
+/* Relay one stream, returning the number of chunks read. */
+static long relay(int in, int out, int speculative) {
+	int mark;
+	long chunks = 0;
+	ssize_t n;
+	char buf[CHUNK];
+	fd_set rset, eset;
+
+	while (1) {
+		FD_ZERO(&rset);
+		FD_ZERO(&eset);
+		FD_SET(in, &rset);
+		FD_SET(in, &eset);
+
+		++syscalls;
+		if ( select(in + 1, &rset, NULL, speculative ? NULL : &eset,
+					NULL) < 0 )
+			return -1;
+
+		if (speculative) {
+			++syscalls;
+			if ( (n = recv(in, buf, sizeof(buf), MSG_OOB)) > 0 ) {
+				++syscalls;
+				send(out, buf, n, MSG_OOB);
+			}
+		} else if ( FD_ISSET(in, &eset) ) {
+			++syscalls;
+			if ( (ioctl(in, SIOCATMARK, &mark) == 0) && mark ) {
+				++syscalls;
+				if ( recv(in, buf, 1, MSG_OOB) == 1 ) {
+					++syscalls;
+					send(out, buf, 1, MSG_OOB);
+				}
+			}
+		}
+
+		if (! FD_ISSET(in, &rset) )
+			continue;
+
+		++syscalls;
+		if ( (n = recv(in, buf, sizeof(buf), 0)) <= 0 )
+			break;
+
+		++chunks;
+		++syscalls;
+		if ( send_all(out, buf, n) )
+			return -1;
+	}
+
+	return chunks;
+} /* relay(int, int, int) */
+
+/* Run one relay loop, returning system calls per chunk. */
+static double measure(int speculative, struct outcome *res) {
+	int pv[2], a[2], b[2];
+	long chunks;
+	double elapsed;
+	struct timespec start, stop;
+
+	if ( pipe(pv) || tcp_pair(&a[0], &a[1]) || tcp_pair(&b[0], &b[1]) )
+		return -1.0;
+
+	if (fork() == 0) {
+		close(a[1]);
+		close(b[0]);
+		close(b[1]);
+		producer(a[0]);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (fork() == 0) {
+		close(a[0]);
+		close(a[1]);
+		close(b[0]);
+		consumer(b[1], pv[1]);
+		exit(EXIT_SUCCESS);
+	}
+
+	close(a[0]);
+	close(b[1]);
+	close(pv[1]);
+
+	syscalls = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	chunks = relay(a[1], b[0], speculative);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	close(a[1]);
+	close(b[0]);
+
+	if ( read(pv[0], res, sizeof(*res)) != sizeof(*res) )
+		res->bytes = -1;
+	close(pv[0]);
+
+	while (wait(NULL) > 0)
+		;
+
+	if (chunks <= 0)
+		return -1.0;
+
+	elapsed = (stop.tv_sec - start.tv_sec) * 1e9
+				+ (stop.tv_nsec - start.tv_nsec);
+
+	fprintf(stderr, "%-12s %6ld chunks, %.2f syscalls and %.0f ns per chunk,"
+					" urgent byte %s.\n",
+			speculative ? "Speculative:" : "Exceptional:",
+			chunks, (double) syscalls / chunks, elapsed / chunks,
+			(res->urgent < 0) ? "lost"
+				: (res->mark == (long) URGENT_AT * CHUNK) ? "at the mark"
+					: "misplaced");
+
+	return (double) syscalls / chunks;
+} /* measure(int, struct outcome *) */
+
+/* Send the stream through a one shot gunnel. Returns -1 at failure. */
+static int through_gunnel(struct outcome *res) {
+	int ls, sd, port, rport, pv[2];
+	pid_t relay, sink;
+	char local[32], remote[32];
+	struct passwd *pw;
+	struct group *gr;
+
+	/* Any free port will do, once released. */
+	if ( (sd = listen_any(&port)) < 0 )
+		return -1;
+	close(sd);
+
+	if ( (ls = listen_any(&rport)) < 0 )
+		return -1;
+
+	snprintf(local, sizeof(local), "127.0.0.1,%d", port);
+	snprintf(remote, sizeof(remote), "127.0.0.1,%d", rport);
+
+	/* The relay keeps our identity. */
+	pw = getpwuid(getuid());
+	gr = getgrgid(getgid());
+	if ( (pw == NULL) || (gr == NULL) || pipe(pv) ) {
+		close(ls);
+		return -1;
+	}
+
+	if ( (relay = fork()) == 0 ) {
+		execl(GUNNEL, "gunnel", "plain-to-plain", "-N", "-o",
+				"-l", local, "-r", remote, "-u", pw->pw_name,
+				"-g", gr->gr_name, (char *) NULL);
+		_exit(EXIT_FAILURE);
+	}
+
+	if ( (sink = fork()) == 0 ) {
+		close(pv[0]);
+		if ( (sd = accept(ls, NULL, NULL)) >= 0 )
+			consumer(sd, pv[1]);
+		exit(EXIT_SUCCESS);
+	}
+
+	close(ls);
+	close(pv[1]);
+
+	if ( (sd = connect_relay(port)) >= 0 )
+		producer(sd);
+	else {
+		kill(relay, SIGTERM);
+		kill(sink, SIGTERM);
+	}
+
+	if ( read(pv[0], res, sizeof(*res)) != sizeof(*res) )
+		res->bytes = -1;
+	close(pv[0]);
+
+	while (wait(NULL) > 0)
+		;
+
+	if ( (sd < 0) || (res->bytes < 0) )
+		return -1;
+
+	fprintf(stderr, "Through gunnel: %ld bytes, urgent byte %s.\n",
+			res->bytes, (res->urgent < 0) ? "lost"
+				: (res->mark == (long) URGENT_AT * CHUNK) ? "at the mark"
+					: "misplaced");
+
+	return 0;
+} /* through_gunnel(struct outcome *) */
+
+int main(int argc, char *argv[]) {
+	double old, new;
+	struct outcome res;
+
+	if ( access(GUNNEL, X_OK) ) {
+		fprintf(stderr, "FAIL: No executable %s.\n", GUNNEL);
+		return EXIT_FAILURE;
+	}
+
+	fprintf(stderr, "Relaying urgent data, %d chunks of %d bytes.\n",
+			CHUNKS, CHUNK);
+
+	old = measure(1, &res);
+	new = measure(0, &res);
+
+	if ( (old < 0) || (new < 0) || through_gunnel(&res) ) {
+		fprintf(stderr, "FAIL: Could not set up the relay.\n");
+		return EXIT_FAILURE;
+	}
+
+	if ( (res.bytes != (long) CHUNKS * CHUNK) || (res.urgent != URGENT_BYTE)
+			|| (res.mark != (long) URGENT_AT * CHUNK) ) {
+		fprintf(stderr, "FAIL: Stream or urgent byte was not relayed intact.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (new >= old) {
+		fprintf(stderr, "FAIL: No reduction in system calls.\n");
+		return EXIT_FAILURE;
+	}
+
+	fprintf(stderr, "PASS: Urgent data kept its mark through gunnel, with"
+					" %.0f%% fewer system calls per chunk.\n",
+			100.0 * (old - new) / old);
+
+	return EXIT_SUCCESS;
+} /* main() */
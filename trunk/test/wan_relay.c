@@ -0,0 +1,668 @@
+/*
+ * test/wan_relay.c  --  Relay emulating a wide area network.
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * Loopback has neither delay nor loss, so a benchmark over it
+ * says little of handshake round trips, record sizing, or bulk
+ * throughput on a real link. This relay is placed between a
+ * client and a gunnel service:
+ *
+ *   wan_relay [-d msec] [-j msec] [-b kbit] [-l percent]
+ *             [-q bytes] [-s seed] [host,]port [host,]port
+ *
+ * It accepts at the former port, connects the latter, and
+ * delays each direction on its own, needing no privileges.
+ *
+ * The stream is cut into segments of SEGMENT bytes. A segment
+ * leaves once the emulated link is free, which happens at the
+ * rate of "-b", arrives after the delay of "-d", plus a random
+ * jitter of at most "-j". A segment lost, by the probability of
+ * "-l", arrives a retransmission timeout later. Segments are
+ * delivered in order, as by TCP, so that loss and reordering
+ * both hold back whatever follows. At most "-q" bytes wait in
+ * each direction, as in the queue of a bottleneck router,
+ * before the relay stops reading.
+ *
+ * Without arguments, the emulation itself is tested, placed
+ * before "gunnel plain-to-plain" in front of an echo server.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <pwd.h>
+#include <grp.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define GUNNEL		"../gunnel"
+
+/* A typical TCP segment on Ethernet. */
+#define SEGMENT		1448
+
+/* Least retransmission timeout, in usec, as by RFC 6298. */
+#define RTO_MIN		200000
+
+#define READ_CHUNK	65536
+
+/* Conditions of the emulated link. */
+struct wan {
+	long delay;				/* One way, in usec. */
+	long jitter;			/* Largest addition, in usec. */
+	long long rate;			/* Bytes per second, naught for unlimited. */
+	double loss;			/* Probability of loss, per segment. */
+	size_t queue;			/* Bytes waiting, at most. */
+	unsigned short seed[3];
+};
+
+struct segment {
+	struct segment *next;
+	long long due;			/* Monotonic usec of arrival. */
+	size_t len, off;
+	int eof;
+	unsigned char data[SEGMENT];
+};
+
+/* One direction of a relayed connection. */
+struct direction {
+	int from, to;
+	struct segment *head, *tail;
+	size_t queued;
+	long long free_at;		/* The link is busy until then. */
+	long long last_due;
+	int read_closed;
+	int blocked;			/* The receiver is full. */
+	int done;
+};
+
+static long long now_usec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+} /* now_usec(void) */
+
+/* Append a segment, timed by the conditions of the link. */
+static int enqueue(struct direction *d, struct wan *wan,
+					const unsigned char *buf, size_t len, int eof) {
+	long long now, depart, due;
+	struct segment *s;
+
+	if ( (s = malloc(sizeof(*s))) == NULL )
+		return -1;
+
+	s->next = NULL;
+	s->len = len;
+	s->off = 0;
+	s->eof = eof;
+	if (len)
+		memcpy(s->data, buf, len);
+
+	now = now_usec();
+	depart = (d->free_at > now) ? d->free_at : now;
+	if (wan->rate)
+		depart += len * 1000000LL / wan->rate;
+	d->free_at = depart;
+
+	due = depart + wan->delay;
+	if (wan->jitter)
+		due += erand48(wan->seed) * wan->jitter;
+	if ( len && (erand48(wan->seed) < wan->loss) )
+		due += (2 * wan->delay > RTO_MIN) ? 2 * wan->delay : RTO_MIN;
+
+	/* Nothing overtakes a segment still awaited. */
+	if (due < d->last_due)
+		due = d->last_due;
+	d->last_due = due;
+	s->due = due;
+
+	if (d->tail)
+		d->tail->next = s;
+	else
+		d->head = s;
+	d->tail = s;
+	d->queued += len;
+
+	return 0;
+} /* enqueue(struct direction *, struct wan *, const unsigned char *,
+	 size_t, int) */
+
+/* Read what the sender offers, cut into segments. */
+static int take_input(struct direction *d, struct wan *wan) {
+	ssize_t n;
+	size_t off, len;
+	unsigned char buf[READ_CHUNK];
+
+	n = recv(d->from, buf, sizeof(buf), 0);
+
+	if ( (n < 0) && ((errno == EAGAIN) || (errno == EINTR)) )
+		return 0;
+
+	if (n < 0)
+		return -1;
+
+	if (n == 0) {
+		d->read_closed = 1;
+		return enqueue(d, wan, NULL, 0, 1);
+	}
+
+	for (off = 0; off < (size_t) n; off += len) {
+		len = (n - off > SEGMENT) ? SEGMENT : n - off;
+		if ( enqueue(d, wan, buf + off, len, 0) )
+			return -1;
+	}
+
+	return 0;
+} /* take_input(struct direction *, struct wan *) */
+
+/* Deliver the segments which have arrived. */
+static int deliver(struct direction *d, long long now) {
+	ssize_t n;
+	struct segment *s;
+
+	d->blocked = 0;
+
+	while ( (s = d->head) && (s->due <= now) ) {
+		if (s->eof) {
+			shutdown(d->to, SHUT_WR);
+			d->done = 1;
+		} else {
+			n = send(d->to, s->data + s->off, s->len - s->off, MSG_NOSIGNAL);
+
+			if ( (n < 0) && ((errno == EAGAIN) || (errno == EINTR)) ) {
+				d->blocked = 1;
+				return 0;
+			}
+
+			if (n < 0)
+				return -1;
+
+			s->off += n;
+			if (s->off < s->len) {
+				d->blocked = 1;
+				return 0;
+			}
+
+			d->queued -= s->len;
+		}
+
+		d->head = s->next;
+		if (d->head == NULL)
+			d->tail = NULL;
+		free(s);
+	}
+
+	return 0;
+} /* deliver(struct direction *, long long) */
+
+static void release(struct direction *d) {
+	struct segment *s;
+
+	while ( (s = d->head) ) {
+		d->head = s->next;
+		free(s);
+	}
+} /* release(struct direction *) */
+
+/* Relay between a and b, until both directions have ended. */
+static void serve(int a, int b, struct wan *wan) {
+	int j, maxfd, failed = 0;
+	long long now, left;
+	fd_set rset, wset;
+	struct timeval tv, *timeout;
+	struct direction dir[2];
+
+	memset(dir, '\0', sizeof(dir));
+	dir[0].from = dir[1].to = a;
+	dir[0].to = dir[1].from = b;
+	maxfd = (a > b) ? a : b;
+
+	fcntl(a, F_SETFL, fcntl(a, F_GETFL) | O_NONBLOCK);
+	fcntl(b, F_SETFL, fcntl(b, F_GETFL) | O_NONBLOCK);
+
+	while ( !failed && !(dir[0].done && dir[1].done) ) {
+		FD_ZERO(&rset);
+		FD_ZERO(&wset);
+		timeout = NULL;
+		now = now_usec();
+
+		for (j = 0; j < 2; ++j) {
+			if ( !dir[j].read_closed && (dir[j].queued < wan->queue) )
+				FD_SET(dir[j].from, &rset);
+
+			if (dir[j].blocked)
+				FD_SET(dir[j].to, &wset);
+			else if (dir[j].head) {
+				left = dir[j].head->due - now;
+				if (left < 0)
+					left = 0;
+				if ( (timeout == NULL)
+						|| (left < tv.tv_sec * 1000000LL + tv.tv_usec) ) {
+					tv.tv_sec = left / 1000000;
+					tv.tv_usec = left % 1000000;
+					timeout = &tv;
+				}
+			}
+		}
+
+		if ( select(maxfd + 1, &rset, &wset, NULL, timeout) < 0 ) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		for (j = 0; j < 2; ++j)
+			if ( FD_ISSET(dir[j].from, &rset) && take_input(&dir[j], wan) )
+				failed = 1;
+
+		now = now_usec();
+		for (j = 0; j < 2; ++j)
+			if ( deliver(&dir[j], now) )
+				failed = 1;
+	}
+
+	if (failed) {
+		shutdown(a, SHUT_RDWR);
+		shutdown(b, SHUT_RDWR);
+	}
+
+	release(&dir[0]);
+	release(&dir[1]);
+	close(a);
+	close(b);
+} /* serve(int, int, struct wan *) */
+
+/* Resolve "[host,]port", the host defaulting to loopback. */
+static int resolve(const char *spec, struct addrinfo **ai) {
+	char host[256];
+	const char *port, *comma;
+	struct addrinfo hints;
+
+	if ( (comma = strrchr(spec, ',')) ) {
+		if ( (size_t) (comma - spec) >= sizeof(host) )
+			return -1;
+		memcpy(host, spec, comma - spec);
+		host[comma - spec] = '\0';
+		port = comma + 1;
+	} else {
+		strcpy(host, "127.0.0.1");
+		port = spec;
+	}
+
+	memset(&hints, '\0', sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	return getaddrinfo(host, port, &hints, ai) ? -1 : 0;
+} /* resolve(const char *, struct addrinfo **) */
+
+/* Accept clients for ever, each relayed by a process of its own. */
+static int run_relay(const char *listen_spec, const char *connect_spec,
+					struct wan *wan) {
+	int ls, td, rd, on = 1;
+	struct addrinfo *lai, *rai;
+
+	if ( resolve(listen_spec, &lai) || resolve(connect_spec, &rai) ) {
+		fprintf(stderr, "Unknown address.\n");
+		return EXIT_FAILURE;
+	}
+
+	if ( ((ls = socket(lai->ai_family, SOCK_STREAM, 0)) < 0)
+			|| setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))
+			|| bind(ls, lai->ai_addr, lai->ai_addrlen)
+			|| listen(ls, 64) ) {
+		perror("wan_relay");
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGCHLD, SIG_IGN);
+
+	while (1) {
+		if ( (td = accept(ls, NULL, NULL)) < 0 )
+			continue;
+
+		switch (fork()) {
+			case -1:
+				close(td);
+				break;
+			case 0:
+				close(ls);
+				if ( ((rd = socket(rai->ai_family, SOCK_STREAM, 0)) < 0)
+						|| connect(rd, rai->ai_addr, rai->ai_addrlen) ) {
+					close(td);
+					exit(EXIT_FAILURE);
+				}
+				/* Segments are timed here, not by Nagle's algorithm. */
+				setsockopt(td, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+				setsockopt(rd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+				serve(td, rd, wan);
+				exit(EXIT_SUCCESS);
+			default:
+				close(td);
+				break;
+		}
+	}
+} /* run_relay(const char *, const char *, struct wan *) */
+
+static void echo(int sd) {
+	ssize_t n;
+	char buf[READ_CHUNK];
+
+	while ( (n = recv(sd, buf, sizeof(buf), 0)) > 0 )
+		if ( send(sd, buf, n, 0) != n )
+			break;
+
+	close(sd);
+} /* echo(int) */
+
+/* Listen at an unused loopback port, returned in *port. */
+static int listen_any(int *port) {
+	int sd, one = 1;
+	socklen_t len;
+	struct sockaddr_in sin;
+
+	if ( (sd = socket(AF_INET, SOCK_STREAM, 0)) < 0 )
+		return -1;
+
+	setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&sin, '\0', sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	len = sizeof(sin);
+
+	if ( bind(sd, (struct sockaddr *) &sin, sizeof(sin))
+			|| listen(sd, 8)
+			|| getsockname(sd, (struct sockaddr *) &sin, &len) ) {
+		close(sd);
+		return -1;
+	}
+
+	*port = ntohs(sin.sin_port);
+
+	return sd;
+} /* listen_any(int *) */
+
+/* Connect, retrying while the relay starts. */
+static int connect_relay(int port) {
+	int sd, tries;
+	struct sockaddr_in sin;
+
+	memset(&sin, '\0', sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(port);
+
+	for (tries = 0; tries < 200; ++tries) {
+		if ( (sd = socket(AF_INET, SOCK_STREAM, 0)) < 0 )
+			return -1;
+
+		if ( connect(sd, (struct sockaddr *) &sin, sizeof(sin)) == 0 )
+			return sd;
+
+		close(sd);
+		usleep(10000);
+	}
+
+	return -1;
+} /* connect_relay(int) */
+
+/*
+ * Start a one shot "gunnel plain-to-plain" in front of an echo
+ * server. Returns a socket connected to it, or -1 at failure.
+ */
+static int start_gunnel(void) {
+	int ls, sd, port, eport;
+	char local[32], remote[32];
+	struct passwd *pw;
+	struct group *gr;
+
+	/* Any free port will do, once released. */
+	if ( (sd = listen_any(&port)) < 0 )
+		return -1;
+	close(sd);
+
+	/* The relay keeps our identity. */
+	pw = getpwuid(getuid());
+	gr = getgrgid(getgid());
+	if ( (pw == NULL) || (gr == NULL) || ((ls = listen_any(&eport)) < 0) )
+		return -1;
+
+	snprintf(local, sizeof(local), "127.0.0.1,%d", port);
+	snprintf(remote, sizeof(remote), "127.0.0.1,%d", eport);
+
+	if (fork() == 0) {
+		execl(GUNNEL, "gunnel", "plain-to-plain", "-N", "-o",
+				"-l", local, "-r", remote, "-u", pw->pw_name,
+				"-g", gr->gr_name, (char *) NULL);
+		_exit(EXIT_FAILURE);
+	}
+
+	if (fork() == 0) {
+		if ( (sd = accept(ls, NULL, NULL)) >= 0 )
+			echo(sd);
+		exit(EXIT_SUCCESS);
+	}
+
+	close(ls);
+
+	return connect_relay(port);
+} /* start_gunnel(void) */
+
+/* A connected pair of loopback TCP sockets. */
+static int tcp_pair(int *a, int *b) {
+	int ls;
+	socklen_t len;
+	struct sockaddr_in sin;
+
+	if ( (ls = socket(AF_INET, SOCK_STREAM, 0)) < 0 )
+		return -1;
+
+	memset(&sin, '\0', sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	len = sizeof(sin);
+
+	if ( bind(ls, (struct sockaddr *) &sin, sizeof(sin))
+			|| listen(ls, 1)
+			|| getsockname(ls, (struct sockaddr *) &sin, &len)
+			|| ((*a = socket(AF_INET, SOCK_STREAM, 0)) < 0) ) {
+		close(ls);
+		return -1;
+	}
+
+	if ( connect(*a, (struct sockaddr *) &sin, sizeof(sin))
+			|| ((*b = accept(ls, NULL, NULL)) < 0) ) {
+		close(*a);
+		close(ls);
+		return -1;
+	}
+
+	close(ls);
+
+	return 0;
+} /* tcp_pair(int *, int *) */
+
+/*
+ * Connect a client to an echo server through the emulation and
+ * gunnel. Returns the usec of a round trip of one byte, and in
+ * *bulk those of echoing len bytes, or -1 at failure.
+ */
+static long long measure(struct wan *wan, size_t len, long long *bulk) {
+	int a[2], rd;
+	char byte = '*';
+	char *buf;
+	size_t got = 0;
+	ssize_t n;
+	long long start, rtt;
+
+	if ( (rd = start_gunnel()) < 0 )
+		return -1;
+
+	if ( tcp_pair(&a[0], &a[1]) ) {
+		close(rd);
+		return -1;
+	}
+
+	if (fork() == 0) {
+		close(a[0]);
+		serve(a[1], rd, wan);
+		exit(EXIT_SUCCESS);
+	}
+
+	close(a[1]);
+	close(rd);
+
+	start = now_usec();
+	if ( (send(a[0], &byte, 1, 0) != 1) || (recv(a[0], &byte, 1, 0) != 1) ) {
+		close(a[0]);
+		return -1;
+	}
+	rtt = now_usec() - start;
+
+	if ( (buf = malloc(len)) == NULL ) {
+		close(a[0]);
+		return -1;
+	}
+	memset(buf, 'w', len);
+
+	/* The echo returns data while more is sent. */
+	start = now_usec();
+	if (fork() == 0) {
+		send(a[0], buf, len, 0);
+		exit(EXIT_SUCCESS);
+	}
+
+	while ( (got < len) && ((n = recv(a[0], buf, len - got, 0)) > 0) )
+		got += n;
+	*bulk = now_usec() - start;
+
+	free(buf);
+	close(a[0]);
+
+	while (wait(NULL) > 0)
+		;
+
+	return (got == len) ? rtt : -1;
+} /* measure(struct wan *, size_t, long long *) */
+
+static int self_test(void) {
+	long long rtt, bulk, lossy;
+	struct wan wan = { 20000, 0, 256 * 1024, 0.0, 64 * 1024, { 1, 2, 3 } };
+
+	/* Twice 20 msec for the round trip, and 256 kB/s for 256 kB. */
+	if ( (rtt = measure(&wan, 256 * 1024, &bulk)) < 0 ) {
+		fprintf(stderr, "FAIL: Could not relay through the emulation.\n");
+		return EXIT_FAILURE;
+	}
+
+	fprintf(stderr, "Round trip %.1f msec, 256 kB echoed in %.2f sec.\n",
+			rtt / 1e3, bulk / 1e6);
+
+	if ( (rtt < 40000) || (rtt > 100000) ) {
+		fprintf(stderr, "FAIL: Round trip was not delayed as requested.\n");
+		return EXIT_FAILURE;
+	}
+
+	if ( (bulk < 900000) || (bulk > 2500000) ) {
+		fprintf(stderr, "FAIL: Throughput was not capped as requested.\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Every segment lost once costs a retransmission timeout. */
+	wan.rate = 0;
+	wan.loss = 1.0;
+	if ( (lossy = measure(&wan, SEGMENT, &bulk)) < 0 ) {
+		fprintf(stderr, "FAIL: Could not relay through a lossy emulation.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (lossy < rtt + 2 * RTO_MIN) {
+		fprintf(stderr, "FAIL: Loss did not delay the round trip.\n");
+		return EXIT_FAILURE;
+	}
+
+	fprintf(stderr, "PASS: Emulated delay, rate, and loss before gunnel,"
+					" the latter taking %.0f msec per round trip.\n",
+			lossy / 1e3);
+
+	return EXIT_SUCCESS;
+} /* self_test(void) */
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-d msec] [-j msec] [-b kbit] [-l percent] "
+					"[-q bytes] [-s seed] [host,]port [host,]port\n", name);
+	exit(EXIT_FAILURE);
+} /* usage(const char *) */
+
+int main(int argc, char *argv[]) {
+	int opt;
+	long seed;
+	struct wan wan = { 0, 0, 0, 0.0, 256 * 1024, { 0, 0, 0 } };
+
+	if (argc == 1) {
+		if ( access(GUNNEL, X_OK) ) {
+			fprintf(stderr, "FAIL: No executable %s.\n", GUNNEL);
+			return EXIT_FAILURE;
+		}
+		return self_test();
+	}
+
+	seed = time(NULL);
+
+	while ( (opt = getopt(argc, argv, "d:j:b:l:q:s:")) != -1 ) {
+		switch (opt) {
+			case 'd':
+				wan.delay = atol(optarg) * 1000;
+				break;
+			case 'j':
+				wan.jitter = atol(optarg) * 1000;
+				break;
+			case 'b':
+				wan.rate = atoll(optarg) * 1000 / 8;
+				break;
+			case 'l':
+				wan.loss = atof(optarg) / 100.0;
+				break;
+			case 'q':
+				wan.queue = atol(optarg);
+				break;
+			case 's':
+				seed = atol(optarg);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if ( (argc - optind != 2) || (wan.delay < 0) || (wan.jitter < 0)
+			|| (wan.rate < 0) || (wan.loss < 0.0) || (wan.loss > 1.0)
+			|| (wan.queue < SEGMENT) )
+		usage(argv[0]);
+
+	wan.seed[0] = seed;
+	wan.seed[1] = seed >> 16;
+	wan.seed[2] = 0x330e;
+
+	return run_relay(argv[optind], argv[optind + 1], &wan);
+} /* main() */
@@ -0,0 +1,33 @@
+/*
+ * tls_to_tls.c  --  receive TLS, forward TLS
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * vim: set sw=4 ts=4
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define _INCLUDE_EXTERNALS	1
+#include "gunnel.h"
+
+/* Also served from a configuration file. */
+const struct service tls_to_tls_service = {
+	"tls-to-tls",
+	TRANSPORT_TLS_SERVER,
+	TRANSPORT_TLS_CLIENT
+};
+
+/*
+ * Main control for this subsystem.
+ */
+int tls_to_tls(int argc, char *argv[]) {
+	return run_service(&tls_to_tls_service, argc, argv);
+} /* tls_to_tls(int, char *[]) */
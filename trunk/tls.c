@@ -8,13 +8,46 @@
  * $Id$
  */
 
+/*
+ * Every tunnel refers to a TLS context, made up of credentials
+ * and a cipher priority. Tunnels naming the same files share
+ * the credentials, which are thus loaded only once, and all
+ * server credentials share a single set of DH parameters.
+ *
+ * A context may hold several certificates, such as RSA together
+ * with ECDSA or Ed25519. GnuTLS offers the first one loaded that
+ * the client is able to use, so the keys cheapest at signing are
+ * loaded first.
+ *
+ * The cipher priority "auto" is composed by cipherbench.c, which
+ * orders the AEAD ciphers by their speed on the present processor.
+ *
+ * Clients keep the latest session ticket, shared by way of resume.c,
+ * and resume with it. When early data is enabled, a client sends
+ * the first bytes with its ClientHello, and a server accepts them,
+ * guarded against replay by resume.c.
+ *
+ * The peer's certificate chain is verified against the CA-chain,
+ * as demanded by the verification mode of the context. Chains
+ * found valid are remembered by verify.c.
+ *
+ * At SIGHUP, every context loads its files anew, into fresh
+ * credentials which replace the old ones for new sessions only.
+ * Forked tunnels keep their own copy, while sessions within the
+ * process keep the old credentials, which are retired, not freed.
+ * Files failing to load, or a certificate out of its validity
+ * period, leave the working credentials in place.
+ */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
+#include <gnutls/crypto.h>
 
 #define _INCLUDE_EXTERNALS	1
 #include "gunnel.h"
@@ -23,164 +56,735 @@
 #   define DH_PARAMS_LEN	1024
 # endif
 
+/* Most certificates, of distinct key types, in one context. */
+#define MAX_CERTIFICATES	4
+
+/* Credentials and cipher priority of one or more tunnels. */
+struct tls_context {
+	char *certificate;
+	char *keyfile;
+	char *cafile;
+	char *ciphers;
+	int server;
+	int verify;			/* Verification mode of the peer. */
+	size_t early_data;	/* Largest amount of early data, or naught. */
+	struct ticket_slot *tickets;	/* Latest ticket for clients. */
+	gnutls_datum_t ticket_key;		/* Issuing tickets as a server. */
+	unsigned int ca_generation;
+	int owns_cred;
+	gnutls_certificate_credentials_t x509_cred;
+	gnutls_priority_t priority;
+	struct tls_context *next;
+};
+
 /* Globals for use by libgnutls. */
-gnutls_certificate_credentials_t x509_cred;
-gnutls_dh_params_t dh_params;
-gnutls_priority_t tls_priority_cache;
-
-void deinit_tls_server(void) {
-	gnutls_priority_deinit(tls_priority_cache);
-	gnutls_certificate_free_credentials(x509_cred);
-	gnutls_global_deinit();
-} /* deinit_tls_server(void) */
-
-void deinit_tls_client(void) {
-	gnutls_certificate_free_credentials(x509_cred);
-	gnutls_global_deinit();
-} /* deinit_tls_client(void) */
-
-int init_tls_server(char *message, int len) {
+static struct tls_context *contexts = NULL;
+static gnutls_dh_params_t dh_params;
+static int dh_generated = 0;
+static int tls_initialised = 0;
+static gnutls_anti_replay_t anti_replay;
+static int anti_replay_ready = 0;
+
+/* Every loaded CA-chain is a generation of its own. */
+static unsigned int ca_generations = 0;
+
+/* Credentials replaced by a reload, possibly still in use. */
+struct retired_cred {
+	gnutls_certificate_credentials_t x509_cred;
+	struct retired_cred *next;
+};
+
+static struct retired_cred *retired = NULL;
+
+/* Relative file names are found from the initial directory. */
+static char *load_dir = NULL;
+
+/* Are two, possibly missing, file names the same? */
+static int same_file(const char *a, const char *b) {
+	if ( (a == NULL) || (b == NULL) )
+		return a == b;
+
+	return strcmp(a, b) == 0;
+} /* same_file(const char *, const char *) */
+
+/* Duplicate a string, keeping a null pointer. */
+static char *copy_string(const char *str) {
+	return str ? strdup(str) : NULL;
+} /* copy_string(const char *) */
+
+static void free_context(struct tls_context *ctx) {
+	if (ctx->priority)
+		gnutls_priority_deinit(ctx->priority);
+	if (ctx->owns_cred)
+		gnutls_certificate_free_credentials(ctx->x509_cred);
+	if (ctx->ticket_key.data) {
+		gnutls_memset(ctx->ticket_key.data, 0, ctx->ticket_key.size);
+		gnutls_free(ctx->ticket_key.data);
+	}
+	free(ctx->certificate);
+	free(ctx->keyfile);
+	free(ctx->cafile);
+	free(ctx->ciphers);
+	free(ctx);
+} /* free_context(struct tls_context *) */
+
+/* Digest identifying a certificate chain. */
+static int chain_digest(const gnutls_datum_t *list, unsigned int num,
+						unsigned char *digest) {
+	unsigned int j;
+	gnutls_hash_hd_t hash;
+
+	if ( gnutls_hash_init(&hash, GNUTLS_DIG_SHA256) < 0 )
+		return -1;
+
+	for (j = 0; j < num; ++j)
+		gnutls_hash(hash, list[j].data, list[j].size);
+
+	gnutls_hash_deinit(hash, digest);
+
+	return 0;
+} /* chain_digest(const gnutls_datum_t *, unsigned int, unsigned char *) */
+
+/* Earliest expiration in a chain, or -1. */
+static time_t chain_expiration(const gnutls_datum_t *list, unsigned int num) {
+	unsigned int j;
+	time_t expires = -1, t;
+	gnutls_x509_crt_t crt;
+
+	for (j = 0; j < num; ++j) {
+		if ( gnutls_x509_crt_init(&crt) < 0 )
+			return -1;
+
+		if ( gnutls_x509_crt_import(crt, &list[j], GNUTLS_X509_FMT_DER) < 0 ) {
+			gnutls_x509_crt_deinit(crt);
+			return -1;
+		}
+
+		t = gnutls_x509_crt_get_expiration_time(crt);
+		gnutls_x509_crt_deinit(crt);
+
+		if ( (t != (time_t) -1) && ((expires < 0) || (t < expires)) )
+			expires = t;
+	}
+
+	return expires;
+} /* chain_expiration(const gnutls_datum_t *, unsigned int) */
+
+/*
+ * Called by the handshake once the peer's certificates are known.
+ * A non-zero return value terminates the handshake.
+ */
+static int verify_peer(gnutls_session_t session) {
+	int rc, digested;
+	unsigned int num, status;
+	time_t expires;
+	unsigned char digest[VERIFY_DIGEST_LENGTH];
+	const gnutls_datum_t *list;
+	const struct tls_context *ctx = gnutls_session_get_ptr(session);
+
+	if ( (ctx == NULL) || (ctx->verify == VERIFY_NONE) )
+		return 0;
+
+	list = gnutls_certificate_get_peers(session, &num);
+	if ( (list == NULL) || (num == 0) )
+		return (ctx->verify == VERIFY_REQUIRE) ? -1 : 0;
+
+	digested = (chain_digest(list, num, digest) == 0);
+
+	if ( digested && verify_cache_lookup(digest, ctx->ca_generation) )
+		return 0;
+
+	rc = gnutls_certificate_verify_peers2(session, &status);
+	if ( (rc < 0) || status )
+		return -1;
+
+	if ( digested && ((expires = chain_expiration(list, num)) > 0) )
+		verify_cache_store(digest, ctx->ca_generation, expires);
+
+	return 0;
+} /* verify_peer(gnutls_session_t) */
+
+/* Relative cost of signing with a key, the cheapest at naught. */
+static int signing_cost(gnutls_pk_algorithm_t pk) {
+	switch (pk) {
+		case GNUTLS_PK_EDDSA_ED25519:
+			return 0;
+		case GNUTLS_PK_ECDSA:
+			return 1;
+		case GNUTLS_PK_EDDSA_ED448:
+			return 2;
+		default:
+			return 3;
+	}
+} /* signing_cost(gnutls_pk_algorithm_t) */
+
+/* Key algorithm of the first certificate in a file. */
+static gnutls_pk_algorithm_t certificate_algorithm(const char *file) {
+	int pk = GNUTLS_PK_UNKNOWN;
+	gnutls_datum_t data;
+	gnutls_x509_crt_t crt;
+
+	if ( gnutls_load_file(file, &data) < 0 )
+		return GNUTLS_PK_UNKNOWN;
+
+	if ( gnutls_x509_crt_init(&crt) == 0 ) {
+		if ( gnutls_x509_crt_import(crt, &data, GNUTLS_X509_FMT_PEM) == 0 )
+			pk = gnutls_x509_crt_get_pk_algorithm(crt, NULL);
+		gnutls_x509_crt_deinit(crt);
+	}
+
+	gnutls_free(data.data);
+
+	return (pk < 0) ? GNUTLS_PK_UNKNOWN : pk;
+} /* certificate_algorithm(const char *) */
+
+/* Split a comma separated list in place, returning its length. */
+static int split_list(char *list, char **item, int max) {
+	int num = 0;
+	char *next;
+
+	while (list && (num < max)) {
+		if ( (next = strchr(list, ',')) )
+			*next++ = '\0';
+
+		while (*list == ' ')
+			++list;
+
+		if (*list)
+			item[num++] = list;
+
+		list = next;
+	}
+
+	return list ? -1 : num;
+} /* split_list(char *, char **, int) */
+
+/*
+ * Load every certificate with its key, in order of increasing
+ * cost of signing. The lists pair their entries by position.
+ */
+static int load_certificates(struct tls_context *ctx, char *message, int len) {
+	int j, k, nc, nk, rc, cost[MAX_CERTIFICATES], order[MAX_CERTIFICATES];
+	char *certs, *keys;
+	char *cert[MAX_CERTIFICATES], *key[MAX_CERTIFICATES];
+
+	certs = strdup(ctx->certificate);
+	keys = strdup(ctx->keyfile ? ctx->keyfile : ctx->certificate);
+
+	nc = split_list(certs, cert, MAX_CERTIFICATES);
+	nk = split_list(keys, key, MAX_CERTIFICATES);
+
+	if ( (nc <= 0) || (nc != nk) ) {
+		if (nc < 0)
+			snprintf(message, len, "At most %d certificates are possible.",
+					MAX_CERTIFICATES);
+		else
+			snprintf(message, len, "Every certificate needs a key of its own.");
+		rc = EXIT_FAILURE;
+		goto out;
+	}
+
+	/* Stable insertion by cost. */
+	for (j = 0; j < nc; ++j) {
+		cost[j] = signing_cost(certificate_algorithm(cert[j]));
+		for (k = j; (k > 0) && (cost[order[k - 1]] > cost[j]); --k)
+			order[k] = order[k - 1];
+		order[k] = j;
+	}
+
+	for (j = 0; j < nc; ++j) {
+		k = order[j];
+		rc = gnutls_certificate_set_x509_key_file(ctx->x509_cred,
+							cert[k], key[k], GNUTLS_X509_FMT_PEM);
+		if (rc < 0) {
+			snprintf(message, len, "Certificate %s: %s",
+					cert[k], gnutls_strerror(rc));
+			rc = EXIT_FAILURE;
+			goto out;
+		}
+	}
+
+	rc = EXIT_SUCCESS;
+
+out:
+	if (len > 1)
+		message[len - 1] = '\0';
+	free(certs);
+	free(keys);
+
+	return rc;
+} /* load_certificates(struct tls_context *, char *, int) */
+
+/* Load certificate, key, and CA-chain into new credentials. */
+static int load_credentials(struct tls_context *ctx, char *message, int len) {
 	int rc;
 
-	gnutls_global_init();
+	gnutls_certificate_allocate_credentials(&ctx->x509_cred);
+	ctx->owns_cred = 1;
 
-	gnutls_certificate_allocate_credentials(&x509_cred);
-	if (cafile && strlen(cafile) &&
-		(rc = gnutls_certificate_set_x509_trust_file(x509_cred,
-								cafile, GNUTLS_X509_FMT_PEM) <=0)){
+	if (ctx->cafile && strlen(ctx->cafile) &&
+		(rc = gnutls_certificate_set_x509_trust_file(ctx->x509_cred,
+								ctx->cafile, GNUTLS_X509_FMT_PEM) <=0)){
 		strncpy(message, "No valid CA-chain.", len);
 		if (len > 1)
 			message[len - 1] = '\0';
-		gnutls_global_deinit();
 		return EXIT_FAILURE;
 	}
 
-	rc = gnutls_certificate_set_x509_key_file(x509_cred,
-							certificate, keyfile, GNUTLS_X509_FMT_PEM);
-	if (rc != GNUTLS_E_SUCCESS) {
-		gnutls_certificate_free_credentials(x509_cred);
-		gnutls_global_deinit();
-		snprintf(message, len, "Certificate: %s", gnutls_strerror(rc));
-		if (len > 1)
-			message[len - 1] = '\0';
+	if (ctx->cafile && strlen(ctx->cafile))
+		ctx->ca_generation = ++ca_generations;
+
+	gnutls_certificate_set_verify_function(ctx->x509_cred, verify_peer);
+
+	if ( ctx->server && (ctx->certificate == NULL) ) {
+		snprintf(message, len, "A server needs a certificate.");
 		return EXIT_FAILURE;
 	}
 
-	gnutls_dh_params_init(&dh_params);
-	gnutls_dh_params_generate2(dh_params, DH_PARAMS_LEN);
+	/* A client may go without a certificate of its own. */
+	if (ctx->certificate)
+		return load_certificates(ctx, message, len);
+
+	return EXIT_SUCCESS;
+} /* load_credentials(struct tls_context *, char *, int) */
+
+/* A new ticket replaces the one kept for the next connection. */
+static int keep_ticket(gnutls_session_t session, unsigned int htype,
+						unsigned int when, unsigned int incoming,
+						const gnutls_datum_t *msg) {
+	gnutls_datum_t data;
+	const struct tls_context *ctx = gnutls_session_get_ptr(session);
+
+	if ( !incoming || (gnutls_session_get_data2(session, &data) < 0) )
+		return 0;
+
+	ticket_slot_store(ctx->tickets, data.data, data.size);
+	gnutls_free(data.data);
+
+	return 0;
+} /* keep_ticket(gnutls_session_t, unsigned int, unsigned int,
+	 unsigned int, const gnutls_datum_t *) */
+
+/* Record a ClientHello carrying early data, refusing a replay. */
+static int record_client_hello(void *ptr, time_t expires,
+						const gnutls_datum_t *key, const gnutls_datum_t *data) {
+	unsigned char digest[VERIFY_DIGEST_LENGTH];
+
+	if ( gnutls_hash_fast(GNUTLS_DIG_SHA256, key->data, key->size, digest) < 0 )
+		return GNUTLS_E_DB_ERROR;
+
+	return replay_seen(digest, expires) ? GNUTLS_E_DB_ENTRY_EXISTS : 0;
+} /* record_client_hello(void *, time_t, const gnutls_datum_t *,
+	 const gnutls_datum_t *) */
+
+/* Resumption, and acceptance of early data, by a server. */
+static int prepare_early_data(struct tls_context *ctx,
+							char *message, int len) {
+	if ( gnutls_session_ticket_key_generate(&ctx->ticket_key) < 0 ) {
+		snprintf(message, len, "No key for session tickets.");
+		return -1;
+	}
+
+	if (anti_replay_ready)
+		return 0;
+
+	if ( replay_init() || (gnutls_anti_replay_init(&anti_replay) < 0) ) {
+		snprintf(message, len, "No shared memory against replay.");
+		return -1;
+	}
+
+	gnutls_anti_replay_set_add_function(anti_replay, record_client_hello);
+	anti_replay_ready = 1;
+
+	return 0;
+} /* prepare_early_data(struct tls_context *, char *, int) */
+
+/* Server credentials all use the same DH parameters. */
+static void attach_dh_params(struct tls_context *ctx) {
+	if (! dh_generated) {
+		gnutls_dh_params_init(&dh_params);
+		gnutls_dh_params_generate2(dh_params, DH_PARAMS_LEN);
+		dh_generated = 1;
+	}
+
+	gnutls_certificate_set_dh_params(ctx->x509_cred, dh_params);
+} /* attach_dh_params(struct tls_context *) */
+
+/**
+ * tls_context_load  --  credentials and priority for a tunnel
+ *
+ * An identical context is shared, and so are credentials
+ * loaded from the same files. Returns NULL at failure, with
+ * the reason in message.
+ */
+
+struct tls_context *tls_context_load(const char *certificate,
+							const char *keyfile, const char *cafile,
+							const char *ciphers, int server, int verify,
+							size_t early, char *message, int len) {
+	int rc;
+	const char *errpos;
+	struct tls_context *ctx, *other;
+
+	if (! tls_initialised) {
+		gnutls_global_init();
+		tls_initialised = 1;
+	}
+
+	if (load_dir == NULL)
+		load_dir = getcwd(NULL, 0);
+
+	if ( (verify != VERIFY_NONE) && ((cafile == NULL) || !strlen(cafile)) ) {
+		snprintf(message, len, "Verification needs a CA-chain.");
+		return NULL;
+	}
+
+	if ( (verify != VERIFY_NONE) && verify_cache_init() ) {
+		snprintf(message, len, "No shared memory for verified chains.");
+		return NULL;
+	}
+
+	for (ctx = contexts; ctx; ctx = ctx->next)
+		if ( same_file(ctx->certificate, certificate)
+				&& same_file(ctx->keyfile, keyfile)
+				&& same_file(ctx->cafile, cafile)
+				&& same_file(ctx->ciphers, ciphers)
+				&& (ctx->server == server)
+				&& (ctx->verify == verify)
+				&& (ctx->early_data == early) ) {
+			snprintf(message, len, "Sharing credentials of \"%s\".\n",
+					certificate ? certificate : "none");
+			if (len > 0)
+				message[len - 1] = '\0';
+			return ctx;
+		}
+
+	if ( (ctx = calloc(1, sizeof(*ctx))) == NULL ) {
+		snprintf(message, len, "Out of memory.");
+		return NULL;
+	}
+
+	ctx->certificate = copy_string(certificate);
+	ctx->keyfile = copy_string(keyfile);
+	ctx->cafile = copy_string(cafile);
+	ctx->ciphers = copy_string(ciphers);
+	ctx->server = server;
+	ctx->verify = verify;
+	ctx->early_data = early;
+	ctx->tickets = ticket_slot_new();
+
+	/* Credentials from the same files need no second load. */
+	for (other = contexts; other; other = other->next)
+		if ( same_file(other->certificate, certificate)
+				&& same_file(other->keyfile, keyfile)
+				&& same_file(other->cafile, cafile) )
+			break;
+
+	if (other) {
+		ctx->x509_cred = other->x509_cred;
+		ctx->ca_generation = other->ca_generation;
+	} else if ( load_credentials(ctx, message, len) ) {
+		free_context(ctx);
+		return NULL;
+	}
+
+	if (server)
+		attach_dh_params(ctx);
+
+	if ( server && early && prepare_early_data(ctx, message, len) ) {
+		free_context(ctx);
+		return NULL;
+	}
+
+	/* Order the ciphers by their speed on this processor. */
+	if ( ciphers && (strcmp(ciphers, "auto") == 0) )
+		ciphers = cipher_priority_auto(server);
 
-	rc = gnutls_priority_init(&tls_priority_cache, ciphers, NULL);
+	rc = gnutls_priority_init(&ctx->priority, ciphers, &errpos);
 	if (rc != GNUTLS_E_SUCCESS) {
-		gnutls_certificate_free_credentials(x509_cred);
-		gnutls_global_deinit();
 		snprintf(message, len, "Priority string: %s\nCipher priority: %s",
 				ciphers, gnutls_strerror(rc));
 		if (len > 1)
 			message[len - 1] = '\0';
-		return EXIT_FAILURE;
+		ctx->priority = NULL;
+		free_context(ctx);
+		return NULL;
 	}
 
-	gnutls_certificate_set_dh_params(x509_cred, dh_params);
+	ctx->next = contexts;
+	contexts = ctx;
 
-	snprintf(message, len, "GnuTLS certificate loaded successfully.\n"
-				"Using ciphers \"%s\".\n", ciphers);
+	snprintf(message, len, "GnuTLS certificate %s successfully.\n"
+				"Using ciphers \"%s\".\n",
+				other ? "shared" : "loaded", ciphers);
 	if (len > 0)
 		message[len - 1] = '\0';
 
-    return EXIT_SUCCESS;
-} /* init_tls_server(char *, int) */
+	return ctx;
+} /* tls_context_load(const char *, const char *, const char *,
+	 const char *, int, int, size_t, char *, int) */
+
+/* Is every certificate of the credentials within its validity? */
+static int certificates_current(gnutls_certificate_credentials_t cred,
+								char *message, int len) {
+	int expired;
+	unsigned int j, num;
+	time_t now = time(NULL);
+	gnutls_x509_crt_t *list;
+
+	for (j = 0; gnutls_certificate_get_x509_crt(cred, j, &list, &num) == 0;
+			++j) {
+		expired = (num > 0)
+			&& ((gnutls_x509_crt_get_activation_time(list[0]) > now)
+				|| (gnutls_x509_crt_get_expiration_time(list[0]) < now));
+
+		while (num > 0)
+			gnutls_x509_crt_deinit(list[--num]);
+		gnutls_free(list);
+
+		if (expired) {
+			snprintf(message, len, "Certificate %u is not valid at present.",
+					j + 1);
+			return 0;
+		}
+	}
 
-int init_tls_client(char *message, int len) {
-	int rc;
+	return 1;
+} /* certificates_current(gnutls_certificate_credentials_t, char *, int) */
 
-	gnutls_global_init();
+/* Keep replaced credentials for sessions begun with them. */
+static void retire(gnutls_certificate_credentials_t cred) {
+	struct retired_cred *old;
 
-	gnutls_certificate_allocate_credentials(&x509_cred);
-	if (cafile && strlen(cafile) &&
-		(rc = gnutls_certificate_set_x509_trust_file(x509_cred,
-								cafile, GNUTLS_X509_FMT_PEM) <=0)){
-		strncpy(message, "No valid CA-chain.", len);
-		if (len > 1)
-			message[len - 1] = '\0';
+	/* Rather lose memory than free credentials in use. */
+	if ( (old = malloc(sizeof(*old))) == NULL )
+		return;
+
+	old->x509_cred = cred;
+	old->next = retired;
+	retired = old;
+} /* retire(gnutls_certificate_credentials_t) */
+
+/*
+ * Load the files of a context into fresh credentials. Contexts
+ * sharing the old credentials are given the fresh ones as well.
+ * Returns -1, with the reason in message, leaving all as it was.
+ */
+static int reload_context(struct tls_context *ctx, char *message, int len) {
+	struct tls_context fresh, *other;
+	gnutls_certificate_credentials_t old = ctx->x509_cred;
+
+	memcpy(&fresh, ctx, sizeof(fresh));
+	fresh.x509_cred = NULL;
+
+	if ( load_credentials(&fresh, message, len)
+			|| (ctx->certificate
+				&& !certificates_current(fresh.x509_cred, message, len)) ) {
+		if (fresh.x509_cred)
+			gnutls_certificate_free_credentials(fresh.x509_cred);
+		return -1;
+	}
+
+	for (other = contexts; other; other = other->next) {
+		if (other->x509_cred != old)
+			continue;
+
+		other->x509_cred = fresh.x509_cred;
+		other->ca_generation = fresh.ca_generation;
+
+		if (other->server)
+			attach_dh_params(other);
+	}
+
+	retire(old);
+
+	return 0;
+} /* reload_context(struct tls_context *, char *, int) */
+
+/**
+ * tls_context_reload_all  --  load the files of every context anew
+ *
+ * New sessions use the fresh credentials, whereas existing
+ * ones keep theirs. Returns the number of renewed credentials.
+ * A context failing to load keeps its credentials, and leaves
+ * the reason in message, which is otherwise empty.
+ */
+
+int tls_context_reload_all(char *message, int len) {
+	int renewed = 0;
+	char reason[MESSAGE_LENGTH], *here;
+	struct tls_context *ctx;
+
+	message[0] = '\0';
+
+	/* A daemon has left the directory of the files. */
+	here = getcwd(NULL, 0);
+	if ( load_dir && chdir(load_dir) ) {
+		snprintf(message, len, "Directory %s is gone.\n", load_dir);
+		free(here);
+		return 0;
+	}
+
+	for (ctx = contexts; ctx; ctx = ctx->next) {
+		if (! ctx->owns_cred )
+			continue;
+
+		if ( reload_context(ctx, reason, sizeof(reason)) ) {
+			snprintf(message, len, "Keeping credentials of \"%s\": %s\n",
+					ctx->certificate ? ctx->certificate : "none", reason);
+		} else
+			++renewed;
+	}
+
+	if ( here && chdir(here) )
+		snprintf(message, len, "Directory %s is gone.\n", here);
+	free(here);
+
+	if (len > 0)
+		message[len - 1] = '\0';
+
+	return renewed;
+} /* tls_context_reload_all(char *, int) */
+
+/**
+ * tls_context_release_all  --  free every context at exit
+ */
+
+void tls_context_release_all(void) {
+	struct tls_context *ctx;
+	struct retired_cred *old;
+
+	while ( (ctx = contexts) ) {
+		contexts = ctx->next;
+		free_context(ctx);
+	}
+
+	if (dh_generated) {
+		gnutls_dh_params_deinit(dh_params);
+		dh_generated = 0;
+	}
+
+	while ( (old = retired) ) {
+		retired = old->next;
+		gnutls_certificate_free_credentials(old->x509_cred);
+		free(old);
+	}
+
+	free(load_dir);
+	load_dir = NULL;
+
+	if (anti_replay_ready) {
+		gnutls_anti_replay_deinit(anti_replay);
+		anti_replay_ready = 0;
+	}
+
+	if (tls_initialised) {
 		gnutls_global_deinit();
-		return EXIT_FAILURE;
+		tls_initialised = 0;
 	}
+} /* tls_context_release_all(void) */
 
-	rc = gnutls_certificate_set_x509_key_file(x509_cred,
-							certificate, keyfile, GNUTLS_X509_FMT_PEM);
+int init_tls_client_session(gnutls_session_t *session,
+							const struct tls_context *ctx,
+							char *message, int len) {
+	int rc;
+	size_t size;
+	unsigned char ticket[TICKET_SIZE];
+
+	rc = gnutls_init(session, GNUTLS_CLIENT
+							| (ctx->early_data ? GNUTLS_ENABLE_EARLY_DATA : 0));
 	if (rc != GNUTLS_E_SUCCESS) {
-		gnutls_certificate_free_credentials(x509_cred);
-		gnutls_global_deinit();
-		snprintf(message, len, "Certificate: %s", gnutls_strerror(rc));
+		snprintf(message, len, "Session init: %s.\n", gnutls_strerror(rc));
 		if (len > 1)
 			message[len - 1] = '\0';
 		return EXIT_FAILURE;
 	}
 
-	gnutls_dh_params_init(&dh_params);
-	gnutls_dh_params_generate2(dh_params, DH_PARAMS_LEN);
-
-#if 0
-	rc = gnutls_priority_init(&tls_priority_cache, ciphers, NULL);
+	rc = gnutls_priority_set(*session, ctx->priority);
 	if (rc != GNUTLS_E_SUCCESS) {
-		gnutls_certificate_free_credentials(x509_cred);
-		gnutls_global_deinit();
-		snprintf(message, len, "Priority string: %s\nCipher priority: %s",
-				ciphers, gnutls_strerror(rc));
+		snprintf(message, len, "Ciphers: %s.\n", gnutls_strerror(rc));
 		if (len > 1)
 			message[len - 1] = '\0';
+		gnutls_deinit(*session);
 		return EXIT_FAILURE;
 	}
-#endif
 
-	gnutls_certificate_set_dh_params(x509_cred, dh_params);
+	gnutls_credentials_set(*session, GNUTLS_CRD_CERTIFICATE, ctx->x509_cred);
+	gnutls_session_set_ptr(*session, (void *) ctx);
 
-	snprintf(message, len, "GnuTLS certificate loaded successfully.\n"
-				"Using ciphers \"%s\".\n", ciphers);
-	if (len > 0)
-		message[len - 1] = '\0';
+	/* Resume with the latest ticket, if any. */
+	if ( (size = ticket_slot_fetch(ctx->tickets, ticket, sizeof(ticket))) )
+		gnutls_session_set_data(*session, ticket, size);
 
-    return EXIT_SUCCESS;
-} /* init_tls_client(char *, int) */
+	gnutls_handshake_set_hook_function(*session,
+								GNUTLS_HANDSHAKE_NEW_SESSION_TICKET,
+								GNUTLS_HOOK_POST, keep_ticket);
 
-int init_tls_client_session(gnutls_session_t *session, char *message, int len) {
+	return EXIT_SUCCESS;
+} /* init_tls_client_session(gnutls_session_t *, const struct tls_context *,
+	 char *, int) */
+
+int init_tls_server_session(gnutls_session_t *session,
+							const struct tls_context *ctx,
+							char *message, int len) {
 	int rc;
-	const char *errmsg;
 
-	rc = gnutls_init(session, GNUTLS_CLIENT);
+	rc = gnutls_init(session, GNUTLS_SERVER
+							| (ctx->early_data ? GNUTLS_ENABLE_EARLY_DATA : 0));
 	if (rc != GNUTLS_E_SUCCESS) {
 		snprintf(message, len, "Session init: %s.\n", gnutls_strerror(rc));
 		if (len > 1)
 			message[len - 1] = '\0';
 		return EXIT_FAILURE;
-	}	
+	}
 
-	rc = gnutls_priority_set_direct(*session, ciphers, &errmsg);
+	rc = gnutls_priority_set(*session, ctx->priority);
 	if (rc != GNUTLS_E_SUCCESS) {
-		snprintf(message, len, "Ciphers: %s.\n", errmsg);
+		snprintf(message, len, "Ciphers: %s.\n", gnutls_strerror(rc));
 		if (len > 1)
 			message[len - 1] = '\0';
 		gnutls_deinit(*session);
 		return EXIT_FAILURE;
 	}
 
-	gnutls_credentials_set(*session, GNUTLS_CRD_CERTIFICATE, x509_cred);
+	gnutls_credentials_set(*session, GNUTLS_CRD_CERTIFICATE, ctx->x509_cred);
+	gnutls_session_set_ptr(*session, (void *) ctx);
+	gnutls_certificate_server_set_request(*session,
+								(ctx->verify == VERIFY_REQUIRE)
+									? GNUTLS_CERT_REQUIRE
+									: GNUTLS_CERT_REQUEST);
+
+	if (ctx->early_data) {
+		gnutls_session_ticket_enable_server(*session, &ctx->ticket_key);
+		gnutls_record_set_max_early_data_size(*session, ctx->early_data);
+		gnutls_anti_replay_enable(*session, anti_replay);
+	}
 
 	return EXIT_SUCCESS;
-} /* init_tls_client_session(gnutls_session_t *, char *, int) */
+} /* init_tls_server_session(gnutls_session_t *, const struct tls_context *,
+	 char *, int) */
+
+/**
+ * init_dtls_session  --  non-blocking DTLS session of either role
+ *
+ * The caller provides the transport functions.
+ */
 
-int init_tls_server_session(gnutls_session_t *session, char *message, int len) {
+int init_dtls_session(gnutls_session_t *session,
+						const struct tls_context *ctx,
+						char *message, int len) {
 	int rc;
 
-	rc = gnutls_init(session, GNUTLS_SERVER);
+	rc = gnutls_init(session, (ctx->server ? GNUTLS_SERVER : GNUTLS_CLIENT)
+								| GNUTLS_DATAGRAM | GNUTLS_NONBLOCK);
 	if (rc != GNUTLS_E_SUCCESS) {
 		snprintf(message, len, "Session init: %s.\n", gnutls_strerror(rc));
 		if (len > 1)
 			message[len - 1] = '\0';
 		return EXIT_FAILURE;
-	}	
+	}
 
-	rc = gnutls_priority_set(*session, tls_priority_cache);
+	rc = gnutls_priority_set(*session, ctx->priority);
 	if (rc != GNUTLS_E_SUCCESS) {
 		snprintf(message, len, "Ciphers: %s.\n", gnutls_strerror(rc));
 		if (len > 1)
@@ -189,9 +793,46 @@ int init_tls_server_session(gnutls_session_t *session, char *message, int len) {
 		return EXIT_FAILURE;
 	}
 
-	gnutls_credentials_set(*session, GNUTLS_CRD_CERTIFICATE, x509_cred);
-	gnutls_certificate_server_set_request(*session, GNUTLS_CERT_REQUEST);
+	gnutls_credentials_set(*session, GNUTLS_CRD_CERTIFICATE, ctx->x509_cred);
+	gnutls_session_set_ptr(*session, (void *) ctx);
+
+	if (ctx->server)
+		gnutls_certificate_server_set_request(*session,
+								(ctx->verify == VERIFY_REQUIRE)
+									? GNUTLS_CERT_REQUIRE
+									: GNUTLS_CERT_REQUEST);
 
 	return EXIT_SUCCESS;
-} /* init_tls_server_session(gnutls_session_t *, char *, int) */
+} /* init_dtls_session(gnutls_session_t *, const struct tls_context *,
+	 char *, int) */
+
+/**
+ * tls_session_credentials  --  serve the certificate of another context
+ *
+ * A server may switch before the certificate is chosen.
+ */
+
+int tls_session_credentials(gnutls_session_t session,
+							const struct tls_context *ctx) {
+	return gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE,
+									ctx->x509_cred);
+} /* tls_session_credentials(gnutls_session_t, const struct tls_context *) */
+
+/**
+ * tls_early_data_room  --  early data a client may send
+ *
+ * Naught unless the context enables early data, and the
+ * session resumes with a ticket permitting it.
+ */
+
+size_t tls_early_data_room(gnutls_session_t session) {
+	size_t room;
+	const struct tls_context *ctx = gnutls_session_get_ptr(session);
+
+	if ( (ctx == NULL) || (ctx->early_data == 0) )
+		return 0;
+
+	room = gnutls_record_get_max_early_data_size(session);
 
+	return (room < ctx->early_data) ? room : ctx->early_data;
+} /* tls_early_data_room(gnutls_session_t) */
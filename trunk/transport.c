@@ -0,0 +1,1185 @@
+/*
+ * transport.c  --  Uniform access to plain and encrypted sockets.
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * vim: set sw=4 ts=4
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/ioctl.h>
+
+#include <gnutls/gnutls.h>
+
+#if defined(__linux__)
+#  include <netinet/in.h>
+#  include <netinet/tcp.h>
+#  include <linux/tls.h>
+#  if defined(TCP_ULP) && defined(TLS_RX)
+#    define HAVE_KTLS	1
+#  endif
+#endif
+
+#ifndef SOL_TLS
+#  define SOL_TLS	282
+#endif
+
+#define _INCLUDE_EXTERNALS	1
+#include "gunnel.h"
+
+/* Record types of interest to kernel TLS. */
+#define RECORD_ALERT		21
+#define RECORD_HANDSHAKE	22
+#define RECORD_APPLICATION	23
+
+/*
+ * Sizing of outgoing TLS records. A record is useless to the peer
+ * until it has arrived in full, so a fresh or idle connection sends
+ * records fitting a single segment. Sustained throughput switches
+ * to the largest records, costing the least framing and crypto calls.
+ */
+#define TLS_RECORD_SMALL	1360
+#define TLS_RECORD_LARGE	16384
+#define TLS_RECORD_BOOST	(1024 * 1024)	/* Bytes before growing. */
+#define TLS_RECORD_IDLE		1000000		/* Usec before shrinking. */
+#define TLS_FLUSH_LIMIT		2000		/* Usec beyond flush window. */
+
+/* Monotonic clock in microseconds. */
+static long long now_usec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+} /* now_usec(void) */
+
+/*
+ * Plain sockets, be they TCP or unix sockets.
+ */
+
+static int plain_handshake(struct transport *tp) {
+	tp->established = 1;
+
+	return GUNNEL_SUCCESS;
+} /* plain_handshake(struct transport *) */
+
+static ssize_t plain_read(struct transport *tp, void *buf, size_t len) {
+	ssize_t n;
+
+	do
+		n = recv(tp->fd, buf, len, 0);
+	while ( (n < 0) && (errno == EINTR) );
+
+	return n;
+} /* plain_read(struct transport *, void *, size_t) */
+
+static ssize_t plain_write(struct transport *tp, const void *buf, size_t len) {
+	ssize_t n;
+
+	do
+		n = send(tp->fd, buf, len, 0);
+	while ( (n < 0) && (errno == EINTR) );
+
+	return n;
+} /* plain_write(struct transport *, const void *, size_t) */
+
+static void plain_shutdown(struct transport *tp) {
+	shutdown(tp->fd, SHUT_RDWR);
+} /* plain_shutdown(struct transport *) */
+
+static size_t plain_pending(struct transport *tp) {
+	return 0;
+} /* plain_pending(struct transport *) */
+
+static const struct transport_ops plain_ops = {
+	plain_handshake,
+	plain_read,
+	plain_write,
+	plain_shutdown,
+	plain_pending
+};
+
+/*
+ * TLS sessions, in either role.
+ */
+
+/* Is the other side a connected plain socket? */
+static int plain_peer(const struct transport *tp) {
+	return tp->peer && (tp->peer->fd >= 0) && (tp->peer->ops == &plain_ops);
+} /* plain_peer(const struct transport *) */
+
+/*
+ * Read what a plain peer has already delivered, without waiting,
+ * and queue it as early data of the coming ClientHello. Returns
+ * the amount read, which is kept in buf.
+ */
+static ssize_t tls_send_early(struct transport *tp, void *buf, size_t len) {
+	ssize_t n;
+
+	do
+		n = recv(tp->peer->fd, buf, len, MSG_DONTWAIT);
+	while ( (n < 0) && (errno == EINTR) );
+
+	if (n <= 0)
+		return 0;
+
+	/* At failure, the data is sent after the handshake. */
+	gnutls_record_send_early_data(tp->session, buf, n);
+
+	return n;
+} /* tls_send_early(struct transport *, void *, size_t) */
+
+/*
+ * Pass received early data to a plain peer at once, so that
+ * it is served while the handshake completes. Without such
+ * a peer, the data is kept until relaying begins.
+ */
+static int tls_take_early(struct transport *tp) {
+	ssize_t n;
+	unsigned char buf[MAX_EARLY_DATA], *more;
+
+	while ( (n = gnutls_record_recv_early_data(tp->session,
+												buf, sizeof(buf))) > 0 ) {
+		if ( plain_peer(tp) && (tp->early_len == 0) ) {
+			if ( transport_write(tp->peer, buf, n) < 0 )
+				return -1;
+			continue;
+		}
+
+		if ( (more = realloc(tp->early, tp->early_len + n)) == NULL )
+			return -1;
+
+		memcpy(more + tp->early_len, buf, n);
+		tp->early = more;
+		tp->early_len += n;
+	}
+
+	return 0;
+} /* tls_take_early(struct transport *) */
+
+/* Has the handshake settled on the application protocol? */
+static int tls_agreed(struct transport *tp, const char *protocol) {
+	gnutls_datum_t alpn;
+
+	if ( gnutls_alpn_get_selected_protocol(tp->session, &alpn) < 0 )
+		return 0;
+
+	return (alpn.size == strlen(protocol))
+			&& (memcmp(alpn.data, protocol, alpn.size) == 0);
+} /* tls_agreed(struct transport *, const char *) */
+
+/* Bound blocking calls on a socket by secs, or by nothing if naught. */
+static void socket_deadline(int fd, int secs) {
+	struct timeval tv;
+
+	tv.tv_sec = secs;
+	tv.tv_usec = 0;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+} /* socket_deadline(int, int) */
+
+/* Wait until the handshake can proceed, or the deadline passes. */
+static int tls_wait(struct transport *tp, long long deadline) {
+	long long left;
+	fd_set set;
+	struct timeval tv;
+
+	if ( (left = deadline - now_usec()) <= 0 ) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	tv.tv_sec = left / 1000000;
+	tv.tv_usec = left % 1000000;
+
+	FD_ZERO(&set);
+	FD_SET(tp->fd, &set);
+
+	if ( gnutls_record_get_direction(tp->session) )
+		return select(tp->fd + 1, NULL, &set, NULL, &tv);
+	else
+		return select(tp->fd + 1, &set, NULL, NULL, &tv);
+} /* tls_wait(struct transport *, long long) */
+
+/*
+ * A server handshakes on a non-blocking socket, so gnutls returns
+ * whenever input runs short, as it does once early data has come.
+ * Early data sent with the ClientHello is thus passed on, a round
+ * trip before the client's Finished message, whatever the socket.
+ */
+static int tls_handshake(struct transport *tp) {
+	int rc, flags = 0;
+	int server = (tp->kind == TRANSPORT_TLS_SERVER);
+	size_t room;
+	ssize_t early = 0;
+	long long deadline;
+	unsigned char buf[MAX_EARLY_DATA];
+
+	/* A silent peer must not hold a process for long. */
+	deadline = now_usec() + HANDSHAKE_TIMEOUT * 1000000LL;
+	gnutls_handshake_set_timeout(tp->session, HANDSHAKE_TIMEOUT * 1000);
+
+	if (server) {
+		flags = fcntl(tp->fd, F_GETFL);
+		fcntl(tp->fd, F_SETFL, flags | O_NONBLOCK);
+	} else
+		socket_deadline(tp->fd, HANDSHAKE_TIMEOUT);
+
+	if ( (tp->kind == TRANSPORT_TLS_CLIENT) && plain_peer(tp)
+			&& (room = tls_early_data_room(tp->session)) )
+		early = tls_send_early(tp, buf,
+								(room < sizeof(buf)) ? room : sizeof(buf));
+
+	while (1) {
+		rc = gnutls_handshake(tp->session);
+
+		/* A server waits for more with early data passed on. */
+		if ( (rc == GNUTLS_E_AGAIN) && server ) {
+			if ( tls_take_early(tp) ) {
+				rc = GNUTLS_E_INTERNAL_ERROR;
+				break;
+			}
+
+			if ( (tls_wait(tp, deadline) < 0) && (errno != EINTR) )
+				break;
+		}
+
+		/* An expired socket timeout of a client also reports E_AGAIN. */
+		if ( ((rc == GNUTLS_E_AGAIN) || (rc == GNUTLS_E_INTERRUPTED))
+				&& (now_usec() < deadline) )
+			continue;
+		break;
+	}
+
+	if (server)
+		fcntl(tp->fd, F_SETFL, flags);
+	else
+		socket_deadline(tp->fd, 0);
+
+	if (rc < 0)
+		return GUNNEL_FAILED_HANDSHAKE;
+
+	tp->established = 1;
+
+	if ( server && tls_take_early(tp) )
+		return GUNNEL_FAILED_HANDSHAKE;
+
+	/* Agreed compression applies to all data beyond early data. */
+	if ( tp->compress && tls_agreed(tp, COMPRESS_PROTOCOL)
+			&& ((tp->zip = zip_new(tp->compress)) == NULL) )
+		return GUNNEL_FAILED_HANDSHAKE;
+
+	/* Early data refused by the server is sent anew. */
+	if ( (early > 0)
+			&& !(gnutls_session_get_flags(tp->session) & GNUTLS_SFLAGS_EARLY_DATA)
+			&& (transport_write(tp, buf, early) < 0) )
+		return GUNNEL_FAILED_HANDSHAKE;
+
+	return GUNNEL_SUCCESS;
+} /* tls_handshake(struct transport *) */
+
+static ssize_t tls_recv(struct transport *tp, void *buf, size_t len) {
+	ssize_t n;
+
+	do
+		n = gnutls_record_recv(tp->session, buf, len);
+	while (n == GNUTLS_E_INTERRUPTED);
+
+	/* Only a non-blocking socket lacks a complete record. */
+	if (n == GNUTLS_E_AGAIN)
+		errno = EAGAIN;
+
+	return (n < 0) ? -1 : n;
+} /* tls_recv(struct transport *, void *, size_t) */
+
+static ssize_t tls_read(struct transport *tp, void *buf, size_t len) {
+	ssize_t n;
+	size_t room;
+	void *input;
+
+	if (tp->zip == NULL)
+		return tls_recv(tp, buf, len);
+
+	/* Inflate what is at hand, then read further records. */
+	while ( (n = zip_inflate(tp->zip, buf, len)) == 0 ) {
+		input = zip_input(tp->zip, &room);
+		if ( (n = tls_recv(tp, input, room)) <= 0 )
+			return n;
+		zip_supply(tp->zip, n);
+	}
+
+	if (n < 0)
+		errno = EIO;
+
+	return n;
+} /* tls_read(struct transport *, void *, size_t) */
+
+static ssize_t tls_send(struct transport *tp, const void *buf, size_t len) {
+	ssize_t n;
+
+	while (1) {
+		n = gnutls_record_send(tp->session, buf, len);
+		if ((n == GNUTLS_E_AGAIN) || (n == GNUTLS_E_INTERRUPTED))
+			continue;
+		break;
+	}
+
+	return (n < 0) ? -1 : n;
+} /* tls_send(struct transport *, const void *, size_t) */
+
+static ssize_t tls_write(struct transport *tp, const void *buf, size_t len) {
+	ssize_t n, m;
+	size_t done = 0;
+	const void *out;
+
+	if (tp->zip == NULL)
+		return tls_send(tp, buf, len);
+
+	/* All compressed output must go, lest the stream break. */
+	if ( (n = zip_deflate(tp->zip, buf, len, &out)) < 0 )
+		return -1;
+
+	while (done < n) {
+		if ( (m = tls_send(tp, (const char *) out + done, n - done)) <= 0 )
+			return -1;
+		done += m;
+	}
+
+	return len;
+} /* tls_write(struct transport *, const void *, size_t) */
+
+static void tls_shutdown(struct transport *tp) {
+	int rc;
+
+	if (tp->established) {
+		while (1) {
+			rc = gnutls_bye(tp->session, GNUTLS_SHUT_RDWR);
+			if ((rc == GNUTLS_E_AGAIN) || (rc == GNUTLS_E_INTERRUPTED))
+				continue;
+			break;
+		}
+	}
+
+	gnutls_deinit(tp->session);
+	shutdown(tp->fd, SHUT_RDWR);
+} /* tls_shutdown(struct transport *) */
+
+static size_t tls_pending(struct transport *tp) {
+	if ( tp->zip && zip_pending(tp->zip) )
+		return 1;
+
+	return gnutls_record_check_pending(tp->session);
+} /* tls_pending(struct transport *) */
+
+
+static const struct transport_ops tls_ops = {
+	tls_handshake,
+	tls_read,
+	tls_write,
+	tls_shutdown,
+	tls_pending
+};
+
+#if HAVE_KTLS
+/*
+ * Sockets with TLS records handled by the kernel, once
+ * a handshake has been completed by GnuTLS.
+ */
+
+static int ktls_handshake(struct transport *tp) {
+	tp->established = 1;
+
+	return GUNNEL_SUCCESS;
+} /* ktls_handshake(struct transport *) */
+
+static ssize_t ktls_read(struct transport *tp, void *buf, size_t len) {
+	ssize_t n;
+	unsigned char type;
+	char control[CMSG_SPACE(sizeof(type))];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+
+	while (1) {
+		memset(&msg, '\0', sizeof(msg));
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		n = recvmsg(tp->fd, &msg, 0);
+		if ( (n < 0) && (errno == EINTR) )
+			continue;
+		if (n <= 0)
+			return n;
+
+		type = RECORD_APPLICATION;
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if ( cmsg && (cmsg->cmsg_level == SOL_TLS)
+				&& (cmsg->cmsg_type == TLS_GET_RECORD_TYPE) )
+			type = *((unsigned char *) CMSG_DATA(cmsg));
+
+		if (type == RECORD_APPLICATION)
+			return n;
+
+		if (type == RECORD_ALERT)
+			return 0;	/* Treat any alert as closure. */
+
+		/* Post-handshake messages, like session tickets,
+		 * are of no concern to the tunnel. */
+	}
+} /* ktls_read(struct transport *, void *, size_t) */
+
+static void ktls_shutdown(struct transport *tp) {
+	unsigned char alert[2] = { 1, 0 };	/* Warning, close_notify. */
+	unsigned char type = RECORD_ALERT;
+	char control[CMSG_SPACE(sizeof(type))];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+
+	memset(&msg, '\0', sizeof(msg));
+	iov.iov_base = alert;
+	iov.iov_len = sizeof(alert);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_TLS;
+	cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(type));
+	*((unsigned char *) CMSG_DATA(cmsg)) = type;
+
+	sendmsg(tp->fd, &msg, MSG_NOSIGNAL);
+	shutdown(tp->fd, SHUT_RDWR);
+
+	/* Present if the keys were installed by this process. */
+	if (tp->session)
+		gnutls_deinit(tp->session);
+} /* ktls_shutdown(struct transport *) */
+
+static const struct transport_ops ktls_ops = {
+	ktls_handshake,
+	ktls_read,
+	plain_write,
+	ktls_shutdown,
+	plain_pending
+};
+
+/* Install the keys of one direction into the kernel. */
+static int ktls_set_keys(struct transport *tp, int read) {
+	int rc;
+	gnutls_datum_t iv, key;
+	unsigned char seq[8];
+	gnutls_protocol_t version;
+	union {
+		struct tls12_crypto_info_aes_gcm_128 aes128;
+		struct tls12_crypto_info_aes_gcm_256 aes256;
+		struct tls12_crypto_info_chacha20_poly1305 chacha;
+	} info;
+	socklen_t len;
+
+	version = gnutls_protocol_get_version(tp->session);
+	if ( (version != GNUTLS_TLS1_2) && (version != GNUTLS_TLS1_3) )
+		return -1;
+
+	rc = gnutls_record_get_state(tp->session, read, NULL, &iv, &key, seq);
+	if (rc != GNUTLS_E_SUCCESS)
+		return -1;
+
+	memset(&info, '\0', sizeof(info));
+
+	switch (gnutls_cipher_get(tp->session)) {
+		case GNUTLS_CIPHER_AES_128_GCM:
+			info.aes128.info.version = (version == GNUTLS_TLS1_2)
+					? TLS_1_2_VERSION : TLS_1_3_VERSION;
+			info.aes128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+			/* The explicit nonce of TLS 1.2 is the sequence number. */
+			if (version == GNUTLS_TLS1_2)
+				memcpy(info.aes128.iv, seq, sizeof(info.aes128.iv));
+			else
+				memcpy(info.aes128.iv, iv.data + sizeof(info.aes128.salt),
+						sizeof(info.aes128.iv));
+			memcpy(info.aes128.salt, iv.data, sizeof(info.aes128.salt));
+			memcpy(info.aes128.key, key.data, sizeof(info.aes128.key));
+			memcpy(info.aes128.rec_seq, seq, sizeof(info.aes128.rec_seq));
+			len = sizeof(info.aes128);
+			break;
+		case GNUTLS_CIPHER_AES_256_GCM:
+			info.aes256.info.version = (version == GNUTLS_TLS1_2)
+					? TLS_1_2_VERSION : TLS_1_3_VERSION;
+			info.aes256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+			if (version == GNUTLS_TLS1_2)
+				memcpy(info.aes256.iv, seq, sizeof(info.aes256.iv));
+			else
+				memcpy(info.aes256.iv, iv.data + sizeof(info.aes256.salt),
+						sizeof(info.aes256.iv));
+			memcpy(info.aes256.salt, iv.data, sizeof(info.aes256.salt));
+			memcpy(info.aes256.key, key.data, sizeof(info.aes256.key));
+			memcpy(info.aes256.rec_seq, seq, sizeof(info.aes256.rec_seq));
+			len = sizeof(info.aes256);
+			break;
+		case GNUTLS_CIPHER_CHACHA20_POLY1305:
+			info.chacha.info.version = (version == GNUTLS_TLS1_2)
+					? TLS_1_2_VERSION : TLS_1_3_VERSION;
+			info.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+			memcpy(info.chacha.iv, iv.data, sizeof(info.chacha.iv));
+			memcpy(info.chacha.key, key.data, sizeof(info.chacha.key));
+			memcpy(info.chacha.rec_seq, seq, sizeof(info.chacha.rec_seq));
+			len = sizeof(info.chacha);
+			break;
+		default:
+			return -1;
+	}
+
+	rc = setsockopt(tp->fd, SOL_TLS, read ? TLS_RX : TLS_TX, &info, len);
+	memset(&info, '\0', sizeof(info));
+
+	return rc;
+} /* ktls_set_keys(struct transport *, int) */
+#endif /* HAVE_KTLS */
+
+/**
+ * transport_enable_ktls  --  let the kernel take over TLS records
+ *
+ * Only possible after the handshake, and before any data has
+ * been exchanged. On success the session may be released and
+ * the socket passed to another process as TRANSPORT_KTLS.
+ */
+
+int transport_enable_ktls(struct transport *tp) {
+#if HAVE_KTLS
+	if ( (tp->ops != &tls_ops) || !tp->established )
+		return -1;
+
+	/* Data already decoded by GnuTLS would be lost. */
+	if ( gnutls_record_check_pending(tp->session) )
+		return -1;
+
+	if ( setsockopt(tp->fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0 )
+		return -1;
+
+	/* A failure past this point leaves the socket unusable
+	 * for GnuTLS, but the caller will then drop it. */
+	if ( ktls_set_keys(tp, 0) || ktls_set_keys(tp, 1) )
+		return -1;
+
+	tp->kind = TRANSPORT_KTLS;
+	tp->ops = &ktls_ops;
+
+	return 0;
+#else /* !HAVE_KTLS */
+	return -1;
+#endif
+} /* transport_enable_ktls(struct transport *) */
+
+/**
+ * transport_init  --  attach a connected socket to a transport
+ */
+
+int transport_init(struct transport *tp, int fd, int kind,
+					const struct tls_context *tls, char *msg, int len) {
+	int rc = EXIT_SUCCESS;
+
+	memset(tp, '\0', sizeof(*tp));
+	tp->fd = fd;
+	tp->kind = kind;
+
+	switch (kind) {
+		case TRANSPORT_TLS_SERVER:
+			rc = init_tls_server_session(&tp->session, tls, msg, len);
+			tp->ops = &tls_ops;
+			break;
+		case TRANSPORT_TLS_CLIENT:
+			rc = init_tls_client_session(&tp->session, tls, msg, len);
+			tp->ops = &tls_ops;
+			break;
+#if HAVE_KTLS
+		case TRANSPORT_KTLS:
+			tp->ops = &ktls_ops;
+			tp->established = 1;
+			break;
+#endif
+		case TRANSPORT_PLAIN:
+		case TRANSPORT_UNIX:
+		default:
+			tp->ops = &plain_ops;
+			break;
+	}
+
+	if (rc != EXIT_SUCCESS) {
+		/* No session to tear down. */
+		tp->ops = &plain_ops;
+		return GUNNEL_FAILED_SESSION;
+	}
+
+	if ( (kind == TRANSPORT_TLS_SERVER) || (kind == TRANSPORT_TLS_CLIENT) ) {
+		gnutls_transport_set_int(tp->session, fd);
+		tp->record_size = TLS_RECORD_SMALL;
+	}
+
+	return GUNNEL_SUCCESS;
+} /* transport_init(struct transport *, int, int,
+	 const struct tls_context *, char *, int) */
+
+/**
+ * transport_compress  --  offer compression to a gunnel peer
+ *
+ * Must precede the handshake. The level is that of deflate,
+ * naught for none.
+ */
+
+void transport_compress(struct transport *tp, int level) {
+	gnutls_datum_t alpn;
+
+	if ( (level == 0) || (tp->ops != &tls_ops) )
+		return;
+
+	tp->compress = level;
+
+	alpn.data = (unsigned char *) COMPRESS_PROTOCOL;
+	alpn.size = strlen(COMPRESS_PROTOCOL);
+	gnutls_alpn_set_protocols(tp->session, &alpn, 1, 0);
+} /* transport_compress(struct transport *, int) */
+
+/**
+ * transport_handshake  --  bring a transport into working order
+ */
+
+int transport_handshake(struct transport *tp) {
+	return tp->ops->handshake(tp);
+} /* transport_handshake(struct transport *) */
+
+/**
+ * transport_write  --  deliver a complete buffer
+ *
+ * Returns the buffer length, or -1 at failure.
+ */
+
+ssize_t transport_write(struct transport *tp, const void *buf, size_t len) {
+	ssize_t n;
+	size_t done = 0;
+
+	while (done < len) {
+		n = tp->ops->write(tp, (const char *) buf + done, len - done);
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+
+	return done;
+} /* transport_write(struct transport *, const void *, size_t) */
+
+/**
+ * transport_send  --  offer data to a non-blocking transport
+ *
+ * Returns the amount accepted, or -1 with errno set to EAGAIN
+ * while the socket is full. A TLS session then holds a record,
+ * and must be offered the same length again.
+ */
+
+ssize_t transport_send(struct transport *tp, const void *buf, size_t len) {
+	ssize_t n;
+
+	if (tp->ops != &tls_ops)
+		return tp->ops->write(tp, buf, len);
+
+	do
+		n = gnutls_record_send(tp->session, buf, len);
+	while (n == GNUTLS_E_INTERRUPTED);
+
+	if (n == GNUTLS_E_AGAIN)
+		errno = EAGAIN;
+
+	return (n < 0) ? -1 : n;
+} /* transport_send(struct transport *, const void *, size_t) */
+
+/**
+ * transport_close  --  orderly shutdown and release
+ */
+
+void transport_close(struct transport *tp) {
+	if (tp->fd < 0)
+		return;
+
+	free(tp->early);
+	tp->early = NULL;
+	tp->early_len = 0;
+
+	zip_free(tp->zip);
+	tp->zip = NULL;
+
+	tp->ops->shutdown(tp);
+	close(tp->fd);
+	tp->fd = -1;
+} /* transport_close(struct transport *) */
+
+/**
+ * transport_release  --  drop a transport without shutting it down
+ *
+ * Used when the socket lives on in some other process.
+ */
+
+void transport_release(struct transport *tp) {
+	if (tp->fd < 0)
+		return;
+
+	free(tp->early);
+	tp->early = NULL;
+	tp->early_len = 0;
+
+	zip_free(tp->zip);
+	tp->zip = NULL;
+
+	if (tp->session)
+		gnutls_deinit(tp->session);
+
+	close(tp->fd);
+	tp->fd = -1;
+} /* transport_release(struct transport *) */
+
+/* Largest amount worth reading for delivery to tp. */
+static size_t record_room(struct transport *tp, size_t len) {
+	size_t room;
+
+	if (tp->ops != &tls_ops)
+		return len;
+
+	room = tp->record_size - tp->corked;
+
+	return (room < len) ? room : len;
+} /* record_room(struct transport *, size_t) */
+
+/*
+ * Send corked data, and adapt the record size. With flags
+ * set to zero, a full socket returns 1 and leaves the data
+ * corked, to be resumed by another call. Returns zero when
+ * all is sent, and -1 at failure.
+ */
+static int record_flush(struct transport *tp, long long now,
+						unsigned int flags) {
+	int rc;
+
+	if (tp->corked == 0)
+		return 0;
+
+	do
+		rc = gnutls_record_uncork(tp->session, flags);
+	while (rc == GNUTLS_E_INTERRUPTED);
+
+	if (rc == GNUTLS_E_AGAIN)
+		return 1;
+
+	if (rc < 0)
+		return -1;
+
+	tp->burst += tp->corked;
+	tp->corked = 0;
+	tp->last_sent = now;
+
+	if (tp->burst >= TLS_RECORD_BOOST)
+		tp->record_size = TLS_RECORD_LARGE;
+
+	return 0;
+} /* record_flush(struct transport *, long long, unsigned int) */
+
+/*
+ * Cork data for a TLS transport, until a record of the present
+ * target size is complete, or until record_flush() is called at
+ * the end of the flush window. Return values as record_flush().
+ */
+static int record_queue(struct transport *tp, const void *buf, size_t len,
+						long long now) {
+	ssize_t n;
+
+	if (tp->corked == 0) {
+		/* An idle connection starts afresh. */
+		if (now - tp->last_sent > TLS_RECORD_IDLE) {
+			tp->burst = 0;
+			tp->record_size = TLS_RECORD_SMALL;
+		}
+
+		gnutls_record_cork(tp->session);
+		tp->flush_at = now + flush_window;
+	}
+
+	/* Compressed data fills the records in its stead. */
+	if (tp->zip) {
+		if ( (n = zip_deflate(tp->zip, buf, len, &buf)) < 0 )
+			return -1;
+		len = n;
+	}
+
+	/* A corked session only buffers the data. */
+	if ( gnutls_record_send(tp->session, buf, len) < 0 )
+		return -1;
+
+	tp->corked += len;
+
+	if (tp->corked >= tp->record_size)
+		return record_flush(tp, now, 0);
+
+	return 0;
+} /* record_queue(struct transport *, const void *, size_t, long long) */
+
+/*
+ * Urgent data is relayed only between TCP sockets, where it keeps
+ * its place at the mark. It has no counterpart in a TLS stream,
+ * so it is never carried across TLS. Left unread, the kernel
+ * drops it from the ordinary data.
+ */
+#define relays_urgent(src, dst) \
+	( ((src)->kind == TRANSPORT_PLAIN) && ((dst)->kind == TRANSPORT_PLAIN) )
+
+/* Relay state in one direction, from tp[j] to tp[1 - j]. */
+struct relay_flow {
+	int stalled;		/* Destination accepts no more for now. */
+	int urgent;			/* Byte to send at the mark, or -1. */
+	size_t start, end;	/* Unsent part of buf[], unless corked. */
+	char *buf;			/* Borrowed while data is in flight. */
+};
+
+/* Push out what a flow holds. Return values as record_flush(). */
+static int flow_push(struct relay_flow *fl, struct transport *dst,
+					long long now) {
+	ssize_t n;
+	char byte;
+
+	if (dst->ops == &tls_ops)
+		return record_flush(dst, now, 0);
+
+	while (fl->start < fl->end) {
+		n = dst->ops->write(dst, fl->buf + fl->start, fl->end - fl->start);
+
+		if ( (n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)) )
+			return 1;
+
+		if (n <= 0)
+			return -1;
+
+		fl->start += n;
+	}
+
+	fl->start = fl->end = 0;
+
+	if (fl->urgent >= 0) {
+		byte = fl->urgent;
+		n = send(dst->fd, &byte, 1, MSG_OOB);
+
+		if ( (n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)) )
+			return 1;
+
+		if (n <= 0)
+			return -1;
+
+		fl->urgent = -1;
+	}
+
+	return 0;
+} /* flow_push(struct relay_flow *, struct transport *, long long) */
+
+/* Return the buffer of a flow with nothing left to send. */
+static void flow_release(struct relay_flow *fl, long long now) {
+	if ( fl->buf && (fl->start == fl->end) ) {
+		buffer_put(fl->buf, now);
+		fl->buf = NULL;
+	}
+} /* flow_release(struct relay_flow *, long long) */
+
+/* Let select() return within 'wait' microseconds, at the latest. */
+static void lower_timeout(struct timeval **timeout, struct timeval *tv,
+						long long wait) {
+	if (wait < 0)
+		wait = 0;
+
+	if ( *timeout && ((long long) (*timeout)->tv_sec * 1000000
+						+ (*timeout)->tv_usec <= wait) )
+		return;
+
+	tv->tv_sec = wait / 1000000;
+	tv->tv_usec = wait % 1000000;
+	*timeout = tv;
+} /* lower_timeout(struct timeval **, struct timeval *, long long) */
+
+/* Deliver whatever a flow still holds, blocking as needed. */
+static void flow_drain(struct relay_flow *fl, struct transport *dst) {
+	if (dst->ops == &tls_ops)
+		record_flush(dst, now_usec(), GNUTLS_RECORD_WAIT);
+	else if (fl->start < fl->end)
+		transport_write(dst, fl->buf + fl->start, fl->end - fl->start);
+} /* flow_drain(struct relay_flow *, struct transport *) */
+
+/*
+ * Spin on peeking reads, rather than let select() sleep, for
+ * at most 'spin' microseconds. Returns as soon as a source
+ * in rset has anything to read, or has failed.
+ */
+static void relay_spin(struct transport *tp[2], fd_set *rset,
+						const struct timeval *timeout, long long spin) {
+	int j;
+	char byte;
+	long long now, until;
+
+	now = now_usec();
+	if ( timeout && ((long long) timeout->tv_sec * 1000000
+						+ timeout->tv_usec < spin) )
+		spin = (long long) timeout->tv_sec * 1000000 + timeout->tv_usec;
+
+	for (until = now + spin; now < until; now = now_usec())
+		for (j = 0; j < 2; ++j) {
+			if (! FD_ISSET(tp[j]->fd, rset) )
+				continue;
+
+			if ( (recv(tp[j]->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) >= 0)
+					|| ((errno != EAGAIN) && (errno != EWOULDBLOCK)) )
+				return;
+		}
+} /* relay_spin(struct transport *[2], fd_set *, const struct timeval *,
+	 long long) */
+
+/**
+ * relay_traffic  --  send data to and fro
+ *
+ * Any pair of transports may be joined. Returns at error,
+ * or when either side has shut down orderly.
+ *
+ * Both sockets are non-blocking during the relay, so a full
+ * destination stalls only its own direction. Data bound for
+ * TLS is coalesced into records, whose size grows with the
+ * sustained throughput. The shaper, unless it is NULL, limits
+ * how much may be read from either side. A direction holds a
+ * buffer only while its data awaits the destination. With busy
+ * polling, the relay spins for a while before it would sleep.
+ */
+
+void relay_traffic(struct transport *local, struct transport *remote,
+					struct shaper *sh) {
+	ssize_t n;
+	int j, rc, mark, maxfd, ready[2], flags[2];
+	char byte;
+	size_t allow[2];
+	long long now, wait, spin;
+	fd_set rset, wset, eset;
+	struct timeval nowait, *timeout;
+	struct transport *tp[2];
+	struct relay_flow fl[2];
+
+	/* Early data kept until the peer was connected. */
+	for (j = 0; j < 2; ++j) {
+		tp[j] = j ? remote : local;
+		if (tp[j]->early_len == 0)
+			continue;
+
+		n = transport_write(j ? local : remote, tp[j]->early,
+							tp[j]->early_len);
+		free(tp[j]->early);
+		tp[j]->early = NULL;
+		tp[j]->early_len = 0;
+
+		if (n < 0)
+			return;
+	}
+
+	spin = tuning_spin_start(local->fd, remote->fd);
+
+	/* Plain sockets on both sides suit io_uring, unless shaped,
+	 * or unless busy polling, since the ring would sleep. Being
+	 * unable to relay urgent data, it is used only on demand. */
+	if ( (local->ops == &plain_ops) && (remote->ops == &plain_ops)
+			&& (strcmp(io_backend, "uring") == 0)
+			&& !shaper_limited(sh) && !spin
+			&& (uring_relay(local, remote) == GUNNEL_SUCCESS) )
+		return;
+
+	memset(fl, '\0', sizeof(fl));
+
+	tp[0] = local;
+	tp[1] = remote;
+
+	for (j = 0; j < 2; ++j) {
+		fl[j].urgent = -1;
+		flags[j] = fcntl(tp[j]->fd, F_GETFL);
+		fcntl(tp[j]->fd, F_SETFL, flags[j] | O_NONBLOCK);
+	}
+
+	maxfd = (local->fd > remote->fd) ? local->fd : remote->fd;
+
+	while (1) {
+		FD_ZERO(&rset);
+		FD_ZERO(&wset);
+		FD_ZERO(&eset);
+		timeout = NULL;
+		now = now_usec();
+
+		for (j = 0; j < 2; ++j) {
+			allow[j] = 0;
+
+			if (fl[j].stalled) {
+				FD_SET(tp[1 - j]->fd, &wset);
+				continue;
+			}
+
+			/* An empty bucket postpones reading, and the urgent
+			 * mark with it, lest a pending mark wakes us at once. */
+			allow[j] = shaper_allow(sh, j, buffer_size, now, &wait);
+			if (allow[j] == 0) {
+				lower_timeout(&timeout, &nowait, wait);
+				continue;
+			}
+
+			FD_SET(tp[j]->fd, &rset);
+
+			if ( relays_urgent(tp[j], tp[1 - j]) )
+				FD_SET(tp[j]->fd, &eset);
+
+			/* Decoded data must not wait for the socket. */
+			if ( tp[j]->ops->pending(tp[j]) )
+				lower_timeout(&timeout, &nowait, 0);
+		}
+
+		/* Corked data waits at most until its flush time. */
+		for (j = 0; j < 2; ++j) {
+			if ( fl[j].stalled || (tp[1 - j]->corked == 0) )
+				continue;
+
+			lower_timeout(&timeout, &nowait, tp[1 - j]->flush_at - now);
+		}
+
+		/* Unused buffers are given back after a while. */
+		if ( (wait = buffer_trim(now)) >= 0 )
+			lower_timeout(&timeout, &nowait, wait);
+
+		/* Small messages are caught without a wakeup. Stalled
+		 * directions are bulk traffic, and wait for select(). */
+		if ( spin && !fl[0].stalled && !fl[1].stalled )
+			relay_spin(tp, &rset, timeout, spin);
+
+		if ( select(maxfd + 1, &rset, &wset, &eset, timeout) < 0 ) {
+			if (errno == EINTR)
+				continue;
+
+			break;	/* An error has occurred. Abort! */
+		}
+
+		now = now_usec();
+
+		for (j = 0; j < 2; ++j)
+			ready[j] = allow[j] && ( FD_ISSET(tp[j]->fd, &rset)
+									|| tp[j]->ops->pending(tp[j]) );
+
+		/* Resume stalled directions. */
+		for (j = 0; j < 2; ++j) {
+			if ( !fl[j].stalled || !FD_ISSET(tp[1 - j]->fd, &wset) )
+				continue;
+
+			if ( (rc = flow_push(&fl[j], tp[1 - j], now)) < 0 )
+				goto done;
+
+			fl[j].stalled = rc;
+			flow_release(&fl[j], now);
+		}
+
+		/* Flush once the source pauses, or has kept on too long. */
+		for (j = 0; j < 2; ++j) {
+			if ( fl[j].stalled || (tp[1 - j]->corked == 0)
+					|| (now < tp[1 - j]->flush_at) )
+				continue;
+
+			if ( ready[j] && (now < tp[1 - j]->flush_at + TLS_FLUSH_LIMIT) )
+				continue;
+
+			if ( (rc = record_flush(tp[1 - j], now, 0)) < 0 )
+				goto done;
+
+			fl[j].stalled = rc;
+			ready[j] = 0;
+		}
+
+		/* Urgent data, once the ordinary data before it is read. */
+		for (j = 0; j < 2; ++j) {
+			if ( fl[j].stalled || !FD_ISSET(tp[j]->fd, &eset) )
+				continue;
+
+			if ( (ioctl(tp[j]->fd, SIOCATMARK, &mark) < 0) || !mark )
+				continue;
+
+			if ( recv(tp[j]->fd, &byte, 1, MSG_OOB) != 1 )
+				continue;
+
+			fl[j].urgent = (unsigned char) byte;
+
+			if ( (rc = flow_push(&fl[j], tp[1 - j], now)) < 0 )
+				goto done;
+
+			fl[j].stalled = rc;
+			ready[j] &= !rc;
+		}
+
+		/* Orderly content now. */
+		for (j = 0; j < 2; ++j) {
+			if (! ready[j])
+				continue;
+
+			if ( (fl[j].buf = buffer_get()) == NULL )
+				goto done;
+
+			n = tp[j]->ops->read(tp[j], fl[j].buf,
+								record_room(tp[1 - j], allow[j]));
+
+			if ( (n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ) {
+				flow_release(&fl[j], now);
+				continue;
+			}
+
+			if (n <= 0)
+				/* Error or orderly shutdown. */
+				goto done;
+
+			shaper_consume(sh, j, n);
+
+			if (tp[1 - j]->ops == &tls_ops)
+				rc = record_queue(tp[1 - j], fl[j].buf, n, now);
+			else {
+				fl[j].start = 0;
+				fl[j].end = n;
+				rc = flow_push(&fl[j], tp[1 - j], now);
+			}
+
+			if (rc < 0)
+				goto done;
+
+			fl[j].stalled = rc;
+			flow_release(&fl[j], now);
+		}
+	}
+
+done:
+	for (j = 0; j < 2; ++j)
+		fcntl(tp[j]->fd, F_SETFL, flags[j]);
+
+	for (j = 0; j < 2; ++j) {
+		flow_drain(&fl[j], tp[1 - j]);
+		buffer_put(fl[j].buf, now);
+	}
+} /* relay_traffic(struct transport *, struct transport *,
+	 struct shaper *) */
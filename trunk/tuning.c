@@ -0,0 +1,282 @@
+/*
+ * tuning.c  --  named socket tuning profiles
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * vim: set sw=4 ts=4
+ */
+
+/*
+ * A profile collects socket options suiting one kind of traffic.
+ * "latency" disables Nagle's algorithm and keeps little unsent
+ * data queued, whereas "bulk" sets large fixed buffers. Either
+ * may be chosen for the accepting and the connecting side alike.
+ * Options unknown to the system are silently passed over.
+ *
+ * Busy polling applies to every relay instead. The relaying process
+ * is pinned to a processor, and spins for a while on its sockets
+ * before it sleeps. Waking up then costs no scheduling latency,
+ * which dominates the relay of small messages. Where permitted,
+ * SO_BUSY_POLL lets the kernel poll the device queue likewise.
+ */
+
+/* For sched_setaffinity() and sched_getcpu(). */
+#define _GNU_SOURCE	1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sched.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define _INCLUDE_EXTERNALS	1
+#include "gunnel.h"
+
+static const struct tuning profiles[] = {
+	/* name, nodelay, sndbuf, rcvbuf, notsent_lowat, defer_accept,
+	 * fastopen, keepidle, keepintvl, keepcnt */
+	{ "latency", 1, 0, 0, 16384, 5, 16, 60, 10, 6 },
+	{ "bulk", 0, 4194304, 4194304, 0, 5, 16, 600, 60, 5 },
+	{ NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
+};
+
+/* Longest spin of a busy polling relay, in usec. */
+#define MAX_SPIN	1000000
+
+/* Busy polling of relays, unless the budget is naught. */
+static long spin_budget = 0;
+static int spin_cpu = -1;	/* Where started, if negative. */
+
+/* Set an integer option, unless it is left at its default. */
+static void set_option(int sd, int level, int name, int value) {
+	if (value > 0)
+		setsockopt(sd, level, name, &value, sizeof(value));
+} /* set_option(int, int, int, int) */
+
+/* Read back an integer option, or -1. */
+static int get_option(int sd, int level, int name) {
+	int value = -1;
+	socklen_t len = sizeof(value);
+
+	if ( getsockopt(sd, level, name, &value, &len) < 0 )
+		return -1;
+
+	return value;
+} /* get_option(int, int, int) */
+
+/**
+ * tuning_lookup  --  find a profile by name
+ *
+ * Returns NULL for unknown names.
+ */
+
+const struct tuning *tuning_lookup(const char *name) {
+	const struct tuning *tune;
+
+	for (tune = profiles; tune->name; ++tune)
+		if ( strcmp(tune->name, name) == 0 )
+			return tune;
+
+	return NULL;
+} /* tuning_lookup(const char *) */
+
+/**
+ * tuning_socket  --  apply a profile to a single connection
+ *
+ * Suits accepted sockets, as well as sockets about to connect,
+ * whose buffers must be sized before the handshake.
+ */
+
+void tuning_socket(int sd, const struct tuning *tune) {
+	if (tune == NULL)
+		return;
+
+	set_option(sd, IPPROTO_TCP, TCP_NODELAY, tune->nodelay);
+	set_option(sd, SOL_SOCKET, SO_SNDBUF, tune->sndbuf);
+	set_option(sd, SOL_SOCKET, SO_RCVBUF, tune->rcvbuf);
+#ifdef TCP_NOTSENT_LOWAT
+	set_option(sd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, tune->notsent_lowat);
+#endif
+
+	if (tune->keepidle > 0) {
+		set_option(sd, SOL_SOCKET, SO_KEEPALIVE, 1);
+#ifdef TCP_KEEPIDLE
+		set_option(sd, IPPROTO_TCP, TCP_KEEPIDLE, tune->keepidle);
+		set_option(sd, IPPROTO_TCP, TCP_KEEPINTVL, tune->keepintvl);
+		set_option(sd, IPPROTO_TCP, TCP_KEEPCNT, tune->keepcnt);
+#endif
+	}
+} /* tuning_socket(int, const struct tuning *) */
+
+/**
+ * tuning_connect  --  prepare a socket for connecting upstream
+ */
+
+void tuning_connect(int sd, const struct tuning *tune) {
+	if (tune == NULL)
+		return;
+
+	tuning_socket(sd, tune);
+#ifdef TCP_FASTOPEN_CONNECT
+	/* The first write travels with the SYN. */
+	set_option(sd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, tune->fastopen > 0);
+#endif
+} /* tuning_connect(int, const struct tuning *) */
+
+/**
+ * tuning_listener  --  apply a profile to a listening socket
+ *
+ * Accepted sockets inherit the buffer sizes, which must be
+ * in place before the first SYN arrives.
+ */
+
+void tuning_listener(int sd, const struct tuning *tune) {
+	if (tune == NULL)
+		return;
+
+	tuning_socket(sd, tune);
+#ifdef TCP_DEFER_ACCEPT
+	set_option(sd, IPPROTO_TCP, TCP_DEFER_ACCEPT, tune->defer_accept);
+#endif
+#ifdef TCP_FASTOPEN
+	set_option(sd, IPPROTO_TCP, TCP_FASTOPEN, tune->fastopen);
+#endif
+} /* tuning_listener(int, const struct tuning *) */
+
+/**
+ * tuning_report  --  display the settings in effect
+ *
+ * The values are read back from sd, the listening socket, or
+ * from a probing socket when sd is negative.
+ */
+
+void tuning_report(const char *side, int sd, const struct tuning *tune) {
+	int probe = -1;
+
+	if (tune == NULL) {
+		fprintf(stderr, "%s tuning: system defaults.\n", side);
+		return;
+	}
+
+	if (sd < 0) {
+		if ( (probe = socket(AF_INET, SOCK_STREAM, 0)) < 0 )
+			return;
+		tuning_connect(probe, tune);
+		sd = probe;
+	}
+
+	fprintf(stderr, "%s tuning (%s): nodelay %d, sndbuf %d, rcvbuf %d",
+			side, tune->name,
+			get_option(sd, IPPROTO_TCP, TCP_NODELAY),
+			get_option(sd, SOL_SOCKET, SO_SNDBUF),
+			get_option(sd, SOL_SOCKET, SO_RCVBUF));
+#ifdef TCP_NOTSENT_LOWAT
+	fprintf(stderr, ", notsent_lowat %d",
+			get_option(sd, IPPROTO_TCP, TCP_NOTSENT_LOWAT));
+#endif
+#ifdef TCP_KEEPIDLE
+	if ( get_option(sd, SOL_SOCKET, SO_KEEPALIVE) > 0 )
+		fprintf(stderr, ", keepalive %d/%d/%d",
+				get_option(sd, IPPROTO_TCP, TCP_KEEPIDLE),
+				get_option(sd, IPPROTO_TCP, TCP_KEEPINTVL),
+				get_option(sd, IPPROTO_TCP, TCP_KEEPCNT));
+#endif
+	if (probe < 0) {
+#ifdef TCP_DEFER_ACCEPT
+		fprintf(stderr, ", defer_accept %d",
+				get_option(sd, IPPROTO_TCP, TCP_DEFER_ACCEPT));
+#endif
+#ifdef TCP_FASTOPEN
+		fprintf(stderr, ", fastopen %d",
+				get_option(sd, IPPROTO_TCP, TCP_FASTOPEN));
+#endif
+	} else {
+#ifdef TCP_FASTOPEN_CONNECT
+		fprintf(stderr, ", fastopen_connect %d",
+				get_option(sd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT));
+#endif
+		close(probe);
+	}
+
+	fprintf(stderr, ".\n");
+} /* tuning_report(const char *, int, const struct tuning *) */
+
+/**
+ * tuning_busy_poll  --  prepare busy polling of every relay
+ *
+ * The description "usec[,cpu]" gives the spin budget, and the
+ * processor to pin relays to. Returns -1 for invalid values.
+ */
+
+int tuning_busy_poll(const char *spec) {
+	long budget, cpu = -1;
+	char *end;
+	cpu_set_t set;
+
+	budget = strtol(spec, &end, 10);
+	if (*end == ',') {
+		cpu = strtol(end + 1, &end, 10);
+		if (cpu < 0)
+			return -1;
+	}
+
+	if ( (*end != '\0') || (budget < 1) || (budget > MAX_SPIN) )
+		return -1;
+
+	/* The processor must be one allowed to this process. */
+	if ( (cpu >= 0) && ((cpu >= CPU_SETSIZE)
+				|| sched_getaffinity(0, sizeof(set), &set)
+				|| !CPU_ISSET(cpu, &set)) )
+		return -1;
+
+	spin_budget = budget;
+	spin_cpu = cpu;
+
+	return 0;
+} /* tuning_busy_poll(const char *) */
+
+/**
+ * tuning_spin_start  --  prepare a relay for busy polling
+ *
+ * The calling process is pinned, and the sockets ask for polling
+ * by the kernel, as far as allowed. Returns the spin budget, which
+ * is naught unless busy polling was chosen.
+ */
+
+long tuning_spin_start(int sd, int rd) {
+	int cpu;
+	cpu_set_t set;
+	static int pinned = 0;
+
+	if (spin_budget == 0)
+		return 0;
+
+	if (! pinned ) {
+		cpu = (spin_cpu >= 0) ? spin_cpu : sched_getcpu();
+		CPU_ZERO(&set);
+		if (cpu >= 0) {
+			CPU_SET(cpu, &set);
+			sched_setaffinity(0, sizeof(set), &set);
+		}
+		pinned = 1;
+	}
+
+#ifdef SO_BUSY_POLL
+	/* Raising the value needs CAP_NET_ADMIN. */
+	set_option(sd, SOL_SOCKET, SO_BUSY_POLL, spin_budget);
+	set_option(rd, SOL_SOCKET, SO_BUSY_POLL, spin_budget);
+#endif
+
+	return spin_budget;
+} /* tuning_spin_start(int, int) */
@@ -0,0 +1,824 @@
+/*
+ * uring.c  --  io_uring backend for accepting and relaying
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * vim: set sw=4 ts=4
+ */
+
+/*
+ * The classic relay spends select(), recv() and send() on every
+ * chunk. Here a single io_uring_enter() both submits the sends
+ * and collects completions of multishot receives, which fill
+ * buffers from a ring registered with the kernel. Likewise a
+ * multishot accept delivers new clients without select().
+ *
+ * The buffers of a relay are buffer_size bytes each. After
+ * URING_IDLE microseconds without traffic, the receives are
+ * cancelled and the pages of the idle buffers are given back,
+ * before receiving anew. Thus an idle tunnel holds no buffer
+ * memory, as with the classic path.
+ *
+ * Whether the running kernel permits all this is decided at
+ * run time. Every failure before traffic has begun makes the
+ * caller fall back on the classic path.
+ *
+ * A multishot receive steps past the urgent mark before any
+ * POLLPRI is reported, whereupon the kernel discards the urgent
+ * byte. Thus TCP urgent data is relayed by the classic path only,
+ * and traffic is relayed here only when io_uring is demanded.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define _INCLUDE_EXTERNALS	1
+#include "gunnel.h"
+
+#if USE_IO_URING && defined(__linux__)
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT) \
+		&& defined(__NR_io_uring_setup)
+#  define HAVE_URING	1
+#endif
+
+#endif /* USE_IO_URING && __linux__ */
+
+#if HAVE_URING
+
+#ifndef URING_ENTRIES
+#  define URING_ENTRIES		32
+#endif
+
+/* The acceptor arms a request for every listener. */
+#ifndef URING_ACCEPT_ENTRIES
+#  define URING_ACCEPT_ENTRIES	(2 * MAX_TUNNELS)
+#endif
+
+#ifndef URING_BUFFERS
+#  define URING_BUFFERS		8	/* Per direction, a power of two. */
+#endif
+
+/* Usec without traffic, before idle buffers are given back. */
+#ifndef URING_IDLE
+#  define URING_IDLE		1000000
+#endif
+
+/* Kinds of requests, kept in the low byte of user_data. */
+enum {
+	URING_ACCEPT = 1,
+	URING_POLL,
+	URING_RECV,
+	URING_SEND,
+	URING_CANCEL,
+	URING_TIMEOUT
+};
+
+#define URING_DATA(op, index, arg) \
+	( (__u64) (op) | ((__u64) (index) << 8) | ((__u64) (arg) << 16) )
+#define URING_OP(data)		( (int) ((data) & 0xff) )
+#define URING_INDEX(data)	( (int) (((data) >> 8) & 0xff) )
+#define URING_ARG(data)		( (int) ((data) >> 16) )
+
+/* Mapped rings of one io_uring instance. */
+struct uring {
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map, *cq_map;
+	size_t sq_len, cq_len, sqe_len;
+	unsigned int entries;	/* Size of submission queue. */
+	unsigned int pending;	/* Prepared, not yet submitted. */
+};
+
+static int uring_setup(struct uring *ring, unsigned int entries) {
+	struct io_uring_params params;
+
+	memset(ring, '\0', sizeof(*ring));
+	memset(&params, '\0', sizeof(params));
+
+	if ( (ring->fd = syscall(__NR_io_uring_setup, entries, &params)) < 0 ) {
+		ring->fd = -1;
+		return -1;
+	}
+
+	ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_len = params.cq_off.cqes
+					+ params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqe_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->entries = params.sq_entries;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_len > ring->sq_len)
+			ring->sq_len = ring->cq_len;
+		ring->cq_len = ring->sq_len;
+	}
+
+	ring->sq_map = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+						MAP_SHARED | MAP_POPULATE, ring->fd,
+						IORING_OFF_SQ_RING);
+	if (ring->sq_map == MAP_FAILED) {
+		close(ring->fd);
+		ring->fd = -1;
+		return -1;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_map = ring->sq_map;
+	else {
+		ring->cq_map = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+							MAP_SHARED | MAP_POPULATE, ring->fd,
+							IORING_OFF_CQ_RING);
+		if (ring->cq_map == MAP_FAILED) {
+			munmap(ring->sq_map, ring->sq_len);
+			close(ring->fd);
+			ring->fd = -1;
+			return -1;
+		}
+	}
+
+	ring->sqes = mmap(NULL, ring->sqe_len, PROT_READ | PROT_WRITE,
+						MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		if (ring->cq_map != ring->sq_map)
+			munmap(ring->cq_map, ring->cq_len);
+		munmap(ring->sq_map, ring->sq_len);
+		close(ring->fd);
+		ring->fd = -1;
+		return -1;
+	}
+
+	ring->sq_head = (unsigned int *) ((char *) ring->sq_map + params.sq_off.head);
+	ring->sq_tail = (unsigned int *) ((char *) ring->sq_map + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *) ((char *) ring->sq_map + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *) ((char *) ring->sq_map + params.sq_off.array);
+	ring->cq_head = (unsigned int *) ((char *) ring->cq_map + params.cq_off.head);
+	ring->cq_tail = (unsigned int *) ((char *) ring->cq_map + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *) ((char *) ring->cq_map + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_map + params.cq_off.cqes);
+
+	return 0;
+} /* uring_setup(struct uring *, unsigned int) */
+
+static void uring_teardown(struct uring *ring) {
+	if (ring->fd < 0)
+		return;
+
+	munmap(ring->sqes, ring->sqe_len);
+	if (ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_len);
+	munmap(ring->sq_map, ring->sq_len);
+	close(ring->fd);
+	ring->fd = -1;
+} /* uring_teardown(struct uring *) */
+
+/* Next free submission entry, cleared. */
+static struct io_uring_sqe *uring_sqe(struct uring *ring) {
+	unsigned int tail, head, index;
+	struct io_uring_sqe *sqe;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	tail = *ring->sq_tail + ring->pending;
+
+	if (tail - head >= ring->entries)
+		return NULL;
+
+	index = tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, '\0', sizeof(*sqe));
+	ring->sq_array[index] = index;
+	++ring->pending;
+
+	return sqe;
+} /* uring_sqe(struct uring *) */
+
+/* Submit prepared entries, waiting for at least 'wait' completions. */
+static int uring_enter(struct uring *ring, unsigned int wait) {
+	unsigned int submit;
+
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->pending,
+					__ATOMIC_RELEASE);
+	ring->pending = 0;
+
+	/* Entries left over by an interrupted call are included. */
+	submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	if ( syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+				wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0 )
+		return -1;
+
+	return 0;
+} /* uring_enter(struct uring *, unsigned int) */
+
+/* Oldest unseen completion, or NULL. */
+static struct io_uring_cqe *uring_peek(struct uring *ring) {
+	unsigned int head = *ring->cq_head;
+
+	if ( head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) )
+		return NULL;
+
+	return &ring->cqes[head & *ring->cq_mask];
+} /* uring_peek(struct uring *) */
+
+static void uring_seen(struct uring *ring) {
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+} /* uring_seen(struct uring *) */
+
+/**
+ * uring_usable  --  can this kernel run the backend?
+ */
+
+int uring_usable(void) {
+	static int usable = -1;
+	struct uring ring;
+
+	if (usable >= 0)
+		return usable;
+
+	if ( strcmp(io_backend, "select") == 0 )
+		return usable = 0;
+
+	usable = (uring_setup(&ring, URING_ENTRIES) == 0);
+	uring_teardown(&ring);
+
+	return usable;
+} /* uring_usable(void) */
+
+/*
+ * Relaying between two plain transports.
+ */
+
+/*
+ * Each direction has a buffer group of its own, lest a stalled
+ * peer holds every buffer and starves the opposite direction.
+ */
+struct uring_direction {
+	int from, to;
+	int armed;		/* Multishot receive is active. */
+	int sending;	/* A send is in flight. */
+	int available;	/* Buffers held by the kernel. */
+	int trimming;	/* Receive cancelled, to give back pages. */
+	long size;		/* Of each buffer. */
+	struct io_uring_buf_ring *br;
+	char *buffers;
+	int queue[URING_BUFFERS], qhead, qlen;
+	int length[URING_BUFFERS], offset[URING_BUFFERS];
+};
+
+struct uring_relay {
+	struct uring ring;
+	struct uring_direction dir[2];
+	int timing;		/* An idle timeout is armed. */
+	int active;		/* Traffic since the timeout was armed. */
+	int resident;	/* Buffers may hold pages. */
+	struct __kernel_timespec idle;
+};
+
+#define URING_RING_SIZE	(URING_BUFFERS * sizeof(struct io_uring_buf))
+#define URING_POOL_SIZE(dir)	(URING_BUFFERS * (dir)->size)
+
+/* Return a consumed buffer to the kernel. */
+static void uring_recycle(struct uring_direction *dir, int bid) {
+	unsigned short tail = dir->br->tail;
+	struct io_uring_buf *buf;
+
+	buf = &dir->br->bufs[tail & (URING_BUFFERS - 1)];
+	buf->addr = (__u64) (unsigned long) (dir->buffers + bid * dir->size);
+	buf->len = dir->size;
+	buf->bid = bid;
+
+	__atomic_store_n(&dir->br->tail, tail + 1, __ATOMIC_RELEASE);
+	++dir->available;
+} /* uring_recycle(struct uring_direction *, int) */
+
+static int uring_arm_recv(struct uring_relay *rl, int j) {
+	struct io_uring_sqe *sqe;
+
+	if ( (sqe = uring_sqe(&rl->ring)) == NULL )
+		return -1;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = rl->dir[j].from;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = j;
+	sqe->user_data = URING_DATA(URING_RECV, j, 0);
+	rl->dir[j].armed = 1;
+
+	return 0;
+} /* uring_arm_recv(struct uring_relay *, int) */
+
+/* Start sending the oldest queued buffer of a direction. */
+static int uring_next_send(struct uring_relay *rl, int j) {
+	int bid;
+	struct io_uring_sqe *sqe;
+	struct uring_direction *dir = &rl->dir[j];
+
+	if (dir->sending || (dir->qlen == 0))
+		return 0;
+
+	if ( (sqe = uring_sqe(&rl->ring)) == NULL )
+		return -1;
+
+	bid = dir->queue[dir->qhead];
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = dir->to;
+	sqe->addr = (__u64) (unsigned long) (dir->buffers + bid * dir->size
+										+ dir->offset[bid]);
+	sqe->len = dir->length[bid] - dir->offset[bid];
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = URING_DATA(URING_SEND, j, bid);
+	dir->sending = 1;
+
+	return 0;
+} /* uring_next_send(struct uring_relay *, int) */
+
+/* Wake up after URING_IDLE usec, unless already armed. */
+static void uring_arm_idle(struct uring_relay *rl) {
+	struct io_uring_sqe *sqe;
+
+	if ( rl->timing || (sqe = uring_sqe(&rl->ring)) == NULL )
+		return;
+
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (__u64) (unsigned long) &rl->idle;
+	sqe->len = 1;
+	sqe->user_data = URING_DATA(URING_TIMEOUT, 0, 0);
+	rl->timing = 1;
+	rl->active = 0;
+} /* uring_arm_idle(struct uring_relay *) */
+
+/* Cancel the receive of an idle direction, to trim it once ended. */
+static void uring_cancel_recv(struct uring_relay *rl, int j) {
+	struct io_uring_sqe *sqe;
+
+	rl->dir[j].trimming = 1;
+
+	if ( !rl->dir[j].armed || (sqe = uring_sqe(&rl->ring)) == NULL )
+		return;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = URING_DATA(URING_RECV, j, 0);
+	sqe->user_data = URING_DATA(URING_CANCEL, j, 0);
+} /* uring_cancel_recv(struct uring_relay *, int) */
+
+/* Give back the pages of buffers not awaiting a send. With no
+ * receive armed, the kernel is not writing to any of them. */
+static void uring_trim(struct uring_direction *dir) {
+	int k, bid, queued[URING_BUFFERS];
+
+	memset(queued, '\0', sizeof(queued));
+	for (k = 0; k < dir->qlen; ++k)
+		queued[dir->queue[(dir->qhead + k) % URING_BUFFERS]] = 1;
+
+	for (bid = 0; bid < URING_BUFFERS; ++bid)
+		if (! queued[bid] )
+			madvise(dir->buffers + bid * dir->size, dir->size,
+					MADV_DONTNEED);
+
+	dir->trimming = 0;
+} /* uring_trim(struct uring_direction *) */
+
+static void uring_relay_teardown(struct uring_relay *rl) {
+	int j;
+
+	uring_teardown(&rl->ring);
+
+	for (j = 0; j < 2; ++j) {
+		if (rl->dir[j].br && (rl->dir[j].br != MAP_FAILED))
+			munmap(rl->dir[j].br, URING_RING_SIZE);
+		if (rl->dir[j].buffers && (rl->dir[j].buffers != MAP_FAILED))
+			munmap(rl->dir[j].buffers, URING_POOL_SIZE(&rl->dir[j]));
+	}
+} /* uring_relay_teardown(struct uring_relay *) */
+
+static int uring_relay_setup(struct uring_relay *rl) {
+	int j, bid;
+	struct io_uring_buf_reg reg;
+	struct uring_direction *dir;
+
+	memset(rl, '\0', sizeof(*rl));
+
+	if ( uring_setup(&rl->ring, URING_ENTRIES) )
+		return -1;
+
+	rl->idle.tv_sec = URING_IDLE / 1000000;
+	rl->idle.tv_nsec = (URING_IDLE % 1000000) * 1000;
+
+	for (j = 0; j < 2; ++j) {
+		dir = &rl->dir[j];
+		dir->size = buffer_size;
+		dir->br = mmap(NULL, URING_RING_SIZE, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		dir->buffers = mmap(NULL, URING_POOL_SIZE(dir), PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if ( (dir->br == MAP_FAILED) || (dir->buffers == MAP_FAILED) ) {
+			uring_relay_teardown(rl);
+			return -1;
+		}
+
+		memset(&reg, '\0', sizeof(reg));
+		reg.ring_addr = (__u64) (unsigned long) dir->br;
+		reg.ring_entries = URING_BUFFERS;
+		reg.bgid = j;
+
+		if ( syscall(__NR_io_uring_register, rl->ring.fd,
+					IORING_REGISTER_PBUF_RING, &reg, 1) < 0 ) {
+			uring_relay_teardown(rl);
+			return -1;
+		}
+
+		for (bid = 0; bid < URING_BUFFERS; ++bid)
+			uring_recycle(dir, bid);
+	}
+
+	return 0;
+} /* uring_relay_setup(struct uring_relay *) */
+
+/**
+ * uring_relay  --  relay two plain transports through io_uring
+ *
+ * Returns GUNNEL_SUCCESS after the tunnel has closed, or -1 when
+ * io_uring could not be used, in which case no data has moved.
+ */
+
+int uring_relay(struct transport *local, struct transport *remote) {
+	int j, bid, res, moved = 0, closing = 0;
+	unsigned int flags;
+	__u64 data;
+	struct io_uring_cqe *cqe;
+	struct uring_relay rl;
+	struct uring_direction *dir;
+
+	if ( !uring_usable() || uring_relay_setup(&rl) )
+		return -1;
+
+	rl.dir[0].from = rl.dir[1].to = local->fd;
+	rl.dir[0].to = rl.dir[1].from = remote->fd;
+
+	if ( uring_arm_recv(&rl, 0) || uring_arm_recv(&rl, 1) ) {
+		uring_relay_teardown(&rl);
+		return -1;
+	}
+
+	while (1) {
+		/* A closing tunnel first delivers what it holds. */
+		if ( closing && !rl.dir[0].sending && !rl.dir[1].sending )
+			break;
+
+		if ( (uring_enter(&rl.ring, 1) < 0) && (errno != EINTR) )
+			break;
+
+		while ( (cqe = uring_peek(&rl.ring)) ) {
+			data = cqe->user_data;
+			res = cqe->res;
+			flags = cqe->flags;
+			uring_seen(&rl.ring);
+
+			j = URING_INDEX(data);
+			dir = &rl.dir[j];
+
+			switch ( URING_OP(data) ) {
+				case URING_RECV:
+					if ( !(flags & IORING_CQE_F_MORE) )
+						dir->armed = 0;
+
+					if (res > 0) {
+						bid = flags >> IORING_CQE_BUFFER_SHIFT;
+						--dir->available;
+						if (closing) {
+							uring_recycle(dir, bid);
+							break;
+						}
+						dir->length[bid] = res;
+						dir->offset[bid] = 0;
+						dir->queue[(dir->qhead + dir->qlen++)
+									% URING_BUFFERS] = bid;
+						uring_next_send(&rl, j);
+						moved = 1;
+						rl.active = rl.resident = 1;
+					} else if (res == -ENOBUFS) {
+						/* Resumed once buffers are returned. */
+					} else if ( (res == -ECANCELED) && dir->trimming ) {
+						/* Resumed once trimmed. */
+					} else if ( (res == -EINVAL) && !moved ) {
+						/* Multishot receive is not supported. */
+						uring_relay_teardown(&rl);
+						return -1;
+					} else if (res != -EINTR)
+						/* Error or orderly shutdown. */
+						closing = 1;
+					break;
+
+				case URING_SEND:
+					dir->sending = 0;
+					bid = URING_ARG(data);
+					rl.active = 1;
+
+					if (res <= 0) {
+						closing = 1;
+						dir->qlen = 0;
+						uring_recycle(dir, bid);
+						break;
+					}
+
+					dir->offset[bid] += res;
+					if (dir->offset[bid] < dir->length[bid]) {
+						/* Short send, the remainder goes next. */
+						uring_next_send(&rl, j);
+						break;
+					}
+
+					dir->qhead = (dir->qhead + 1) % URING_BUFFERS;
+					--dir->qlen;
+					uring_recycle(dir, bid);
+					uring_next_send(&rl, j);
+					break;
+
+				case URING_TIMEOUT:
+					rl.timing = 0;
+					if (rl.active || closing)
+						break;
+					/* Idle since the previous timeout. */
+					uring_cancel_recv(&rl, 0);
+					uring_cancel_recv(&rl, 1);
+					rl.resident = 0;
+					break;
+
+				default:
+					break;
+			}
+		}
+
+		/* Restart a receive that ran out of buffers, or that was
+		 * cancelled, once its idle buffers have been trimmed. */
+		for (j = 0; j < 2; ++j) {
+			if ( rl.dir[j].trimming && !rl.dir[j].armed )
+				uring_trim(&rl.dir[j]);
+			if ( !closing && !rl.dir[j].armed && (rl.dir[j].available > 0) )
+				uring_arm_recv(&rl, j);
+		}
+
+		/* Traffic leaves pages behind, to be trimmed when idle. */
+		if ( rl.resident && !closing )
+			uring_arm_idle(&rl);
+	}
+
+	uring_relay_teardown(&rl);
+
+	return GUNNEL_SUCCESS;
+} /* uring_relay(struct transport *, struct transport *) */
+
+/*
+ * Accepting clients.
+ */
+
+static struct uring acceptor = { -1 };
+static int accept_fds[MAX_TUNNELS];
+static int accept_armed[MAX_TUNNELS];
+static int accept_count = 0;
+
+static int uring_arm_accept(int index) {
+	struct io_uring_sqe *sqe;
+
+	if ( (sqe = uring_sqe(&acceptor)) == NULL )
+		return -1;
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = accept_fds[index];
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = URING_DATA(URING_ACCEPT, index, 0);
+	accept_armed[index] = 1;
+
+	return 0;
+} /* uring_arm_accept(int) */
+
+static int uring_arm_poll(int index, int fd) {
+	struct io_uring_sqe *sqe;
+
+	if ( (sqe = uring_sqe(&acceptor)) == NULL )
+		return -1;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = URING_DATA(URING_POLL, index, fd);
+
+	return 0;
+} /* uring_arm_poll(int, int) */
+
+/**
+ * uring_accept_start  --  accept clients through io_uring
+ *
+ * Every listener in sds[] gets a multishot accept, whereas
+ * the descriptors in pollfds[] are watched for input.
+ * Returns -1 if the classic path must be taken.
+ */
+
+int uring_accept_start(const int *sds, int nsd, const int *pollfds, int num) {
+	int j;
+
+	if ( (nsd > MAX_TUNNELS) || !uring_usable()
+			|| uring_setup(&acceptor, URING_ACCEPT_ENTRIES) )
+		return -1;
+
+	accept_count = nsd;
+
+	for (j = 0; j < nsd; ++j) {
+		accept_fds[j] = sds[j];
+		if ( uring_arm_accept(j) ) {
+			uring_teardown(&acceptor);
+			return -1;
+		}
+	}
+
+	for (j = 0; j < num; ++j)
+		if ( (pollfds[j] >= 0) && uring_arm_poll(j, pollfds[j]) ) {
+			uring_teardown(&acceptor);
+			return -1;
+		}
+
+	if ( uring_enter(&acceptor, 0) ) {
+		uring_teardown(&acceptor);
+		return -1;
+	}
+
+	return 0;
+} /* uring_accept_start(const int *, int, const int *, int) */
+
+/**
+ * uring_accept_wait  --  wait for the next client or event
+ *
+ * Returns a new client socket, with *ready set to the index
+ * of its listener. Otherwise returns -1, with *ready set to
+ * the index of a watched descriptor having input, or -1.
+ */
+
+int uring_accept_wait(int *ready) {
+	int res, op, index;
+	unsigned int flags;
+	__u64 data;
+	struct io_uring_cqe *cqe;
+
+	*ready = -1;
+
+	while (1) {
+		if ( (cqe = uring_peek(&acceptor)) == NULL ) {
+			if ( uring_enter(&acceptor, 1) < 0 )
+				return -1;	/* Interrupted, let the caller decide. */
+			continue;
+		}
+
+		data = cqe->user_data;
+		res = cqe->res;
+		flags = cqe->flags;
+		uring_seen(&acceptor);
+
+		op = URING_OP(data);
+		index = URING_INDEX(data);
+
+		if (op == URING_ACCEPT) {
+			if ( !(flags & IORING_CQE_F_MORE) ) {
+				accept_armed[index] = 0;
+				if ( (res == -EINVAL) || (res == -ECANCELED) ) {
+					/* Multishot accept is not supported. */
+					uring_teardown(&acceptor);
+					return -1;
+				}
+				if ( again && (uring_arm_accept(index) == 0) )
+					uring_enter(&acceptor, 0);
+			}
+
+			if (res >= 0) {
+				*ready = index;
+				return res;
+			}
+
+			continue;
+		}
+
+		if (op == URING_POLL) {
+			/* Single shot, so arm again for the next time. */
+			uring_arm_poll(index, URING_ARG(data));
+			uring_enter(&acceptor, 0);
+			*ready = index;
+			return -1;
+		}
+	}
+} /* uring_accept_wait(int *) */
+
+/**
+ * uring_accept_active  --  are clients accepted through io_uring?
+ */
+
+int uring_accept_active(void) {
+	return acceptor.fd >= 0;
+} /* uring_accept_active(void) */
+
+/**
+ * uring_accept_stop  --  cancel accepting, collect stragglers
+ *
+ * Clients accepted by the kernel but not yet collected are
+ * returned one at a time, with *which set to the index of
+ * their listener. Returns -1 when none remain.
+ */
+
+int uring_accept_stop(int *which) {
+	int j, res, cancelled = 0;
+	__u64 data;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+
+	if (acceptor.fd < 0)
+		return -1;
+
+	for (j = 0; j < accept_count; ++j) {
+		if (! accept_armed[j] )
+			continue;
+
+		if ( (sqe = uring_sqe(&acceptor)) ) {
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = URING_DATA(URING_ACCEPT, j, 0);
+			sqe->user_data = URING_DATA(URING_CANCEL, j, 0);
+			++cancelled;
+		}
+		accept_armed[j] = 0;
+	}
+
+	if (cancelled)
+		uring_enter(&acceptor, 2 * cancelled);
+
+	while ( (cqe = uring_peek(&acceptor)) ) {
+		data = cqe->user_data;
+		res = cqe->res;
+		uring_seen(&acceptor);
+
+		if ( (URING_OP(data) == URING_ACCEPT) && (res >= 0) ) {
+			*which = URING_INDEX(data);
+			return res;
+		}
+	}
+
+	uring_teardown(&acceptor);
+
+	return -1;
+} /* uring_accept_stop(int *) */
+
+/**
+ * uring_accept_forget  --  drop the acceptor in a child process
+ */
+
+void uring_accept_forget(void) {
+	uring_teardown(&acceptor);
+} /* uring_accept_forget(void) */
+
+#else /* !HAVE_URING */
+
+int uring_usable(void) {
+	return 0;
+} /* uring_usable(void) */
+
+int uring_relay(struct transport *local, struct transport *remote) {
+	return -1;
+} /* uring_relay(struct transport *, struct transport *) */
+
+int uring_accept_start(const int *sds, int nsd, const int *pollfds, int num) {
+	return -1;
+} /* uring_accept_start(const int *, int, const int *, int) */
+
+int uring_accept_wait(int *ready) {
+	*ready = -1;
+	return -1;
+} /* uring_accept_wait(int *) */
+
+int uring_accept_active(void) {
+	return 0;
+} /* uring_accept_active(void) */
+
+int uring_accept_stop(int *which) {
+	return -1;
+} /* uring_accept_stop(int *) */
+
+void uring_accept_forget(void) {
+} /* uring_accept_forget(void) */
+
+#endif /* HAVE_URING */
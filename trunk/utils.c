@@ -15,6 +15,8 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <signal.h>
 #include <pwd.h>
@@ -39,6 +41,9 @@ static struct {
 	{ GUNNEL_ALLOCATION_FAILURE, "Unable to allocate memory."},
 	{ GUNNEL_FAILED_REMOTE_CONN, "Unable to build remote connection."},
 	{ GUNNEL_FAILED_REMOTELY, "Remote host failed."},
+	{ GUNNEL_FAILED_HANDSHAKE, "TLS handshake failed."},
+	{ GUNNEL_FAILED_SESSION, "Unable to initiate TLS session."},
+	{ GUNNEL_FAILED_HANDOVER, "Unable to hand over listening sockets."},
 	{ 0, NULL}
 };
 
@@ -73,8 +78,6 @@ void gunnel_error_message(FILE * file, int num) {
 int test_usr_grp(char *usr, char *grp) {
 	struct passwd *passwd;
 	struct group *group;
-	pid_t pid;
-	int rc;
 
 	if ( (group = getgrnam(grp)) == NULL )
 		return GUNNEL_INVALID_GID;
@@ -82,40 +85,39 @@ int test_usr_grp(char *usr, char *grp) {
 	if ( (passwd = getpwnam(usr)) == NULL )
 		return GUNNEL_INVALID_UID;
 
-	/* Fork off a process to see if setting of
-	 * GID and UID is feasible. */
-	if ( (pid = fork()) == 0 ) {
-		/* Child process for testing. */
+	/* The superuser may take any identity, others only
+	 * their own. No probing process need be forked. */
+	if ( geteuid() == 0 )
+		return GUNNEL_SUCCESS;
 
-		/* Must begin with setgid! */
-		if ( setgid(group->gr_gid) < 0 )
-			exit(GUNNEL_FAILED_GID);
+	if ( (getgid() != group->gr_gid) && (getegid() != group->gr_gid) )
+		return GUNNEL_FAILED_GID;
 
-		/* Double check GID! */
-		if ( getgid() != group->gr_gid )
-			exit(GUNNEL_FAILED_GID);
+	if ( (getuid() != passwd->pw_uid) && (geteuid() != passwd->pw_uid) )
+		return GUNNEL_FAILED_UID;
 
-		/* Continue with UID. */
-		if ( setuid(passwd->pw_uid) < 0 )
-			exit(GUNNEL_FAILED_UID);
+	return GUNNEL_SUCCESS;
+} /* test_usr_grp(char *, char *) */
 
-		/* Double check UID! */
-		if ( getuid() != passwd->pw_uid )
-			exit(GUNNEL_FAILED_UID);
+/**
+ * append_list  --  extend a comma separated list
+ *
+ * Used for repeatable switches. Returns the new list, or
+ * the old one when memory is exhausted.
+ */
+char *append_list(char *list, const char *item) {
+	char *joined;
 
-		/* All is well. */
-		exit(GUNNEL_SUCCESS);
-	} /* Child process. */
+	if (list == NULL)
+		return (char *) item;
 
-	/* Capture complete failure. */
-	if (pid < 0)
-		return GUNNEL_FORKING;
+	if ( (joined = malloc(strlen(list) + strlen(item) + 2)) == NULL )
+		return list;
 
-	/* Parent process must get return status of child. */
-	waitpid(pid, &rc, 0);
+	sprintf(joined, "%s,%s", list, item);
 
-	return WEXITSTATUS(rc);
-} /* test_usr_grp(char *, char *) */
+	return joined;
+} /* append_list(char *, const char *) */
 
 /**
  * decompose_port  --  parse a generalized port
@@ -185,6 +187,12 @@ void signal_responder(int sig) {
 		case SIGUSR1:
 			again = 0;
 			break;
+		case SIGUSR2:
+			statistics_due = 1;
+			break;
+		case SIGHUP:
+			reload_due = 1;
+			break;
 		case SIGCHLD:
 			while ( waitpid(-1, NULL, WNOHANG) > 0 )
 				;
@@ -204,6 +212,9 @@ int route_content(int source, int sink, int flags) {
 
 /**
  * Change GID/UID and enter daemon mode.
+ *
+ * In the foreground, as wanted by a supervisor like systemd,
+ * neither forking nor detaching from the terminal is done.
  */
 int underpriv_daemon_mode(void) {
 	pid_t pid;
@@ -213,11 +224,13 @@ int underpriv_daemon_mode(void) {
 
 	signal(SIGTERM, signal_responder);
 	signal(SIGUSR1, signal_responder);
+	signal(SIGUSR2, signal_responder);
 	signal(SIGCHLD, signal_responder);
+	signal(SIGHUP, signal_responder);
 
 	/* Forking and intending an underprivileged
 	 * process owner. */
-	switch (pid = fork()) {
+	switch (pid = foreground ? 0 : fork()) {
 		case -1:
 			/* Failure */
 			return GUNNEL_FORKING;
@@ -231,15 +244,16 @@ int underpriv_daemon_mode(void) {
 			break;
 	}
 
-	if (setsid() < 0)
-		return GUNNEL_FORKING;
+	if ( !foreground ) {
+		if (setsid() < 0)
+			return GUNNEL_FORKING;
 
-	close(STDIN_FILENO);
-	close(STDOUT_FILENO);
+		close(STDIN_FILENO);
+		close(STDOUT_FILENO);
 
-	signal(SIGHUP, SIG_IGN);
-	signal(SIGINT, SIG_IGN);
-	signal(SIGTSTP, SIG_IGN);
+		signal(SIGINT, SIG_IGN);
+		signal(SIGTSTP, SIG_IGN);
+	}
 
 	chdir(FORKDIR);
 
@@ -265,6 +279,10 @@ int underpriv_daemon_mode(void) {
 	if ( setuid(passwd->pw_uid) < 0 )
 		return GUNNEL_FAILED_UID;
 
+	if (foreground)
+		/* Error messages reach the supervisor. */
+		return GUNNEL_SUCCESS;
+
 	switch (pid = fork()) {
 		case -1:
 			return GUNNEL_FORKING;
@@ -284,6 +302,55 @@ int underpriv_daemon_mode(void) {
 	return GUNNEL_SUCCESS;
 } /* underpriv_daemon_mode(void) */
 
+/**
+ * is_unix_socket_path  --  does a decomposed port name a unix socket
+ */
+
+int is_unix_socket_path(const char *host, const char *port) {
+	return host && (host[0] == '/') && (port == NULL);
+} /* is_unix_socket_path(const char *, const char *) */
+
+/* Fill in a unix socket address, reporting its length. */
+static socklen_t fill_unix_address(struct sockaddr_un *sun, const char *path) {
+	memset(sun, '\0', sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+
+	if ( strlen(path) >= sizeof(sun->sun_path) )
+		return 0;
+
+	strcpy(sun->sun_path, path);
+
+	return sizeof(*sun);
+} /* fill_unix_address(struct sockaddr_un *, const char *) */
+
+/* Bind and listen to a unix socket, removing any stale socket. */
+static int get_listening_unix_socket(char *path) {
+	int sd;
+	socklen_t len;
+	struct stat st;
+	struct sockaddr_un sun;
+
+	if ( (len = fill_unix_address(&sun, path)) == 0 ) {
+		fprintf(stderr, "Socket path is too long.\n");
+		return -1;
+	}
+
+	if ( (stat(path, &st) == 0) && S_ISSOCK(st.st_mode) )
+		unlink(path);
+
+	if ( (sd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 )
+		return -1;
+
+	if ( (bind(sd, (struct sockaddr *) &sun, len) < 0)
+			|| (listen(sd, 5) < 0) ) {
+		fprintf(stderr, "Could not bind to local socket.\n");
+		close(sd);
+		return -1;
+	}
+
+	return sd;
+} /* get_listening_unix_socket(char *) */
+
 /**
  * get_listening_socket -- examine local host, get socket
  */
@@ -292,6 +359,9 @@ int get_listening_socket(char *lhost, char *lport) {
 	int rc, sd = -1;
 	struct addrinfo hints, *ai, *aiptr;
 
+	if ( is_unix_socket_path(lhost, lport) )
+		return get_listening_unix_socket(lhost);
+
 	memset(&hints, '\0', sizeof(hints));
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_family = AF_UNSPEC;
@@ -331,3 +401,201 @@ int get_listening_socket(char *lhost, char *lport) {
 
 	return sd;
 } /* get_listening_socket(char *, char *) */
+
+/**
+ * get_connected_socket -- connect to remote host or unix socket
+ */
+
+int get_connected_socket(char *rhost, char *rport,
+							const struct tuning *tune) {
+	int rd = -1;
+	socklen_t len;
+	struct sockaddr_un sun;
+	struct addrinfo hints, *ai, *aiptr;
+
+	if ( is_unix_socket_path(rhost, rport) ) {
+		if ( (len = fill_unix_address(&sun, rhost)) == 0 )
+			return -1;
+
+		if ( (rd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 )
+			return -1;
+
+		if ( connect(rd, (struct sockaddr *) &sun, len) < 0 ) {
+			close(rd);
+			return -1;
+		}
+
+		return rd;
+	}
+
+	memset(&hints, '\0', sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+#if defined(AI_ADDRCONFIG)
+	hints.ai_flags = AI_ADDRCONFIG;
+#endif
+
+	if ( getaddrinfo(rhost, rport, &hints, &aiptr) )
+		return -1;
+
+	for (ai = aiptr; ai; ai = ai->ai_next) {
+		if ( (rd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0 )
+			continue;
+
+		tuning_connect(rd, tune);
+
+		if ( connect(rd, ai->ai_addr, ai->ai_addrlen) < 0 ) {
+			close(rd);
+			rd = -1;
+			continue;
+		}
+
+		/* Successfully connected. */
+		break;
+	}
+
+	freeaddrinfo(aiptr);
+
+	return rd;
+} /* get_connected_socket(char *, char *, const struct tuning *) */
+
+/**
+ * get_datagram_socket -- UDP socket bound to a local address
+ */
+
+int get_datagram_socket(char *lhost, char *lport) {
+	int rc, sd = -1;
+	struct addrinfo hints, *ai, *aiptr;
+
+	memset(&hints, '\0', sizeof(hints));
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_family = AF_UNSPEC;
+#if defined(__linux__) || defined(__FreeBSD__)
+	hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG;
+#else
+	hints.ai_flags = AI_PASSIVE;
+#endif
+
+	if ( (rc = getaddrinfo(lhost, lport, &hints, &aiptr)) ) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+		return -1;
+	}
+
+	for ( ai = aiptr; ai; ai = ai->ai_next ) {
+		int one = 1;
+
+		if ( (sd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0 )
+			continue;
+
+		setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+		if ( bind(sd, ai->ai_addr, ai->ai_addrlen) == 0 )
+			break;	/* Successful. */
+
+		close(sd);
+		sd = -1;
+	}
+
+	freeaddrinfo(aiptr);
+
+	if ( ai == NULL ) {
+		fprintf(stderr, "Could not bind to local address.\n");
+		return -1;
+	}
+
+	return sd;
+} /* get_datagram_socket(char *, char *) */
+
+/**
+ * send_fds  --  send a message with attached descriptors
+ */
+
+int send_fds(int sd, const void *buf, size_t len, const int *fds, int num) {
+	ssize_t n;
+	char control[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+
+	if ( (num < 0) || (num > MAX_PASSED_FDS) )
+		return -1;
+
+	memset(&msg, '\0', sizeof(msg));
+	memset(control, '\0', sizeof(control));
+	iov.iov_base = (void *) buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (num > 0) {
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(num * sizeof(int));
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(num * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, num * sizeof(int));
+	}
+
+	do
+		n = sendmsg(sd, &msg, MSG_NOSIGNAL);
+	while ( (n < 0) && (errno == EINTR) );
+
+	return (n == (ssize_t) len) ? 0 : -1;
+} /* send_fds(int, const void *, size_t, const int *, int) */
+
+/**
+ * recv_fds  --  receive a message with attached descriptors
+ *
+ * Returns the length of the message, storing the number
+ * of received descriptors in *num.
+ */
+
+ssize_t recv_fds(int sd, void *buf, size_t len, int *fds, int *num) {
+	ssize_t n;
+	int max = *num;
+	char control[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+
+	*num = 0;
+
+	memset(&msg, '\0', sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	do
+		n = recvmsg(sd, &msg, 0);
+	while ( (n < 0) && (errno == EINTR) );
+
+	if (n < 0)
+		return n;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		int j, got;
+
+		if ( (cmsg->cmsg_level != SOL_SOCKET)
+				|| (cmsg->cmsg_type != SCM_RIGHTS) )
+			continue;
+
+		got = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+		for (j = 0; j < got; ++j) {
+			int fd;
+
+			memcpy(&fd, CMSG_DATA(cmsg) + j * sizeof(int), sizeof(int));
+			if (*num < max)
+				fds[(*num)++] = fd;
+			else
+				close(fd);	/* Surplus is of no use. */
+		}
+	}
+
+	return n;
+} /* recv_fds(int, void *, size_t, int *, int *) */
@@ -0,0 +1,173 @@
+/*
+ * verify.c  --  cache of verified certificate chains
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * vim: set sw=4 ts=4
+ */
+
+/*
+ * Building and checking a certificate chain costs several public
+ * key operations. A chain once found valid is remembered by the
+ * SHA-256 digest of its certificates, together with the generation
+ * of the CA-chain it was verified against, and with the earliest
+ * expiration in the chain. Since every connection is served by a
+ * forked process, the cache resides in shared memory, mapped by
+ * the daemon before it accepts any client. Loading a CA-chain
+ * anew yields a new generation, retiring all earlier results.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/types.h>
+
+#define _INCLUDE_EXTERNALS	1
+#include "gunnel.h"
+
+#ifndef VERIFY_CACHE_SETS
+#  define VERIFY_CACHE_SETS	256
+#endif
+
+#define VERIFY_CACHE_WAYS	4
+
+/* A chain found valid. */
+struct verified {
+	unsigned char digest[VERIFY_DIGEST_LENGTH];
+	unsigned int generation;	/* Naught for an unused entry. */
+	time_t expires;
+	unsigned long used;			/* Recency of last hit. */
+};
+
+struct verify_cache {
+	char lock;
+	unsigned long clock;
+	unsigned long lookups, hits, stores;
+	struct verified entry[VERIFY_CACHE_SETS][VERIFY_CACHE_WAYS];
+};
+
+static struct verify_cache *cache = NULL;
+
+/* The digest is already well mixed. */
+static struct verified *cache_set(const unsigned char *digest) {
+	return cache->entry[ (digest[0] | (digest[1] << 8)) % VERIFY_CACHE_SETS ];
+} /* cache_set(const unsigned char *) */
+
+/**
+ * verify_cache_init  --  map the cache, once
+ *
+ * Must be called before any connection is forked.
+ */
+
+int verify_cache_init(void) {
+	if (cache)
+		return 0;
+
+	if ( (cache = map_shared(sizeof(*cache))) == NULL )
+		return -1;
+
+	return 0;
+} /* verify_cache_init(void) */
+
+/**
+ * verify_cache_lookup  --  was this chain verified before?
+ */
+
+int verify_cache_lookup(const unsigned char *digest, unsigned int generation) {
+	int j, found = 0;
+	time_t now = time(NULL);
+	struct verified *set;
+
+	if (cache == NULL)
+		return 0;
+
+	spin_lock(&cache->lock);
+
+	++cache->lookups;
+	set = cache_set(digest);
+
+	for (j = 0; j < VERIFY_CACHE_WAYS; ++j) {
+		if ( (set[j].generation != generation)
+				|| memcmp(set[j].digest, digest, VERIFY_DIGEST_LENGTH) )
+			continue;
+
+		if (set[j].expires <= now) {
+			/* Expired since it was verified. */
+			set[j].generation = 0;
+			break;
+		}
+
+		set[j].used = ++cache->clock;
+		++cache->hits;
+		found = 1;
+		break;
+	}
+
+	spin_unlock(&cache->lock);
+
+	return found;
+} /* verify_cache_lookup(const unsigned char *, unsigned int) */
+
+/**
+ * verify_cache_store  --  remember a valid chain
+ *
+ * The least recently used entry of its set is replaced.
+ */
+
+void verify_cache_store(const unsigned char *digest, unsigned int generation,
+						time_t expires) {
+	int j, victim = 0;
+	struct verified *set;
+
+	if (cache == NULL)
+		return;
+
+	spin_lock(&cache->lock);
+
+	set = cache_set(digest);
+
+	for (j = 1; j < VERIFY_CACHE_WAYS; ++j)
+		if (set[j].used < set[victim].used)
+			victim = j;
+
+	memcpy(set[victim].digest, digest, VERIFY_DIGEST_LENGTH);
+	set[victim].generation = generation;
+	set[victim].expires = expires;
+	set[victim].used = ++cache->clock;
+	++cache->stores;
+
+	spin_unlock(&cache->lock);
+} /* verify_cache_store(const unsigned char *, unsigned int, time_t) */
+
+/**
+ * verify_cache_report  --  write the counters of the cache
+ */
+
+void verify_cache_report(FILE *file) {
+	unsigned long lookups, hits, stores;
+
+	if (cache == NULL)
+		return;
+
+	spin_lock(&cache->lock);
+	lookups = cache->lookups;
+	hits = cache->hits;
+	stores = cache->stores;
+	spin_unlock(&cache->lock);
+
+	fprintf(file, "verify_cache_lookups %lu\n"
+				"verify_cache_hits %lu\n"
+				"verify_cache_stores %lu\n"
+				"verify_cache_hit_rate %.3f\n",
+			lookups, hits, stores,
+			lookups ? (double) hits / lookups : 0.0);
+} /* verify_cache_report(FILE *) */
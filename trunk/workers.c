@@ -0,0 +1,369 @@
+/*
+ * workers.c  --  pool of processes dedicated to TLS handshakes
+ *
+ * Author: Mats Erik Andersson <meand@users.berlios.de>, 2010.
+ *
+ * License: EUPL v1.0.
+ *
+ * $Id$
+ */
+
+/*
+ * vim: set sw=4 ts=4
+ */
+
+/*
+ * A public key operation costs far more than relaying a chunk
+ * of data. With a handshake pool, the accepting process passes
+ * every new client to a small set of workers sharing one queue,
+ * so that at most that many handshakes compete for processors.
+ * When the kernel is able to take over the negotiated session,
+ * the finished sockets return to the accepting process which
+ * forks a relay worker, free of any GnuTLS state. Otherwise the
+ * handshake worker forks the relay worker itself, which then
+ * inherits the session. Such a relay worker is admitted by the
+ * supervisor as any other, and its room is given back once the
+ * handshake worker has reaped it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define _INCLUDE_EXTERNALS	1
+#include "gunnel.h"
+
+/* Message passing */
+static char message[MESSAGE_LENGTH] = "";
+
+/* Tag accompanying each passed client. */
+#define POOL_NEW_CLIENT		'n'
+#define POOL_ESTABLISHED	'e'
+
+/* Message accompanying each passed client. */
+struct pool_note {
+	char tag;
+	unsigned char index;	/* The tunnel it belongs to. */
+};
+
+/* Connect the remote side, unless already done, and relay. */
+static void finish_tunnel(const struct tunnel *tun,
+						struct transport *local, struct transport *remote) {
+	int rd;
+	struct shaper shaper;
+
+	/* Multiplexed and striped streams each connect on their own. */
+	if ( tun->mux || tun->stripes ) {
+		if (tun->mux)
+			mux_serve(tun, local);
+		else
+			stripe_serve(tun, local);
+		transport_close(local);
+		return;
+	}
+
+	if (remote->fd < 0) {
+		if ( (rd = get_connected_socket(tun->rhost, tun->rport,
+										tun->svc.remote_tuning)) < 0 ) {
+			transport_close(local);
+			return;
+		}
+
+		if ( transport_init(remote, rd, tun->svc.remote_kind, tun->tls,
+							message, sizeof(message)) ) {
+			close(rd);
+			transport_close(local);
+			return;
+		}
+
+		transport_compress(remote, tun->compress);
+
+		if ( transport_handshake(remote) != GUNNEL_SUCCESS ) {
+			transport_close(remote);
+			transport_close(local);
+			return;
+		}
+	}
+
+	shaper_init(&shaper, tun->rate, tun->shaping);
+	relay_traffic(local, remote, &shaper);
+	shaper_release(&shaper);
+
+	transport_close(remote);
+	transport_close(local);
+} /* finish_tunnel(const struct tunnel *, struct transport *,
+	 struct transport *) */
+
+/* Can the kernel handle this transport from now on? */
+static int kernel_takes_over(struct transport *tp) {
+	if (tp->fd < 0)
+		return 1;
+
+	if (! is_tls_transport(tp->kind) )
+		return 1;
+
+	/* Early data is kept by this process, as is compression. */
+	if ( tp->early_len || tp->zip )
+		return 0;
+
+	return transport_enable_ktls(tp) == 0;
+} /* kernel_takes_over(struct transport *) */
+
+/* Reap the relay workers, releasing their room. The census lock
+ * is taken here, so SIGCHLD is blocked wherever the worker itself
+ * holds that lock. */
+static void relay_reaper(int sig) {
+	int saved = errno;
+
+	while ( waitpid(-1, NULL, WNOHANG) > 0 )
+		supervisor_release();
+
+	errno = saved;
+} /* relay_reaper(int) */
+
+/* Loop of a single handshake worker. */
+static void handshake_worker(const struct tunnel *tunnels, int count, int qd) {
+	int num, fds[2];
+	pid_t pid;
+	sigset_t chld, mask;
+	struct pool_note note;
+	const struct tunnel *tun;
+	struct transport local, remote;
+
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	signal(SIGCHLD, relay_reaper);
+
+	while (1) {
+		num = 1;
+		if ( recv_fds(qd, &note, sizeof(note), fds, &num) <= 0 ) {
+			/* The accepting process is gone, or has retired
+			 * this worker. Linger until the relays have ended. */
+			signal(SIGCHLD, SIG_DFL);
+			while ( ((pid = wait(NULL)) > 0) || (errno == EINTR) )
+				if (pid > 0)
+					supervisor_release();
+			exit(GUNNEL_SUCCESS);
+		}
+
+		if ( (num != 1) || (note.tag != POOL_NEW_CLIENT)
+				|| (note.index >= count) ) {
+			while (num > 0)
+				close(fds[--num]);
+			continue;
+		}
+
+		tun = &tunnels[note.index];
+
+		if ( transport_init(&local, fds[0], tun->svc.local_kind, tun->tls,
+							message, sizeof(message)) ) {
+			shutdown(fds[0], SHUT_RDWR);
+			close(fds[0]);
+			continue;
+		}
+
+		transport_compress(&local, tun->compress);
+		route_prepare(tun, &local);
+
+		if ( transport_handshake(&local) != GUNNEL_SUCCESS ) {
+			transport_close(&local);
+			continue;
+		}
+
+		/* An encrypted remote side is negotiated here as well,
+		 * and a routed one is known only with the session.
+		 * Striped links are connected by the relay worker. */
+		memset(&remote, '\0', sizeof(remote));
+		remote.fd = -1;
+
+		if ( (is_tls_transport(tun->svc.remote_kind) || tun->routes)
+				&& !tun->stripes ) {
+			if ( (fds[1] = route_connect(tun, &local)) < 0 ) {
+				transport_close(&local);
+				continue;
+			}
+
+			if ( transport_init(&remote, fds[1], tun->svc.remote_kind,
+								tun->tls, message, sizeof(message)) ) {
+				close(fds[1]);
+				transport_close(&local);
+				continue;
+			}
+
+			transport_compress(&remote, tun->compress);
+
+			if ( transport_handshake(&remote) != GUNNEL_SUCCESS ) {
+				transport_close(&remote);
+				transport_close(&local);
+				continue;
+			}
+		}
+
+		/* Preferably return sockets without any session state. */
+		if ( kernel_takes_over(&local) && kernel_takes_over(&remote) ) {
+			note.tag = POOL_ESTABLISHED;
+			fds[0] = local.fd;
+			fds[1] = remote.fd;
+			num = (remote.fd < 0) ? 1 : 2;
+
+			if ( send_fds(qd, &note, sizeof(note), fds, num) == 0 ) {
+				transport_release(&remote);
+				transport_release(&local);
+				continue;
+			}
+		}
+
+		/* Beyond the limit, the client is turned away. */
+		sigprocmask(SIG_BLOCK, &chld, &mask);
+		if (! supervisor_admit() ) {
+			sigprocmask(SIG_SETMASK, &mask, NULL);
+			transport_close(&remote);
+			transport_close(&local);
+			continue;
+		}
+
+		/* Relay worker inheriting the sessions. */
+		pid = fork();
+		if (pid < 0)
+			supervisor_release();
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+
+		switch (pid) {
+			case -1:
+				transport_close(&remote);
+				transport_close(&local);
+				break;
+			case 0:
+				close(qd);
+				finish_tunnel(tun, &local, &remote);
+				exit(GUNNEL_SUCCESS);
+			default:
+				transport_release(&remote);
+				transport_release(&local);
+				break;
+		}
+	}
+} /* handshake_worker(const struct tunnel *, int, int) */
+
+/**
+ * handshake_pool_start  --  fork the handshake workers
+ *
+ * The workers serve every tunnel in tunnels[]. The descriptors
+ * in unneeded[] are closed by each worker.
+ * Returns the queue descriptor of the accepting process,
+ * or -1 at failure.
+ */
+
+int handshake_pool_start(const struct tunnel *tunnels, int count,
+						int workers, const int *unneeded, int num) {
+	int j, qv[2];
+
+	if ( socketpair(AF_UNIX, SOCK_SEQPACKET, 0, qv) < 0 )
+		return -1;
+
+	for (j = 0; j < workers; ++j) {
+		switch (supervisor_fork()) {
+			case -1:
+				if (j == 0) {
+					close(qv[0]);
+					close(qv[1]);
+					return -1;
+				}
+				/* Make do with fewer workers. */
+				j = workers;
+				break;
+			case 0:
+				close(qv[0]);
+				while (num > 0)
+					if (unneeded[--num] >= 0)
+						close(unneeded[num]);
+				handshake_worker(tunnels, count, qv[1]);
+				exit(GUNNEL_SUCCESS);
+			default:
+				break;
+		}
+	}
+
+	close(qv[1]);
+
+	/* Dispatching must never stall the accepting process. */
+	fcntl(qv[0], F_SETFL, fcntl(qv[0], F_GETFL) | O_NONBLOCK);
+
+	return qv[0];
+} /* handshake_pool_start(const struct tunnel *, int, int,
+	 const int *, int) */
+
+/**
+ * handshake_pool_dispatch  --  queue a new client for handshake
+ *
+ * The caller keeps its copy of td, and should serve the
+ * client itself if this fails.
+ */
+
+int handshake_pool_dispatch(int qd, int index, int td) {
+	struct pool_note note;
+
+	note.tag = POOL_NEW_CLIENT;
+	note.index = index;
+
+	return send_fds(qd, &note, sizeof(note), &td, 1);
+} /* handshake_pool_dispatch(int, int, int) */
+
+/**
+ * handshake_pool_collect  --  receive an established client
+ *
+ * Sets *index to its tunnel, and *rd to -1 when only
+ * the accepted side was returned.
+ */
+
+int handshake_pool_collect(int qd, int *index, int *td, int *rd) {
+	int num = 2, fds[2];
+	struct pool_note note;
+
+	if ( recv_fds(qd, &note, sizeof(note), fds, &num) <= 0 )
+		return -1;
+
+	if ( (note.tag != POOL_ESTABLISHED) || (num < 1) ) {
+		while (num > 0)
+			close(fds[--num]);
+		return -1;
+	}
+
+	*index = note.index;
+	*td = fds[0];
+	*rd = (num > 1) ? fds[1] : -1;
+
+	return 0;
+} /* handshake_pool_collect(int, int *, int *, int *) */
+
+/**
+ * handshake_pool_relay  --  relay a client returned from the pool
+ *
+ * Its sessions are in the hands of the kernel.
+ */
+
+void handshake_pool_relay(const struct tunnel *tun, int td, int rd) {
+	struct transport local, remote;
+
+	transport_init(&local, td, is_tls_transport(tun->svc.local_kind)
+								? TRANSPORT_KTLS : tun->svc.local_kind,
+					tun->tls, message, sizeof(message));
+
+	memset(&remote, '\0', sizeof(remote));
+	remote.fd = -1;
+
+	if (rd >= 0)
+		transport_init(&remote, rd, is_tls_transport(tun->svc.remote_kind)
+									? TRANSPORT_KTLS : tun->svc.remote_kind,
+						tun->tls, message, sizeof(message));
+
+	finish_tunnel(tun, &local, &remote);
+} /* handshake_pool_relay(const struct tunnel *, int, int) */